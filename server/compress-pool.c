@@ -0,0 +1,371 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <pthread.h>
+#include <signal.h>
+#include <glib.h>
+
+#include "compress-pool.h"
+
+#define COMPRESS_POOL_MAX_THREADS 16
+/* about 1MiB of 32 bit pixels, small enough to keep all the threads busy
+ * on a full screen update without hurting the compression ratio much */
+#define COMPRESS_POOL_TILE_PIXELS (512 * 512)
+
+typedef enum {
+    COMPRESS_JOB_STATE_QUEUED,
+    COMPRESS_JOB_STATE_RUNNING,
+    COMPRESS_JOB_STATE_DONE,
+    COMPRESS_JOB_STATE_CANCELLED,
+} CompressJobState;
+
+struct CompressJob {
+    CompressPool *pool;
+    CompressJobState state;
+
+    SpiceBitmap src;
+    SpiceImageCompression compression;
+    int use_jpeg;
+
+    int success;
+    SpiceImage dest;
+    compress_send_data_t comp_data;
+    uint64_t time_ns;   /* the time the compression took */
+};
+
+typedef struct CompressPoolThread {
+    CompressPool *pool;
+    pthread_t thread;
+    /* only written by this thread, its statistics are added to the ones of
+     * the pool after each job */
+    ImageEncoderSharedData shared_data;
+    ImageEncoders encoders;
+} CompressPoolThread;
+
+struct CompressPool {
+    pthread_mutex_t lock;
+    pthread_cond_t jobs_cond;   // signalled when a job is queued or on quit
+    pthread_cond_t done_cond;   // signalled when a job stops running
+    GQueue jobs;
+    int quit;
+    /* the jobs not released yet, the last one releases the pool if it
+     * outlives compress_pool_free() */
+    int n_jobs;
+    int freed;
+    ImageEncoderSharedData stats;
+
+    int n_threads;
+    CompressPoolThread threads[0];
+};
+
+static void compress_buf_free_chain(RedCompressBuf *buf)
+{
+    while (buf) {
+        RedCompressBuf *next = buf->send_next;
+        compress_buf_free(buf);
+        buf = next;
+    }
+}
+
+static void compress_pool_destroy(CompressPool *pool)
+{
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_cond_destroy(&pool->jobs_cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+/* must be called with the pool lock held, or when the job is not visible to
+ * the pool threads anymore */
+static void compress_job_destroy(CompressJob *job)
+{
+    if (job->state == COMPRESS_JOB_STATE_DONE && job->success) {
+        compress_buf_free_chain(job->comp_data.comp_buf);
+    }
+    spice_chunks_destroy(job->src.data);
+    free(job);
+}
+
+static void compress_job_free(CompressJob *job)
+{
+    CompressPool *pool = job->pool;
+    int destroy;
+
+    compress_job_destroy(job);
+
+    pthread_mutex_lock(&pool->lock);
+    destroy = --pool->n_jobs == 0 && pool->freed;
+    pthread_mutex_unlock(&pool->lock);
+    if (destroy) {
+        compress_pool_destroy(pool);
+    }
+}
+
+static int compress_job_run(ImageEncoders *enc, CompressJob *job)
+{
+    switch (job->compression) {
+    case SPICE_IMAGE_COMPRESSION_QUIC:
+        if (job->use_jpeg) {
+            return image_encoders_compress_jpeg(enc, &job->dest, &job->src, &job->comp_data);
+        }
+        return image_encoders_compress_quic(enc, &job->dest, &job->src, &job->comp_data);
+#ifdef USE_LZ4
+    case SPICE_IMAGE_COMPRESSION_LZ4:
+        return image_encoders_compress_lz4(enc, &job->dest, &job->src, &job->comp_data);
+#endif
+    case SPICE_IMAGE_COMPRESSION_LZ:
+        return image_encoders_compress_lz(enc, &job->dest, &job->src, &job->comp_data);
+    default:
+        spice_warning("invalid image compression type %u", job->compression);
+    }
+    return FALSE;
+}
+
+static void *compress_pool_thread_main(void *opaque)
+{
+    CompressPoolThread *thread = opaque;
+    CompressPool *pool = thread->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        CompressJob *job;
+        uint64_t start;
+        int success;
+
+        while (!pool->quit && g_queue_is_empty(&pool->jobs)) {
+            pthread_cond_wait(&pool->jobs_cond, &pool->lock);
+        }
+        /* the queued jobs still run on quit, their owners wait for them */
+        if (g_queue_is_empty(&pool->jobs)) {
+            break;
+        }
+
+        job = g_queue_pop_head(&pool->jobs);
+        if (job->state == COMPRESS_JOB_STATE_CANCELLED) {
+            /* the pool cannot be freed yet, the threads are not joined */
+            compress_job_destroy(job);
+            pool->n_jobs--;
+            continue;
+        }
+        job->state = COMPRESS_JOB_STATE_RUNNING;
+        pthread_mutex_unlock(&pool->lock);
+
+        start = spice_get_monotonic_time_ns();
+        success = compress_job_run(&thread->encoders, job);
+        job->time_ns = spice_get_monotonic_time_ns() - start;
+
+        pthread_mutex_lock(&pool->lock);
+        image_encoder_shared_stat_merge(&pool->stats, &thread->shared_data);
+        job->success = success;
+        job->state = COMPRESS_JOB_STATE_DONE;
+        pthread_cond_broadcast(&pool->done_cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+CompressPool *compress_pool_new(int n_threads)
+{
+    CompressPool *pool;
+    sigset_t thread_sig_mask;
+    sigset_t curr_sig_mask;
+    int i;
+
+    spice_return_val_if_fail(n_threads > 0, NULL);
+
+    n_threads = MIN(n_threads, COMPRESS_POOL_MAX_THREADS);
+    pool = spice_malloc0(sizeof(CompressPool) + n_threads * sizeof(CompressPoolThread));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->jobs_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    g_queue_init(&pool->jobs);
+    image_encoder_shared_init(&pool->stats);
+
+    /* the threads are not supposed to handle any signal, see red_worker_run() */
+    sigfillset(&thread_sig_mask);
+    sigdelset(&thread_sig_mask, SIGILL);
+    sigdelset(&thread_sig_mask, SIGFPE);
+    sigdelset(&thread_sig_mask, SIGSEGV);
+    pthread_sigmask(SIG_SETMASK, &thread_sig_mask, &curr_sig_mask);
+    for (i = 0; i < n_threads; i++) {
+        CompressPoolThread *thread = &pool->threads[pool->n_threads];
+        int r;
+
+        thread->pool = pool;
+        /* the compression buffers of the threads are not counted, the
+         * counters are not atomic */
+        image_encoder_shared_init(&thread->shared_data);
+        image_encoders_init(&thread->encoders, &thread->shared_data);
+        thread->encoders.jpeg_quality = 85;
+        if ((r = pthread_create(&thread->thread, NULL, compress_pool_thread_main, thread))) {
+            spice_warning("create compression thread failed %d", r);
+            image_encoders_free(&thread->encoders);
+            break;
+        }
+        pool->n_threads++;
+    }
+    pthread_sigmask(SIG_SETMASK, &curr_sig_mask, NULL);
+
+    if (pool->n_threads == 0) {
+        compress_pool_free(pool);
+        return NULL;
+    }
+    spice_debug("image compression pool with %d threads", pool->n_threads);
+    return pool;
+}
+
+void compress_pool_free(CompressPool *pool)
+{
+    int destroy;
+    int i;
+
+    if (!pool) {
+        return;
+    }
+
+    /* the threads run the queued jobs before exiting */
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = TRUE;
+    pthread_cond_broadcast(&pool->jobs_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->n_threads; i++) {
+        pthread_join(pool->threads[i].thread, NULL);
+        image_encoders_free(&pool->threads[i].encoders);
+    }
+
+    /* the jobs still owned by pipe items are done, finishing or cancelling
+     * them does not need the threads */
+    pthread_mutex_lock(&pool->lock);
+    pool->freed = TRUE;
+    destroy = pool->n_jobs == 0;
+    pthread_mutex_unlock(&pool->lock);
+    if (destroy) {
+        compress_pool_destroy(pool);
+    }
+}
+
+void compress_pool_stat_reset(CompressPool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    image_encoder_shared_stat_reset(&pool->stats);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void compress_pool_stat_print(CompressPool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    image_encoder_shared_stat_print(&pool->stats);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+int compress_pool_get_n_threads(CompressPool *pool)
+{
+    return pool ? pool->n_threads : 0;
+}
+
+int compress_pool_get_tile_rows(CompressPool *pool, int width, int height)
+{
+    if (!pool || pool->n_threads < 2 || width <= 0 ||
+        (uint64_t)width * height < 2 * COMPRESS_POOL_TILE_PIXELS) {
+        return height;
+    }
+    return MAX(COMPRESS_POOL_TILE_PIXELS / width, 1);
+}
+
+CompressJob *compress_pool_submit(CompressPool *pool, const SpiceBitmap *src,
+                                  SpiceImageCompression compression, int use_jpeg)
+{
+    CompressJob *job;
+
+    spice_return_val_if_fail(pool != NULL, NULL);
+    spice_return_val_if_fail(compression != SPICE_IMAGE_COMPRESSION_GLZ, NULL);
+
+    job = spice_new0(CompressJob, 1);
+    job->pool = pool;
+    job->state = COMPRESS_JOB_STATE_QUEUED;
+    job->src = *src;
+    job->compression = compression;
+    job->use_jpeg = use_jpeg;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->n_jobs++;
+    g_queue_push_tail(&pool->jobs, job);
+    pthread_cond_signal(&pool->jobs_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    return job;
+}
+
+CompressJobResult compress_job_finish(CompressJob *job, SpiceImage *dest,
+                                      compress_send_data_t *o_comp_data, uint64_t *o_time_ns)
+{
+    CompressPool *pool = job->pool;
+    CompressJobResult result;
+
+    pthread_mutex_lock(&pool->lock);
+    if (job->state == COMPRESS_JOB_STATE_QUEUED) {
+        /* compressing in the caller is quicker than waiting for the jobs
+         * in front of this one, the pool thread will free it */
+        job->state = COMPRESS_JOB_STATE_CANCELLED;
+        pthread_mutex_unlock(&pool->lock);
+        return COMPRESS_JOB_SKIPPED;
+    }
+    while (job->state == COMPRESS_JOB_STATE_RUNNING) {
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    spice_assert(job->state == COMPRESS_JOB_STATE_DONE);
+    if (job->success) {
+        dest->descriptor.type = job->dest.descriptor.type;
+        dest->u = job->dest.u;
+        *o_comp_data = job->comp_data;
+        if (o_time_ns) {
+            *o_time_ns = job->time_ns;
+        }
+        job->success = FALSE;
+        result = COMPRESS_JOB_SUCCEEDED;
+    } else {
+        result = COMPRESS_JOB_FAILED;
+    }
+    compress_job_free(job);
+
+    return result;
+}
+
+void compress_job_cancel(CompressJob *job)
+{
+    CompressPool *pool = job->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    if (job->state == COMPRESS_JOB_STATE_QUEUED) {
+        job->state = COMPRESS_JOB_STATE_CANCELLED;
+        pthread_mutex_unlock(&pool->lock);
+        return;
+    }
+    /* the thread reads the bitmap, wait before the caller releases it */
+    while (job->state == COMPRESS_JOB_STATE_RUNNING) {
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    compress_job_free(job);
+}
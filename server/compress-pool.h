@@ -0,0 +1,67 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef COMPRESS_POOL_H_
+#define COMPRESS_POOL_H_
+
+#include "image-encoders.h"
+
+/* A pool of threads compressing bitmaps ahead of the time they are
+ * marshalled. Each thread owns a private set of ImageEncoders so only
+ * stateless codecs (QUIC, JPEG, LZ, LZ4) can be used; GLZ depends on the
+ * order images are sent and stays on the worker thread.
+ *
+ * Jobs are consumed in pipe order by the worker: compress_job_finish()
+ * waits for a running job, and hands back a job which did not start yet
+ * so that the caller compresses it synchronously instead of waiting
+ * behind other queued jobs.
+ */
+
+typedef struct CompressPool CompressPool;
+typedef struct CompressJob CompressJob;
+
+typedef enum {
+    COMPRESS_JOB_SKIPPED,   /* the job did not run, the caller has to compress */
+    COMPRESS_JOB_FAILED,    /* the bitmap could not be compressed */
+    COMPRESS_JOB_SUCCEEDED,
+} CompressJobResult;
+
+CompressPool *compress_pool_new(int n_threads);
+/* The queued jobs are run before the threads exit. The jobs which are not
+ * released yet keep the pool memory alive, they can still be finished or
+ * cancelled. */
+void compress_pool_free(CompressPool *pool);
+/* The threads keep their own compression statistics */
+void compress_pool_stat_reset(CompressPool *pool);
+void compress_pool_stat_print(CompressPool *pool);
+int compress_pool_get_n_threads(CompressPool *pool);
+/* Large images are split in bands of full rows which are compressed
+ * concurrently, returns the height of the bands to use for an image */
+int compress_pool_get_tile_rows(CompressPool *pool, int width, int height);
+
+/* The job takes ownership of src->data, the chunks must point to memory
+ * that stays valid until compress_job_finish() or compress_job_cancel()
+ * returns. */
+CompressJob *compress_pool_submit(CompressPool *pool, const SpiceBitmap *src,
+                                  SpiceImageCompression compression, int use_jpeg);
+/* Both functions release the job. On success the descriptor type and the
+ * compressed data of dest are set, the buffers in o_comp_data belong to the
+ * caller, and o_time_ns, unless NULL, is set to the time the compression
+ * took in the pool thread. */
+CompressJobResult compress_job_finish(CompressJob *job, SpiceImage *dest,
+                                      compress_send_data_t *o_comp_data, uint64_t *o_time_ns);
+void compress_job_cancel(CompressJob *job);
+
+#endif /* COMPRESS_POOL_H_ */
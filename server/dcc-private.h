@@ -57,6 +57,12 @@ struct DisplayChannelClientPrivate
     StreamAgent stream_agents[NUM_STREAMS];
     uint32_t streams_max_latency;
     uint64_t streams_max_bit_rate;
+
+    /* moving average of the size of the drawing messages, for the pipe
+     * budget */
+    uint64_t avg_msg_size;
+    /* when is_low_bandwidth was last compared with the network model */
+    uint64_t low_bandwidth_check_time;
     bool gl_draw_ongoing;
 };
 
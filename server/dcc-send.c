@@ -55,22 +55,34 @@ static int dcc_pixmap_cache_unlocked_hit(DisplayChannelClient *dcc, uint64_t id,
     uint64_t serial;
 
     serial = red_channel_client_get_message_serial(RED_CHANNEL_CLIENT(dcc));
-    item = cache->hash_table[BITS_CACHE_HASH_KEY(id)];
-
-    while (item) {
-        if (item->id == id) {
-            ring_remove(&item->lru_link);
-            ring_add(&cache->lru, &item->lru_link);
-            spice_assert(dcc->priv->id < MAX_CACHE_CLIENTS);
-            item->sync[dcc->priv->id] = serial;
-            cache->sync[dcc->priv->id] = serial;
-            *lossy = item->lossy;
-            break;
-        }
-        item = item->next;
+    item = pixmap_cache_unlocked_lookup(cache, id);
+    if (!item) {
+        return FALSE;
     }
 
-    return !!item;
+    spice_assert(dcc->priv->id < MAX_CACHE_CLIENTS);
+    item->sync[dcc->priv->id] = serial;
+    cache->sync[dcc->priv->id] = serial;
+    *lossy = item->lossy;
+
+    return TRUE;
+}
+
+/* Looks for a cached image with the same content, the client can use it
+ * instead of receiving the same pixels again under a new id. Lossy items are
+ * ignored as is_bitmap_lossy() only knows about the id of the image. */
+static int dcc_pixmap_cache_unlocked_content_hit(DisplayChannelClient *dcc,
+                                                 const BitmapContentHash *hash,
+                                                 uint64_t *id, int *lossy)
+{
+    NewCacheItem *item;
+
+    item = pixmap_cache_unlocked_content_find(dcc->priv->pixmap_cache, hash);
+    if (!item) {
+        return FALSE;
+    }
+    *id = item->id;
+    return dcc_pixmap_cache_unlocked_hit(dcc, item->id, lossy);
 }
 
 static int dcc_pixmap_cache_hit(DisplayChannelClient *dcc, uint64_t id, int *lossy)
@@ -182,7 +194,8 @@ static GList *dcc_get_tail(DisplayChannelClient *dcc)
 
 static void red_display_add_image_to_pixmap_cache(RedChannelClient *rcc,
                                                   SpiceImage *image, SpiceImage *io_image,
-                                                  int is_lossy)
+                                                  int is_lossy,
+                                                  const BitmapContentHash *content_hash)
 {
     DisplayChannel *display_channel G_GNUC_UNUSED =
         DISPLAY_CHANNEL(red_channel_client_get_channel(rcc));
@@ -193,7 +206,7 @@ static void red_display_add_image_to_pixmap_cache(RedChannelClient *rcc,
         if (!(io_image->descriptor.flags & SPICE_IMAGE_FLAGS_CACHE_REPLACE_ME)) {
             if (dcc_pixmap_cache_unlocked_add(dcc, image->descriptor.id,
                                               image->descriptor.width * image->descriptor.height,
-                                              is_lossy)) {
+                                              is_lossy, content_hash)) {
                 io_image->descriptor.flags |= SPICE_IMAGE_FLAGS_CACHE_ME;
                 dcc->priv->send_data.pixmap_cache_items[dcc->priv->send_data.num_pixmap_cache_items++] =
                                                                                image->descriptor.id;
@@ -349,6 +362,26 @@ static void marshaller_unref_drawable(uint8_t *data, void *opaque)
     drawable_unref(drawable);
 }
 
+static void marshall_image_from_cache(DisplayChannelClient *dcc, SpiceMarshaller *m,
+                                      SpiceImage *image, int lossy_cache_item)
+{
+    DisplayChannel *display = DCC_TO_DC(dcc);
+    SpiceMarshaller *bitmap_palette_out, *lzplt_palette_out;
+
+    if (!display->priv->enable_jpeg || lossy_cache_item) {
+        image->descriptor.type = SPICE_IMAGE_TYPE_FROM_CACHE;
+    } else {
+        // making sure, in multiple monitor scenario, that lossy items that
+        // should have been replaced with lossless data by one display channel,
+        // will be retrieved as lossless by another display channel.
+        image->descriptor.type = SPICE_IMAGE_TYPE_FROM_CACHE_LOSSLESS;
+    }
+    spice_marshall_Image(m, image,
+                         &bitmap_palette_out, &lzplt_palette_out);
+    spice_assert(bitmap_palette_out == NULL);
+    spice_assert(lzplt_palette_out == NULL);
+}
+
 /* if the number of times fill_bits can be called per one qxl_drawable increases -
    MAX_LZ_DRAWABLE_INSTANCES must be increased as well */
 /* NOTE: 'simage' should be owned by the drawable. The drawable will be kept
@@ -362,6 +395,8 @@ static FillBitsType fill_bits(DisplayChannelClient *dcc, SpiceMarshaller *m,
     SpiceImage image;
     compress_send_data_t comp_send_data = {0};
     SpiceMarshaller *bitmap_palette_out, *lzplt_palette_out;
+    BitmapContentHash content_hash_buf;
+    BitmapContentHash *content_hash = NULL;
 
     if (simage == NULL) {
         spice_assert(drawable->red_drawable->self_bitmap_image);
@@ -377,22 +412,24 @@ static FillBitsType fill_bits(DisplayChannelClient *dcc, SpiceMarshaller *m,
 
     if ((simage->descriptor.flags & SPICE_IMAGE_FLAGS_CACHE_ME)) {
         int lossy_cache_item;
-        if (dcc_pixmap_cache_unlocked_hit(dcc, image.descriptor.id, &lossy_cache_item)) {
+        int hit = dcc_pixmap_cache_unlocked_hit(dcc, image.descriptor.id, &lossy_cache_item);
+
+        /* the image is only hashed on id misses, without holding the lock
+         * of the cache shared with the other clients */
+        if (!hit && dcc->priv->pixmap_cache->content_dedup &&
+            simage->descriptor.type == SPICE_IMAGE_TYPE_BITMAP) {
+            pthread_mutex_unlock(&dcc->priv->pixmap_cache->lock);
+            content_hash = &content_hash_buf;
+            bitmap_get_content_hash(&simage->u.bitmap, simage->descriptor.flags, content_hash);
+            pthread_mutex_lock(&dcc->priv->pixmap_cache->lock);
+            /* another client may have added it meanwhile */
+            hit = dcc_pixmap_cache_unlocked_hit(dcc, image.descriptor.id, &lossy_cache_item);
+        }
+        if (hit) {
             dcc->priv->send_data.pixmap_cache_items[dcc->priv->send_data.num_pixmap_cache_items++] =
                 image.descriptor.id;
             if (can_lossy || !lossy_cache_item) {
-                if (!display->priv->enable_jpeg || lossy_cache_item) {
-                    image.descriptor.type = SPICE_IMAGE_TYPE_FROM_CACHE;
-                } else {
-                    // making sure, in multiple monitor scenario, that lossy items that
-                    // should have been replaced with lossless data by one display channel,
-                    // will be retrieved as lossless by another display channel.
-                    image.descriptor.type = SPICE_IMAGE_TYPE_FROM_CACHE_LOSSLESS;
-                }
-                spice_marshall_Image(m, &image,
-                                     &bitmap_palette_out, &lzplt_palette_out);
-                spice_assert(bitmap_palette_out == NULL);
-                spice_assert(lzplt_palette_out == NULL);
+                marshall_image_from_cache(dcc, m, &image, lossy_cache_item);
                 stat_inc_counter(reds, display->priv->cache_hits_counter, 1);
                 pthread_mutex_unlock(&dcc->priv->pixmap_cache->lock);
                 return FILL_BITS_TYPE_CACHE;
@@ -401,6 +438,20 @@ static FillBitsType fill_bits(DisplayChannelClient *dcc, SpiceMarshaller *m,
                                                 FALSE);
                 image.descriptor.flags |= SPICE_IMAGE_FLAGS_CACHE_REPLACE_ME;
             }
+        } else if (content_hash) {
+            uint64_t cache_id;
+
+            if (dcc_pixmap_cache_unlocked_content_hit(dcc, content_hash,
+                                                      &cache_id, &lossy_cache_item)) {
+                dcc->priv->send_data.pixmap_cache_items[dcc->priv->send_data.num_pixmap_cache_items++] =
+                    cache_id;
+                image.descriptor.id = cache_id;
+                marshall_image_from_cache(dcc, m, &image, lossy_cache_item);
+                stat_inc_counter(reds, display->priv->content_cache_hits_counter, 1);
+                pthread_mutex_unlock(&dcc->priv->pixmap_cache->lock);
+                return FILL_BITS_TYPE_CACHE;
+            }
+            stat_inc_counter(reds, display->priv->content_cache_misses_counter, 1);
         }
     }
 
@@ -438,12 +489,12 @@ static FillBitsType fill_bits(DisplayChannelClient *dcc, SpiceMarshaller *m,
         /* Images must be added to the cache only after they are compressed
            in order to prevent starvation in the client between pixmap_cache and
            global dictionary (in cases of multiple monitors) */
-        if (reds_stream_get_family(red_channel_client_get_stream(rcc)) == AF_UNIX ||
+        if (dcc_sends_raw_images(dcc) ||
             !dcc_compress_image(dcc, &image, &simage->u.bitmap,
                                 drawable, can_lossy, &comp_send_data)) {
             SpicePalette *palette;
 
-            red_display_add_image_to_pixmap_cache(rcc, simage, &image, FALSE);
+            red_display_add_image_to_pixmap_cache(rcc, simage, &image, FALSE, content_hash);
 
             *bitmap = simage->u.bitmap;
             bitmap->flags = bitmap->flags & SPICE_BITMAP_FLAGS_TOP_DOWN;
@@ -461,7 +512,7 @@ static FillBitsType fill_bits(DisplayChannelClient *dcc, SpiceMarshaller *m,
             /* 'drawable' owns this bitmap data, so it must be kept
              * alive until the message is sent. */
             for (unsigned int i = 0; i < bitmap->data->num_chunks; i++) {
-                drawable->refs++;
+                drawable_ref(drawable);
                 spice_marshaller_add_by_ref_full(m, bitmap->data->chunk[i].data,
                                                  bitmap->data->chunk[i].len,
                                                  marshaller_unref_drawable, drawable);
@@ -470,7 +521,7 @@ static FillBitsType fill_bits(DisplayChannelClient *dcc, SpiceMarshaller *m,
             return FILL_BITS_TYPE_BITMAP;
         } else {
             red_display_add_image_to_pixmap_cache(rcc, simage, &image,
-                                                  comp_send_data.is_lossy);
+                                                  comp_send_data.is_lossy, content_hash);
 
             spice_marshall_Image(m, &image,
                                  &bitmap_palette_out, &lzplt_palette_out);
@@ -491,7 +542,7 @@ static FillBitsType fill_bits(DisplayChannelClient *dcc, SpiceMarshaller *m,
         break;
     }
     case SPICE_IMAGE_TYPE_QUIC:
-        red_display_add_image_to_pixmap_cache(rcc, simage, &image, FALSE);
+        red_display_add_image_to_pixmap_cache(rcc, simage, &image, FALSE, content_hash);
         image.u.quic = simage->u.quic;
         spice_marshall_Image(m, &image,
                              &bitmap_palette_out, &lzplt_palette_out);
@@ -500,7 +551,7 @@ static FillBitsType fill_bits(DisplayChannelClient *dcc, SpiceMarshaller *m,
         /* 'drawable' owns this image data, so it must be kept
          * alive until the message is sent. */
         for (unsigned int i = 0; i < image.u.quic.data->num_chunks; i++) {
-            drawable->refs++;
+            drawable_ref(drawable);
             spice_marshaller_add_by_ref_full(m, image.u.quic.data->chunk[i].data,
                                              image.u.quic.data->chunk[i].len,
                                              marshaller_unref_drawable, drawable);
@@ -739,7 +790,11 @@ static void red_pipe_replace_rendered_drawables_with_images(DisplayChannelClient
         // these bitmaps state at the client might not be synchronized with X
         // (i.e., the bitmaps can be more futuristic w.r.t X). Thus, X shouldn't
         // be rendered at the client, and we replace it with an image as well.
-        if (!drawable_depends_on_areas(drawable,
+        // The pipe can be longer than MAX_PIPE_SIZE when coalescing is
+        // enabled, once the areas cannot be tracked anymore all the
+        // following drawables are replaced.
+        if (num_resent < MAX_PIPE_SIZE &&
+            !drawable_depends_on_areas(drawable,
                                        resent_surface_ids,
                                        resent_areas,
                                        num_resent)) {
@@ -748,9 +803,11 @@ static void red_pipe_replace_rendered_drawables_with_images(DisplayChannelClient
 
         image = dcc_add_surface_area_image(dcc, drawable->red_drawable->surface_id,
                                            &drawable->red_drawable->bbox, l, TRUE);
-        resent_surface_ids[num_resent] = drawable->red_drawable->surface_id;
-        resent_areas[num_resent] = drawable->red_drawable->bbox;
-        num_resent++;
+        if (num_resent < MAX_PIPE_SIZE) {
+            resent_surface_ids[num_resent] = drawable->red_drawable->surface_id;
+            resent_areas[num_resent] = drawable->red_drawable->bbox;
+            num_resent++;
+        }
 
         spice_assert(image);
         red_channel_client_pipe_remove_and_release_pos(RED_CHANNEL_CLIENT(dcc), l);
@@ -1680,6 +1737,29 @@ static void red_release_video_encoder_buffer(uint8_t *data, void *opaque)
     buffer->free(buffer);
 }
 
+/* The pipe works as the encode queue of the streams: a frame is only worth
+ * encoding if it is the latest one the client will get. When a newer frame of
+ * the stream is already waiting in the pipe, the older one is superseded and
+ * is skipped before spending any time compressing it. */
+static int stream_frame_is_superseded(DisplayChannelClient *dcc, Stream *stream,
+                                      Drawable *drawable)
+{
+    GList *l;
+
+    if (!stream->current || stream->current == drawable) {
+        return FALSE;
+    }
+    for (l = stream->current->pipes; l; l = l->next) {
+        RedDrawablePipeItem *dpi = l->data;
+
+        if (dpi->dcc == dcc) {
+            return red_channel_client_pipe_item_is_linked(RED_CHANNEL_CLIENT(dcc),
+                                                          &dpi->dpi_pipe_item);
+        }
+    }
+    return FALSE;
+}
+
 static int red_marshall_stream_data(RedChannelClient *rcc,
                                     SpiceMarshaller *base_marshaller,
                                     Drawable *drawable)
@@ -1710,6 +1790,15 @@ static int red_marshall_stream_data(RedChannelClient *rcc,
 
     StreamAgent *agent = &dcc->priv->stream_agents[display_channel_get_stream_id(display, stream)];
     VideoBuffer *outbuf;
+
+    if (stream_frame_is_superseded(dcc, stream, drawable)) {
+#ifdef STREAM_STATS
+        agent->stats.num_skips_superseded++;
+#endif
+        stat_inc_counter(reds, display->priv->stream_frames_superseded_counter, 1);
+        return TRUE;
+    }
+
     /* workaround for vga streams */
     frame_mm_time =  drawable->red_drawable->mm_time ?
                         drawable->red_drawable->mm_time :
@@ -1726,6 +1815,7 @@ static int red_marshall_stream_data(RedChannelClient *rcc,
 #ifdef STREAM_STATS
         agent->stats.num_drops_fps++;
 #endif
+        stat_inc_counter(reds, display->priv->stream_frames_dropped_counter, 1);
         return TRUE;
     case VIDEO_ENCODER_FRAME_UNSUPPORTED:
         return FALSE;
@@ -1979,8 +2069,9 @@ static void red_marshall_image(RedChannelClient *rcc,
                                          &src_bitmap_out, &mask_bitmap_out);
 
     compress_send_data_t comp_send_data = {0};
+    int comp_succeeded;
 
-    int comp_succeeded = dcc_compress_image(dcc, &red_image, &bitmap, NULL, item->can_lossy, &comp_send_data);
+    comp_succeeded = dcc_compress_image_item(dcc, item, &red_image, &bitmap, &comp_send_data);
 
     surface_lossy_region = &dcc->priv->surface_client_lossy_region[item->surface_id];
     if (comp_succeeded) {
@@ -2458,6 +2549,10 @@ void dcc_send_item(RedChannelClient *rcc, RedPipeItem *pipe_item)
         spice_warn_if_reached();
     }
 
+    if (pipe_item->type == RED_PIPE_ITEM_TYPE_DRAW || pipe_item->type == RED_PIPE_ITEM_TYPE_IMAGE) {
+        dcc_account_sent_message(dcc, spice_marshaller_get_total_size(m));
+    }
+
     // a message is pending
     if (red_channel_client_send_message_pending(rcc)) {
         begin_send_message(rcc);
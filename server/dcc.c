@@ -30,6 +30,7 @@ G_DEFINE_TYPE(DisplayChannelClient, display_channel_client, RED_TYPE_CHANNEL_CLI
 
 #define DISPLAY_CLIENT_SHORT_TIMEOUT 15000000000ULL //nano
 #define DISPLAY_FREE_LIST_DEFAULT_SIZE 128
+#define DCC_LOW_BANDWIDTH_CHECK_INTERVAL NSEC_PER_SEC
 
 enum
 {
@@ -88,6 +89,7 @@ display_channel_client_set_property(GObject *object,
 }
 
 static void dcc_init_stream_agents(DisplayChannelClient *dcc);
+static void dcc_image_item_start_compress(DisplayChannelClient *dcc, RedImageItem *item);
 
 static void
 display_channel_client_constructed(GObject *object)
@@ -205,6 +207,146 @@ int dcc_drawable_is_in_pipe(DisplayChannelClient *dcc, Drawable *drawable)
     return FALSE;
 }
 
+void dcc_account_sent_message(DisplayChannelClient *dcc, size_t size)
+{
+    dcc->priv->avg_msg_size = (dcc->priv->avg_msg_size * 15 + size) / 16;
+}
+
+/* The number of items the client can have queued: what its link can send
+ * in DCC_PIPE_TARGET_DELAY_MS, minus the time for the data to reach it,
+ * given the average size of the messages sent so far */
+uint32_t dcc_get_pipe_budget(DisplayChannelClient *dcc)
+{
+    RedClient *client = red_channel_client_get_client(RED_CHANNEL_CLIENT(dcc));
+    MainChannelClient *mcc = red_client_get_main(client);
+    uint64_t bitrate, roundtrip, delay_ms, budget;
+
+    if (!mcc || !main_channel_client_is_network_info_initialized(mcc) ||
+        dcc->priv->avg_msg_size == 0) {
+        return MAX_PIPE_SIZE;
+    }
+
+    bitrate = main_channel_client_get_bitrate_per_sec(mcc);
+    roundtrip = main_channel_client_get_roundtrip_ms(mcc);
+    delay_ms = MAX(DCC_PIPE_TARGET_DELAY_MS - MIN(roundtrip / 2, DCC_PIPE_TARGET_DELAY_MS),
+                   DCC_PIPE_TARGET_DELAY_MS / 4);
+    if (bitrate / 8 > UINT64_MAX / delay_ms) {
+        return MAX_PIPE_SIZE;
+    }
+    budget = bitrate / 8 * delay_ms / 1000 / dcc->priv->avg_msg_size;
+
+    return CLAMP(budget, DCC_MIN_PIPE_BUDGET, MAX_PIPE_SIZE);
+}
+
+/* the pipe exceeds the budget of the client and nothing can be sent for now */
+int dcc_is_behind(DisplayChannelClient *dcc)
+{
+    RedChannelClient *rcc = RED_CHANNEL_CLIENT(dcc);
+
+    return red_channel_client_get_pipe_size(rcc) > dcc_get_pipe_budget(dcc) &&
+           (red_channel_client_is_blocked(rcc) || red_channel_client_is_waiting_for_ack(rcc));
+}
+
+static uint64_t rect_area(const SpiceRect *rect)
+{
+    return (uint64_t)(rect->right - rect->left) * (rect->bottom - rect->top);
+}
+
+/* Replaces the newest drawables and images queued for a surface with an
+ * image of the area they cover, read once the surface is rendered. When the
+ * bounding box of that area is much larger than the area itself, like for
+ * small updates far apart, one image per rectangle of the area is queued
+ * instead, if that still shortens the pipe. Only the run of items at the
+ * head of the pipe is considered so that no item left in the pipe can
+ * depend on the removed ones.
+ * Returns by how many items the pipe was shortened. */
+int dcc_coalesce_pipe(DisplayChannelClient *dcc)
+{
+    DisplayChannel *display = DCC_TO_DC(dcc);
+    RedChannelClient *rcc = RED_CHANNEL_CLIENT(dcc);
+    GQueue *pipe = red_channel_client_get_pipe(rcc);
+    QRegion region;
+    SpiceRect area;
+    SpiceRect *rects;
+    uint64_t region_area = 0;
+    GList *l;
+    int surface_id = -1;
+    int n_items = 0;
+    int n_rects;
+    int i;
+
+    region_init(&region);
+    for (l = pipe->head; l != NULL; l = l->next) {
+        RedPipeItem *item = l->data;
+        int item_surface_id;
+
+        if (item->type == RED_PIPE_ITEM_TYPE_DRAW) {
+            Drawable *drawable = SPICE_CONTAINEROF(item, RedDrawablePipeItem,
+                                                   dpi_pipe_item)->drawable;
+
+            /* stream frames are not drawn on the surface by the client */
+            if (drawable->stream) {
+                break;
+            }
+            item_surface_id = drawable->surface_id;
+            area = drawable->red_drawable->bbox;
+        } else if (item->type == RED_PIPE_ITEM_TYPE_IMAGE) {
+            RedImageItem *image = SPICE_UPCAST(RedImageItem, item);
+
+            item_surface_id = image->surface_id;
+            area.left = image->pos.x;
+            area.top = image->pos.y;
+            area.right = image->pos.x + image->width;
+            area.bottom = image->pos.y + image->height;
+        } else {
+            break;
+        }
+        if (surface_id != -1 && item_surface_id != surface_id) {
+            break;
+        }
+        surface_id = item_surface_id;
+        region_add(&region, &area);
+        n_items++;
+    }
+
+    if (n_items < 2 || region_is_empty(&region)) {
+        region_destroy(&region);
+        return 0;
+    }
+
+    area.left = region.extents.x1;
+    area.top = region.extents.y1;
+    area.right = region.extents.x2;
+    area.bottom = region.extents.y2;
+    n_rects = pixman_region32_n_rects(&region);
+    rects = spice_new(SpiceRect, n_rects);
+    region_ret_rects(&region, rects, n_rects);
+    region_destroy(&region);
+    for (i = 0; i < n_rects; i++) {
+        region_area += rect_area(&rects[i]);
+    }
+
+    if (rect_area(&area) <= region_area * DCC_COALESCE_MAX_EXTENTS_RATIO) {
+        rects[0] = area;
+        n_rects = 1;
+    } else if (n_rects >= n_items) {
+        free(rects);
+        return 0;
+    }
+
+    for (i = 0; i < n_items; i++) {
+        red_channel_client_pipe_remove_and_release_pos(rcc, pipe->head);
+    }
+    for (i = 0; i < n_rects; i++) {
+        display_channel_draw(display, &rects[i], surface_id);
+        dcc_add_surface_area_image(dcc, surface_id, &rects[i], NULL, TRUE);
+    }
+    free(rects);
+    stat_inc_counter(reds, display->priv->coalesced_items_counter, n_items - n_rects);
+
+    return n_items - n_rects;
+}
+
 /*
  * Return: TRUE if wait_if_used == FALSE, or otherwise, if all of the pipe items that
  * are related to the surface have been cleared (or sent) from the pipe.
@@ -300,6 +442,16 @@ void dcc_create_surface(DisplayChannelClient *dcc, int surface_id)
     red_channel_client_pipe_add(RED_CHANNEL_CLIENT(dcc), &create->pipe_item);
 }
 
+static void red_image_item_free(RedPipeItem *base)
+{
+    RedImageItem *item = SPICE_CONTAINEROF(base, RedImageItem, base);
+
+    if (item->compress_job) {
+        compress_job_cancel(item->compress_job);
+    }
+    free(item);
+}
+
 // adding the pipe item after pos. If pos == NULL, adding to head.
 RedImageItem *dcc_add_surface_area_image(DisplayChannelClient *dcc,
                                          int surface_id,
@@ -326,7 +478,7 @@ RedImageItem *dcc_add_surface_area_image(DisplayChannelClient *dcc,
 
     item = (RedImageItem *)spice_malloc_n_m(height, stride, sizeof(RedImageItem));
 
-    red_pipe_item_init(&item->base, RED_PIPE_ITEM_TYPE_IMAGE);
+    red_pipe_item_init_full(&item->base, RED_PIPE_ITEM_TYPE_IMAGE, red_image_item_free);
 
     item->surface_id = surface_id;
     item->image_format =
@@ -354,6 +506,9 @@ RedImageItem *dcc_add_surface_area_image(DisplayChannelClient *dcc,
         }
     }
 
+    item->compress_job = NULL;
+    dcc_image_item_start_compress(dcc, item);
+
     if (pipe_item_pos) {
         red_channel_client_pipe_add_after_pos(RED_CHANNEL_CLIENT(dcc), &item->base, pipe_item_pos);
     } else {
@@ -368,6 +523,7 @@ void dcc_push_surface_image(DisplayChannelClient *dcc, int surface_id)
     DisplayChannel *display;
     SpiceRect area;
     RedSurface *surface;
+    int tile_rows;
 
     if (!dcc) {
         return;
@@ -378,13 +534,20 @@ void dcc_push_surface_image(DisplayChannelClient *dcc, int surface_id)
     if (!surface->context.canvas) {
         return;
     }
-    area.top = area.left = 0;
+    area.left = 0;
     area.right = surface->context.width;
-    area.bottom = surface->context.height;
 
-    /* not allowing lossy compression because probably, especially if it is a primary surface,
-       it combines both "picture-like" areas with areas that are more "artificial"*/
-    dcc_add_surface_area_image(dcc, surface_id, &area, NULL, FALSE);
+    /* big surfaces are sent as several images so that they are compressed
+     * in parallel when a compression pool is available */
+    tile_rows = compress_pool_get_tile_rows(display->priv->compress_pool,
+                                            surface->context.width, surface->context.height);
+    for (area.top = 0; area.top < surface->context.height; area.top = area.bottom) {
+        area.bottom = MIN(area.top + tile_rows, surface->context.height);
+        /* not allowing lossy compression because probably, especially if it is a primary
+           surface, it combines both "picture-like" areas with areas that are more
+           "artificial"*/
+        dcc_add_surface_area_image(dcc, surface_id, &area, NULL, FALSE);
+    }
     red_channel_client_push(RED_CHANNEL_CLIENT(dcc));
 }
 
@@ -420,11 +583,18 @@ static void red_drawable_pipe_item_free(RedPipeItem *item)
 {
     RedDrawablePipeItem *dpi = SPICE_CONTAINEROF(item, RedDrawablePipeItem,
                                                  dpi_pipe_item);
+    DisplayChannel *display;
+
     spice_assert(item->refcount == 0);
+    /* the pipes of the drawable and the slab of the items belong to the worker */
+    if (send_pool_defer((SendPoolDeferFunc)red_drawable_pipe_item_free, item)) {
+        return;
+    }
 
+    display = dpi->drawable->display;
     dpi->drawable->pipes = g_list_remove(dpi->drawable->pipes, dpi);
     drawable_unref(dpi->drawable);
-    free(dpi);
+    slab_release(display->priv->drawable_pipe_item_slab, dpi);
 }
 
 static RedDrawablePipeItem *red_drawable_pipe_item_new(DisplayChannelClient *dcc,
@@ -432,13 +602,14 @@ static RedDrawablePipeItem *red_drawable_pipe_item_new(DisplayChannelClient *dcc
 {
     RedDrawablePipeItem *dpi;
 
-    dpi = spice_malloc0(sizeof(*dpi));
+    dpi = slab_alloc(DCC_TO_DC(dcc)->priv->drawable_pipe_item_slab);
+    memset(dpi, 0, sizeof(*dpi));
     dpi->drawable = drawable;
     dpi->dcc = dcc;
     drawable->pipes = g_list_prepend(drawable->pipes, dpi);
     red_pipe_item_init_full(&dpi->dpi_pipe_item, RED_PIPE_ITEM_TYPE_DRAW,
                             red_drawable_pipe_item_free);
-    drawable->refs++;
+    drawable_ref(drawable);
     return dpi;
 }
 
@@ -501,6 +672,9 @@ DisplayChannelClient *dcc_new(DisplayChannel *display,
         caps_array = g_array_sized_new(FALSE, FALSE, sizeof (*caps), num_caps);
         g_array_append_vals(caps_array, caps, num_caps);
     }
+    if (getenv("SPICE_ZEROCOPY") != NULL && !reds_stream_enable_zerocopy(stream)) {
+        spice_debug("zero copy send not available for the display channel");
+    }
 
     dcc = g_initable_new(TYPE_DISPLAY_CHANNEL_CLIENT,
                          NULL, NULL,
@@ -622,6 +796,7 @@ void dcc_stop(DisplayChannelClient *dcc)
     free(dcc->priv->send_data.free_list.res);
     dcc_destroy_stream_agents(dcc);
     image_encoders_free(&dcc->priv->encoders);
+    display_channel_glz_expire_parked(dc);
 
     if (dcc->priv->gl_draw_ongoing) {
         display_channel_gl_draw_done(dc);
@@ -781,11 +956,109 @@ static bool can_lz_compress(SpiceBitmap *bitmap)
            !(bitmap->data->flags & SPICE_CHUNKS_FLAGS_UNSTABLE);
 }
 
+static const SpiceImageCompression image_codec_compression[IMAGE_CODEC_COUNT] = {
+    [IMAGE_CODEC_QUIC] = SPICE_IMAGE_COMPRESSION_QUIC,
+    [IMAGE_CODEC_JPEG] = SPICE_IMAGE_COMPRESSION_QUIC, /* see dcc_compress_image() */
+    [IMAGE_CODEC_LZ] = SPICE_IMAGE_COMPRESSION_LZ,
+    [IMAGE_CODEC_GLZ] = SPICE_IMAGE_COMPRESSION_GLZ,
+    [IMAGE_CODEC_LZ4] = SPICE_IMAGE_COMPRESSION_LZ4,
+};
+
+static ImageCodec image_codec_from_type(uint8_t image_type)
+{
+    switch (image_type) {
+    case SPICE_IMAGE_TYPE_QUIC:
+        return IMAGE_CODEC_QUIC;
+    case SPICE_IMAGE_TYPE_JPEG:
+    case SPICE_IMAGE_TYPE_JPEG_ALPHA:
+        return IMAGE_CODEC_JPEG;
+    case SPICE_IMAGE_TYPE_LZ_RGB:
+    case SPICE_IMAGE_TYPE_LZ_PLT:
+        return IMAGE_CODEC_LZ;
+    case SPICE_IMAGE_TYPE_GLZ_RGB:
+    case SPICE_IMAGE_TYPE_ZLIB_GLZ_RGB:
+        return IMAGE_CODEC_GLZ;
+    case SPICE_IMAGE_TYPE_LZ4:
+        return IMAGE_CODEC_LZ4;
+    default:
+        return IMAGE_CODEC_COUNT;
+    }
+}
+
+/* Chooses the codec of an image of an automatic compression from what the
+ * codecs did with the previous images of the same graduality and from the
+ * current bandwidth of the client, see SPICE_IMAGE_COST_MODEL.
+ * Returns SPICE_IMAGE_COMPRESSION_INVALID when the bandwidth isn't known yet,
+ * otherwise graduality is set to the class of the image. */
+static SpiceImageCompression get_compression_by_cost(DisplayChannelClient *dcc,
+                                                     SpiceBitmap *bitmap,
+                                                     SpiceImageCompression preferred_compression,
+                                                     Drawable *drawable, int use_jpeg,
+                                                     BitmapGradualType *graduality)
+{
+    RedChannelClient *rcc = RED_CHANNEL_CLIENT(dcc);
+    MainChannelClient *mcc = red_client_get_main(red_channel_client_get_client(rcc));
+    uint64_t bit_rate;
+    uint32_t codecs = 0;
+    ImageCodec codec;
+
+    if (!mcc) {
+        return SPICE_IMAGE_COMPRESSION_INVALID;
+    }
+    /* the bit rate is UINT64_MAX when the net test wasn't done */
+    bit_rate = main_channel_client_get_bitrate_per_sec(mcc);
+    if (bit_rate == 0 || bit_rate == UINT64_MAX) {
+        return SPICE_IMAGE_COMPRESSION_INVALID;
+    }
+
+    if (can_quic_compress(bitmap)) {
+        codecs |= 1 << (use_jpeg ? IMAGE_CODEC_JPEG : IMAGE_CODEC_QUIC);
+    }
+    if (can_lz_compress(bitmap)) {
+        codecs |= 1 << IMAGE_CODEC_LZ;
+        if (preferred_compression == SPICE_IMAGE_COMPRESSION_AUTO_GLZ &&
+            drawable != NULL && bitmap_fmt_has_graduality(bitmap->format)) {
+            codecs |= 1 << IMAGE_CODEC_GLZ;
+        }
+#ifdef USE_LZ4
+        if (bitmap_fmt_is_rgb(bitmap->format) &&
+            red_channel_client_test_remote_cap(rcc, SPICE_DISPLAY_CAP_LZ4_COMPRESSION)) {
+            codecs |= 1 << IMAGE_CODEC_LZ4;
+        }
+#endif
+    }
+    if (codecs == 0) {
+        return SPICE_IMAGE_COMPRESSION_OFF;
+    }
+
+    if (drawable != NULL && drawable->copy_bitmap_graduality != BITMAP_GRADUAL_INVALID) {
+        *graduality = drawable->copy_bitmap_graduality;
+    } else if (bitmap_fmt_has_graduality(bitmap->format)) {
+        *graduality = bitmap_get_graduality_level(bitmap);
+    } else {
+        *graduality = BITMAP_GRADUAL_NOT_AVAIL;
+    }
+
+    codec = image_encoder_shared_choose_codec(&DCC_TO_DC(dcc)->priv->encoder_shared_data,
+                                              *graduality, codecs,
+                                              bitmap->y * (uint64_t)bitmap->stride, bit_rate);
+    if (codec == IMAGE_CODEC_COUNT) {
+        *graduality = BITMAP_GRADUAL_INVALID;
+        return SPICE_IMAGE_COMPRESSION_INVALID;
+    }
+    return image_codec_compression[codec];
+}
+
 #define MIN_SIZE_TO_COMPRESS 54
-static SpiceImageCompression get_compression_for_bitmap(SpiceBitmap *bitmap,
+/* graduality is set when the codec was chosen by the cost model, and left
+ * to BITMAP_GRADUAL_INVALID otherwise */
+static SpiceImageCompression get_compression_for_bitmap(DisplayChannelClient *dcc,
+                                                        SpiceBitmap *bitmap,
                                                         SpiceImageCompression preferred_compression,
-                                                        Drawable *drawable)
+                                                        Drawable *drawable, int use_jpeg,
+                                                        BitmapGradualType *graduality)
 {
+    *graduality = BITMAP_GRADUAL_INVALID;
     if (bitmap->y * bitmap->stride < MIN_SIZE_TO_COMPRESS) { // TODO: change the size cond
         return SPICE_IMAGE_COMPRESSION_OFF;
     }
@@ -801,6 +1074,15 @@ static SpiceImageCompression get_compression_for_bitmap(SpiceBitmap *bitmap,
 
     if (preferred_compression == SPICE_IMAGE_COMPRESSION_AUTO_GLZ ||
         preferred_compression == SPICE_IMAGE_COMPRESSION_AUTO_LZ) {
+        if (DCC_TO_DC(dcc)->priv->image_cost_model) {
+            SpiceImageCompression image_compression =
+                get_compression_by_cost(dcc, bitmap, preferred_compression, drawable,
+                                        use_jpeg, graduality);
+
+            if (image_compression != SPICE_IMAGE_COMPRESSION_INVALID) {
+                return image_compression;
+            }
+        }
         if (can_quic_compress(bitmap)) {
             if (drawable == NULL ||
                 drawable->copy_bitmap_graduality == BITMAP_GRADUAL_INVALID) {
@@ -844,25 +1126,59 @@ static SpiceImageCompression get_compression_for_bitmap(SpiceBitmap *bitmap,
     return SPICE_IMAGE_COMPRESSION_INVALID;
 }
 
-int dcc_compress_image(DisplayChannelClient *dcc,
-                       SpiceImage *dest, SpiceBitmap *src, Drawable *drawable,
-                       int can_lossy,
-                       compress_send_data_t* o_comp_data)
+/* Images are sent uncompressed to local clients and when compression is
+ * disabled. The pixels are then referenced by the marshaller directly from
+ * the guest memory or the image pipe item, so no compression buffers are
+ * filled and no compression job needs to be started. */
+int dcc_sends_raw_images(DisplayChannelClient *dcc)
+{
+    return dcc->priv->image_compression == SPICE_IMAGE_COMPRESSION_OFF ||
+           reds_stream_get_family(red_channel_client_get_stream(RED_CHANNEL_CLIENT(dcc))) ==
+           AF_UNIX;
+}
+
+static int dcc_can_use_jpeg(DisplayChannelClient *dcc, SpiceBitmap *bitmap, int can_lossy)
+{
+    return can_lossy && DCC_TO_DC(dcc)->priv->enable_jpeg &&
+           (bitmap->format != SPICE_BITMAP_FMT_RGBA || !bitmap_has_extra_stride(bitmap));
+}
+
+/* the codec of the image was chosen by the cost model */
+static void dcc_add_codec_sample(DisplayChannelClient *dcc, BitmapGradualType graduality,
+                                 SpiceImage *dest, SpiceBitmap *src,
+                                 compress_send_data_t *comp_data, uint64_t time_ns)
+{
+    ImageCodec codec = image_codec_from_type(dest->descriptor.type);
+
+    if (codec != IMAGE_CODEC_COUNT) {
+        image_encoder_shared_add_codec_sample(&DCC_TO_DC(dcc)->priv->encoder_shared_data,
+                                              codec, graduality,
+                                              src->stride * (uint64_t)src->y,
+                                              comp_data->comp_buf_size, time_ns);
+    }
+}
+
+static int dcc_compress_image_with(DisplayChannelClient *dcc,
+                                   SpiceImage *dest, SpiceBitmap *src, Drawable *drawable,
+                                   SpiceImageCompression image_compression,
+                                   BitmapGradualType graduality, int use_jpeg,
+                                   compress_send_data_t* o_comp_data)
 {
     DisplayChannel *display_channel = DCC_TO_DC(dcc);
-    SpiceImageCompression image_compression;
     stat_start_time_t start_time;
+    uint64_t encode_start = 0;
     int success = FALSE;
 
     stat_start_time_init(&start_time, &display_channel->priv->encoder_shared_data.off_stat);
 
-    image_compression = get_compression_for_bitmap(src, dcc->priv->image_compression, drawable);
+    if (graduality != BITMAP_GRADUAL_INVALID) {
+        encode_start = spice_get_monotonic_time_ns();
+    }
     switch (image_compression) {
     case SPICE_IMAGE_COMPRESSION_OFF:
         break;
     case SPICE_IMAGE_COMPRESSION_QUIC:
-        if (can_lossy && display_channel->priv->enable_jpeg &&
-            (src->format != SPICE_BITMAP_FMT_RGBA || !bitmap_has_extra_stride(src))) {
+        if (use_jpeg) {
             success = image_encoders_compress_jpeg(&dcc->priv->encoders, dest, src, o_comp_data);
             break;
         }
@@ -899,11 +1215,127 @@ lz_compress:
     if (!success) {
         uint64_t image_size = src->stride * (uint64_t)src->y;
         stat_compress_add(&display_channel->priv->encoder_shared_data.off_stat, start_time, image_size, image_size);
+    } else if (graduality != BITMAP_GRADUAL_INVALID) {
+        dcc_add_codec_sample(dcc, graduality, dest, src, o_comp_data,
+                             spice_get_monotonic_time_ns() - encode_start);
     }
 
     return success;
 }
 
+int dcc_compress_image(DisplayChannelClient *dcc,
+                       SpiceImage *dest, SpiceBitmap *src, Drawable *drawable,
+                       int can_lossy,
+                       compress_send_data_t* o_comp_data)
+{
+    SpiceImageCompression image_compression;
+    BitmapGradualType graduality;
+    int use_jpeg;
+
+    use_jpeg = dcc_can_use_jpeg(dcc, src, can_lossy);
+    image_compression = get_compression_for_bitmap(dcc, src, dcc->priv->image_compression,
+                                                   drawable, use_jpeg, &graduality);
+    return dcc_compress_image_with(dcc, dest, src, drawable, image_compression, graduality,
+                                   use_jpeg, o_comp_data);
+}
+
+/* Compresses the image of an item, with the job started by
+ * dcc_image_item_start_compress() if there is one. A codec chosen by the cost
+ * model when the job was submitted gets the sample of the image, whether the
+ * job ran or the image is compressed now because it did not start yet. */
+int dcc_compress_image_item(DisplayChannelClient *dcc, RedImageItem *item,
+                            SpiceImage *dest, SpiceBitmap *src,
+                            compress_send_data_t *o_comp_data)
+{
+    CompressJobResult result;
+    uint64_t time_ns;
+
+    if (!item->compress_job) {
+        return !dcc_sends_raw_images(dcc) &&
+               dcc_compress_image(dcc, dest, src, NULL, item->can_lossy, o_comp_data);
+    }
+
+    result = compress_job_finish(item->compress_job, dest, o_comp_data, &time_ns);
+    item->compress_job = NULL;
+    switch (result) {
+    case COMPRESS_JOB_SKIPPED:
+        stat_inc_counter(reds, DCC_TO_DC(dcc)->priv->compress_pool_skips_counter, 1);
+        return dcc_compress_image_with(dcc, dest, src, NULL, item->compress_compression,
+                                       item->compress_graduality,
+                                       dcc_can_use_jpeg(dcc, src, item->can_lossy),
+                                       o_comp_data);
+    case COMPRESS_JOB_SUCCEEDED:
+        stat_inc_counter(reds, DCC_TO_DC(dcc)->priv->compress_pool_hits_counter, 1);
+        if (item->compress_graduality != BITMAP_GRADUAL_INVALID) {
+            dcc_add_codec_sample(dcc, item->compress_graduality, dest, src, o_comp_data,
+                                 time_ns);
+        }
+        return TRUE;
+    default:
+        stat_inc_counter(reds, DCC_TO_DC(dcc)->priv->compress_pool_hits_counter, 1);
+        return FALSE;
+    }
+}
+
+/* Hand the compression of a surface image to the compression pool so that
+ * it runs while the items in front of it are being sent. The codec is chosen
+ * now, like dcc_compress_image() would do it at send time. */
+static void dcc_image_item_start_compress(DisplayChannelClient *dcc, RedImageItem *item)
+{
+    DisplayChannel *display = DCC_TO_DC(dcc);
+    CompressPool *pool = display->priv->compress_pool;
+    SpiceImageCompression image_compression;
+    BitmapGradualType graduality;
+    SpiceBitmap bitmap;
+    int use_jpeg;
+
+    if (!pool || !bitmap_fmt_is_rgb(item->image_format) || dcc_sends_raw_images(dcc)) {
+        return;
+    }
+
+    bitmap.format = item->image_format;
+    bitmap.flags = item->top_down ? SPICE_BITMAP_FLAGS_TOP_DOWN : 0;
+    bitmap.x = item->width;
+    bitmap.y = item->height;
+    bitmap.stride = item->stride;
+    bitmap.palette = NULL;
+    bitmap.palette_id = 0;
+    bitmap.data = spice_chunks_new_linear(item->data, item->stride * item->height);
+
+    use_jpeg = dcc_can_use_jpeg(dcc, &bitmap, item->can_lossy);
+    image_compression = get_compression_for_bitmap(dcc, &bitmap, dcc->priv->image_compression,
+                                                   NULL, use_jpeg, &graduality);
+    switch (image_compression) {
+    case SPICE_IMAGE_COMPRESSION_QUIC:
+        break;
+    case SPICE_IMAGE_COMPRESSION_LZ4:
+#ifdef USE_LZ4
+        if (red_channel_client_test_remote_cap(RED_CHANNEL_CLIENT(dcc),
+                                               SPICE_DISPLAY_CAP_LZ4_COMPRESSION)) {
+            break;
+        }
+#endif
+        image_compression = SPICE_IMAGE_COMPRESSION_LZ;
+        break;
+    case SPICE_IMAGE_COMPRESSION_LZ:
+        break;
+    default:
+        /* OFF, and GLZ which is never picked without a drawable */
+        spice_chunks_destroy(bitmap.data);
+        return;
+    }
+
+    item->compress_job = compress_pool_submit(pool, &bitmap, image_compression, use_jpeg);
+    if (!item->compress_job) {
+        spice_chunks_destroy(bitmap.data);
+        return;
+    }
+    /* a codec chosen by cost may be the one to measure again, the sample is
+     * taken once the image is compressed, see dcc_compress_image_item() */
+    item->compress_compression = image_compression;
+    item->compress_graduality = graduality;
+}
+
 #define CLIENT_PALETTE_CACHE
 #include "cache-item.tmpl.c"
 #undef CLIENT_PALETTE_CACHE
@@ -950,17 +1382,25 @@ static void dcc_push_release(DisplayChannelClient *dcc, uint8_t type, uint64_t i
     free_list->res->resources[free_list->res->count++].id = id;
 }
 
+static void dcc_pixmap_cache_release(NewCacheItem *victim, void *opaque)
+{
+    DisplayChannelClient *dcc = opaque;
+
+    dcc->priv->pixmap_cache->sync[dcc->priv->id] =
+        red_channel_client_get_message_serial(RED_CHANNEL_CLIENT(dcc));
+    dcc_push_release(dcc, SPICE_RES_TYPE_PIXMAP, victim->id, victim->sync);
+}
+
 int dcc_pixmap_cache_unlocked_add(DisplayChannelClient *dcc, uint64_t id,
-                                  uint32_t size, int lossy)
+                                  uint32_t size, int lossy,
+                                  const BitmapContentHash *content_hash)
 {
     PixmapCache *cache = dcc->priv->pixmap_cache;
     NewCacheItem *item;
     uint64_t serial;
-    int key;
 
     spice_assert(size > 0);
 
-    item = spice_new(NewCacheItem, 1);
     serial = red_channel_client_get_message_serial(RED_CHANNEL_CLIENT(dcc));
 
     if (cache->generation != dcc->priv->pixmap_cache_generation) {
@@ -969,48 +1409,19 @@ int dcc_pixmap_cache_unlocked_add(DisplayChannelClient *dcc, uint64_t id,
                                              RED_CHANNEL_CLIENT(dcc), RED_PIPE_ITEM_TYPE_PIXMAP_SYNC);
             dcc->priv->pending_pixmaps_sync = TRUE;
         }
-        free(item);
         return FALSE;
     }
 
-    cache->available -= size;
-    while (cache->available < 0) {
-        NewCacheItem *tail;
-        NewCacheItem **now;
-
-        SPICE_VERIFY(SPICE_OFFSETOF(NewCacheItem, lru_link) == 0);
-        if (!(tail = (NewCacheItem *)ring_get_tail(&cache->lru)) ||
-                                                   tail->sync[dcc->priv->id] == serial) {
-            cache->available += size;
-            free(item);
-            return FALSE;
-        }
-
-        now = &cache->hash_table[BITS_CACHE_HASH_KEY(tail->id)];
-        for (;;) {
-            spice_assert(*now);
-            if (*now == tail) {
-                *now = tail->next;
-                break;
-            }
-            now = &(*now)->next;
-        }
-        ring_remove(&tail->lru_link);
-        cache->items--;
-        cache->available += tail->size;
-        cache->sync[dcc->priv->id] = serial;
-        dcc_push_release(dcc, SPICE_RES_TYPE_PIXMAP, tail->id, tail->sync);
-        free(tail);
-    }
-    ++cache->items;
-    item->next = cache->hash_table[(key = BITS_CACHE_HASH_KEY(id))];
-    cache->hash_table[key] = item;
-    ring_item_init(&item->lru_link);
-    ring_add(&cache->lru, &item->lru_link);
-    item->id = id;
+    if (!pixmap_cache_unlocked_reserve(cache, dcc->priv->id, serial, size,
+                                       dcc_pixmap_cache_release, dcc)) {
+        return FALSE;
+    }
+    item = pixmap_cache_unlocked_insert(cache, id);
     item->size = size;
     item->lossy = lossy;
-    memset(item->sync, 0, sizeof(item->sync));
+    if (content_hash) {
+        pixmap_cache_unlocked_content_add(cache, item, content_hash);
+    }
     item->sync[dcc->priv->id] = serial;
     cache->sync[dcc->priv->id] = serial;
     return TRUE;
@@ -1020,6 +1431,8 @@ static int dcc_handle_init(DisplayChannelClient *dcc, SpiceMsgcDisplayInit *init
 {
     gboolean success;
     RedClient *client = red_channel_client_get_client(RED_CHANNEL_CLIENT(dcc));
+    MainChannelClient *mcc = red_client_get_main(client);
+    uint32_t connection_id = 0;
 
     spice_return_val_if_fail(dcc->priv->expect_init, FALSE);
     dcc->priv->expect_init = FALSE;
@@ -1030,8 +1443,14 @@ static int dcc_handle_init(DisplayChannelClient *dcc, SpiceMsgcDisplayInit *init
                                                init->pixmap_cache_size);
     spice_return_val_if_fail(dcc->priv->pixmap_cache, FALSE);
 
+    /* any client can send the connection id of another session, only the
+     * ones which keep their window can be given the window of that session */
+    if (mcc && red_channel_client_test_remote_cap(RED_CHANNEL_CLIENT(dcc),
+                                                  DCC_CAP_GLZ_KEEP_WINDOW)) {
+        connection_id = main_channel_client_get_connection_id(mcc);
+    }
     success = image_encoders_get_glz_dictionary(&dcc->priv->encoders,
-                                                client,
+                                                client, connection_id,
                                                 init->glz_dictionary_id,
                                                 init->glz_dictionary_window_size);
     spice_return_val_if_fail(success, FALSE);
@@ -1121,9 +1540,39 @@ static int dcc_handle_gl_draw_done(DisplayChannelClient *dcc)
     return TRUE;
 }
 
+/* Follows the network model of the client, if any, to change the compression
+ * when the bandwidth of the client changes, e.g. when it moves from a wired
+ * network to a wireless one */
+static void dcc_update_low_bandwidth(DisplayChannelClient *dcc)
+{
+    RedClient *client = red_channel_client_get_client(RED_CHANNEL_CLIENT(dcc));
+    MainChannelClient *mcc = red_client_get_main(client);
+    uint64_t now;
+    int is_low_bandwidth;
+
+    if (!mcc || !red_client_get_net_model(client)) {
+        return;
+    }
+    now = spice_get_monotonic_time_ns();
+    if (now - dcc->priv->low_bandwidth_check_time < DCC_LOW_BANDWIDTH_CHECK_INTERVAL) {
+        return;
+    }
+    dcc->priv->low_bandwidth_check_time = now;
+
+    is_low_bandwidth = main_channel_client_is_still_low_bandwidth(mcc, dcc->is_low_bandwidth);
+    if (is_low_bandwidth == dcc->is_low_bandwidth) {
+        return;
+    }
+    spice_debug("bit rate %"PRIu64" bps, %s bandwidth", main_channel_client_get_bitrate_per_sec(mcc),
+                is_low_bandwidth ? "low" : "high");
+    dcc->is_low_bandwidth = is_low_bandwidth;
+    display_channel_update_compression(DCC_TO_DC(dcc), dcc);
+}
+
 int dcc_handle_message(RedChannelClient *rcc, uint32_t size, uint16_t type, void *msg)
 {
     DisplayChannelClient *dcc = DISPLAY_CHANNEL_CLIENT(rcc);
+    int ret;
 
     switch (type) {
     case SPICE_MSGC_DISPLAY_INIT:
@@ -1135,6 +1584,10 @@ int dcc_handle_message(RedChannelClient *rcc, uint32_t size, uint16_t type, void
             (SpiceMsgcDisplayPreferredCompression *)msg);
     case SPICE_MSGC_DISPLAY_GL_DRAW_DONE:
         return dcc_handle_gl_draw_done(dcc);
+    case SPICE_MSGC_ACK:
+        ret = red_channel_client_handle_message(rcc, size, type, msg);
+        dcc_update_low_bandwidth(dcc);
+        return ret;
     default:
         return red_channel_client_handle_message(rcc, size, type, msg);
     }
@@ -77,6 +77,22 @@ GType display_channel_client_get_type(void) G_GNUC_CONST;
 #define NARROW_CLIENT_ACK_WINDOW 20
 
 #define MAX_PIPE_SIZE 50
+/* With SPICE_DISPLAY_COALESCE each client gets a pipe budget between
+ * DCC_MIN_PIPE_BUDGET and MAX_PIPE_SIZE items, depending on how long its
+ * link needs to send them, see dcc_get_pipe_budget(). The worker only
+ * stops processing commands when a pipe exceeds DCC_MAX_PIPE_SIZE. */
+#define DCC_MIN_PIPE_BUDGET 8
+#define DCC_MAX_PIPE_SIZE (2 * MAX_PIPE_SIZE)
+/* how long sending the queued messages may take */
+#define DCC_PIPE_TARGET_DELAY_MS 200
+/* Not in spice-protocol: the client keeps its GLZ window when it reconnects
+ * a session, the dictionary kept for it with SPICE_GLZ_DICT_GRACE can be
+ * given back. The server only advertises it when SPICE_GLZ_DICT_GRACE is
+ * set, and only the clients which advertise it get their dictionary kept. */
+#define DCC_CAP_GLZ_KEEP_WINDOW 31
+/* how much larger than the area of the coalesced items the image of their
+ * bounding box may be, see dcc_coalesce_pipe() */
+#define DCC_COALESCE_MAX_EXTENTS_RATIO 2
 
 typedef struct DisplayChannel DisplayChannel;
 typedef struct Stream Stream;
@@ -121,6 +137,11 @@ typedef struct RedImageItem {
     int image_format;
     uint32_t image_flags;
     int can_lossy;
+    struct CompressJob *compress_job; /* compression started ahead of sending */
+    /* the codec of compress_job, and the class of the image when the codec
+     * was chosen by the cost model, BITMAP_GRADUAL_INVALID otherwise */
+    SpiceImageCompression compress_compression;
+    BitmapGradualType compress_graduality;
     uint8_t data[0];
 } RedImageItem;
 
@@ -169,7 +190,8 @@ void                       dcc_palette_cache_palette                 (DisplayCha
                                                                       SpicePalette *palette,
                                                                       uint8_t *flags);
 int                        dcc_pixmap_cache_unlocked_add             (DisplayChannelClient *dcc,
-                                                                      uint64_t id, uint32_t size, int lossy);
+                                                                      uint64_t id, uint32_t size, int lossy,
+                                                                      const BitmapContentHash *content_hash);
 void                       dcc_prepend_drawable                      (DisplayChannelClient *dcc,
                                                                       Drawable *drawable);
 void                       dcc_append_drawable                       (DisplayChannelClient *dcc,
@@ -182,6 +204,11 @@ void                       dcc_send_item                             (RedChannel
 int                        dcc_clear_surface_drawables_from_pipe     (DisplayChannelClient *dcc,
                                                                       int surface_id,
                                                                       int wait_if_used);
+void                       dcc_account_sent_message                  (DisplayChannelClient *dcc,
+                                                                      size_t size);
+uint32_t                   dcc_get_pipe_budget                       (DisplayChannelClient *dcc);
+int                        dcc_is_behind                             (DisplayChannelClient *dcc);
+int                        dcc_coalesce_pipe                         (DisplayChannelClient *dcc);
 int                        dcc_drawable_is_in_pipe                   (DisplayChannelClient *dcc,
                                                                       Drawable *drawable);
 RedPipeItem *              dcc_gl_scanout_item_new                   (RedChannelClient *rcc,
@@ -189,10 +216,15 @@ RedPipeItem *              dcc_gl_scanout_item_new                   (RedChannel
 RedPipeItem *              dcc_gl_draw_item_new                      (RedChannelClient *rcc,
                                                                       void *data, int num);
 
+int                        dcc_sends_raw_images                      (DisplayChannelClient *dcc);
 int                        dcc_compress_image                        (DisplayChannelClient *dcc,
                                                                       SpiceImage *dest, SpiceBitmap *src, Drawable *drawable,
                                                                       int can_lossy,
                                                                       compress_send_data_t* o_comp_data);
+int                        dcc_compress_image_item                   (DisplayChannelClient *dcc,
+                                                                      RedImageItem *item,
+                                                                      SpiceImage *dest, SpiceBitmap *src,
+                                                                      compress_send_data_t *o_comp_data);
 
 StreamAgent *              dcc_get_stream_agent                      (DisplayChannelClient *dcc, int stream_id);
 ImageEncoders *dcc_get_encoders(DisplayChannelClient *dcc);
@@ -25,6 +25,9 @@
 #include <pthread.h>
 #include <fcntl.h>
 #include <poll.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
 
 #define SPICE_LOG_DOMAIN "SpiceDispatcher"
 
@@ -44,9 +47,34 @@ G_DEFINE_TYPE(Dispatcher, dispatcher, G_TYPE_OBJECT)
 
 #define DISPATCHER_PRIVATE(o) (G_TYPE_INSTANCE_GET_PRIVATE ((o), TYPE_DISPATCHER, DispatcherPrivate))
 
+/* must be a power of 2, much larger than the largest message */
+#define DISPATCHER_RING_SIZE (64 * 1024)
+#define DISPATCHER_RING_ALIGN 8
+
+/* Shared memory transport: the senders, serialized by the dispatcher lock,
+ * copy the messages in a ring read by the receiver thread. head and tail
+ * are free running byte counters, each only written by one side. The
+ * receiver is woken up through an eventfd only when the ring was empty,
+ * it then processes all the messages it finds. */
+typedef struct DispatcherRing {
+    guint head;         // written by the sender
+    guint tail;         // written by the receiver
+    gint sender_waiting;
+    int space_fd;       // signalled when space was freed for a waiting sender
+    int ack_fd;         // signalled after DISPATCHER_ACK messages
+    uint8_t data[DISPATCHER_RING_SIZE];
+} DispatcherRing;
+
+typedef struct DispatcherRingHeader {
+    uint32_t type;
+    uint32_t size;
+} DispatcherRingHeader;
+
 struct DispatcherPrivate {
     int recv_fd;
     int send_fd;
+    DispatcherRing *ring;
+    gboolean use_ring;
     pthread_t thread_id;
     pthread_mutex_t lock;
     DispatcherMessage *messages;
@@ -62,7 +90,8 @@ struct DispatcherPrivate {
 enum {
     PROP_0,
     PROP_MAX_MESSAGE_TYPE,
-    PROP_OPAQUE
+    PROP_OPAQUE,
+    PROP_USE_RING
 };
 
 static void
@@ -81,6 +110,9 @@ dispatcher_get_property(GObject    *object,
         case PROP_OPAQUE:
             g_value_set_pointer(value, self->priv->opaque);
             break;
+        case PROP_USE_RING:
+            g_value_set_boolean(value, self->priv->use_ring);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
     }
@@ -102,6 +134,9 @@ dispatcher_set_property(GObject      *object,
         case PROP_OPAQUE:
             dispatcher_set_opaque(self, g_value_get_pointer(value));
             break;
+        case PROP_USE_RING:
+            self->priv->use_ring = g_value_get_boolean(value);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
     }
@@ -112,13 +147,21 @@ dispatcher_finalize(GObject *object)
 {
     Dispatcher *self = DISPATCHER(object);
     g_free(self->priv->messages);
-    close(self->priv->send_fd);
+    if (self->priv->ring) {
+        close(self->priv->ring->space_fd);
+        close(self->priv->ring->ack_fd);
+        g_free(self->priv->ring);
+    } else {
+        close(self->priv->send_fd);
+    }
     close(self->priv->recv_fd);
     pthread_mutex_destroy(&self->priv->lock);
     free(self->priv->payload);
     G_OBJECT_CLASS(dispatcher_parent_class)->finalize(object);
 }
 
+static gboolean dispatcher_ring_init(Dispatcher *self);
+
 static void dispatcher_constructed(GObject *object)
 {
     Dispatcher *self = DISPATCHER(object);
@@ -129,17 +172,20 @@ static void dispatcher_constructed(GObject *object)
 #ifdef DEBUG_DISPATCHER
     setup_dummy_signal_handler();
 #endif
+    pthread_mutex_init(&self->priv->lock, NULL);
+    self->priv->thread_id = pthread_self();
+    self->priv->messages = g_new0(DispatcherMessage,
+                                  self->priv->max_message_type);
+
+    if (self->priv->use_ring && dispatcher_ring_init(self)) {
+        return;
+    }
     if (socketpair(AF_LOCAL, SOCK_STREAM, 0, channels) == -1) {
         spice_error("socketpair failed %s", strerror(errno));
         return;
     }
-    pthread_mutex_init(&self->priv->lock, NULL);
     self->priv->recv_fd = channels[0];
     self->priv->send_fd = channels[1];
-    self->priv->thread_id = pthread_self();
-
-    self->priv->messages = g_new0(DispatcherMessage,
-                                  self->priv->max_message_type);
 }
 
 static void
@@ -171,6 +217,15 @@ dispatcher_class_init(DispatcherClass *klass)
                                                          G_PARAM_STATIC_STRINGS |
                                                          G_PARAM_READWRITE |
                                                          G_PARAM_CONSTRUCT));
+    g_object_class_install_property(object_class,
+                                    PROP_USE_RING,
+                                    g_param_spec_boolean("use-ring",
+                                                         "use-ring",
+                                                         "Pass the messages through a shared memory ring",
+                                                         FALSE,
+                                                         G_PARAM_STATIC_STRINGS |
+                                                         G_PARAM_READWRITE |
+                                                         G_PARAM_CONSTRUCT_ONLY));
 
 }
 
@@ -189,6 +244,16 @@ dispatcher_new(size_t max_message_type, void *opaque)
                         NULL);
 }
 
+Dispatcher *
+dispatcher_new_ring(size_t max_message_type, void *opaque)
+{
+    return g_object_new(TYPE_DISPATCHER,
+                        "max-message-type", (guint) max_message_type,
+                        "opaque", opaque,
+                        "use-ring", TRUE,
+                        NULL);
+}
+
 
 #define ACK 0xffffffff
 
@@ -264,6 +329,24 @@ static int write_safe(int fd, uint8_t *buf, size_t size)
     return written_size;
 }
 
+/* calls the handlers of a message, except for the ack which depends on
+ * the transport */
+static void dispatcher_call_handlers(Dispatcher *dispatcher, uint32_t type,
+                                     DispatcherMessage *msg, void *payload)
+{
+    if (dispatcher->priv->any_handler) {
+        dispatcher->priv->any_handler(dispatcher->priv->opaque, type, payload);
+    }
+    if (msg->handler) {
+        msg->handler(dispatcher->priv->opaque, payload);
+    } else {
+        spice_printerr("error: no handler for message type %d", type);
+    }
+    if (msg->ack == DISPATCHER_ASYNC && dispatcher->priv->handle_async_done) {
+        dispatcher->priv->handle_async_done(dispatcher->priv->opaque, type, payload);
+    }
+}
+
 static int dispatcher_handle_single_read(Dispatcher *dispatcher)
 {
     int ret;
@@ -286,32 +369,174 @@ static int dispatcher_handle_single_read(Dispatcher *dispatcher)
         /* TODO: close socketpair? */
         return 0;
     }
-    if (dispatcher->priv->any_handler) {
-        dispatcher->priv->any_handler(dispatcher->priv->opaque, type, payload);
-    }
-    if (msg->handler) {
-        msg->handler(dispatcher->priv->opaque, payload);
-    } else {
-        spice_printerr("error: no handler for message type %d", type);
-    }
+    dispatcher_call_handlers(dispatcher, type, msg, payload);
     if (msg->ack == DISPATCHER_ACK) {
         if (write_safe(dispatcher->priv->recv_fd,
                        (uint8_t*)&ack, sizeof(ack)) == -1) {
             spice_printerr("error writing ack for message %d", type);
             /* TODO: close socketpair? */
         }
-    } else if (msg->ack == DISPATCHER_ASYNC && dispatcher->priv->handle_async_done) {
-        dispatcher->priv->handle_async_done(dispatcher->priv->opaque, type, payload);
     }
     return 1;
 }
 
+#ifdef HAVE_SYS_EVENTFD_H
+static gboolean dispatcher_ring_init(Dispatcher *self)
+{
+    DispatcherRing *ring = g_new0(DispatcherRing, 1);
+
+    self->priv->recv_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ring->space_fd = eventfd(0, EFD_CLOEXEC);
+    ring->ack_fd = eventfd(0, EFD_CLOEXEC);
+    if (self->priv->recv_fd == -1 || ring->space_fd == -1 || ring->ack_fd == -1) {
+        spice_warning("eventfd failed %s, using a socket", strerror(errno));
+        if (self->priv->recv_fd != -1) {
+            close(self->priv->recv_fd);
+        }
+        if (ring->space_fd != -1) {
+            close(ring->space_fd);
+        }
+        if (ring->ack_fd != -1) {
+            close(ring->ack_fd);
+        }
+        g_free(ring);
+        return FALSE;
+    }
+    self->priv->send_fd = -1;
+    self->priv->ring = ring;
+    return TRUE;
+}
+
+static void eventfd_signal(int fd)
+{
+    uint64_t one = 1;
+
+    if (write_safe(fd, (uint8_t *)&one, sizeof(one)) == -1) {
+        spice_printerr("error signalling eventfd: %d", errno);
+    }
+}
+
+static int eventfd_wait(int fd)
+{
+    uint64_t count;
+
+    return read_safe(fd, (uint8_t *)&count, sizeof(count), 1);
+}
+
+static void ring_copy_in(DispatcherRing *ring, guint pos, const void *data, size_t size)
+{
+    size_t offset = pos & (DISPATCHER_RING_SIZE - 1);
+    size_t now = MIN(size, DISPATCHER_RING_SIZE - offset);
+
+    memcpy(ring->data + offset, data, now);
+    memcpy(ring->data, (const uint8_t *)data + now, size - now);
+}
+
+static void ring_copy_out(DispatcherRing *ring, guint pos, void *data, size_t size)
+{
+    size_t offset = pos & (DISPATCHER_RING_SIZE - 1);
+    size_t now = MIN(size, DISPATCHER_RING_SIZE - offset);
+
+    memcpy(data, ring->data + offset, now);
+    memcpy((uint8_t *)data + now, ring->data, size - now);
+}
+
+static size_t ring_entry_size(size_t payload_size)
+{
+    return SPICE_ALIGN(sizeof(DispatcherRingHeader) + payload_size, DISPATCHER_RING_ALIGN);
+}
+
+/* called with the dispatcher lock held */
+static void dispatcher_ring_send(Dispatcher *dispatcher, uint32_t message_type,
+                                 void *payload, DispatcherMessage *msg)
+{
+    DispatcherRing *ring = dispatcher->priv->ring;
+    DispatcherRingHeader header = { message_type, msg->size };
+    size_t size = ring_entry_size(msg->size);
+    guint head = ring->head;
+
+    while (DISPATCHER_RING_SIZE - (head - g_atomic_int_get(&ring->tail)) < size) {
+        g_atomic_int_set(&ring->sender_waiting, 1);
+        if (DISPATCHER_RING_SIZE - (head - g_atomic_int_get(&ring->tail)) >= size) {
+            g_atomic_int_set(&ring->sender_waiting, 0);
+            break;
+        }
+        if (eventfd_wait(ring->space_fd) == -1) {
+            spice_printerr("error: failed to wait for space for message %d", message_type);
+            return;
+        }
+    }
+
+    ring_copy_in(ring, head, &header, sizeof(header));
+    ring_copy_in(ring, head + sizeof(header), payload, msg->size);
+    g_atomic_int_set(&ring->head, head + size);
+
+    /* the receiver processes everything it sees, it only needs a wakeup
+     * if it might have been done before this message was added */
+    if (g_atomic_int_get(&ring->tail) == head) {
+        eventfd_signal(dispatcher->priv->recv_fd);
+    }
+
+    if (msg->ack == DISPATCHER_ACK && eventfd_wait(ring->ack_fd) == -1) {
+        spice_printerr("error: failed to read ack");
+    }
+}
+
+static void dispatcher_ring_handle_recv_read(Dispatcher *dispatcher)
+{
+    DispatcherRing *ring = dispatcher->priv->ring;
+    uint8_t *payload = dispatcher->priv->payload;
+    uint64_t count;
+    guint tail = ring->tail;
+    guint head;
+
+    /* reset the wakeup before looking at the ring, a message added after
+     * the last check signals it again */
+    if (read(dispatcher->priv->recv_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        spice_printerr("error reading from dispatcher: %d", errno);
+    }
+
+    while ((head = g_atomic_int_get(&ring->head)) != tail) {
+        while (tail != head) {
+            DispatcherRingHeader header;
+            DispatcherMessage *msg;
+
+            ring_copy_out(ring, tail, &header, sizeof(header));
+            msg = &dispatcher->priv->messages[header.type];
+            ring_copy_out(ring, tail + sizeof(header), payload, header.size);
+            tail += ring_entry_size(header.size);
+            g_atomic_int_set(&ring->tail, tail);
+            if (g_atomic_int_get(&ring->sender_waiting)) {
+                g_atomic_int_set(&ring->sender_waiting, 0);
+                eventfd_signal(ring->space_fd);
+            }
+
+            dispatcher_call_handlers(dispatcher, header.type, msg, payload);
+            if (msg->ack == DISPATCHER_ACK) {
+                eventfd_signal(ring->ack_fd);
+            }
+        }
+    }
+}
+#else
+static gboolean dispatcher_ring_init(Dispatcher *self)
+{
+    return FALSE;
+}
+#endif
+
 /*
  * dispatcher_handle_recv_read
  * doesn't handle being in the middle of a message. all reads are blocking.
  */
 void dispatcher_handle_recv_read(Dispatcher *dispatcher)
 {
+#ifdef HAVE_SYS_EVENTFD_H
+    if (dispatcher->priv->ring) {
+        dispatcher_ring_handle_recv_read(dispatcher);
+        return;
+    }
+#endif
     while (dispatcher_handle_single_read(dispatcher)) {
     }
 }
@@ -327,6 +552,12 @@ void dispatcher_send_message(Dispatcher *dispatcher, uint32_t message_type,
     assert(dispatcher->priv->messages[message_type].handler);
     msg = &dispatcher->priv->messages[message_type];
     pthread_mutex_lock(&dispatcher->priv->lock);
+#ifdef HAVE_SYS_EVENTFD_H
+    if (dispatcher->priv->ring) {
+        dispatcher_ring_send(dispatcher, message_type, payload, msg);
+        goto unlock;
+    }
+#endif
     if (write_safe(send_fd, (uint8_t*)&message_type, sizeof(message_type)) == -1) {
         spice_printerr("error: failed to send message type for message %d",
                    message_type);
@@ -370,6 +601,10 @@ void dispatcher_register_handler(Dispatcher *dispatcher, uint32_t message_type,
     msg->handler = handler;
     msg->size = size;
     msg->ack = ack;
+#ifdef HAVE_SYS_EVENTFD_H
+    assert(!dispatcher->priv->ring ||
+           ring_entry_size(size) <= DISPATCHER_RING_SIZE / 4);
+#endif
     if (msg->size > dispatcher->priv->payload_size) {
         dispatcher->priv->payload = realloc(dispatcher->priv->payload, msg->size);
         dispatcher->priv->payload_size = msg->size;
@@ -49,6 +49,11 @@ struct DispatcherClass
 GType dispatcher_get_type(void) G_GNUC_CONST;
 
 Dispatcher *dispatcher_new(size_t max_message_type, void *opaque);
+/* Same as dispatcher_new() but the messages are passed through a ring in
+ * memory and the receiver is woken up with an eventfd, which only costs a
+ * system call when the receiver is idle. Falls back to a socket pair if
+ * eventfd is not available. */
+Dispatcher *dispatcher_new_ring(size_t max_message_type, void *opaque);
 
 
 typedef void (*dispatcher_handle_message)(void *opaque,
@@ -19,25 +19,31 @@
 #define DISPLAY_CHANNEL_PRIVATE_H_
 
 #include "display-channel.h"
+#include "compress-pool.h"
+#include "send-pool.h"
+#include "slab.h"
 
 struct DisplayChannelPrivate
 {
     DisplayChannel *pub;
 
-    uint32_t bits_unique;
+    gint bits_unique;
 
     MonitorsConfig *monitors_config;
 
     uint32_t renderer;
     int enable_jpeg;
     int enable_zlib_glz_wrap;
+    int image_cost_model;
 
     Ring current_list; // of TreeItem
     uint32_t current_size;
 
     uint32_t drawable_count;
-    _Drawable drawables[NUM_DRAWABLES];
-    _Drawable *free_drawables;
+    /* used from the worker thread only, like the drawables */
+    Slab *drawable_slab;
+    Slab *red_drawable_slab;
+    Slab *drawable_pipe_item_slab;
 
     int stream_video;
     GArray *video_codecs;
@@ -48,6 +54,8 @@ struct DisplayChannelPrivate
     ItemTrace items_trace[NUM_TRACE_ITEMS];
     uint32_t next_item_trace;
     uint64_t streams_size_total;
+    int stream_heatmap_enabled;
+    StreamHeatmap heatmap;
 
     RedSurface surfaces[NUM_SURFACES];
     uint32_t n_surfaces;
@@ -69,8 +77,26 @@ struct DisplayChannelPrivate
     uint64_t *cache_hits_counter;
     uint64_t *add_to_cache_counter;
     uint64_t *non_cache_counter;
+    uint64_t *content_cache_hits_counter;
+    uint64_t *content_cache_misses_counter;
+    uint64_t *compress_pool_hits_counter;
+    uint64_t *compress_pool_skips_counter;
+    uint64_t *coalesced_items_counter;
+    uint64_t *threaded_pushes_counter;
+    uint64_t *stream_frames_superseded_counter;
+    uint64_t *stream_frames_dropped_counter;
+    uint64_t *drawables_counter;
+    uint64_t *drawables_capacity_counter;
+    uint64_t *red_drawables_counter;
+    uint64_t *red_drawables_capacity_counter;
+    uint64_t *drawable_pipe_items_counter;
+    uint64_t *drawable_pipe_items_capacity_counter;
 #endif
     ImageEncoderSharedData encoder_shared_data;
+    CompressPool *compress_pool;
+    SendPool *send_pool;
+    int coalesce_pipes;
+    SpiceTimer *glz_expire_timer;
 };
 
 #endif /* DISPLAY_CHANNEL_PRIVATE_H_ */
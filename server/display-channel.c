@@ -77,7 +77,17 @@ static void
 display_channel_finalize(GObject *object)
 {
     DisplayChannel *self = DISPLAY_CHANNEL(object);
+    SpiceCoreInterfaceInternal *core = red_channel_get_core_interface(RED_CHANNEL(self));
 
+    if (self->priv->glz_expire_timer) {
+        core->timer_remove(core, self->priv->glz_expire_timer);
+    }
+    send_pool_free(self->priv->send_pool);
+    compress_pool_free(self->priv->compress_pool);
+    stream_heatmap_free(self);
+    slab_free(self->priv->drawable_pipe_item_slab);
+    slab_free(self->priv->drawable_slab);
+    slab_free(self->priv->red_drawable_slab);
     g_array_unref(self->priv->video_codecs);
     g_free(self->priv);
 
@@ -92,7 +102,8 @@ uint32_t display_channel_generate_uid(DisplayChannel *display)
 {
     spice_return_val_if_fail(display != NULL, 0);
 
-    return ++display->priv->bits_unique;
+    /* images can be sent from several threads, see display_channel_push_in_threads() */
+    return (uint32_t)g_atomic_int_add(&display->priv->bits_unique, 1) + 1;
 }
 
 #define stat_start(stat, var)                                        \
@@ -103,6 +114,9 @@ void display_channel_compress_stats_reset(DisplayChannel *display)
     spice_return_if_fail(display);
 
     image_encoder_shared_stat_reset(&display->priv->encoder_shared_data);
+    if (display->priv->compress_pool) {
+        compress_pool_stat_reset(display->priv->compress_pool);
+    }
 }
 
 void display_channel_compress_stats_print(DisplayChannel *display_channel)
@@ -116,6 +130,10 @@ void display_channel_compress_stats_print(DisplayChannel *display_channel)
 
     spice_info("==> Compression stats for display %u", id);
     image_encoder_shared_stat_print(&display_channel->priv->encoder_shared_data);
+    if (display_channel->priv->compress_pool) {
+        spice_info("==> Compression stats of the compression threads of display %u", id);
+        compress_pool_stat_print(display_channel->priv->compress_pool);
+    }
 #endif
 }
 
@@ -390,7 +408,7 @@ static void current_add_drawable(DisplayChannel *display,
     ring_add(&display->priv->current_list, &drawable->list_link);
     ring_add(&surface->current_list, &drawable->surface_list_link);
     display->priv->current_size++;
-    drawable->refs++;
+    drawable_ref(drawable);
 }
 
 static void current_remove_drawable(DisplayChannel *display, Drawable *item)
@@ -494,7 +512,7 @@ static int current_add_equal(DisplayChannel *display, DrawItem *item, TreeItem *
                         is_drawable_independent_from_surfaces(drawable);
         stream_maintenance(display, drawable, other_drawable);
         current_add_drawable(display, drawable, &other->siblings_link);
-        other_drawable->refs++;
+        drawable_ref(other_drawable);
         current_remove_drawable(display, other_drawable);
         if (add_after) {
             pipes_add_drawable_after(display, drawable, other_drawable);
@@ -514,7 +532,7 @@ static int current_add_equal(DisplayChannel *display, DrawItem *item, TreeItem *
             GList *dpi_item;
             GListIter iter;
 
-            other_drawable->refs++;
+            drawable_ref(other_drawable);
             current_remove_drawable(display, other_drawable);
 
             /* sending the drawable to clients that already received
@@ -933,9 +951,11 @@ static void surface_read_bits(DisplayChannel *display, int surface_id,
     canvas->ops->read_bits(canvas, dest, dest_stride, area);
 }
 
-static void handle_self_bitmap(DisplayChannel *display, Drawable *drawable)
+/* returns a bitmap of the area of the surface, once the drawables of the area are rendered.
+ * The bitmap is allocated from the arena of the RedDrawable that uses it. */
+static SpiceImage *surface_read_image(DisplayChannel *display, int surface_id,
+                                      const SpiceRect *area, RedParseArena *arena)
 {
-    RedDrawable *red_drawable = drawable->red_drawable;
     SpiceImage *image;
     int32_t width;
     int32_t height;
@@ -943,16 +963,16 @@ static void handle_self_bitmap(DisplayChannel *display, Drawable *drawable)
     int dest_stride;
     RedSurface *surface;
     int bpp;
-    int all_set;
 
-    surface = &display->priv->surfaces[drawable->surface_id];
+    surface = &display->priv->surfaces[surface_id];
 
     bpp = SPICE_SURFACE_FMT_DEPTH(surface->context.format) / 8;
-    width = red_drawable->self_bitmap_area.right - red_drawable->self_bitmap_area.left;
-    height = red_drawable->self_bitmap_area.bottom - red_drawable->self_bitmap_area.top;
+    width = area->right - area->left;
+    height = area->bottom - area->top;
     dest_stride = SPICE_ALIGN(width * bpp, 4);
 
-    image = spice_new0(SpiceImage, 1);
+    image = red_parse_arena_alloc(arena, sizeof(*image));
+    memset(image, 0, sizeof(*image));
     image->descriptor.type = SPICE_IMAGE_TYPE_BITMAP;
     image->descriptor.flags = 0;
 
@@ -964,13 +984,36 @@ static void handle_self_bitmap(DisplayChannel *display, Drawable *drawable)
     image->descriptor.height = image->u.bitmap.y = height;
     image->u.bitmap.palette = NULL;
 
-    dest = (uint8_t *)spice_malloc_n(height, dest_stride);
-    image->u.bitmap.data = spice_chunks_new_linear(dest, height * dest_stride);
-    image->u.bitmap.data->flags |= SPICE_CHUNKS_FLAGS_FREE;
+    dest = red_parse_arena_alloc(arena, (size_t)height * dest_stride);
+    image->u.bitmap.data = red_parse_arena_alloc(arena, sizeof(SpiceChunks) + sizeof(SpiceChunk));
+    image->u.bitmap.data->data_size = height * dest_stride;
+    image->u.bitmap.data->num_chunks = 1;
+    image->u.bitmap.data->flags = 0;
+    image->u.bitmap.data->chunk[0].data = dest;
+    image->u.bitmap.data->chunk[0].len = height * dest_stride;
 
-    display_channel_draw(display, &red_drawable->self_bitmap_area, drawable->surface_id);
-    surface_read_bits(display, drawable->surface_id,
-        &red_drawable->self_bitmap_area, dest, dest_stride);
+    display_channel_draw(display, area, surface_id);
+    surface_read_bits(display, surface_id, area, dest, dest_stride);
+
+    return image;
+}
+
+static void handle_self_bitmap(DisplayChannel *display, Drawable *drawable)
+{
+    RedDrawable *red_drawable = drawable->red_drawable;
+    SpiceImage *image;
+    uint8_t *dest;
+    int32_t width;
+    int32_t height;
+    int dest_stride;
+    int all_set;
+
+    image = surface_read_image(display, drawable->surface_id, &red_drawable->self_bitmap_area,
+                               &red_drawable->arena);
+    dest = image->u.bitmap.data->chunk[0].data;
+    width = image->u.bitmap.x;
+    height = image->u.bitmap.y;
+    dest_stride = image->u.bitmap.stride;
 
     /* For 32bit non-primary surfaces we need to keep any non-zero
        high bytes as the surface may be used as source to an alpha_blend */
@@ -1185,11 +1228,93 @@ void display_channel_process_draw(DisplayChannel *display, RedDrawable *red_draw
         return;
     }
 
+    /* the send pool threads would linearize them concurrently for each of
+     * the clients the drawable is sent to */
+    if (display->priv->send_pool) {
+        red_parse_arena_linearize_unstable(&red_drawable->arena);
+    }
+
     display_channel_add_drawable(display, drawable);
+    stream_heatmap_add_damage(display, drawable);
 
     drawable_unref(drawable);
 }
 
+/* The drawables of the primary surface fully inside the area, which a copy of the area can
+ * replace in the pipes. None when a drawable reads from the surface, like copy bits. */
+static GList *heat_frame_get_covered_drawables(DisplayChannel *display, const SpiceRect *area)
+{
+    RedSurface *surface = &display->priv->surfaces[0];
+    GList *covered = NULL;
+    RingItem *item;
+
+    if (!ring_is_empty(&surface->depend_on_me)) {
+        return NULL;
+    }
+
+    RING_FOREACH(item, &surface->current_list) {
+        Drawable *drawable = SPICE_CONTAINEROF(item, Drawable, surface_list_link);
+
+        if (drawable->tree_item.shadow || drawable->surface_deps[0] != -1 ||
+            drawable->surface_deps[1] != -1 || drawable->surface_deps[2] != -1) {
+            g_list_free_full(covered, (GDestroyNotify)drawable_unref);
+            return NULL;
+        }
+        if (rect_contains(area, &drawable->red_drawable->bbox)) {
+            drawable_ref(drawable);
+            covered = g_list_prepend(covered, drawable);
+        }
+    }
+    return covered;
+}
+
+/* Adds a copy of the hot area of the stream heatmap, the frames of its video stream. The
+ * drawables of the area which weren't sent yet are not sent anymore. */
+void display_channel_add_heat_frame(DisplayChannel *display, uint32_t process_commands_generation)
+{
+    RedDrawable *red_drawable;
+    Drawable *drawable;
+    SpiceRect area;
+    GList *covered, *l;
+
+    if (!stream_heatmap_get_frame_area(display, &area)) {
+        return;
+    }
+
+    covered = heat_frame_get_covered_drawables(display, &area);
+
+    red_drawable = display_channel_red_drawable_new(display, NULL);
+    red_drawable->surface_id = 0;
+    red_drawable->effect = QXL_EFFECT_OPAQUE;
+    red_drawable->type = QXL_DRAW_COPY;
+    red_drawable->bbox = area;
+    red_drawable->clip.type = SPICE_CLIP_TYPE_NONE;
+    red_drawable->surface_deps[0] = red_drawable->surface_deps[1] =
+        red_drawable->surface_deps[2] = -1;
+    red_drawable->u.copy.src_bitmap = surface_read_image(display, 0, &area, &red_drawable->arena);
+    red_drawable->u.copy.src_area.right = area.right - area.left;
+    red_drawable->u.copy.src_area.bottom = area.bottom - area.top;
+    red_drawable->u.copy.rop_descriptor = SPICE_ROPD_OP_PUT;
+    red_drawable->u.copy.scale_mode = SPICE_IMAGE_SCALE_MODE_NEAREST;
+
+    drawable = display_channel_get_drawable(display, red_drawable->effect, red_drawable,
+                                            process_commands_generation);
+    red_drawable_unref(red_drawable);
+    if (drawable) {
+        drawable->heat_frame = TRUE;
+        display_channel_add_drawable(display, drawable);
+        drawable_unref(drawable);
+    }
+
+    for (l = covered; l != NULL; l = l->next) {
+        if (drawable) {
+            drawable_remove_from_pipes(l->data);
+        }
+        drawable_unref(l->data);
+    }
+    g_list_free(covered);
+}
+
 int display_channel_wait_for_migrate_data(DisplayChannel *display)
 {
     uint64_t end_time = spice_get_monotonic_time_ns() + DISPLAY_CLIENT_MIGRATE_DATA_TIMEOUT;
@@ -1251,6 +1376,57 @@ void display_channel_free_glz_drawables_to_free(DisplayChannel *display)
     }
 }
 
+/* With a send pool, pushes the clients which have items to send from
+ * several threads. The pool threads only read the tree and the surfaces,
+ * and hand the releases back to the worker, see send-pool.h. The lossy
+ * marshalling used with JPEG may render the tree to resend the areas a
+ * drawable depends on, so the clients are then pushed by the worker as
+ * they become writable. */
+void display_channel_push_in_threads(DisplayChannel *display)
+{
+    GListIter iter;
+    DisplayChannelClient *dcc;
+    GList *rccs = NULL;
+
+    if (!display->priv->send_pool || display->priv->enable_jpeg) {
+        return;
+    }
+
+    FOREACH_DCC(display, iter, dcc) {
+        if (red_channel_client_prepare_push_in_thread(RED_CHANNEL_CLIENT(dcc))) {
+            rccs = g_list_prepend(rccs, dcc);
+        }
+    }
+    if (rccs == NULL) {
+        return;
+    }
+
+    send_pool_push(display->priv->send_pool, rccs);
+    stat_inc_counter(reds, display->priv->threaded_pushes_counter, g_list_length(rccs));
+
+    g_list_free_full(rccs, (GDestroyNotify)red_channel_client_finish_push_in_thread);
+    display_channel_free_glz_drawables_to_free(display);
+}
+
+static void display_channel_glz_expire_timeout(void *opaque)
+{
+    display_channel_glz_expire_parked(opaque);
+}
+
+/* The glz dictionary of a client which disconnected is kept for a grace period,
+ * see SPICE_GLZ_DICT_GRACE, the timer destroys it once it is over */
+void display_channel_glz_expire_parked(DisplayChannel *display)
+{
+    SpiceCoreInterfaceInternal *core;
+    uint32_t timeout = image_encoders_glz_expire_parked();
+
+    if (timeout == 0 || display->priv->glz_expire_timer == NULL) {
+        return;
+    }
+    core = red_channel_get_core_interface(RED_CHANNEL(display));
+    core->timer_start(core, display->priv->glz_expire_timer, timeout);
+}
+
 void display_channel_free_glz_drawables(DisplayChannel *display)
 {
     GListIter iter;
@@ -1326,11 +1502,10 @@ static Drawable* drawable_try_new(DisplayChannel *display)
 {
     Drawable *drawable;
 
-    if (!display->priv->free_drawables)
+    drawable = slab_alloc(display->priv->drawable_slab);
+    if (!drawable)
         return NULL;
 
-    drawable = &display->priv->free_drawables->u.drawable;
-    display->priv->free_drawables = display->priv->free_drawables->u.next;
     display->priv->drawable_count++;
 
     return drawable;
@@ -1338,18 +1513,34 @@ static Drawable* drawable_try_new(DisplayChannel *display)
 
 static void drawable_free(DisplayChannel *display, Drawable *drawable)
 {
-    ((_Drawable *)drawable)->u.next = display->priv->free_drawables;
-    display->priv->free_drawables = (_Drawable *)drawable;
+    slab_release(display->priv->drawable_slab, drawable);
 }
 
+/* The drawables, the RedDrawables they are made from and the pipe items
+ * which reference them are allocated at the rate of the commands of the
+ * guest. They grow as the guest and the clients need more of them: only
+ * MAX_DRAWABLES drawables in use make the oldest ones be rendered to free
+ * some. */
 static void drawables_init(DisplayChannel *display)
 {
-    int i;
+    display->priv->drawable_slab = slab_new(sizeof(Drawable), NUM_DRAWABLES, MAX_DRAWABLES);
+    display->priv->red_drawable_slab = slab_new(sizeof(RedDrawable), NUM_DRAWABLES, 0);
+    display->priv->drawable_pipe_item_slab = slab_new(sizeof(RedDrawablePipeItem),
+                                                      NUM_DRAWABLES, 0);
+}
 
-    display->priv->free_drawables = NULL;
-    for (i = 0; i < NUM_DRAWABLES; i++) {
-        drawable_free(display, &display->priv->drawables[i].u.drawable);
-    }
+/* returns a RedDrawable with a reference and everything else zeroed, it's
+ * freed by red_drawable_unref() */
+RedDrawable *display_channel_red_drawable_new(DisplayChannel *display, QXLInstance *qxl)
+{
+    RedDrawable *red_drawable = slab_alloc(display->priv->red_drawable_slab);
+
+    memset(red_drawable, 0, sizeof(*red_drawable));
+    red_drawable->slab = display->priv->red_drawable_slab;
+    red_drawable->refs = 1;
+    red_drawable->qxl = qxl;
+
+    return red_drawable;
 }
 
 /**
@@ -1425,7 +1616,10 @@ void drawable_unref(Drawable *drawable)
 {
     DisplayChannel *display = drawable->display;
 
-    if (--drawable->refs != 0)
+    if (send_pool_defer((SendPoolDeferFunc)drawable_unref, drawable)) {
+        return;
+    }
+    if (!g_atomic_int_dec_and_test(&drawable->refs))
         return;
 
     spice_warn_if_fail(!drawable->tree_item.shadow);
@@ -1632,7 +1826,7 @@ static void draw_until(DisplayChannel *display, RedSurface *surface, Drawable *l
     do {
         ring_item = ring_get_tail(&surface->current_list);
         now = SPICE_CONTAINEROF(ring_item, Drawable, surface_list_link);
-        now->refs++;
+        drawable_ref(now);
         container = now->tree_item.base.container;
         current_remove_drawable(display, now);
         container_cleanup(container);
@@ -1739,6 +1933,55 @@ void display_channel_draw(DisplayChannel *display, const SpiceRect *area, int su
     surface_update_dest(surface, area);
 }
 
+/* Returns TRUE if the pipes have room for the items of new commands.
+ * By default the longest pipe must not exceed MAX_PIPE_SIZE, so a single
+ * slow client holds back the processing for all of them. When coalescing is
+ * enabled, the pipes of the clients which exceed their own budget are
+ * shortened instead, see display_channel_coalesce_pipes(), and the processing
+ * only stops when that was not enough to keep a pipe under DCC_MAX_PIPE_SIZE.
+ * This has no side effect, the pipes are coalesced before calling it. */
+int display_channel_pipes_have_room(DisplayChannel *display)
+{
+    GListIter iter;
+    DisplayChannelClient *dcc;
+
+    if (!display->priv->coalesce_pipes) {
+        return red_channel_max_pipe_size(RED_CHANNEL(display)) <= MAX_PIPE_SIZE;
+    }
+
+    FOREACH_DCC(display, iter, dcc) {
+        if (red_channel_client_get_pipe_size(RED_CHANNEL_CLIENT(dcc)) > DCC_MAX_PIPE_SIZE) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+int display_channel_get_coalesce_pipes(DisplayChannel *display)
+{
+    return display->priv->coalesce_pipes;
+}
+
+/* Shortens the pipes of the clients which exceed their budget by replacing
+ * their newest drawables with an image of the area they cover, see
+ * dcc_coalesce_pipe(). This renders the surfaces, it must not be called
+ * while only checking whether the worker can process commands. */
+void display_channel_coalesce_pipes(DisplayChannel *display)
+{
+    GListIter iter;
+    DisplayChannelClient *dcc;
+
+    if (!display->priv->coalesce_pipes) {
+        return;
+    }
+
+    FOREACH_DCC(display, iter, dcc) {
+        if (dcc_is_behind(dcc)) {
+            dcc_coalesce_pipe(dcc);
+        }
+    }
+}
+
 static void region_to_qxlrects(QRegion *region, QXLRect *qxl_rects, uint32_t num_rects)
 {
     SpiceRect *rects;
@@ -2030,11 +2273,36 @@ display_channel_init(DisplayChannel *self)
     self->priv->image_surfaces.ops = &image_surfaces_ops;
 }
 
+/* Number of threads set by an environment variable, 0 (the default) does
+ * everything in the worker thread. SPICE_COMPRESS_THREADS compresses images
+ * ahead of sending them, SPICE_DISPLAY_SEND_THREADS pushes the clients. */
+static int get_env_threads(const char *name)
+{
+    const char *env_threads_str;
+    long threads;
+    char *end;
+
+    env_threads_str = getenv(name);
+    if (env_threads_str == NULL) {
+        return 0;
+    }
+
+    errno = 0;
+    threads = strtol(env_threads_str, &end, 10);
+    if (errno != 0 || *end != '\0' || threads < 0 || threads > G_MAXINT) {
+        spice_warning("error parsing %s: %s", name, env_threads_str);
+        return 0;
+    }
+    return threads;
+}
+
 static void
 display_channel_constructed(GObject *object)
 {
     DisplayChannel *self = DISPLAY_CHANNEL(object);
     RedChannel *channel = RED_CHANNEL(self);
+    SpiceCoreInterfaceInternal *core;
+    int compress_threads, send_threads;
 
     G_OBJECT_CLASS(display_channel_parent_class)->constructed(object);
 
@@ -2056,14 +2324,86 @@ display_channel_constructed(GObject *object)
     self->priv->non_cache_counter =
         stat_add_counter(reds, red_channel_get_stat_node(channel),
                          "non_cache", TRUE);
+    self->priv->content_cache_hits_counter =
+        stat_add_counter(reds, red_channel_get_stat_node(channel),
+                         "content_cache_hits", TRUE);
+    self->priv->content_cache_misses_counter =
+        stat_add_counter(reds, red_channel_get_stat_node(channel),
+                         "content_cache_misses", TRUE);
+    self->priv->compress_pool_hits_counter =
+        stat_add_counter(reds, red_channel_get_stat_node(channel),
+                         "compress_pool_hits", TRUE);
+    self->priv->compress_pool_skips_counter =
+        stat_add_counter(reds, red_channel_get_stat_node(channel),
+                         "compress_pool_skips", TRUE);
+    self->priv->encoder_shared_data.compress_buf_hits_counter =
+        stat_add_counter(reds, red_channel_get_stat_node(channel),
+                         "compress_buf_hits", TRUE);
+    self->priv->encoder_shared_data.compress_buf_misses_counter =
+        stat_add_counter(reds, red_channel_get_stat_node(channel),
+                         "compress_buf_misses", TRUE);
+    self->priv->coalesced_items_counter =
+        stat_add_counter(reds, red_channel_get_stat_node(channel),
+                         "coalesced_items", TRUE);
+    self->priv->threaded_pushes_counter =
+        stat_add_counter(reds, red_channel_get_stat_node(channel),
+                         "threaded_pushes", TRUE);
+    self->priv->drawables_counter =
+        stat_add_counter(reds, red_channel_get_stat_node(channel),
+                         "drawables", TRUE);
+    self->priv->drawables_capacity_counter =
+        stat_add_counter(reds, red_channel_get_stat_node(channel),
+                         "drawables_capacity", TRUE);
+    slab_set_counters(self->priv->drawable_slab, self->priv->drawables_counter,
+                      self->priv->drawables_capacity_counter);
+    self->priv->red_drawables_counter =
+        stat_add_counter(reds, red_channel_get_stat_node(channel),
+                         "red_drawables", TRUE);
+    self->priv->red_drawables_capacity_counter =
+        stat_add_counter(reds, red_channel_get_stat_node(channel),
+                         "red_drawables_capacity", TRUE);
+    slab_set_counters(self->priv->red_drawable_slab, self->priv->red_drawables_counter,
+                      self->priv->red_drawables_capacity_counter);
+    self->priv->drawable_pipe_items_counter =
+        stat_add_counter(reds, red_channel_get_stat_node(channel),
+                         "drawable_pipe_items", TRUE);
+    self->priv->drawable_pipe_items_capacity_counter =
+        stat_add_counter(reds, red_channel_get_stat_node(channel),
+                         "drawable_pipe_items_capacity", TRUE);
+    slab_set_counters(self->priv->drawable_pipe_item_slab,
+                      self->priv->drawable_pipe_items_counter,
+                      self->priv->drawable_pipe_items_capacity_counter);
+    self->priv->stream_frames_superseded_counter =
+        stat_add_counter(reds, red_channel_get_stat_node(channel),
+                         "stream_frames_superseded", TRUE);
+    self->priv->stream_frames_dropped_counter =
+        stat_add_counter(reds, red_channel_get_stat_node(channel),
+                         "stream_frames_dropped", TRUE);
 #endif
     image_cache_init(&self->priv->image_cache);
+    compress_threads = get_env_threads("SPICE_COMPRESS_THREADS");
+    if (compress_threads > 0) {
+        self->priv->compress_pool = compress_pool_new(compress_threads);
+    }
+    send_threads = get_env_threads("SPICE_DISPLAY_SEND_THREADS");
+    if (send_threads > 0) {
+        self->priv->send_pool = send_pool_new(send_threads);
+    }
+    self->priv->coalesce_pipes = getenv("SPICE_DISPLAY_COALESCE") != NULL;
+    core = red_channel_get_core_interface(channel);
+    self->priv->glz_expire_timer = core->timer_add(core, display_channel_glz_expire_timeout,
+                                                   self);
+    self->priv->stream_heatmap_enabled = getenv("SPICE_STREAM_HEATMAP") != NULL;
+    self->priv->image_cost_model = getenv("SPICE_IMAGE_COST_MODEL") != NULL;
     self->priv->stream_video = SPICE_STREAM_VIDEO_OFF;
     display_channel_init_streams(self);
 
     red_channel_set_cap(channel, SPICE_DISPLAY_CAP_MONITORS_CONFIG);
     red_channel_set_cap(channel, SPICE_DISPLAY_CAP_PREF_COMPRESSION);
     red_channel_set_cap(channel, SPICE_DISPLAY_CAP_STREAM_REPORT);
+    if (image_encoders_glz_can_park()) {
+        red_channel_set_cap(channel, DCC_CAP_GLZ_KEEP_WINDOW);
+    }
 }
 
 void display_channel_process_surface_cmd(DisplayChannel *display,
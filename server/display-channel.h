@@ -81,7 +81,9 @@ typedef struct DependItem {
 } DependItem;
 
 struct Drawable {
-    uint32_t refs;
+    /* also taken from the threads of a send pool, only change it with
+     * drawable_ref() and drawable_unref() */
+    int refs;
     RingItem surface_list_link;
     RingItem list_link;
     DrawItem tree_item;
@@ -97,6 +99,7 @@ struct Drawable {
     int last_gradual_frame;
     Stream *stream;
     int streamable;
+    int heat_frame; // a copy of the hot area of the stream heatmap
     BitmapGradualType copy_bitmap_graduality;
     DependItem depend_items[3];
 
@@ -107,6 +110,12 @@ struct Drawable {
     DisplayChannel *display;
 };
 
+static inline Drawable *drawable_ref(Drawable *drawable)
+{
+    g_atomic_int_inc(&drawable->refs);
+    return drawable;
+}
+
 void drawable_unref (Drawable *drawable);
 
 enum {
@@ -173,14 +182,9 @@ typedef struct RedSurface {
     QXLReleaseInfoExt create, destroy;
 } RedSurface;
 
+/* the drawables are allocated by NUM_DRAWABLES, up to MAX_DRAWABLES */
 #define NUM_DRAWABLES 1000
-typedef struct _Drawable _Drawable;
-struct _Drawable {
-    union {
-        Drawable drawable;
-        _Drawable *next;
-    } u;
-};
+#define MAX_DRAWABLES (NUM_DRAWABLES * 16)
 
 #define FOREACH_DCC(_channel, _iter, _data) \
     GLIST_FOREACH((_channel ? red_channel_get_clients(RED_CHANNEL(_channel)) : NULL), \
@@ -214,6 +218,9 @@ void                       display_channel_create_surface            (DisplayCha
 void                       display_channel_draw                      (DisplayChannel *display,
                                                                       const SpiceRect *area,
                                                                       int surface_id);
+int                        display_channel_pipes_have_room           (DisplayChannel *display);
+int                        display_channel_get_coalesce_pipes        (DisplayChannel *display);
+void                       display_channel_coalesce_pipes            (DisplayChannel *display);
 void                       display_channel_draw_until                (DisplayChannel *display,
                                                                       const SpiceRect *area,
                                                                       int surface_id,
@@ -241,14 +248,20 @@ void                       display_channel_current_flush             (DisplayCha
 int                        display_channel_wait_for_migrate_data     (DisplayChannel *display);
 void                       display_channel_flush_all_surfaces        (DisplayChannel *display);
 void                       display_channel_free_glz_drawables_to_free(DisplayChannel *display);
+void                       display_channel_push_in_threads           (DisplayChannel *display);
 void                       display_channel_free_glz_drawables        (DisplayChannel *display);
+void                       display_channel_glz_expire_parked         (DisplayChannel *display);
 void                       display_channel_destroy_surface_wait      (DisplayChannel *display,
                                                                       uint32_t surface_id);
 void                       display_channel_destroy_surfaces          (DisplayChannel *display);
 uint32_t                   display_channel_generate_uid              (DisplayChannel *display);
+RedDrawable *              display_channel_red_drawable_new          (DisplayChannel *display,
+                                                                      QXLInstance *qxl);
 void                       display_channel_process_draw              (DisplayChannel *display,
                                                                       RedDrawable *red_drawable,
                                                                       uint32_t process_commands_generation);
+void                       display_channel_add_heat_frame            (DisplayChannel *display,
+                                                                      uint32_t process_commands_generation);
 void                       display_channel_process_surface_cmd       (DisplayChannel *display,
                                                                       const RedSurfaceCmd *surface_cmd,
                                                                       int loadvm);
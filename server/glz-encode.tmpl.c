@@ -28,6 +28,7 @@
     ENCODE_PIXEL(encoder, pixel) : writing a pixel to the compressed buffer (byte by byte)
     SAME_PIXEL(pix1, pix2)         : comparing two pixels
     HASH_FUNC(value, pix_ptr)    : hash func of 3 consecutive pixels
+    MATCH_LEN(a, b, n)           : number of leading pixels of a and b that are the same, up to n
 */
 
 #ifdef LZ_PLT
@@ -128,6 +129,25 @@
 
 #endif
 
+#if defined(LZ_RGB16)
+#define MATCH_LEN(a, b, n) glz_match.rgb16(a, b, n)
+#elif defined(LZ_RGB24)
+#define MATCH_LEN(a, b, n) glz_match.rgb24(a, b, n)
+#elif defined(LZ_RGB32)
+#define MATCH_LEN(a, b, n) glz_match.rgb32(a, b, n)
+#else
+#define MATCH_LEN(a, b, n) FNAME(match_len)(a, b, n)
+
+static inline size_t FNAME(match_len)(const PIXEL *a, const PIXEL *b, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n && SAME_PIXEL(a[i], b[i]); i++) {
+    }
+    return i;
+}
+#endif
+
 #define PIXEL_ID(pix_ptr, seg_ptr, pix_per_byte) \
     (((pix_ptr) - ((PIXEL *)(seg_ptr)->lines)) * pix_per_byte + (seg_ptr)->pixels_so_far)
 
@@ -197,8 +217,8 @@ static inline size_t FNAME(do_match)(SharedDictionary *dict,
         *o_pix_distance = PIXEL_DIST(ip, ip_seg, ref, ref_seg, pix_per_byte);
     } else { // the ref is at different image - encode offset from the image start
         *o_pix_distance = PIXEL_DIST(ref, ref_seg,
-                                     (PIXEL *)(dict->window.segs[ref_seg->image->first_seg].lines),
-                                     &dict->window.segs[ref_seg->image->first_seg],
+                                     (PIXEL *)(WINDOW_SEG(dict, ref_seg->image->first_seg)->lines),
+                                     WINDOW_SEG(dict, ref_seg->image->first_seg),
                                      pix_per_byte);
     }
 
@@ -209,13 +229,8 @@ static inline size_t FNAME(do_match)(SharedDictionary *dict,
 
 
     /* continue the match*/
-    while ((tmp_ip < ip_limit) && (tmp_ref < ref_limit)) {
-        if (!SAME_PIXEL(*tmp_ref, *tmp_ip)) {
-            break;
-        } else {
-            tmp_ref++;
-            tmp_ip++;
-        }
+    if ((tmp_ip < ip_limit) && (tmp_ref < ref_limit)) {
+        tmp_ip += MATCH_LEN(tmp_ip, tmp_ref, MIN(ip_limit - tmp_ip, ref_limit - tmp_ref));
     }
 
 
@@ -246,7 +261,7 @@ static inline size_t FNAME(do_match)(SharedDictionary *dict,
 */
 static void FNAME(compress_seg)(Encoder *encoder, uint32_t seg_idx, PIXEL *from, int copied)
 {
-    WindowImageSegment *seg = &encoder->dict->window.segs[seg_idx];
+    WindowImageSegment *seg = WINDOW_SEG(encoder->dict, seg_idx);
     const PIXEL *ip = from;
     const PIXEL *ip_bound = (PIXEL *)(seg->lines_end) - BOUND_OFFSET;
     const PIXEL *ip_limit = (PIXEL *)(seg->lines_end) - LIMIT_OFFSET;
@@ -290,7 +305,6 @@ static void FNAME(compress_seg)(Encoder *encoder, uint32_t seg_idx, PIXEL *from,
 
         if (LZ_EXPECT_CONDITIONAL(ip > (PIXEL *)(seg->lines))) {
             if (SAME_PIXEL(ip[-1], ip[0]) && SAME_PIXEL(ip[0], ip[1]) && SAME_PIXEL(ip[1], ip[2])) {
-                PIXEL x;
                 pix_dist = 1;
                 image_dist = 0;
 
@@ -299,17 +313,9 @@ static void FNAME(compress_seg)(Encoder *encoder, uint32_t seg_idx, PIXEL *from,
                 ref_limit = (PIXEL *)(seg->lines_end);
                 len = 3;
 
-                x = *ref;
-
-                while (ip < ip_bound) { // TODO: maybe separate a run from the same seg or from
-                                       // different ones in order to spare ref < ref_limit
-                    if (!SAME_PIXEL(*ip, x)) {
-                        ip++;
-                        break;
-                    } else {
-                        ip++;
-                        len++;
-                    }
+                // a run is a match with the previous pixel
+                if (ip < ip_bound) {
+                    len += MATCH_LEN(ip, ip - 1, ip_bound - ip);
                 }
 
                 goto match;
@@ -325,7 +331,7 @@ static void FNAME(compress_seg)(Encoder *encoder, uint32_t seg_idx, PIXEL *from,
 #else
         ref_seg_idx = encoder->dict->htab[hval].image_seg_idx;
 #endif
-            ref_seg = encoder->dict->window.segs + ref_seg_idx;
+            ref_seg = WINDOW_SEG(encoder->dict, ref_seg_idx);
             if (REF_SEG_IS_VALID(encoder->dict, encoder->id,
                                  ref_seg, seg)) {
 #ifdef CHAINED_HASH
@@ -478,30 +484,30 @@ static void FNAME(compress)(Encoder *encoder)
 
     // fetch the first image segment that is not too small
     while ((seg_id != NULL_IMAGE_SEG_ID) &&
-           (dict->window.segs[seg_id].image->id == encoder->cur_image.id) &&
-           ((((PIXEL *)dict->window.segs[seg_id].lines_end) -
-             ((PIXEL *)dict->window.segs[seg_id].lines)) < 4)) {
+           (WINDOW_SEG(dict, seg_id)->image->id == encoder->cur_image.id) &&
+           ((((PIXEL *)WINDOW_SEG(dict, seg_id)->lines_end) -
+             ((PIXEL *)WINDOW_SEG(dict, seg_id)->lines)) < 4)) {
         // coping the segment
-        if (dict->window.segs[seg_id].lines != dict->window.segs[seg_id].lines_end) {
-            ip = (PIXEL *)dict->window.segs[seg_id].lines;
+        if (WINDOW_SEG(dict, seg_id)->lines != WINDOW_SEG(dict, seg_id)->lines_end) {
+            ip = (PIXEL *)WINDOW_SEG(dict, seg_id)->lines;
             // Note: we assume MAX_COPY > 3
             encode_copy_count(encoder, (uint8_t)(
-                                  (((PIXEL *)dict->window.segs[seg_id].lines_end) -
-                                   ((PIXEL *)dict->window.segs[seg_id].lines)) - 1));
-            while (ip < (PIXEL *)dict->window.segs[seg_id].lines_end) {
+                                  (((PIXEL *)WINDOW_SEG(dict, seg_id)->lines_end) -
+                                   ((PIXEL *)WINDOW_SEG(dict, seg_id)->lines)) - 1));
+            while (ip < (PIXEL *)WINDOW_SEG(dict, seg_id)->lines_end) {
                 ENCODE_PIXEL(encoder, *ip);
                 ip++;
             }
         }
-        seg_id = dict->window.segs[seg_id].next;
+        seg_id = WINDOW_SEG(dict, seg_id)->next;
     }
 
     if ((seg_id == NULL_IMAGE_SEG_ID) ||
-        (dict->window.segs[seg_id].image->id != encoder->cur_image.id)) {
+        (WINDOW_SEG(dict, seg_id)->image->id != encoder->cur_image.id)) {
         return;
     }
 
-    ip = (PIXEL *)dict->window.segs[seg_id].lines;
+    ip = (PIXEL *)WINDOW_SEG(dict, seg_id)->lines;
 
 
     encode_copy_count(encoder, MAX_COPY - 1);
@@ -520,11 +526,11 @@ static void FNAME(compress)(Encoder *encoder)
     FNAME(compress_seg)(encoder, seg_id, ip, 2);
 
     // compressing the next segments
-    for (seg_id = dict->window.segs[seg_id].next;
+    for (seg_id = WINDOW_SEG(dict, seg_id)->next;
         seg_id != NULL_IMAGE_SEG_ID && (
-        dict->window.segs[seg_id].image->id == encoder->cur_image.id);
-        seg_id = dict->window.segs[seg_id].next) {
-        FNAME(compress_seg)(encoder, seg_id, (PIXEL *)dict->window.segs[seg_id].lines, 0);
+        WINDOW_SEG(dict, seg_id)->image->id == encoder->cur_image.id);
+        seg_id = WINDOW_SEG(dict, seg_id)->next) {
+        FNAME(compress_seg)(encoder, seg_id, (PIXEL *)WINDOW_SEG(dict, seg_id)->lines, 0);
     }
 }
 
@@ -534,6 +540,7 @@ static void FNAME(compress)(Encoder *encoder)
 #undef PIXEL
 #undef ENCODE_PIXEL
 #undef SAME_PIXEL
+#undef MATCH_LEN
 #undef HASH_FUNC
 #undef GET_r
 #undef GET_g
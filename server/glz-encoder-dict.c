@@ -18,6 +18,7 @@
 #include <config.h>
 #endif
 
+#include <limits.h>
 #include <pthread.h>
 #include <string.h>
 #include <stdio.h>
@@ -26,6 +27,18 @@
 #include "glz-encoder-dict.h"
 #include "glz-encoder-priv.h"
 
+/* calls the free_image callback if the image is alive, or frees the lines of a detached one */
+static inline void __glz_dictionary_window_release_image(SharedDictionary *dict,
+                                                         WindowImage *image)
+{
+    if (image->detached_lines) {
+        dict->cur_usr->free(dict->cur_usr, image->detached_lines);
+        image->detached_lines = NULL;
+    } else if (image->is_alive) {
+        dict->cur_usr->free_image(dict->cur_usr, image->usr_context);
+    }
+}
+
 /* turning all used images to free ones. If they are alive, calling the free_image callback for
    each one */
 static inline void __glz_dictionary_window_reset_images(SharedDictionary *dict)
@@ -35,9 +48,7 @@ static inline void __glz_dictionary_window_reset_images(SharedDictionary *dict)
     while (dict->window.used_images_head) {
         tmp = dict->window.used_images_head;
         dict->window.used_images_head = dict->window.used_images_head->next;
-        if (tmp->is_alive) {
-            dict->cur_usr->free_image(dict->cur_usr, tmp->usr_context);
-        }
+        __glz_dictionary_window_release_image(dict, tmp);
         tmp->next = dict->window.free_images;
         tmp->is_alive = FALSE;
         dict->window.free_images = tmp;
@@ -45,6 +56,22 @@ static inline void __glz_dictionary_window_reset_images(SharedDictionary *dict)
     dict->window.used_images_tail = NULL;
 }
 
+static void glz_dictionary_window_reset_segs_block(WindowImageSegment *block,
+                                                   uint32_t first_seg_id)
+{
+    WindowImageSegment *seg;
+    uint32_t i;
+
+    for (seg = block, i = first_seg_id + 1; seg < block + WINDOW_SEGS_BLOCK_SIZE; seg++, i++) {
+        seg->next = i;
+        seg->image = NULL;
+        seg->lines = NULL;
+        seg->lines_end = NULL;
+        seg->pixels_num = 0;
+        seg->pixels_so_far = 0;
+    }
+}
+
 /* allocate window fields (no reset)*/
 static int glz_dictionary_window_create(SharedDictionary *dict, uint32_t size)
 {
@@ -53,20 +80,23 @@ static int glz_dictionary_window_create(SharedDictionary *dict, uint32_t size)
     }
 
     dict->window.size_limit = size;
-    dict->window.segs = (WindowImageSegment *)(
-            dict->cur_usr->malloc(dict->cur_usr, sizeof(WindowImageSegment) * INIT_IMAGE_SEGS_NUM));
+    memset(dict->window.segs_blocks, 0, sizeof(dict->window.segs_blocks));
+    dict->window.segs_blocks[0] = (WindowImageSegment *)(
+            dict->cur_usr->malloc(dict->cur_usr,
+                                  sizeof(WindowImageSegment) * WINDOW_SEGS_BLOCK_SIZE));
 
-    if (!dict->window.segs) {
+    if (!dict->window.segs_blocks[0]) {
         return FALSE;
     }
 
-    dict->window.segs_quota = INIT_IMAGE_SEGS_NUM;
+    dict->window.segs_quota = WINDOW_SEGS_BLOCK_SIZE;
 
     dict->window.encoders_heads = (uint32_t *)dict->cur_usr->malloc(dict->cur_usr,
                                                             sizeof(uint32_t) * dict->max_encoders);
 
     if (!dict->window.encoders_heads) {
-        dict->cur_usr->free(dict->cur_usr, dict->window.segs);
+        dict->cur_usr->free(dict->cur_usr, dict->window.segs_blocks[0]);
+        dict->window.segs_blocks[0] = NULL;
         return FALSE;
     }
 
@@ -83,20 +113,13 @@ static int glz_dictionary_window_create(SharedDictionary *dict, uint32_t size)
 static void glz_dictionary_window_reset(SharedDictionary *dict)
 {
     uint32_t i;
-    WindowImageSegment *seg, *last_seg;
 
-    last_seg = dict->window.segs + dict->window.segs_quota;
     /* reset free segs list */
     dict->window.free_segs_head = 0;
-    for (seg = dict->window.segs, i = 0; seg < last_seg; seg++, i++) {
-        seg->next = i + 1;
-        seg->image = NULL;
-        seg->lines = NULL;
-        seg->lines_end = NULL;
-        seg->pixels_num = 0;
-        seg->pixels_so_far = 0;
+    for (i = 0; i < dict->window.segs_quota; i += WINDOW_SEGS_BLOCK_SIZE) {
+        glz_dictionary_window_reset_segs_block(WINDOW_SEG(dict, i), i);
     }
-    dict->window.segs[dict->window.segs_quota - 1].next = NULL_IMAGE_SEG_ID;
+    WINDOW_SEG(dict, dict->window.segs_quota - 1)->next = NULL_IMAGE_SEG_ID;
 
     dict->window.used_segs_head = NULL_IMAGE_SEG_ID;
     dict->window.used_segs_tail = NULL_IMAGE_SEG_ID;
@@ -119,12 +142,15 @@ static inline void glz_dictionary_reset_hash(SharedDictionary *dict)
 
 static inline void glz_dictionary_window_destroy(SharedDictionary *dict)
 {
+    uint32_t i;
+
     __glz_dictionary_window_reset_images(dict);
 
-    if (dict->window.segs) {
-        dict->cur_usr->free(dict->cur_usr, dict->window.segs);
-        dict->window.segs = NULL;
+    for (i = 0; i < WINDOW_SEGS_MAX_BLOCKS && dict->window.segs_blocks[i]; i++) {
+        dict->cur_usr->free(dict->cur_usr, dict->window.segs_blocks[i]);
+        dict->window.segs_blocks[i] = NULL;
     }
+    dict->window.segs_quota = 0;
 
     while (dict->window.free_images) {
         WindowImage *tmp = dict->window.free_images;
@@ -160,7 +186,6 @@ GlzEncDictContext *glz_enc_dictionary_create(uint32_t size, uint32_t max_encoder
     dict->max_encoders = max_encoders;
 
     pthread_mutex_init(&dict->lock, NULL);
-    pthread_rwlock_init(&dict->rw_alloc_lock, NULL);
 
     dict->window.encoders_heads = NULL;
 
@@ -224,7 +249,6 @@ void glz_enc_dictionary_destroy(GlzEncDictContext *opaque_dict, GlzEncoderUsrCon
     glz_dictionary_window_destroy(dict);
 
     pthread_mutex_destroy(&dict->lock);
-    pthread_rwlock_destroy(&dict->rw_alloc_lock);
 
     dict->cur_usr->free(dict->cur_usr, dict);
 }
@@ -252,6 +276,64 @@ void glz_enc_dictionary_remove_image(GlzEncDictContext *opaque_dict,
     glz_dictionary_window_kill_image(dict, image);
 }
 
+/* copies the lines of the segments of the image to a single buffer, and makes them point
+   there */
+static int glz_dictionary_window_copy_image_lines(SharedDictionary *dict, WindowImage *image)
+{
+    WindowImageSegment *seg;
+    uint32_t seg_id;
+    size_t size = 0;
+    uint8_t *copy;
+
+    for (seg_id = image->first_seg;
+         seg_id != NULL_IMAGE_SEG_ID && (seg = WINDOW_SEG(dict, seg_id))->image == image;
+         seg_id = seg->next) {
+        size += (uint8_t *)seg->lines_end - (uint8_t *)seg->lines;
+    }
+
+    if (size > INT_MAX || !(copy = dict->cur_usr->malloc(dict->cur_usr, size))) {
+        return FALSE;
+    }
+    image->detached_lines = copy;
+
+    for (seg_id = image->first_seg;
+         seg_id != NULL_IMAGE_SEG_ID && (seg = WINDOW_SEG(dict, seg_id))->image == image;
+         seg_id = seg->next) {
+        size = (uint8_t *)seg->lines_end - (uint8_t *)seg->lines;
+        memcpy(copy, seg->lines, size);
+        seg->lines = copy;
+        seg->lines_end = copy + size;
+        copy += size;
+    }
+    return TRUE;
+}
+
+int glz_enc_dictionary_detach_images(GlzEncDictContext *opaque_dict,
+                                     GlzEncDictImageFilter filter, void *opaque,
+                                     GlzEncoderUsrContext *usr)
+{
+    SharedDictionary *dict = (SharedDictionary *)opaque_dict;
+    WindowImage *image;
+    int ret = TRUE;
+
+    dict->cur_usr = usr;
+    GLZ_ASSERT(dict->cur_usr, opaque_dict && filter);
+
+    for (image = dict->window.used_images_head; image; image = image->next) {
+        if (!image->is_alive || image->detached_lines ||
+            !filter(image->usr_context, opaque)) {
+            continue;
+        }
+        if (!glz_dictionary_window_copy_image_lines(dict, image)) {
+            glz_dictionary_window_kill_image(dict, image);
+            ret = FALSE;
+        }
+        dict->cur_usr->free_image(dict->cur_usr, image->usr_context);
+        image->usr_context = NULL;
+    }
+    return ret;
+}
+
 /***********************************************************************************
  Mutators of the window. Should be called by the encoder before and after encoding.
  ***********************************************************************************/
@@ -265,48 +347,31 @@ static inline int __get_pixels_num(LzImageType image_type, unsigned int num_line
     }
 }
 
-static void __glz_dictionary_window_segs_realloc(SharedDictionary *dict)
+/* The existing segments are not moved, so the encoders which are reading them
+   don't have to be stopped */
+static void __glz_dictionary_window_segs_grow(SharedDictionary *dict)
 {
-    WindowImageSegment *new_segs;
-    uint32_t new_quota = (MAX_IMAGE_SEGS_NUM < (dict->window.segs_quota * 2)) ?
-        MAX_IMAGE_SEGS_NUM : (dict->window.segs_quota * 2);
-    WindowImageSegment *seg;
-    uint32_t i;
+    WindowImageSegment *block;
+    uint32_t first_seg_id = dict->window.segs_quota;
 
-    pthread_rwlock_wrlock(&dict->rw_alloc_lock);
-
-    if (dict->window.segs_quota == MAX_IMAGE_SEGS_NUM) {
+    if (dict->window.segs_quota == WINDOW_SEGS_MAX_BLOCKS * WINDOW_SEGS_BLOCK_SIZE) {
         dict->cur_usr->error(dict->cur_usr, "overflow in image segments window\n");
     }
 
-    new_segs = (WindowImageSegment*)dict->cur_usr->malloc(
-            dict->cur_usr, sizeof(WindowImageSegment) * new_quota);
+    block = (WindowImageSegment*)dict->cur_usr->malloc(
+            dict->cur_usr, sizeof(WindowImageSegment) * WINDOW_SEGS_BLOCK_SIZE);
 
-    if (!new_segs) {
+    if (!block) {
         dict->cur_usr->error(dict->cur_usr,
                              "realloc of dictionary window failed\n");
     }
 
-    memcpy(new_segs, dict->window.segs,
-           sizeof(WindowImageSegment) * dict->window.segs_quota);
-
-    // resetting the new elements
-    for (i = dict->window.segs_quota, seg = new_segs + i; i < new_quota; i++, seg++) {
-        seg->image = NULL;
-        seg->lines = NULL;
-        seg->lines_end = NULL;
-        seg->pixels_num = 0;
-        seg->pixels_so_far = 0;
-        seg->next = i + 1;
-    }
-    new_segs[new_quota - 1].next = dict->window.free_segs_head;
-    dict->window.free_segs_head = dict->window.segs_quota;
-
-    dict->cur_usr->free(dict->cur_usr, dict->window.segs);
-    dict->window.segs = new_segs;
-    dict->window.segs_quota = new_quota;
+    glz_dictionary_window_reset_segs_block(block, first_seg_id);
+    block[WINDOW_SEGS_BLOCK_SIZE - 1].next = dict->window.free_segs_head;
 
-    pthread_rwlock_unlock(&dict->rw_alloc_lock);
+    dict->window.segs_blocks[first_seg_id >> WINDOW_SEGS_BLOCK_LOG] = block;
+    dict->window.segs_quota += WINDOW_SEGS_BLOCK_SIZE;
+    dict->window.free_segs_head = first_seg_id;
 }
 
 /* NOTE - it also updates the used_images_list*/
@@ -342,15 +407,14 @@ static uint32_t __glz_dictionary_window_alloc_image_seg(SharedDictionary *dict)
     uint32_t seg_id;
     WindowImageSegment *seg;
 
-    // TODO: when is it best to realloc? when full or when half full?
     if (dict->window.free_segs_head == NULL_IMAGE_SEG_ID) {
-        __glz_dictionary_window_segs_realloc(dict);
+        __glz_dictionary_window_segs_grow(dict);
     }
 
     GLZ_ASSERT(dict->cur_usr, dict->window.free_segs_head != NULL_IMAGE_SEG_ID);
 
     seg_id = dict->window.free_segs_head;
-    seg = dict->window.segs + seg_id;
+    seg = WINDOW_SEG(dict, seg_id);
     dict->window.free_segs_head = seg->next;
 
     return seg_id;
@@ -359,9 +423,7 @@ static uint32_t __glz_dictionary_window_alloc_image_seg(SharedDictionary *dict)
 /* moves image to free list and "kill" it. Calls the free_image callback if was alive. */
 static inline void __glz_dictionary_window_free_image(SharedDictionary *dict, WindowImage *image)
 {
-    if (image->is_alive) {
-        dict->cur_usr->free_image(dict->cur_usr, image->usr_context);
-    }
+    __glz_dictionary_window_release_image(dict, image);
     image->is_alive = FALSE;
     image->next = dict->window.free_images;
     dict->window.free_images = image;
@@ -378,13 +440,13 @@ static inline void __glz_dictionary_window_free_image_segs(SharedDictionary *dic
     dict->window.free_segs_head = image->first_seg;
 
     // retrieving the last segment of the image
-    for (seg_id = image->first_seg, next_seg_id = dict->window.segs[seg_id].next;
-         (next_seg_id != NULL_IMAGE_SEG_ID) && (dict->window.segs[next_seg_id].image == image);
-         seg_id = next_seg_id, next_seg_id = dict->window.segs[seg_id].next) {
+    for (seg_id = image->first_seg, next_seg_id = WINDOW_SEG(dict, seg_id)->next;
+         (next_seg_id != NULL_IMAGE_SEG_ID) && (WINDOW_SEG(dict, next_seg_id)->image == image);
+         seg_id = next_seg_id, next_seg_id = WINDOW_SEG(dict, seg_id)->next) {
     }
 
     // concatenate the free list
-    dict->window.segs[seg_id].next = old_free_head;
+    WINDOW_SEG(dict, seg_id)->next = old_free_head;
 }
 
 /* Returns the logical head of the window after we add an image with the give size to its tail.
@@ -410,10 +472,10 @@ static WindowImage *glz_dictionary_window_get_new_head(SharedDictionary *dict, i
     GLZ_ASSERT(dict->cur_usr, dict->window.used_segs_tail != NULL_IMAGE_SEG_ID);
 
     // used_segs_head is the latest logical head (the physical head may preceed it)
-    cur_head = dict->window.segs[dict->window.used_segs_head].image;
-    cur_win_size = dict->window.segs[dict->window.used_segs_tail].pixels_num +
-        dict->window.segs[dict->window.used_segs_tail].pixels_so_far -
-        dict->window.segs[dict->window.used_segs_head].pixels_so_far;
+    cur_head = WINDOW_SEG(dict, dict->window.used_segs_head)->image;
+    cur_win_size = WINDOW_SEG(dict, dict->window.used_segs_tail)->pixels_num +
+        WINDOW_SEG(dict, dict->window.used_segs_tail)->pixels_so_far -
+        WINDOW_SEG(dict, dict->window.used_segs_head)->pixels_so_far;
 
     while ((cur_win_size + new_image_size) > dict->window.size_limit) {
         GLZ_ASSERT(dict->cur_usr, cur_head);
@@ -424,15 +486,20 @@ static WindowImage *glz_dictionary_window_get_new_head(SharedDictionary *dict, i
     return cur_head;
 }
 
-static inline int glz_dictionary_is_in_use(SharedDictionary *dict)
+/* Returns the earliest image that the other encoders may refer to, NULL when none of them
+   is encoding */
+static WindowImage *glz_dictionary_get_used_head(SharedDictionary *dict, uint32_t encoder_id)
 {
-    uint32_t i = 0;
+    uint32_t i;
+    uint32_t early_head_seg = NULL_IMAGE_SEG_ID;
+
     for (i = 0; i < dict->max_encoders; i++) {
-        if (dict->window.encoders_heads[i] != NULL_IMAGE_SEG_ID) {
-            return TRUE;
+        if (i != encoder_id &&
+            IMAGE_SEG_IS_EARLIER(dict, dict->window.encoders_heads[i], early_head_seg)) {
+            early_head_seg = dict->window.encoders_heads[i];
         }
     }
-    return FALSE;
+    return early_head_seg == NULL_IMAGE_SEG_ID ? NULL : WINDOW_SEG(dict, early_head_seg)->image;
 }
 
 /* remove from the window (and free relevant data) the images between the oldest physical head
@@ -459,12 +526,28 @@ static void glz_dictionary_window_remove_head(SharedDictionary *dict, uint32_t e
     }
 }
 
+/* Releases the images which are out of the window, but not the ones which are still in the
+   window of another encoder. win_head is the new logical head of the window, see
+   glz_dictionary_window_get_new_head */
+static void glz_dictionary_window_trim(SharedDictionary *dict, uint32_t encoder_id,
+                                       WindowImage *win_head)
+{
+    WindowImage *used_head = glz_dictionary_get_used_head(dict, encoder_id);
+
+    if (used_head && (!win_head || used_head->id < win_head->id)) {
+        win_head = used_head;
+    }
+    if (dict->window.used_images_head != win_head) {
+        glz_dictionary_window_remove_head(dict, encoder_id, win_head);
+    }
+}
+
 static uint32_t glz_dictionary_window_alloc_image_seg(SharedDictionary *dict, WindowImage* image,
                                                       int size, int stride,
                                                       uint8_t *lines, unsigned int num_lines)
 {
     uint32_t seg_id = __glz_dictionary_window_alloc_image_seg(dict);
-    WindowImageSegment *seg = &dict->window.segs[seg_id];
+    WindowImageSegment *seg = WINDOW_SEG(dict, seg_id);
 
     seg->image = image;
     seg->lines = lines;
@@ -478,49 +561,90 @@ static uint32_t glz_dictionary_window_alloc_image_seg(SharedDictionary *dict, Wi
     return seg_id;
 }
 
+/* the lines of the image, as returned by the more_lines callback */
+typedef struct WindowImageLines {
+    uint8_t *lines;
+    unsigned int num_lines;
+} WindowImageLines;
+
+#define PRE_ENCODE_LINES_NUM 16
+
+/* Reads all the chunks of the image before the dictionary is locked, since the callback
+   doesn't depend on the dictionary. Returns the number of chunks; *chunks is either the
+   given array, or a larger one which should be released with the free callback. */
+static unsigned int glz_dictionary_get_image_lines(GlzEncoderUsrContext *usr, int image_height,
+                                                   uint8_t *first_lines,
+                                                   unsigned int num_first_lines,
+                                                   WindowImageLines **chunks,
+                                                   unsigned int max_chunks)
+{
+    WindowImageLines *stack_chunks = *chunks;
+    unsigned int n_chunks = 0;
+    unsigned int row = 0;
+    uint8_t *lines = first_lines;
+    int num_lines = num_first_lines;
+
+    if (num_lines <= 0) {
+        num_lines = usr->more_lines(usr, &lines);
+    }
+    for (;;) {
+        if (num_lines <= 0) {
+            usr->error(usr, "more lines failed\n");
+        }
+        if (n_chunks == max_chunks) {
+            WindowImageLines *new_chunks;
+
+            new_chunks = usr->malloc(usr, sizeof(WindowImageLines) * max_chunks * 2);
+            if (!new_chunks) {
+                usr->error(usr, "failed to allocate the image chunks\n");
+            }
+            memcpy(new_chunks, *chunks, sizeof(WindowImageLines) * n_chunks);
+            if (*chunks != stack_chunks) {
+                usr->free(usr, *chunks);
+            }
+            *chunks = new_chunks;
+            max_chunks *= 2;
+        }
+        (*chunks)[n_chunks].lines = lines;
+        (*chunks)[n_chunks].num_lines = num_lines;
+        n_chunks++;
+
+        row += num_lines;
+        if (row >= (uint32_t)image_height) {
+            break;
+        }
+        num_lines = usr->more_lines(usr, &lines);
+    }
+
+    return n_chunks;
+}
+
 static WindowImage *glz_dictionary_window_add_image(SharedDictionary *dict, LzImageType image_type,
                                                     int image_size, int image_height,
-                                                    int image_stride, uint8_t *first_lines,
-                                                    unsigned int num_first_lines,
+                                                    int image_stride, WindowImageLines *chunks,
+                                                    unsigned int n_chunks,
                                                     GlzUsrImageContext *usr_image_context)
 {
-    unsigned int num_lines = num_first_lines;
-    unsigned int row;
-    uint32_t seg_id, prev_seg_id;
-    uint8_t* lines = first_lines;
+    unsigned int i;
+    uint32_t seg_id = NULL_IMAGE_SEG_ID, prev_seg_id = NULL_IMAGE_SEG_ID;
     // alloc image info,update used head tail,  if used_head null - update  head
     WindowImage *image = __glz_dictionary_window_alloc_image(dict);
     image->id = dict->last_image_id++;
     image->size = image_size;
     image->type = image_type;
     image->usr_context = usr_image_context;
+    image->detached_lines = NULL;
 
-    if (num_lines <= 0) {
-        num_lines = dict->cur_usr->more_lines(dict->cur_usr, &lines);
-        if (num_lines <= 0) {
-            dict->cur_usr->error(dict->cur_usr, "more lines failed\n");
-        }
-    }
-
-    for (row = 0;;) {
+    for (i = 0; i < n_chunks; i++) {
         seg_id = glz_dictionary_window_alloc_image_seg(dict, image,
-                                                       image_size * num_lines / image_height,
+                                                       image_size * chunks[i].num_lines /
+                                                       image_height,
                                                        image_stride,
-                                                       lines, num_lines);
-        if (row == 0) {
+                                                       chunks[i].lines, chunks[i].num_lines);
+        if (i == 0) {
             image->first_seg = seg_id;
         } else {
-            dict->window.segs[prev_seg_id].next = seg_id;
-        }
-
-        row += num_lines;
-        if (row < (uint32_t)image_height) {
-            num_lines = dict->cur_usr->more_lines(dict->cur_usr, &lines);
-            if (num_lines <= 0) {
-                dict->cur_usr->error(dict->cur_usr, "more lines failed\n");
-            }
-        } else {
-            break;
+            WINDOW_SEG(dict, prev_seg_id)->next = seg_id;
         }
         prev_seg_id = seg_id;
     }
@@ -540,7 +664,7 @@ static WindowImage *glz_dictionary_window_add_image(SharedDictionary *dict, LzIm
         // For the other thread that may read 'next' of the old tail, NULL_IMAGE_SEG_ID
         // is equivalent to a segment with an image id that is different
         // from the image id of the tail, so we don't need to further protect this field.
-        dict->window.segs[prev_tail].next = image->first_seg;
+        WINDOW_SEG(dict, prev_tail)->next = image->first_seg;
         dict->window.used_segs_tail = seg_id;
     }
     image->is_alive = TRUE;
@@ -556,23 +680,28 @@ WindowImage *glz_dictionary_pre_encode(uint32_t encoder_id, GlzEncoderUsrContext
                                        uint32_t *image_head_dist)
 {
     WindowImage *new_win_head, *ret;
+    WindowImageLines stack_chunks[PRE_ENCODE_LINES_NUM];
+    WindowImageLines *chunks = stack_chunks;
+    unsigned int n_chunks;
     int image_size;
 
+    // the lock only protects the window lists: the segments are filled from the
+    // chunks fetched here, and the image is published by linking it to the tail
+    n_chunks = glz_dictionary_get_image_lines(usr, image_height, first_lines, num_first_lines,
+                                              &chunks, PRE_ENCODE_LINES_NUM);
+    image_size = __get_pixels_num(image_type, image_height, image_stride);
 
     pthread_mutex_lock(&dict->lock);
 
     dict->cur_usr = usr;
     GLZ_ASSERT(dict->cur_usr, dict->window.encoders_heads[encoder_id] == NULL_IMAGE_SEG_ID);
 
-    image_size = __get_pixels_num(image_type, image_height, image_stride);
     new_win_head = glz_dictionary_window_get_new_head(dict, image_size);
 
-    if (!glz_dictionary_is_in_use(dict)) {
-        glz_dictionary_window_remove_head(dict, encoder_id, new_win_head);
-    }
+    glz_dictionary_window_trim(dict, encoder_id, new_win_head);
 
     ret = glz_dictionary_window_add_image(dict, image_type, image_size, image_height, image_stride,
-                                          first_lines, num_first_lines, usr_image_context);
+                                          chunks, n_chunks, usr_image_context);
 
     if (new_win_head) {
         dict->window.encoders_heads[encoder_id] = new_win_head->first_seg;
@@ -587,47 +716,25 @@ WindowImage *glz_dictionary_pre_encode(uint32_t encoder_id, GlzEncoderUsrContext
 
     // update encoders head  (the other heads were already updated)
     pthread_mutex_unlock(&dict->lock);
-    pthread_rwlock_rdlock(&dict->rw_alloc_lock);
+
+    if (chunks != stack_chunks) {
+        usr->free(usr, chunks);
+    }
     return ret;
 }
 
 void glz_dictionary_post_encode(uint32_t encoder_id, GlzEncoderUsrContext *usr,
                                 SharedDictionary *dict)
 {
-    uint32_t i;
-    uint32_t early_head_seg = NULL_IMAGE_SEG_ID;
-    uint32_t this_encoder_head_seg;
-
-    pthread_rwlock_unlock(&dict->rw_alloc_lock);
     pthread_mutex_lock(&dict->lock);
     dict->cur_usr = usr;
 
     GLZ_ASSERT(dict->cur_usr, dict->window.encoders_heads[encoder_id] != NULL_IMAGE_SEG_ID);
-    // get the earliest head in use (not including this encoder head)
-    for (i = 0; i < dict->max_encoders; i++) {
-        if (i != encoder_id) {
-            if (IMAGE_SEG_IS_EARLIER(dict, dict->window.encoders_heads[i], early_head_seg)) {
-                early_head_seg = dict->window.encoders_heads[i];
-            }
-        }
-    }
-
-    // possible only if early_head_seg == NULL
-    if (IMAGE_SEG_IS_EARLIER(dict, dict->window.used_segs_head, early_head_seg)) {
-        early_head_seg = dict->window.used_segs_head;
-    }
-
-    this_encoder_head_seg = dict->window.encoders_heads[encoder_id];
-
-    GLZ_ASSERT(dict->cur_usr, early_head_seg != NULL_IMAGE_SEG_ID);
-
-    if (IMAGE_SEG_IS_EARLIER(dict, this_encoder_head_seg, early_head_seg)) {
-        GLZ_ASSERT(dict->cur_usr,
-                   this_encoder_head_seg == dict->window.used_images_head->first_seg);
-        glz_dictionary_window_remove_head(dict, encoder_id,
-                                          dict->window.segs[early_head_seg].image);
-    }
 
+    // the images this encoder kept alive may be released now, unless another encoder is
+    // still using them. Otherwise, with several encoders at work, the window would
+    // only be trimmed when all of them happen to be idle.
+    glz_dictionary_window_trim(dict, encoder_id, glz_dictionary_window_get_new_head(dict, 0));
 
     dict->window.encoders_heads[encoder_id] = NULL_IMAGE_SEG_ID;
     pthread_mutex_unlock(&dict->lock);
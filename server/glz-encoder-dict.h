@@ -68,4 +68,16 @@ void glz_enc_dictionary_reset(GlzEncDictContext *opaque_dict, GlzEncoderUsrConte
 void glz_enc_dictionary_remove_image(GlzEncDictContext *opaque_dict,
                                      GlzEncDictImageContext *image, GlzEncoderUsrContext *usr);
 
+/* returns TRUE for the images whose lines should be copied by glz_enc_dictionary_detach_images */
+typedef int (*GlzEncDictImageFilter)(GlzUsrImageContext *image, void *opaque);
+
+/* Copies the lines of the alive images accepted by filter to memory owned by the dictionary,
+   and calls the free_image callback for them: the dictionary doesn't reference the user
+   data of these images anymore, and they stay in the window until they are out of it.
+   Returns FALSE when out of memory, the images which weren't copied are removed.
+   NOTE - you should use this routine only when no encoder uses the dictionary.*/
+int glz_enc_dictionary_detach_images(GlzEncDictContext *opaque_dict,
+                                     GlzEncDictImageFilter filter, void *opaque,
+                                     GlzEncoderUsrContext *usr);
+
 #endif // GLZ_ENCODER_DICT_H_
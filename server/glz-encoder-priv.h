@@ -53,13 +53,25 @@ struct WindowImage {
     int size;                    // in pixels
     uint32_t first_seg;
     GlzUsrImageContext  *usr_context;
+    uint8_t             *detached_lines; // the copy of the lines, see
+                                         // glz_enc_dictionary_detach_images
     WindowImage*       next;
     uint8_t is_alive;
 };
 
 #define MAX_IMAGE_SEGS_NUM (0xffffffff)
 #define NULL_IMAGE_SEG_ID MAX_IMAGE_SEGS_NUM
-#define INIT_IMAGE_SEGS_NUM 1000
+
+/* The segments are allocated by blocks which are never moved, so that the
+   encoders can keep reading them without any lock while the window grows. */
+#define WINDOW_SEGS_BLOCK_LOG 10
+#define WINDOW_SEGS_BLOCK_SIZE (1 << WINDOW_SEGS_BLOCK_LOG)
+#define WINDOW_SEGS_BLOCK_MASK (WINDOW_SEGS_BLOCK_SIZE - 1)
+#define WINDOW_SEGS_MAX_BLOCKS 4096
+
+#define WINDOW_SEG(dict, seg_id)                                    \
+    (&(dict)->window.segs_blocks[(seg_id) >> WINDOW_SEGS_BLOCK_LOG] \
+                                [(seg_id) & WINDOW_SEGS_BLOCK_MASK])
 
 /* Images can be separated into several chunks. The basic unit of the
    dictionary window is one image segment. Each segment is encoded separately.
@@ -84,15 +96,16 @@ struct  __attribute__ ((__packed__)) HashEntry {
 
 struct SharedDictionary {
     struct {
-        /* The segments storage. A dynamic array.
+        /* The segments storage. Blocks of WINDOW_SEGS_BLOCK_SIZE segments, a new
+           block is added when all the segments are used.
            By referring to a segment by its index, instead of address,
            we save space in the hash entries (32bit instead of 64bit) */
-        WindowImageSegment  *segs;
+        WindowImageSegment  *segs_blocks[WINDOW_SEGS_MAX_BLOCKS];
         uint32_t segs_quota;
 
         /* The window is manged as a linked list rather than as a cyclic
            array in order to keep the indices of the segments consistent
-           after reallocation */
+           when blocks are added */
 
         /* the window in a resolution of image segments */
         uint32_t used_segs_head;             // the latest head
@@ -126,7 +139,6 @@ struct SharedDictionary {
     uint64_t last_image_id;
     uint32_t max_encoders;
     pthread_mutex_t lock;
-    pthread_rwlock_t rw_alloc_lock;
     GlzEncoderUsrContext       *cur_usr; // each encoder has other context.
 };
 
@@ -157,8 +169,8 @@ void glz_dictionary_post_encode(uint32_t encoder_id, GlzEncoderUsrContext *usr,
 
 #define IMAGE_SEG_IS_EARLIER(dict, dst_seg, src_seg) (                     \
     ((src_seg) == NULL_IMAGE_SEG_ID) || (((dst_seg) != NULL_IMAGE_SEG_ID)  \
-    && ((dict)->window.segs[(dst_seg)].pixels_so_far <                     \
-       (dict)->window.segs[(src_seg)].pixels_so_far)))
+    && (WINDOW_SEG(dict, dst_seg)->pixels_so_far <                         \
+        WINDOW_SEG(dict, src_seg)->pixels_so_far)))
 
 
 #ifdef CHAINED_HASH
@@ -184,8 +196,8 @@ void glz_dictionary_post_encode(uint32_t encoder_id, GlzEncoderUsrContext *usr,
      (ref_seg)->image->is_alive &&                         \
      (src_seg->image->type == ref_seg->image->type) &&     \
      (ref_seg->pixels_so_far <= src_seg->pixels_so_far) && \
-     ((dict)->window.segs[                                 \
-        (dict)->window.encoders_heads[enc_id]].pixels_so_far <= \
+     (WINDOW_SEG(dict,                                     \
+        (dict)->window.encoders_heads[enc_id])->pixels_so_far <= \
         ref_seg->pixels_so_far)))
 
 #ifdef DEBUG
@@ -21,6 +21,10 @@
 #include <glib.h>
 #include <pthread.h>
 #include <stdio.h>
+#include <string.h>
+#if defined(__GNUC__) && defined(__SSE2__)
+#include <immintrin.h>
+#endif
 #include "glz-encoder.h"
 #include "glz-encoder-priv.h"
 
@@ -124,6 +128,9 @@ static int encoder_reset(Encoder *encoder, uint8_t *io_ptr, uint8_t *io_ptr_end)
 *           Encoding
 ***********************************************************/
 
+static pthread_once_t glz_match_once = PTHREAD_ONCE_INIT;
+static void glz_match_init(void);
+
 GlzEncoderContext *glz_encoder_create(uint8_t id, GlzEncDictContext *dictionary,
                                       GlzEncoderUsrContext *usr)
 {
@@ -138,6 +145,8 @@ GlzEncoderContext *glz_encoder_create(uint8_t id, GlzEncDictContext *dictionary,
         return NULL;
     }
 
+    pthread_once(&glz_match_once, glz_match_init);
+
     encoder->id = id;
     encoder->usr = usr;
     encoder->dict = (SharedDictionary *)dictionary;
@@ -191,6 +200,206 @@ typedef uint16_t rgb16_pixel_t;
 
 #define BOUND_OFFSET 2
 #define LIMIT_OFFSET 6
+
+/**********************************************************
+*           Match length
+***********************************************************/
+
+/* Return the number of leading pixels of a and b that are the same, up to n. Only the
+   bytes compared by SAME_PIXEL are checked: the pad byte of rgb32 pixels and the top
+   bit of rgb16 pixels are ignored. The best implementations for the cpu are selected
+   when the first encoder is created. */
+typedef struct GlzMatchFuncs {
+    GlzSimd simd;
+    size_t (*rgb16)(const rgb16_pixel_t *a, const rgb16_pixel_t *b, size_t n);
+    size_t (*rgb24)(const rgb24_pixel_t *a, const rgb24_pixel_t *b, size_t n);
+    size_t (*rgb32)(const rgb32_pixel_t *a, const rgb32_pixel_t *b, size_t n);
+} GlzMatchFuncs;
+
+static GlzMatchFuncs glz_match;
+
+static size_t match_len_rgb16_c(const rgb16_pixel_t *a, const rgb16_pixel_t *b, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n && !((a[i] ^ b[i]) & 0x7fff); i++) {
+    }
+    return i;
+}
+
+static size_t match_len_rgb24_c(const rgb24_pixel_t *a, const rgb24_pixel_t *b, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n && a[i].b == b[i].b && a[i].g == b[i].g && a[i].r == b[i].r; i++) {
+    }
+    return i;
+}
+
+static size_t match_len_rgb32_c(const rgb32_pixel_t *a, const rgb32_pixel_t *b, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n && a[i].b == b[i].b && a[i].g == b[i].g && a[i].r == b[i].r; i++) {
+    }
+    return i;
+}
+
+#if defined(__GNUC__) && defined(__SSE2__)
+/* The vectors are compared byte by byte, the bits of the bytes which don't matter are
+   set in the mask of the equal bytes, the first unset bit is the first difference.
+   The tail which doesn't fill a vector is left to the plain versions. */
+static size_t match_len_rgb16_sse2(const rgb16_pixel_t *a, const rgb16_pixel_t *b, size_t n)
+{
+    const __m128i mask = _mm_set1_epi16(0x7fff);
+    size_t i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m128i diff = _mm_and_si128(_mm_xor_si128(_mm_loadu_si128((const __m128i *)(a + i)),
+                                                   _mm_loadu_si128((const __m128i *)(b + i))),
+                                     mask);
+        unsigned int eq = _mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128()));
+
+        if (eq != 0xffff) {
+            return i + __builtin_ctz(~eq) / sizeof(rgb16_pixel_t);
+        }
+    }
+    return i + match_len_rgb16_c(a + i, b + i, n - i);
+}
+
+static size_t match_len_rgb24_sse2(const rgb24_pixel_t *a, const rgb24_pixel_t *b, size_t n)
+{
+    const uint8_t *a_bytes = (const uint8_t *)a;
+    const uint8_t *b_bytes = (const uint8_t *)b;
+    size_t n_bytes = n * sizeof(rgb24_pixel_t);
+    size_t i;
+
+    for (i = 0; i + 16 <= n_bytes; i += 16) {
+        unsigned int eq = _mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a_bytes + i)),
+                           _mm_loadu_si128((const __m128i *)(b_bytes + i))));
+
+        if (eq != 0xffff) {
+            return (i + __builtin_ctz(~eq)) / sizeof(rgb24_pixel_t);
+        }
+    }
+    i /= sizeof(rgb24_pixel_t);
+    return i + match_len_rgb24_c(a + i, b + i, n - i);
+}
+
+static size_t match_len_rgb32_sse2(const rgb32_pixel_t *a, const rgb32_pixel_t *b, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        unsigned int eq = _mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i)),
+                           _mm_loadu_si128((const __m128i *)(b + i)))) | 0x8888;
+
+        if (eq != 0xffff) {
+            return i + __builtin_ctz(~eq) / sizeof(rgb32_pixel_t);
+        }
+    }
+    return i + match_len_rgb32_c(a + i, b + i, n - i);
+}
+
+#define GLZ_AVX2 __attribute__((target("avx2")))
+
+static GLZ_AVX2 size_t match_len_rgb16_avx2(const rgb16_pixel_t *a, const rgb16_pixel_t *b,
+                                             size_t n)
+{
+    const __m256i mask = _mm256_set1_epi16(0x7fff);
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        __m256i diff = _mm256_and_si256(
+            _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a + i)),
+                             _mm256_loadu_si256((const __m256i *)(b + i))),
+            mask);
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(diff, _mm256_setzero_si256()));
+
+        if (eq != 0xffffffff) {
+            return i + __builtin_ctz(~eq) / sizeof(rgb16_pixel_t);
+        }
+    }
+    return i + match_len_rgb16_sse2(a + i, b + i, n - i);
+}
+
+static GLZ_AVX2 size_t match_len_rgb24_avx2(const rgb24_pixel_t *a, const rgb24_pixel_t *b,
+                                             size_t n)
+{
+    const uint8_t *a_bytes = (const uint8_t *)a;
+    const uint8_t *b_bytes = (const uint8_t *)b;
+    size_t n_bytes = n * sizeof(rgb24_pixel_t);
+    size_t i;
+
+    for (i = 0; i + 32 <= n_bytes; i += 32) {
+        uint32_t eq = _mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a_bytes + i)),
+                              _mm256_loadu_si256((const __m256i *)(b_bytes + i))));
+
+        if (eq != 0xffffffff) {
+            return (i + __builtin_ctz(~eq)) / sizeof(rgb24_pixel_t);
+        }
+    }
+    i /= sizeof(rgb24_pixel_t);
+    return i + match_len_rgb24_sse2(a + i, b + i, n - i);
+}
+
+static GLZ_AVX2 size_t match_len_rgb32_avx2(const rgb32_pixel_t *a, const rgb32_pixel_t *b,
+                                             size_t n)
+{
+    size_t i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        uint32_t eq = _mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + i)),
+                              _mm256_loadu_si256((const __m256i *)(b + i)))) | 0x88888888;
+
+        if (eq != 0xffffffff) {
+            return i + __builtin_ctz(~eq) / sizeof(rgb32_pixel_t);
+        }
+    }
+    return i + match_len_rgb32_sse2(a + i, b + i, n - i);
+}
+#endif
+
+static void glz_match_select(GlzSimd max)
+{
+    glz_match.simd = GLZ_SIMD_NONE;
+    glz_match.rgb16 = match_len_rgb16_c;
+    glz_match.rgb24 = match_len_rgb24_c;
+    glz_match.rgb32 = match_len_rgb32_c;
+#if defined(__GNUC__) && defined(__SSE2__)
+    if (max >= GLZ_SIMD_SSE2) {
+        glz_match.simd = GLZ_SIMD_SSE2;
+        glz_match.rgb16 = match_len_rgb16_sse2;
+        glz_match.rgb24 = match_len_rgb24_sse2;
+        glz_match.rgb32 = match_len_rgb32_sse2;
+    }
+    __builtin_cpu_init();
+    if (max >= GLZ_SIMD_AVX2 && __builtin_cpu_supports("avx2")) {
+        glz_match.simd = GLZ_SIMD_AVX2;
+        glz_match.rgb16 = match_len_rgb16_avx2;
+        glz_match.rgb24 = match_len_rgb24_avx2;
+        glz_match.rgb32 = match_len_rgb32_avx2;
+    }
+#endif
+}
+
+static void glz_match_init(void)
+{
+    glz_match_select(GLZ_SIMD_AVX2);
+}
+
+GlzSimd glz_encoder_set_simd(GlzSimd max)
+{
+    pthread_once(&glz_match_once, glz_match_init);
+    glz_match_select(max);
+    return glz_match.simd;
+}
+
+
 #define MIN_FILE_SIZE 4
 
 #define MAX_PIXEL_SHORT_DISTANCE 4096       // (1 << 12)
@@ -46,11 +46,23 @@ struct GlzEncoderUsrContext {
 
 typedef void GlzEncoderContext;
 
+/* the vector instructions used to find the length of the matches */
+typedef enum {
+    GLZ_SIMD_NONE,
+    GLZ_SIMD_SSE2,
+    GLZ_SIMD_AVX2,
+} GlzSimd;
+
 GlzEncoderContext *glz_encoder_create(uint8_t id, GlzEncDictContext *dictionary,
                                       GlzEncoderUsrContext *usr);
 
 void glz_encoder_destroy(GlzEncoderContext *opaque_encoder);
 
+/* The best instructions supported by the cpu are used by default. Restricts them to max,
+   for testing purposes, and returns the ones which will be used. Should not be called
+   while encoding */
+GlzSimd glz_encoder_set_simd(GlzSimd max);
+
 /*
         assumes width is in pixels and stride is in bytes
     usr_context       : when an image is released from the window due to capacity overflow,
@@ -19,12 +19,16 @@
 #include <config.h>
 #endif
 
+#include <errno.h>
+#include <stdlib.h>
 #include <glib.h>
 
 #include "image-encoders.h"
 #include "spice-bitmap-utils.h"
 #include "red-parse-qxl.h" // red_drawable_unref
 #include "pixmap-cache.h" // MAX_CACHE_CLIENTS
+#include "send-pool.h" // send_pool_in_thread
+#include "utils.h"
 
 #define ZLIB_DEFAULT_COMPRESSION_LEVEL 3
 
@@ -42,6 +46,8 @@ struct GlzSharedDictionary {
     pthread_rwlock_t encode_lock;
     int migrate_freeze;
     RedClient *client; // channel clients of the same client share the dict
+    uint32_t connection_id; // to find the dictionary again when the client reconnects
+    red_time_t expire_time; // the end of the grace period, when the client is disconnected
 };
 
 /* for each qxl drawable, there may be several instances of lz drawables */
@@ -192,11 +198,123 @@ static void glz_usr_free(GlzEncoderUsrContext *usr, void *ptr)
     free(ptr);
 }
 
+#define COMPRESS_BUF_POOL_PERIOD_NS (NSEC_PER_SEC * 2)
+/* 8MB, enough for the largest images */
+#define COMPRESS_BUF_POOL_MAX_FREE 128
+
+struct RedCompressBufPool {
+    pthread_mutex_t lock;
+    ImageEncoderSharedData *shared_data;
+    RedCompressBuf *free_bufs;
+    uint32_t n_free;
+    uint32_t n_used;        /* being filled or sent */
+    uint32_t high_water;    /* the most buffers used at once during the period */
+    uint64_t period_start;
+    gboolean released;      /* the encoders are gone, freed with the last buffer */
+};
+
+RedCompressBufPool *compress_buf_pool_new(ImageEncoderSharedData *shared_data)
+{
+    RedCompressBufPool *pool = spice_new0(RedCompressBufPool, 1);
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->shared_data = shared_data;
+    pool->period_start = spice_get_monotonic_time_ns();
+    return pool;
+}
+
+static void compress_buf_pool_free_bufs(RedCompressBufPool *pool, uint32_t n_kept)
+{
+    while (pool->n_free > n_kept) {
+        RedCompressBuf *buf = pool->free_bufs;
+
+        pool->free_bufs = buf->send_next;
+        pool->n_free--;
+        g_free(buf);
+    }
+}
+
+static void compress_buf_pool_destroy(RedCompressBufPool *pool)
+{
+    compress_buf_pool_free_bufs(pool, 0);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+void compress_buf_pool_release(RedCompressBufPool *pool)
+{
+    gboolean destroy;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->released = TRUE;
+    destroy = pool->n_used == 0;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (destroy) {
+        compress_buf_pool_destroy(pool);
+    }
+}
+
+RedCompressBuf *compress_buf_new(RedCompressBufPool *pool)
+{
+    RedCompressBuf *buf;
+    uint64_t now = spice_get_monotonic_time_ns();
+
+    pthread_mutex_lock(&pool->lock);
+    if (now - pool->period_start > COMPRESS_BUF_POOL_PERIOD_NS) {
+        /* the buffers which weren't needed during the period */
+        compress_buf_pool_free_bufs(pool, pool->high_water > pool->n_used ?
+                                          pool->high_water - pool->n_used : 0);
+        pool->high_water = pool->n_used;
+        pool->period_start = now;
+    }
+    buf = pool->free_bufs;
+    if (buf) {
+        pool->free_bufs = buf->send_next;
+        pool->n_free--;
+        stat_inc_counter(reds, pool->shared_data->compress_buf_hits_counter, 1);
+    } else {
+        stat_inc_counter(reds, pool->shared_data->compress_buf_misses_counter, 1);
+    }
+    pool->n_used++;
+    pool->high_water = MAX(pool->high_water, pool->n_used);
+    pthread_mutex_unlock(&pool->lock);
+
+    if (!buf) {
+        buf = g_new(RedCompressBuf, 1);
+        buf->pool = pool;
+    }
+    buf->send_next = NULL;
+    return buf;
+}
+
+void compress_buf_free(RedCompressBuf *buf)
+{
+    RedCompressBufPool *pool = buf->pool;
+    gboolean destroy = FALSE;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->n_used--;
+    if (pool->released) {
+        destroy = pool->n_used == 0;
+    } else if (pool->n_free < COMPRESS_BUF_POOL_MAX_FREE) {
+        buf->send_next = pool->free_bufs;
+        pool->free_bufs = buf;
+        pool->n_free++;
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    g_free(buf);
+    if (destroy) {
+        compress_buf_pool_destroy(pool);
+    }
+}
+
 static void encoder_data_init(EncoderData *data)
 {
-    data->bufs_tail = g_new(RedCompressBuf, 1);
+    data->bufs_tail = compress_buf_new(data->buf_pool);
     data->bufs_head = data->bufs_tail;
-    data->bufs_head->send_next = NULL;
 }
 
 static void encoder_data_reset(EncoderData *data)
@@ -204,7 +322,7 @@ static void encoder_data_reset(EncoderData *data)
     RedCompressBuf *buf = data->bufs_head;
     while (buf) {
         RedCompressBuf *next = buf->send_next;
-        g_free(buf);
+        compress_buf_free(buf);
         buf = next;
     }
     data->bufs_head = data->bufs_tail = NULL;
@@ -217,10 +335,9 @@ static int encoder_usr_more_space(EncoderData *enc_data, uint8_t **io_ptr)
 {
     RedCompressBuf *buf;
 
-    buf = g_new(RedCompressBuf, 1);
+    buf = compress_buf_new(enc_data->buf_pool);
     enc_data->bufs_tail->send_next = buf;
     enc_data->bufs_tail = buf;
-    buf->send_next = NULL;
     *io_ptr = buf->buf.bytes;
     return sizeof(buf->buf);
 }
@@ -384,7 +501,7 @@ static void glz_usr_free_image(GlzEncoderUsrContext *usr, GlzUsrImageContext *im
     GlzDrawableInstanceItem *glz_drawable_instance = (GlzDrawableInstanceItem *)image;
     ImageEncoders *drawable_enc = glz_drawable_instance->glz_drawable->encoders;
     ImageEncoders *this_enc = SPICE_CONTAINEROF(lz_data, ImageEncoders, glz_data);
-    if (this_enc == drawable_enc) {
+    if (this_enc == drawable_enc && !send_pool_in_thread()) {
         glz_drawable_instance_item_free(glz_drawable_instance);
     } else {
         /* The glz dictionary is shared between all DisplayChannelClient
@@ -393,6 +510,8 @@ static void glz_usr_free_image(GlzEncoderUsrContext *usr, GlzUsrImageContext *im
          * (glz_dictionary_window_remove_head). Thus this function can be
          * called from any DisplayChannelClient thread, hence the need for
          * this check.
+         * The instances are also freed later when the image is sent from
+         * a send pool, the drawable they retain belongs to the worker.
          */
         pthread_mutex_lock(&drawable_enc->glz_drawables_inst_to_free_lock);
         ring_add_before(&glz_drawable_instance->free_link,
@@ -471,6 +590,16 @@ void image_encoders_init(ImageEncoders *enc, ImageEncoderSharedData *shared_data
 
     // todo: tune level according to bandwidth
     enc->zlib_level = ZLIB_DEFAULT_COMPRESSION_LEVEL;
+
+    enc->buf_pool = compress_buf_pool_new(shared_data);
+    enc->quic_data.data.buf_pool = enc->buf_pool;
+    enc->lz_data.data.buf_pool = enc->buf_pool;
+    enc->jpeg_data.data.buf_pool = enc->buf_pool;
+#ifdef USE_LZ4
+    enc->lz4_data.data.buf_pool = enc->buf_pool;
+#endif
+    enc->zlib_data.data.buf_pool = enc->buf_pool;
+    enc->glz_data.data.buf_pool = enc->buf_pool;
 }
 
 void image_encoders_free(ImageEncoders *enc)
@@ -488,6 +617,9 @@ void image_encoders_free(ImageEncoders *enc)
 #endif
     zlib_encoder_destroy(enc->zlib);
     enc->zlib = NULL;
+    /* the buffers being sent keep it until they are freed */
+    compress_buf_pool_release(enc->buf_pool);
+    enc->buf_pool = NULL;
     pthread_mutex_destroy(&enc->glz_drawables_inst_to_free_lock);
 }
 
@@ -517,13 +649,18 @@ static void glz_drawable_instance_item_free(GlzDrawableInstanceItem *instance)
     }
 
     if (ring_is_empty(&glz_drawable->instances)) {
+        ImageEncoderSharedData *shared_data = glz_drawable->encoders->shared_data;
+
         spice_assert(glz_drawable->instances_count == 0);
 
+        /* the other clients of the drawable can be adding theirs */
+        pthread_mutex_lock(&shared_data->glz_retention_lock);
         if (glz_drawable->has_drawable) {
             ring_remove(&glz_drawable->drawable_link);
         }
+        shared_data->glz_drawable_count--;
+        pthread_mutex_unlock(&shared_data->glz_retention_lock);
         red_drawable_unref(glz_drawable->red_drawable);
-        glz_drawable->encoders->shared_data->glz_drawable_count--;
         if (ring_item_is_linked(&glz_drawable->link)) {
             ring_remove(&glz_drawable->link);
         }
@@ -664,6 +801,67 @@ void glz_retention_detach_drawables(GlzImageRetention *ret)
     }
 }
 
+/* SPICE_GLZ_DICT_GRACE: the number of seconds the dictionary of a client is kept after it
+ * disconnected. 0, the default, destroys it with the last display channel client. */
+static red_time_t glz_dictionary_grace_time;
+static pthread_once_t glz_dictionary_grace_once = PTHREAD_ONCE_INIT;
+
+static void glz_dictionary_grace_init(void)
+{
+    const char *grace_str = getenv("SPICE_GLZ_DICT_GRACE");
+    long grace;
+    char *end;
+
+    if (grace_str == NULL) {
+        return;
+    }
+
+    errno = 0;
+    grace = strtol(grace_str, &end, 10);
+    if (errno != 0 || *end != '\0' || grace < 0 || grace > G_MAXINT) {
+        spice_warning("error parsing SPICE_GLZ_DICT_GRACE: %s", grace_str);
+        return;
+    }
+    glz_dictionary_grace_time = grace * NSEC_PER_SEC;
+}
+
+static red_time_t glz_dictionary_get_grace_time(void)
+{
+    pthread_once(&glz_dictionary_grace_once, glz_dictionary_grace_init);
+    return glz_dictionary_grace_time;
+}
+
+gboolean image_encoders_glz_can_park(void)
+{
+    return glz_dictionary_get_grace_time() != 0;
+}
+
+static int glz_image_is_from_encoders(GlzUsrImageContext *image, void *opaque)
+{
+    GlzDrawableInstanceItem *instance = (GlzDrawableInstanceItem *)image;
+
+    return instance->glz_drawable->encoders == opaque;
+}
+
+/* Copies the images the encoders added to the window, so that they stay in the dictionary
+ * once the drawables are freed, see glz_dictionary_park() */
+static void image_encoders_detach_glz_images(ImageEncoders *enc)
+{
+    GlzSharedDictionary *glz_dict = enc->glz_dict;
+
+    if (!glz_dict || glz_dict->connection_id == 0 || glz_dictionary_get_grace_time() == 0) {
+        return;
+    }
+
+    pthread_rwlock_wrlock(&glz_dict->encode_lock);
+    if (!glz_dict->migrate_freeze &&
+        !glz_enc_dictionary_detach_images(glz_dict->dict, glz_image_is_from_encoders, enc,
+                                          &enc->glz_data.usr)) {
+        spice_warning("failed to keep the images of glz dictionary %d", glz_dict->id);
+    }
+    pthread_rwlock_unlock(&glz_dict->encode_lock);
+}
+
 static void image_encoders_freeze_glz(ImageEncoders *enc)
 {
     pthread_rwlock_wrlock(&enc->glz_dict->encode_lock);
@@ -681,7 +879,8 @@ void image_encoders_glz_get_restore_data(ImageEncoders *enc,
                                         &enc->glz_data.usr);
 }
 
-static GlzSharedDictionary *glz_shared_dictionary_new(RedClient *client, uint8_t id,
+static GlzSharedDictionary *glz_shared_dictionary_new(RedClient *client,
+                                                      uint32_t connection_id, uint8_t id,
                                                       GlzEncDictContext *dict)
 {
     spice_return_val_if_fail(dict != NULL, NULL);
@@ -693,13 +892,132 @@ static GlzSharedDictionary *glz_shared_dictionary_new(RedClient *client, uint8_t
     shared_dict->refs = 1;
     shared_dict->migrate_freeze = FALSE;
     shared_dict->client = client;
+    shared_dict->connection_id = connection_id;
     pthread_rwlock_init(&shared_dict->encode_lock, NULL);
 
     return shared_dict;
 }
 
+static void glz_shared_dictionary_free(GlzSharedDictionary *shared_dict,
+                                       GlzEncoderUsrContext *usr)
+{
+    glz_enc_dictionary_destroy(shared_dict->dict, usr);
+    pthread_rwlock_destroy(&shared_dict->encode_lock);
+    free(shared_dict);
+}
+
 static pthread_mutex_t glz_dictionary_list_lock = PTHREAD_MUTEX_INITIALIZER;
 static GList *glz_dictionary_list;
+/* the dictionaries of the disconnected clients, the latest first */
+static GList *glz_parked_dictionary_list;
+
+#define GLZ_MAX_PARKED_DICTIONARIES 4
+
+/* The parked dictionaries are not used by any encoder anymore, they only hold detached
+ * images whose lines are released with usr->free */
+static GlzEncoderUsrContext glz_parked_usr = {
+    .error = glz_usr_error,
+    .warn = glz_usr_warn,
+    .info = glz_usr_warn,
+    .malloc = glz_usr_malloc,
+    .free = glz_usr_free,
+};
+
+/* Destroys the parked dictionaries whose grace period is over and returns the end of the
+ * grace period of the next one to expire, 0 if none is left.
+ * Must be called with glz_dictionary_list_lock held. */
+static red_time_t glz_dictionary_expire_parked(void)
+{
+    red_time_t now = spice_get_monotonic_time_ns();
+    red_time_t next_expire_time = 0;
+    GList *l, *next;
+    int n_parked = 0;
+
+    for (l = glz_parked_dictionary_list; l != NULL; l = next) {
+        GlzSharedDictionary *shared_dict = l->data;
+
+        next = l->next;
+        if (shared_dict->expire_time > now && ++n_parked <= GLZ_MAX_PARKED_DICTIONARIES) {
+            if (next_expire_time == 0 || shared_dict->expire_time < next_expire_time) {
+                next_expire_time = shared_dict->expire_time;
+            }
+            continue;
+        }
+        spice_debug("glz dictionary %d of connection %u expired",
+                    shared_dict->id, shared_dict->connection_id);
+        glz_parked_dictionary_list = g_list_delete_link(glz_parked_dictionary_list, l);
+        glz_shared_dictionary_free(shared_dict, &glz_parked_usr);
+    }
+    return next_expire_time;
+}
+
+uint32_t image_encoders_glz_expire_parked(void)
+{
+    red_time_t next_expire_time, now;
+
+    pthread_mutex_lock(&glz_dictionary_list_lock);
+    next_expire_time = glz_dictionary_expire_parked();
+    pthread_mutex_unlock(&glz_dictionary_list_lock);
+
+    if (next_expire_time == 0) {
+        return 0;
+    }
+    now = spice_get_monotonic_time_ns();
+    if (next_expire_time <= now) {
+        return 1;
+    }
+    return MIN((next_expire_time - now + NSEC_PER_MILLISEC - 1) / NSEC_PER_MILLISEC,
+               G_MAXUINT32);
+}
+
+/* Keeps the dictionary of a client which disconnected for the grace period, with the
+ * images it still had in its window (see image_encoders_detach_glz_images()), so that the
+ * client can keep on using its own window if it reconnects meanwhile.
+ * Must be called with glz_dictionary_list_lock held. */
+static gboolean glz_dictionary_park(GlzSharedDictionary *shared_dict)
+{
+    if (shared_dict->connection_id == 0 || shared_dict->migrate_freeze ||
+        glz_dictionary_get_grace_time() == 0) {
+        return FALSE;
+    }
+
+    shared_dict->client = NULL;
+    shared_dict->expire_time = spice_get_monotonic_time_ns() + glz_dictionary_get_grace_time();
+    glz_parked_dictionary_list = g_list_prepend(glz_parked_dictionary_list, shared_dict);
+    glz_dictionary_expire_parked();
+    return TRUE;
+}
+
+/* Returns the dictionary the client had before it reconnected, if it asks for the same
+ * one. Must be called with glz_dictionary_list_lock held. */
+static GlzSharedDictionary *glz_dictionary_unpark(RedClient *client, uint32_t connection_id,
+                                                  uint8_t id, int window_size)
+{
+    GList *l;
+
+    glz_dictionary_expire_parked();
+    if (connection_id == 0) {
+        return NULL;
+    }
+
+    for (l = glz_parked_dictionary_list; l != NULL; l = l->next) {
+        GlzSharedDictionary *shared_dict = l->data;
+
+        if (shared_dict->connection_id != connection_id || shared_dict->id != id) {
+            continue;
+        }
+        glz_parked_dictionary_list = g_list_delete_link(glz_parked_dictionary_list, l);
+        if (glz_enc_dictionary_get_size(shared_dict->dict) != (uint32_t)window_size) {
+            glz_shared_dictionary_free(shared_dict, &glz_parked_usr);
+            return NULL;
+        }
+        spice_info("Lz Window %d of connection %u reused", id, connection_id);
+        shared_dict->client = client;
+        shared_dict->refs = 1;
+        return shared_dict;
+    }
+    return NULL;
+}
 
 static GlzSharedDictionary *find_glz_dictionary(RedClient *client, uint8_t dict_id)
 {
@@ -720,7 +1038,7 @@ static GlzSharedDictionary *find_glz_dictionary(RedClient *client, uint8_t dict_
 #define MAX_LZ_ENCODERS MAX_CACHE_CLIENTS
 
 static GlzSharedDictionary *create_glz_dictionary(ImageEncoders *enc,
-                                                  RedClient *client,
+                                                  RedClient *client, uint32_t connection_id,
                                                   uint8_t id, int window_size)
 {
     spice_info("Lz Window %d Size=%d", id, window_size);
@@ -728,11 +1046,11 @@ static GlzSharedDictionary *create_glz_dictionary(ImageEncoders *enc,
     GlzEncDictContext *glz_dict =
         glz_enc_dictionary_create(window_size, MAX_LZ_ENCODERS, &enc->glz_data.usr);
 
-    return glz_shared_dictionary_new(client, id, glz_dict);
+    return glz_shared_dictionary_new(client, connection_id, id, glz_dict);
 }
 
 gboolean image_encoders_get_glz_dictionary(ImageEncoders *enc,
-                                           RedClient *client,
+                                           RedClient *client, uint32_t connection_id,
                                            uint8_t id, int window_size)
 {
     GlzSharedDictionary *shared_dict;
@@ -744,8 +1062,10 @@ gboolean image_encoders_get_glz_dictionary(ImageEncoders *enc,
     shared_dict = find_glz_dictionary(client, id);
     if (shared_dict) {
         shared_dict->refs++;
+    } else if ((shared_dict = glz_dictionary_unpark(client, connection_id, id, window_size))) {
+        glz_dictionary_list = g_list_prepend(glz_dictionary_list, shared_dict);
     } else {
-        shared_dict = create_glz_dictionary(enc, client, id, window_size);
+        shared_dict = create_glz_dictionary(enc, client, connection_id, id, window_size);
         if (shared_dict != NULL) {
             glz_dictionary_list = g_list_prepend(glz_dictionary_list, shared_dict);
         }
@@ -764,7 +1084,7 @@ static GlzSharedDictionary *restore_glz_dictionary(ImageEncoders *enc,
     GlzEncDictContext *glz_dict =
         glz_enc_dictionary_restore(restore_data, &enc->glz_data.usr);
 
-    return glz_shared_dictionary_new(client, id, glz_dict);
+    return glz_shared_dictionary_new(client, 0, id, glz_dict);
 }
 
 gboolean image_encoders_restore_glz_dictionary(ImageEncoders *enc,
@@ -805,6 +1125,7 @@ static void image_encoders_release_glz(ImageEncoders *enc)
 {
     GlzSharedDictionary *shared_dict;
 
+    image_encoders_detach_glz_images(enc);
     image_encoders_free_glz_drawables(enc);
 
     glz_encoder_destroy(enc->glz);
@@ -821,10 +1142,12 @@ static void image_encoders_release_glz(ImageEncoders *enc)
         return;
     }
     glz_dictionary_list = g_list_remove(glz_dictionary_list, shared_dict);
+    if (glz_dictionary_park(shared_dict)) {
+        pthread_mutex_unlock(&glz_dictionary_list_lock);
+        return;
+    }
     pthread_mutex_unlock(&glz_dictionary_list_lock);
-    glz_enc_dictionary_destroy(shared_dict->dict, &enc->glz_data.usr);
-    pthread_rwlock_destroy(&shared_dict->encode_lock);
-    free(shared_dict);
+    glz_shared_dictionary_free(shared_dict, &enc->glz_data.usr);
 }
 
 int image_encoders_compress_quic(ImageEncoders *enc, SpiceImage *dest,
@@ -1163,11 +1486,13 @@ static RedGlzDrawable *get_glz_drawable(ImageEncoders *enc, RedDrawable *red_dra
     RedGlzDrawable *ret;
     RingItem *item, *next;
 
+    pthread_mutex_lock(&enc->shared_data->glz_retention_lock);
     // TODO - I don't really understand what's going on here, so doing the technical equivalent
     // now that we have multiple glz_dicts, so the only way to go from dcc to drawable glz is to go
     // over the glz_ring (unless adding some better data structure then a ring)
     SAFE_FOREACH(item, next, TRUE, &glz_retention->ring, ret, LINK_TO_GLZ(item)) {
         if (ret->encoders == enc) {
+            pthread_mutex_unlock(&enc->shared_data->glz_retention_lock);
             return ret;
         }
     }
@@ -1185,6 +1510,7 @@ static RedGlzDrawable *get_glz_drawable(ImageEncoders *enc, RedDrawable *red_dra
     ring_add_before(&ret->link, &enc->glz_drawables);
     ring_add(&glz_retention->ring, &ret->drawable_link);
     enc->shared_data->glz_drawable_count++;
+    pthread_mutex_unlock(&enc->shared_data->glz_retention_lock);
     return ret;
 }
 
@@ -1306,10 +1632,117 @@ glz:
     return TRUE;
 }
 
+/* What the codecs typically do with 32 bits images, until they are measured */
+static const struct {
+    double ns_per_byte;
+    double ratio[BITMAP_GRADUAL_HIGH + 1];
+} codec_cost_priors[IMAGE_CODEC_COUNT] = {
+    /*                        invalid, not avail, low, medium, high */
+    [IMAGE_CODEC_QUIC] = { 12, { 0.30, 0.30, 0.30, 0.25, 0.20 } },
+    [IMAGE_CODEC_JPEG] = {  5, { 0.10, 0.10, 0.10, 0.08, 0.05 } },
+    [IMAGE_CODEC_LZ]   = {  5, { 0.30, 0.30, 0.10, 0.35, 0.75 } },
+    [IMAGE_CODEC_GLZ]  = {  7, { 0.25, 0.25, 0.07, 0.30, 0.70 } },
+    [IMAGE_CODEC_LZ4]  = {  1, { 0.40, 0.40, 0.15, 0.45, 0.90 } },
+};
+
+/* one image of the graduality out of this is compressed with the codec
+ * which was measured the longest time ago */
+#define CODEC_COST_REFRESH_INTERVAL 32
+
+static void codec_cost_init(ImageEncoderSharedData *shared_data)
+{
+    int graduality, codec;
+
+    pthread_mutex_init(&shared_data->codec_cost_lock, NULL);
+    for (graduality = 0; graduality <= BITMAP_GRADUAL_HIGH; graduality++) {
+        for (codec = 0; codec < IMAGE_CODEC_COUNT; codec++) {
+            ImageCodecCost *cost = &shared_data->codec_cost[graduality][codec];
+
+            cost->ns_per_byte = codec_cost_priors[codec].ns_per_byte;
+            cost->ratio = codec_cost_priors[codec].ratio[graduality];
+            cost->samples = 0;
+            cost->last_sample = 0;
+        }
+        shared_data->codec_cost_images[graduality] = 0;
+    }
+}
+
+void image_encoder_shared_add_codec_sample(ImageEncoderSharedData *shared_data,
+                                           ImageCodec codec, BitmapGradualType graduality,
+                                           uint64_t image_size, uint64_t compressed_size,
+                                           uint64_t time_ns)
+{
+    ImageCodecCost *cost;
+    double weight;
+
+    spice_return_if_fail(codec < IMAGE_CODEC_COUNT && graduality <= BITMAP_GRADUAL_HIGH);
+    if (image_size == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&shared_data->codec_cost_lock);
+    cost = &shared_data->codec_cost[graduality][codec];
+    /* the first samples replace the prior quickly, then it's a moving average */
+    weight = cost->samples < 7 ? 1.0 / (cost->samples + 2) : 1.0 / 8;
+    cost->ns_per_byte += ((double)time_ns / image_size - cost->ns_per_byte) * weight;
+    cost->ratio += ((double)compressed_size / image_size - cost->ratio) * weight;
+    cost->samples++;
+    cost->last_sample = shared_data->codec_cost_images[graduality];
+    pthread_mutex_unlock(&shared_data->codec_cost_lock);
+}
+
+ImageCodec image_encoder_shared_choose_codec(ImageEncoderSharedData *shared_data,
+                                             BitmapGradualType graduality, uint32_t codecs,
+                                             uint64_t image_size, uint64_t bit_rate)
+{
+    ImageCodec codec, best = IMAGE_CODEC_COUNT, oldest = IMAGE_CODEC_COUNT;
+    double best_time = 0;
+    uint32_t images;
+
+    spice_return_val_if_fail(graduality <= BITMAP_GRADUAL_HIGH, IMAGE_CODEC_COUNT);
+    spice_return_val_if_fail(bit_rate != 0, IMAGE_CODEC_COUNT);
+
+    pthread_mutex_lock(&shared_data->codec_cost_lock);
+    images = ++shared_data->codec_cost_images[graduality];
+    for (codec = 0; codec < IMAGE_CODEC_COUNT; codec++) {
+        const ImageCodecCost *cost = &shared_data->codec_cost[graduality][codec];
+        double time;
+
+        if (!(codecs & (1 << codec))) {
+            continue;
+        }
+        time = image_size * cost->ns_per_byte +
+               image_size * cost->ratio * 8 * NSEC_PER_SEC / bit_rate;
+        if (best == IMAGE_CODEC_COUNT || time < best_time) {
+            best = codec;
+            best_time = time;
+        }
+        if (oldest == IMAGE_CODEC_COUNT ||
+            images - cost->last_sample >
+            images - shared_data->codec_cost[graduality][oldest].last_sample) {
+            oldest = codec;
+        }
+    }
+    pthread_mutex_unlock(&shared_data->codec_cost_lock);
+
+    if (images % CODEC_COST_REFRESH_INTERVAL == 0) {
+        return oldest;
+    }
+    return best;
+}
+
 void image_encoder_shared_init(ImageEncoderSharedData *shared_data)
 {
     clockid_t stat_clock = CLOCK_THREAD_CPUTIME_ID;
 
+    pthread_mutex_init(&shared_data->glz_retention_lock, NULL);
+    shared_data->glz_drawable_count = 0;
+    codec_cost_init(shared_data);
+#ifdef RED_STATISTICS
+    shared_data->compress_buf_hits_counter = NULL;
+    shared_data->compress_buf_misses_counter = NULL;
+#endif
+
     stat_compress_init(&shared_data->off_stat, "off", stat_clock);
     stat_compress_init(&shared_data->lz_stat, "lz", stat_clock);
     stat_compress_init(&shared_data->glz_stat, "glz", stat_clock);
@@ -1332,6 +1765,34 @@ void image_encoder_shared_stat_reset(ImageEncoderSharedData *shared_data)
     stat_reset(&shared_data->lz4_stat);
 }
 
+#ifdef COMPRESS_STAT
+static void stat_merge(stat_info_t *info, stat_info_t *from)
+{
+    info->count += from->count;
+    info->total += from->total;
+    info->max = MAX(info->max, from->max);
+    info->min = MIN(info->min, from->min);
+    info->orig_size += from->orig_size;
+    info->comp_size += from->comp_size;
+    stat_reset(from);
+}
+#endif
+
+void image_encoder_shared_stat_merge(G_GNUC_UNUSED ImageEncoderSharedData *shared_data,
+                                     G_GNUC_UNUSED ImageEncoderSharedData *from)
+{
+#ifdef COMPRESS_STAT
+    stat_merge(&shared_data->off_stat, &from->off_stat);
+    stat_merge(&shared_data->quic_stat, &from->quic_stat);
+    stat_merge(&shared_data->lz_stat, &from->lz_stat);
+    stat_merge(&shared_data->glz_stat, &from->glz_stat);
+    stat_merge(&shared_data->jpeg_stat, &from->jpeg_stat);
+    stat_merge(&shared_data->zlib_glz_stat, &from->zlib_glz_stat);
+    stat_merge(&shared_data->jpeg_alpha_stat, &from->jpeg_alpha_stat);
+    stat_merge(&shared_data->lz4_stat, &from->lz4_stat);
+#endif
+}
+
 #define STAT_FMT "%s\t%8u\t%13.8g\t%12.8g\t%12.8g"
 
 #ifdef COMPRESS_STAT
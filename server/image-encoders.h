@@ -30,10 +30,12 @@
 #include "lz4-encoder.h"
 #endif
 #include "zlib-encoder.h"
+#include "spice-bitmap-utils.h"
 
 struct RedClient;
 
 typedef struct RedCompressBuf RedCompressBuf;
+typedef struct RedCompressBufPool RedCompressBufPool;
 typedef struct ImageEncoders ImageEncoders;
 typedef struct ImageEncoderSharedData ImageEncoderSharedData;
 typedef struct GlzSharedDictionary GlzSharedDictionary;
@@ -42,6 +44,34 @@ typedef struct GlzImageRetention GlzImageRetention;
 void image_encoder_shared_init(ImageEncoderSharedData *shared_data);
 void image_encoder_shared_stat_reset(ImageEncoderSharedData *shared_data);
 void image_encoder_shared_stat_print(const ImageEncoderSharedData *shared_data);
+/* Adds the statistics of from to the ones of shared_data and resets them */
+void image_encoder_shared_stat_merge(ImageEncoderSharedData *shared_data,
+                                     ImageEncoderSharedData *from);
+
+typedef enum {
+    IMAGE_CODEC_QUIC,
+    IMAGE_CODEC_JPEG,
+    IMAGE_CODEC_LZ,
+    IMAGE_CODEC_GLZ,
+    IMAGE_CODEC_LZ4,
+
+    IMAGE_CODEC_COUNT
+} ImageCodec;
+
+/* image_size bytes of an image of the given graduality were compressed to
+ * compressed_size bytes in time_ns nanoseconds */
+void image_encoder_shared_add_codec_sample(ImageEncoderSharedData *shared_data,
+                                           ImageCodec codec, BitmapGradualType graduality,
+                                           uint64_t image_size, uint64_t compressed_size,
+                                           uint64_t time_ns);
+/* Returns the codec among codecs, a mask of (1 << ImageCodec), with which an
+ * image of image_size bytes is expected to reach a client whose link is of
+ * bit_rate bits per second first, counting its encoding and its transfer.
+ * Now and then the codec measured the longest time ago is returned instead,
+ * so that the estimates of all the codecs follow the content. */
+ImageCodec image_encoder_shared_choose_codec(ImageEncoderSharedData *shared_data,
+                                             BitmapGradualType graduality, uint32_t codecs,
+                                             uint64_t image_size, uint64_t bit_rate);
 
 void image_encoders_init(ImageEncoders *enc, ImageEncoderSharedData *shared_data);
 void image_encoders_free(ImageEncoders *enc);
@@ -59,6 +89,8 @@ void glz_retention_detach_drawables(GlzImageRetention *ret);
 #define RED_COMPRESS_BUF_SIZE (1024 * 64)
 struct RedCompressBuf {
     RedCompressBuf *send_next;
+    /* the pool of the encoders which filled it, the buffer goes back to it when freed */
+    RedCompressBufPool *pool;
 
     /* This buffer provide space for compression algorithms.
      * Some algorithms access the buffer as an array of 32 bit words
@@ -70,20 +102,34 @@ struct RedCompressBuf {
     } buf;
 };
 
-static inline void compress_buf_free(RedCompressBuf *buf)
-{
-    g_free(buf);
-}
-
+/* The compression buffers of each ImageEncoders are kept in a pool once they
+ * are sent, the next images need as many of them. The buffers beyond the most
+ * used at once during a period of a couple of seconds are freed.
+ * The buffers can be freed from any thread, and after the pool is released. */
+RedCompressBufPool *compress_buf_pool_new(ImageEncoderSharedData *shared_data);
+void compress_buf_pool_release(RedCompressBufPool *pool);
+RedCompressBuf *compress_buf_new(RedCompressBufPool *pool);
+void compress_buf_free(RedCompressBuf *buf);
+
+/* connection_id: the id of the client session, its dictionary is kept for a grace period
+ * when it disconnects, see SPICE_GLZ_DICT_GRACE. 0 doesn't keep it, and must be used for
+ * the clients which do not keep their window, see DCC_CAP_GLZ_KEEP_WINDOW. */
 gboolean image_encoders_get_glz_dictionary(ImageEncoders *enc,
-                                           struct RedClient *client,
+                                           struct RedClient *client, uint32_t connection_id,
                                            uint8_t id, int window_size);
+/* Whether the dictionaries of the clients are kept when they disconnect */
+gboolean image_encoders_glz_can_park(void);
 gboolean image_encoders_restore_glz_dictionary(ImageEncoders *enc,
                                                struct RedClient *client,
                                                uint8_t id,
                                                GlzEncDictRestoreData *restore_data);
+/* The dictionary of a client which disconnected is parked for the grace period.
+ * Destroys the parked dictionaries whose grace period is over, returns the number
+ * of milliseconds until the next one expires, 0 if none is parked. */
+uint32_t image_encoders_glz_expire_parked(void);
 
 typedef struct  {
+    RedCompressBufPool *buf_pool;
     RedCompressBuf *bufs_head;
     RedCompressBuf *bufs_tail;
     jmp_buf jmp_env;
@@ -142,9 +188,25 @@ static inline void glz_retention_init(GlzImageRetention *ret)
     ring_init(&ret->ring);
 }
 
+/* running estimate of a codec for the images of a graduality */
+typedef struct ImageCodecCost {
+    double ns_per_byte;
+    double ratio;           /* compressed size / image size */
+    uint32_t samples;
+    uint32_t last_sample;   /* the number of chosen images when it was updated */
+} ImageCodecCost;
+
 struct ImageEncoderSharedData {
+    /* the clients of a drawable can be sent to from several threads of a send
+     * pool, protects its GlzImageRetention and glz_drawable_count */
+    pthread_mutex_t glz_retention_lock;
     uint32_t glz_drawable_count;
 
+    /* shared by the clients, whose images are compressed from several threads */
+    pthread_mutex_t codec_cost_lock;
+    ImageCodecCost codec_cost[BITMAP_GRADUAL_HIGH + 1][IMAGE_CODEC_COUNT];
+    uint32_t codec_cost_images[BITMAP_GRADUAL_HIGH + 1];
+
     stat_info_t off_stat;
     stat_info_t lz_stat;
     stat_info_t glz_stat;
@@ -153,10 +215,16 @@ struct ImageEncoderSharedData {
     stat_info_t zlib_glz_stat;
     stat_info_t jpeg_alpha_stat;
     stat_info_t lz4_stat;
+
+#ifdef RED_STATISTICS
+    uint64_t *compress_buf_hits_counter;
+    uint64_t *compress_buf_misses_counter;
+#endif
 };
 
 struct ImageEncoders {
     ImageEncoderSharedData *shared_data;
+    RedCompressBufPool *buf_pool;
 
     QuicData quic_data;
     QuicContext *quic;
@@ -37,6 +37,7 @@ typedef struct JpegEncoder {
         int height;
         int stride;
         unsigned int out_size;
+        /* NULL when the lines are given to libjpeg as they are */
         void (*convert_line_to_RGB24) (void *line, int width, uint8_t **out_line);
     } cur_image;
 } JpegEncoder;
@@ -124,6 +125,7 @@ static void convert_RGB16_to_RGB24(void *line, int width, uint8_t **out_line)
    }
 }
 
+#ifndef JCS_EXTENSIONS
 static void convert_BGR24_to_RGB24(void *in_line, int width, uint8_t **out_line)
 {
     int x;
@@ -158,11 +160,7 @@ static void convert_BGRX32_to_RGB24(void *line, int width, uint8_t **out_line)
         *out_pix++ = pixel & 0xff;
     }
 }
-
-static void convert_RGB24_to_RGB24(void *line, int width, uint8_t **out_line)
-{
-    *out_line = line;
-}
+#endif
 
 
 #define FILL_LINES() {                                                  \
@@ -175,6 +173,32 @@ static void convert_RGB24_to_RGB24(void *line, int width, uint8_t **out_line)
     }                                                                   \
 }
 
+#define JPEG_ENCODER_MAX_ROWS 16
+
+/* the lines are in a format libjpeg reads: hand them over without copying,
+   several rows at a time as long as they are in the same chunk */
+static void do_jpeg_encode_direct(JpegEncoder *jpeg, uint8_t *lines, unsigned int num_lines)
+{
+    uint8_t *lines_end;
+    int stride;
+    JSAMPROW row_pointers[JPEG_ENCODER_MAX_ROWS];
+    stride = jpeg->cur_image.stride;
+
+    lines_end = lines + (stride * num_lines);
+
+    while (jpeg->cinfo.next_scanline < jpeg->cinfo.image_height) {
+        JDIMENSION num_rows = 0;
+
+        FILL_LINES();
+        while (num_rows < JPEG_ENCODER_MAX_ROWS && lines != lines_end &&
+               jpeg->cinfo.next_scanline + num_rows < jpeg->cinfo.image_height) {
+            row_pointers[num_rows++] = lines;
+            lines += stride;
+        }
+        jpeg_write_scanlines(&jpeg->cinfo, row_pointers, num_rows);
+    }
+}
+
 static void do_jpeg_encode(JpegEncoder *jpeg, uint8_t *lines, unsigned int num_lines)
 {
     uint8_t *lines_end;
@@ -184,10 +208,13 @@ static void do_jpeg_encode(JpegEncoder *jpeg, uint8_t *lines, unsigned int num_l
     width = jpeg->cur_image.width;
     stride = jpeg->cur_image.stride;
 
-    if (jpeg->cur_image.type != JPEG_IMAGE_TYPE_RGB24) {
-        RGB24_line = (uint8_t *)spice_malloc(width*3);
+    if (!jpeg->cur_image.convert_line_to_RGB24) {
+        do_jpeg_encode_direct(jpeg, lines, num_lines);
+        return;
     }
 
+    RGB24_line = (uint8_t *)spice_malloc(width*3);
+
     lines_end = lines + (stride * num_lines);
 
     for (;jpeg->cinfo.next_scanline < jpeg->cinfo.image_height; lines += stride) {
@@ -197,9 +224,7 @@ static void do_jpeg_encode(JpegEncoder *jpeg, uint8_t *lines, unsigned int num_l
         jpeg_write_scanlines(&jpeg->cinfo, row_pointer, 1);
     }
 
-    if (jpeg->cur_image.type != JPEG_IMAGE_TYPE_RGB24) {
-        free(RGB24_line);
-    }
+    free(RGB24_line);
 }
 
 int jpeg_encode(JpegEncoderContext *jpeg, int quality, JpegEncoderImageType type,
@@ -207,6 +232,8 @@ int jpeg_encode(JpegEncoderContext *jpeg, int quality, JpegEncoderImageType type
                 uint8_t *io_ptr, unsigned int num_io_bytes)
 {
     JpegEncoder *enc = (JpegEncoder *)jpeg;
+    J_COLOR_SPACE in_color_space = JCS_RGB;
+    int input_components = 3;
 
     enc->cur_image.type = type;
     enc->cur_image.width = width;
@@ -219,22 +246,35 @@ int jpeg_encode(JpegEncoderContext *jpeg, int quality, JpegEncoderImageType type
         enc->cur_image.convert_line_to_RGB24 = convert_RGB16_to_RGB24;
         break;
     case JPEG_IMAGE_TYPE_RGB24:
-        enc->cur_image.convert_line_to_RGB24 = convert_RGB24_to_RGB24;
+        enc->cur_image.convert_line_to_RGB24 = NULL;
+        break;
+#ifdef JCS_EXTENSIONS
+    /* libjpeg-turbo reads these directly, and converts them to YCbCr at once */
+    case JPEG_IMAGE_TYPE_BGR24:
+        enc->cur_image.convert_line_to_RGB24 = NULL;
+        in_color_space = JCS_EXT_BGR;
         break;
+    case JPEG_IMAGE_TYPE_BGRX32:
+        enc->cur_image.convert_line_to_RGB24 = NULL;
+        in_color_space = JCS_EXT_BGRX;
+        input_components = 4;
+        break;
+#else
     case JPEG_IMAGE_TYPE_BGR24:
         enc->cur_image.convert_line_to_RGB24 = convert_BGR24_to_RGB24;
         break;
     case JPEG_IMAGE_TYPE_BGRX32:
         enc->cur_image.convert_line_to_RGB24 = convert_BGRX32_to_RGB24;
         break;
+#endif
     default:
         spice_error("bad image type");
     }
 
     enc->cinfo.image_width = width;
     enc->cinfo.image_height = height;
-    enc->cinfo.input_components = 3;
-    enc->cinfo.in_color_space = JCS_RGB;
+    enc->cinfo.input_components = input_components;
+    enc->cinfo.in_color_space = in_color_space;
     jpeg_set_defaults(&enc->cinfo);
     jpeg_set_quality(&enc->cinfo, quality, TRUE);
 
@@ -38,6 +38,8 @@ enum NetTestStage {
     NET_TEST_STAGE_COMPLETE,
 };
 
+#define LOW_BANDWIDTH_BIT_RATE (10 * 1024 * 1024)
+
 #define CLIENT_CONNECTIVITY_TIMEOUT (MSEC_PER_SEC * 30)
 #define PING_INTERVAL (MSEC_PER_SEC * 10)
 
@@ -479,6 +481,7 @@ void main_channel_client_handle_pong(MainChannelClient *mcc, SpiceMsgPing *ping,
 {
     uint64_t roundtrip;
     RedChannelClient* rcc = RED_CHANNEL_CLIENT(mcc);
+    NetModel *net_model;
 
     roundtrip = g_get_monotonic_time() - ping->timestamp;
 
@@ -517,6 +520,11 @@ void main_channel_client_handle_pong(MainChannelClient *mcc, SpiceMsgPing *ping,
         mcc->priv->bitrate_per_sec = (uint64_t)(NET_TEST_BYTES * 8) * 1000000
             / (roundtrip - mcc->priv->latency);
         mcc->priv->net_test_stage = NET_TEST_STAGE_COMPLETE;
+        /* the first values of the estimate the other channels keep up to date */
+        net_model = red_client_get_net_model(red_channel_client_get_client(rcc));
+        net_model_add_roundtrip_sample(net_model, mcc->priv->latency);
+        net_model_add_rate_sample(net_model, NET_TEST_BYTES, roundtrip - mcc->priv->latency,
+                                  FALSE);
         spice_printerr("net test: latency %f ms, bitrate %"PRIu64" bps (%f Mbps)%s",
                        (double)mcc->priv->latency / 1000,
                        mcc->priv->bitrate_per_sec,
@@ -686,25 +694,45 @@ MainChannelClient *main_channel_client_create(MainChannel *main_chan, RedClient
     return mcc;
 }
 
+static NetModel *main_channel_client_get_net_model(MainChannelClient *mcc)
+{
+    return red_client_get_net_model(red_channel_client_get_client(RED_CHANNEL_CLIENT(mcc)));
+}
+
 int main_channel_client_is_network_info_initialized(MainChannelClient *mcc)
 {
-    return mcc->priv->net_test_stage == NET_TEST_STAGE_COMPLETE;
+    return mcc->priv->net_test_stage == NET_TEST_STAGE_COMPLETE ||
+           net_model_get_bit_rate(main_channel_client_get_net_model(mcc)) != 0;
 }
 
 int main_channel_client_is_low_bandwidth(MainChannelClient *mcc)
 {
     // TODO: configurable?
-    return mcc->priv->bitrate_per_sec < 10 * 1024 * 1024;
+    return main_channel_client_get_bitrate_per_sec(mcc) < LOW_BANDWIDTH_BIT_RATE;
+}
+
+/* like main_channel_client_is_low_bandwidth(), but the bit rate must be clearly
+   above the limit before a low bandwidth client is not considered so anymore */
+int main_channel_client_is_still_low_bandwidth(MainChannelClient *mcc, int was_low_bandwidth)
+{
+    if (!was_low_bandwidth) {
+        return main_channel_client_is_low_bandwidth(mcc);
+    }
+    return main_channel_client_get_bitrate_per_sec(mcc) < LOW_BANDWIDTH_BIT_RATE / 4 * 5;
 }
 
 uint64_t main_channel_client_get_bitrate_per_sec(MainChannelClient *mcc)
 {
-    return mcc->priv->bitrate_per_sec;
+    uint64_t bitrate = net_model_get_bit_rate(main_channel_client_get_net_model(mcc));
+
+    return bitrate ? bitrate : mcc->priv->bitrate_per_sec;
 }
 
 uint64_t main_channel_client_get_roundtrip_ms(MainChannelClient *mcc)
 {
-    return mcc->priv->latency / 1000;
+    uint64_t roundtrip = net_model_get_roundtrip_us(main_channel_client_get_net_model(mcc));
+
+    return (roundtrip ? roundtrip : mcc->priv->latency) / 1000;
 }
 
 void main_channel_client_migrate(RedChannelClient *rcc)
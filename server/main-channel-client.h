@@ -91,11 +91,13 @@ gboolean main_channel_client_migrate_src_complete(MainChannelClient *mcc,
 void main_channel_client_handle_pong(MainChannelClient *mcc, SpiceMsgPing *ping, uint32_t size);
 
 /*
- * return TRUE if network test had been completed successfully.
+ * return TRUE if network test had been completed successfully, or the network
+ * model of the client has an estimate of the bit rate.
  * If FALSE, bitrate_per_sec is set to MAX_UINT64 and the roundtrip is set to 0
  */
 int main_channel_client_is_network_info_initialized(MainChannelClient *mcc);
 int main_channel_client_is_low_bandwidth(MainChannelClient *mcc);
+int main_channel_client_is_still_low_bandwidth(MainChannelClient *mcc, int was_low_bandwidth);
 uint64_t main_channel_client_get_bitrate_per_sec(MainChannelClient *mcc);
 uint64_t main_channel_client_get_roundtrip_ms(MainChannelClient *mcc);
 
@@ -0,0 +1,115 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "red-common.h"
+#include "utils.h"
+#include "net-model.h"
+
+struct NetModel {
+    pthread_mutex_t lock;
+
+    uint64_t bit_rate;
+    uint64_t roundtrip_us;
+    uint64_t roundtrip_time;
+};
+
+NetModel *net_model_new(void)
+{
+    NetModel *model = spice_new0(NetModel, 1);
+
+    pthread_mutex_init(&model->lock, NULL);
+    return model;
+}
+
+void net_model_free(NetModel *model)
+{
+    if (!model) {
+        return;
+    }
+    pthread_mutex_destroy(&model->lock);
+    free(model);
+}
+
+void net_model_add_rate_sample(NetModel *model, uint64_t bytes, uint64_t time_us,
+                               int app_limited)
+{
+    uint64_t bit_rate;
+
+    if (!model || time_us == 0 || bytes > UINT64_MAX / 8 / 1000000) {
+        return;
+    }
+    bit_rate = bytes * 8 * 1000000 / time_us;
+
+    pthread_mutex_lock(&model->lock);
+    if (!app_limited) {
+        model->bit_rate = model->bit_rate ? (model->bit_rate * 3 + bit_rate) / 4 : bit_rate;
+    } else if (model->bit_rate && bit_rate > model->bit_rate) {
+        model->bit_rate = bit_rate;
+    }
+    pthread_mutex_unlock(&model->lock);
+}
+
+void net_model_add_roundtrip_sample(NetModel *model, uint64_t roundtrip_us)
+{
+    net_model_add_roundtrip_sample_at(model, roundtrip_us, spice_get_monotonic_time_ns());
+}
+
+void net_model_add_roundtrip_sample_at(NetModel *model, uint64_t roundtrip_us, uint64_t now)
+{
+    if (!model || roundtrip_us == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&model->lock);
+    if (model->roundtrip_us == 0 || roundtrip_us <= model->roundtrip_us ||
+        now - model->roundtrip_time > NET_MODEL_ROUNDTRIP_WINDOW_NS) {
+        model->roundtrip_us = roundtrip_us;
+        model->roundtrip_time = now;
+    }
+    pthread_mutex_unlock(&model->lock);
+}
+
+uint64_t net_model_get_bit_rate(NetModel *model)
+{
+    uint64_t bit_rate;
+
+    if (!model) {
+        return 0;
+    }
+    pthread_mutex_lock(&model->lock);
+    bit_rate = model->bit_rate;
+    pthread_mutex_unlock(&model->lock);
+    return bit_rate;
+}
+
+uint64_t net_model_get_roundtrip_us(NetModel *model)
+{
+    uint64_t roundtrip_us;
+
+    if (!model) {
+        return 0;
+    }
+    pthread_mutex_lock(&model->lock);
+    roundtrip_us = model->roundtrip_us;
+    pthread_mutex_unlock(&model->lock);
+    return roundtrip_us;
+}
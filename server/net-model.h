@@ -0,0 +1,58 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef NET_MODEL_H_
+#define NET_MODEL_H_
+
+#include <stdint.h>
+
+#include "utils.h"
+
+/* An estimate of the network between the server and a client, kept up to
+ * date while the client is connected.
+ *
+ * All the channels of the client feed it from their own thread: the
+ * channel clients add a rate sample for the data the client acknowledged
+ * between two ACK messages, and roundtrip samples from their pongs and from
+ * the TCP stack. The main channel net test gives the first values.
+ *
+ * The bit rate is a moving average of the samples which were limited by
+ * the network, i.e. the socket was full at some point. The other samples
+ * only tell that the link is at least that fast and can only raise it.
+ * The roundtrip is the minimum of the recent samples, which leaves out
+ * the time spent in the queues of the loaded links.
+ */
+
+/* how long a minimal roundtrip is kept, a newer path may be slower */
+#define NET_MODEL_ROUNDTRIP_WINDOW_NS (NSEC_PER_SEC * 10)
+
+typedef struct NetModel NetModel;
+
+NetModel *net_model_new(void);
+void net_model_free(NetModel *model);
+
+/* bytes were received by the client in time_us microseconds. app_limited is
+ * TRUE when the sender didn't have enough data to fill the link meanwhile */
+void net_model_add_rate_sample(NetModel *model, uint64_t bytes, uint64_t time_us,
+                               int app_limited);
+void net_model_add_roundtrip_sample(NetModel *model, uint64_t roundtrip_us);
+/* same with the monotonic time of the sample in nanoseconds */
+void net_model_add_roundtrip_sample_at(NetModel *model, uint64_t roundtrip_us, uint64_t now);
+
+/* return 0 until the first sample */
+uint64_t net_model_get_bit_rate(NetModel *model);
+uint64_t net_model_get_roundtrip_us(NetModel *model);
+
+#endif /* NET_MODEL_H_ */
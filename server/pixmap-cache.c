@@ -20,43 +20,302 @@
 
 #include "pixmap-cache.h"
 
-int pixmap_cache_unlocked_set_lossy(PixmapCache *cache, uint64_t id, int lossy)
+/* table sizes are powers of 2, kept at most 3/4 full */
+#define PIXMAP_CACHE_MIN_TABLE_SIZE BITS_CACHE_HASH_SIZE
+#define PIXMAP_CACHE_SLAB_ITEMS 256
+
+static inline uint32_t pixmap_cache_hash_id(uint64_t id)
+{
+    /* ids are often sequential in the low bits, spread them over the table */
+    return (id * G_GUINT64_CONSTANT(0x9e3779b97f4a7c15)) >> 32;
+}
+
+static void pixmap_cache_init_table(PixmapCache *cache, uint32_t size)
+{
+    cache->table = spice_new0(PixmapCacheSlot, size);
+    cache->table_mask = size - 1;
+}
+
+static void pixmap_cache_table_add(PixmapCache *cache, uint64_t id, NewCacheItem *item)
+{
+    uint32_t i = pixmap_cache_hash_id(id) & cache->table_mask;
+
+    while (cache->table[i].item) {
+        i = (i + 1) & cache->table_mask;
+    }
+    cache->table[i].id = id;
+    cache->table[i].item = item;
+}
+
+static void pixmap_cache_grow_table(PixmapCache *cache)
+{
+    PixmapCacheSlot *old_table = cache->table;
+    uint32_t old_size = cache->table_mask + 1;
+    uint32_t i;
+
+    pixmap_cache_init_table(cache, old_size * 2);
+    for (i = 0; i < old_size; i++) {
+        if (old_table[i].item) {
+            pixmap_cache_table_add(cache, old_table[i].id, old_table[i].item);
+        }
+    }
+    free(old_table);
+}
+
+/* removes the slot and moves back the following entries of the cluster
+ * which would not be reachable anymore, so that no tombstones are needed */
+static void pixmap_cache_table_remove(PixmapCache *cache, uint32_t i)
+{
+    uint32_t mask = cache->table_mask;
+    uint32_t j = i;
+
+    for (;;) {
+        uint32_t k;
+
+        cache->table[i].item = NULL;
+        do {
+            j = (j + 1) & mask;
+            if (!cache->table[j].item) {
+                return;
+            }
+            k = pixmap_cache_hash_id(cache->table[j].id) & mask;
+        } while (i <= j ? (i < k && k <= j) : (i < k || k <= j));
+        cache->table[i] = cache->table[j];
+        i = j;
+    }
+}
+
+static int pixmap_cache_find_slot(PixmapCache *cache, uint64_t id, uint32_t *slot)
+{
+    uint32_t i;
+
+    if (cache->frozen) {
+        return FALSE;
+    }
+    for (i = pixmap_cache_hash_id(id) & cache->table_mask; cache->table[i].item;
+         i = (i + 1) & cache->table_mask) {
+        if (cache->table[i].id == id) {
+            *slot = i;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+NewCacheItem *pixmap_cache_unlocked_lookup(PixmapCache *cache, uint64_t id)
 {
     NewCacheItem *item;
+    uint32_t slot;
+
+    if (!pixmap_cache_find_slot(cache, id, &slot)) {
+        return NULL;
+    }
+    item = cache->table[slot].item;
+    item->referenced = TRUE;
+    return item;
+}
 
-    item = cache->hash_table[BITS_CACHE_HASH_KEY(id)];
+static void pixmap_cache_add_slab(PixmapCache *cache)
+{
+    NewCacheItem *slab = spice_new0(NewCacheItem, PIXMAP_CACHE_SLAB_ITEMS);
+    int i;
 
-    while (item) {
-        if (item->id == id) {
-            item->lossy = lossy;
+    cache->slabs = spice_realloc_n(cache->slabs, cache->n_slabs + 1, sizeof(*cache->slabs));
+    cache->slabs[cache->n_slabs++] = slab;
+    for (i = PIXMAP_CACHE_SLAB_ITEMS - 1; i >= 0; i--) {
+        slab[i].next = cache->free_items;
+        cache->free_items = &slab[i];
+    }
+}
+
+NewCacheItem *pixmap_cache_unlocked_insert(PixmapCache *cache, uint64_t id)
+{
+    NewCacheItem *item;
+
+    spice_return_val_if_fail(!cache->frozen, NULL);
+
+    if ((uint64_t)(cache->items + 1) * 4 > (uint64_t)(cache->table_mask + 1) * 3) {
+        pixmap_cache_grow_table(cache);
+    }
+    if (!cache->free_items) {
+        pixmap_cache_add_slab(cache);
+    }
+    item = cache->free_items;
+    cache->free_items = item->next;
+
+    memset(item, 0, sizeof(*item));
+    item->id = id;
+    item->in_use = TRUE;
+    /* like the head of a LRU list, new items survive one turn of the hand */
+    item->referenced = TRUE;
+    pixmap_cache_table_add(cache, id, item);
+    cache->items++;
+
+    return item;
+}
+
+void pixmap_cache_unlocked_remove(PixmapCache *cache, NewCacheItem *item)
+{
+    uint32_t i = pixmap_cache_hash_id(item->id) & cache->table_mask;
+
+    spice_return_if_fail(item->in_use);
+
+    while (cache->table[i].item != item) {
+        spice_assert(cache->table[i].item);
+        i = (i + 1) & cache->table_mask;
+    }
+    pixmap_cache_table_remove(cache, i);
+    pixmap_cache_unlocked_content_remove(cache, item);
+
+    item->in_use = FALSE;
+    item->next = cache->free_items;
+    cache->free_items = item;
+    cache->items--;
+}
+
+NewCacheItem *pixmap_cache_unlocked_get_victim(PixmapCache *cache, uint8_t client,
+                                               uint64_t serial)
+{
+    uint32_t n_slots = cache->n_slabs * PIXMAP_CACHE_SLAB_ITEMS;
+    uint32_t i;
+
+    if (cache->frozen) {
+        return NULL;
+    }
+
+    /* the first turn may only clear the reference bits, so a call can walk
+     * all the slots twice. The bits are only set by insertions and hits, the
+     * walks of a series of calls are thus bounded by the number of slots plus
+     * the number of insertions and hits since the first call. */
+    for (i = 0; i < 2 * n_slots; i++) {
+        NewCacheItem *item = &cache->slabs[cache->clock_hand / PIXMAP_CACHE_SLAB_ITEMS]
+                                          [cache->clock_hand % PIXMAP_CACHE_SLAB_ITEMS];
+
+        cache->clock_hand = (cache->clock_hand + 1) % n_slots;
+        if (!item->in_use || item->sync[client] == serial) {
+            continue;
+        }
+        if (item->referenced) {
+            item->referenced = FALSE;
+            continue;
+        }
+        return item;
+    }
+    return NULL;
+}
+
+int pixmap_cache_unlocked_reserve(PixmapCache *cache, uint8_t client, uint64_t serial,
+                                   uint32_t size, PixmapCacheReleaseFunc release,
+                                   void *opaque)
+{
+    cache->available -= size;
+    while (cache->available < 0) {
+        NewCacheItem *victim;
+
+        if (!(victim = pixmap_cache_unlocked_get_victim(cache, client, serial))) {
+            cache->available += size;
+            return FALSE;
+        }
+
+        cache->available += victim->size;
+        release(victim, opaque);
+        pixmap_cache_unlocked_remove(cache, victim);
+    }
+    return TRUE;
+}
+
+int pixmap_cache_unlocked_set_lossy(PixmapCache *cache, uint64_t id, int lossy)
+{
+    uint32_t slot;
+
+    if (!pixmap_cache_find_slot(cache, id, &slot)) {
+        return FALSE;
+    }
+    cache->table[slot].item->lossy = lossy;
+    return TRUE;
+}
+
+#define CONTENT_HASH_KEY(hash) BITS_CACHE_HASH_KEY((hash)->h[0])
+
+void pixmap_cache_unlocked_content_add(PixmapCache *cache, NewCacheItem *item,
+                                       const BitmapContentHash *hash)
+{
+    int key = CONTENT_HASH_KEY(hash);
+
+    item->content_hash = *hash;
+    item->has_content_hash = TRUE;
+    item->content_next = cache->content_table[key];
+    cache->content_table[key] = item;
+}
+
+void pixmap_cache_unlocked_content_remove(PixmapCache *cache, NewCacheItem *item)
+{
+    NewCacheItem **now;
+
+    if (!item->has_content_hash) {
+        return;
+    }
+
+    now = &cache->content_table[CONTENT_HASH_KEY(&item->content_hash)];
+    while (*now) {
+        if (*now == item) {
+            *now = item->content_next;
             break;
         }
-        item = item->next;
+        now = &(*now)->content_next;
     }
-    return !!item;
+    item->has_content_hash = FALSE;
 }
 
-void pixmap_cache_clear(PixmapCache *cache)
+NewCacheItem *pixmap_cache_unlocked_content_find(PixmapCache *cache,
+                                                 const BitmapContentHash *hash)
 {
     NewCacheItem *item;
 
     if (cache->frozen) {
-        cache->lru.next = cache->frozen_head;
-        cache->lru.prev = cache->frozen_tail;
-        cache->frozen = FALSE;
+        return NULL;
     }
 
-    SPICE_VERIFY(SPICE_OFFSETOF(NewCacheItem, lru_link) == 0);
-    while ((item = (NewCacheItem *)ring_get_head(&cache->lru))) {
-        ring_remove(&item->lru_link);
-        free(item);
+    item = cache->content_table[CONTENT_HASH_KEY(hash)];
+    while (item) {
+        /* a lossy copy must not hide a lossless one */
+        if (!item->lossy && bitmap_content_hash_equal(&item->content_hash, hash)) {
+            break;
+        }
+        item = item->content_next;
     }
-    memset(cache->hash_table, 0, sizeof(*cache->hash_table) * BITS_CACHE_HASH_SIZE);
+    return item;
+}
 
-    cache->available = cache->size;
+static void pixmap_cache_free_items(PixmapCache *cache)
+{
+    uint32_t i;
+
+    for (i = 0; i < cache->n_slabs; i++) {
+        free(cache->slabs[i]);
+    }
+    free(cache->slabs);
+    cache->slabs = NULL;
+    cache->n_slabs = 0;
+    cache->free_items = NULL;
+    cache->clock_hand = 0;
+    free(cache->table);
+    cache->table = NULL;
+    memset(cache->content_table, 0, sizeof(*cache->content_table) * BITS_CACHE_HASH_SIZE);
     cache->items = 0;
 }
 
+void pixmap_cache_clear(PixmapCache *cache)
+{
+    pixmap_cache_free_items(cache);
+    pixmap_cache_init_table(cache, PIXMAP_CACHE_MIN_TABLE_SIZE);
+    cache->frozen = FALSE;
+
+    cache->available = cache->size;
+}
+
+/* the items are kept until the cache is cleared but are not visible
+ * anymore, and no item can be added */
 int pixmap_cache_freeze(PixmapCache *cache)
 {
     pthread_mutex_lock(&cache->lock);
@@ -66,10 +325,6 @@ int pixmap_cache_freeze(PixmapCache *cache)
         return FALSE;
     }
 
-    cache->frozen_head = cache->lru.next;
-    cache->frozen_tail = cache->lru.prev;
-    ring_init(&cache->lru);
-    memset(cache->hash_table, 0, sizeof(*cache->hash_table) * BITS_CACHE_HASH_SIZE);
     cache->available = -1;
     cache->frozen = TRUE;
 
@@ -82,7 +337,7 @@ static void pixmap_cache_destroy(PixmapCache *cache)
     spice_assert(cache);
 
     pthread_mutex_lock(&cache->lock);
-    pixmap_cache_clear(cache);
+    pixmap_cache_free_items(cache);
     pthread_mutex_unlock(&cache->lock);
 }
 
@@ -98,10 +353,11 @@ static PixmapCache *pixmap_cache_new(RedClient *client, uint8_t id, int64_t size
     pthread_mutex_init(&cache->lock, NULL);
     cache->id = id;
     cache->refs = 1;
-    ring_init(&cache->lru);
+    pixmap_cache_init_table(cache, PIXMAP_CACHE_MIN_TABLE_SIZE);
     cache->available = size;
     cache->size = size;
     cache->client = client;
+    cache->content_dedup = getenv("SPICE_PIXMAP_CACHE_DEDUP") != NULL;
 
     return cache;
 }
@@ -19,6 +19,7 @@
 # define _PIXMAP_CACHE_H
 
 #include "red-channel.h"
+#include "spice-bitmap-utils.h"
 
 #define MAX_CACHE_CLIENTS 4
 
@@ -29,14 +30,26 @@
 
 typedef struct PixmapCache PixmapCache;
 typedef struct NewCacheItem NewCacheItem;
+typedef struct PixmapCacheSlot PixmapCacheSlot;
 
 struct NewCacheItem {
-    RingItem lru_link;
-    NewCacheItem *next;
     uint64_t id;
     uint64_t sync[MAX_CACHE_CLIENTS];
     size_t size;
     int lossy;
+    uint8_t in_use;
+    uint8_t referenced; // CLOCK reference bit, set on each hit
+    NewCacheItem *next; // free list link when not in use
+    NewCacheItem *content_next;
+    int has_content_hash;
+    BitmapContentHash content_hash;
+};
+
+/* open addressing table entry, the id is copied so that probing does not
+ * need to touch the items */
+struct PixmapCacheSlot {
+    uint64_t id;
+    NewCacheItem *item;
 };
 
 struct PixmapCache {
@@ -44,15 +57,24 @@ struct PixmapCache {
     pthread_mutex_t lock;
     uint8_t id;
     uint32_t refs;
-    NewCacheItem *hash_table[BITS_CACHE_HASH_SIZE];
-    Ring lru;
+    /* ids are looked up in a linear probing table which grows with the
+     * number of items, the items are allocated from slabs which are also
+     * walked by the CLOCK hand when looking for an item to evict */
+    PixmapCacheSlot *table;
+    uint32_t table_mask;
+    NewCacheItem **slabs;
+    uint32_t n_slabs;
+    NewCacheItem *free_items;
+    uint32_t clock_hand;
+    /* items indexed by the hash of their content, only used if content_dedup
+     * is set, see dcc_pixmap_cache_unlocked_content_hit() */
+    NewCacheItem *content_table[BITS_CACHE_HASH_SIZE];
+    int content_dedup;
     int64_t available;
     int64_t size;
     int32_t items;
 
     int frozen;
-    RingItem *frozen_head;
-    RingItem *frozen_tail;
 
     uint32_t generation;
     struct {
@@ -69,5 +91,30 @@ void         pixmap_cache_unref(PixmapCache *cache);
 void         pixmap_cache_clear(PixmapCache *cache);
 int          pixmap_cache_unlocked_set_lossy(PixmapCache *cache, uint64_t id, int lossy);
 int          pixmap_cache_freeze(PixmapCache *cache);
+/* Finds the item with the given id and marks it as recently used */
+NewCacheItem *pixmap_cache_unlocked_lookup(PixmapCache *cache, uint64_t id);
+/* Adds a new item, the caller must fill its fields and make room for it */
+NewCacheItem *pixmap_cache_unlocked_insert(PixmapCache *cache, uint64_t id);
+void         pixmap_cache_unlocked_remove(PixmapCache *cache, NewCacheItem *item);
+/* Returns the next item to evict according to the CLOCK policy, skipping
+ * the ones used by the message being sent by the client, NULL if there are
+ * none. A call walks the slots twice at worst, see the implementation for
+ * the amortized cost. */
+NewCacheItem *pixmap_cache_unlocked_get_victim(PixmapCache *cache, uint8_t client,
+                                               uint64_t serial);
+typedef void (*PixmapCacheReleaseFunc)(NewCacheItem *item, void *opaque);
+/* Takes size from the available space, evicting items until it fits.
+ * release is called with each evicted item before it is removed. Returns
+ * FALSE if there are not enough items which can be evicted, the space is
+ * given back then but the items evicted so far are gone. */
+int          pixmap_cache_unlocked_reserve(PixmapCache *cache, uint8_t client, uint64_t serial,
+                                           uint32_t size, PixmapCacheReleaseFunc release,
+                                           void *opaque);
+void         pixmap_cache_unlocked_content_add(PixmapCache *cache, NewCacheItem *item,
+                                               const BitmapContentHash *hash);
+void         pixmap_cache_unlocked_content_remove(PixmapCache *cache, NewCacheItem *item);
+/* Returns a lossless item with the given content, NULL if there is none */
+NewCacheItem *pixmap_cache_unlocked_content_find(PixmapCache *cache,
+                                                 const BitmapContentHash *hash);
 
 #endif /* _PIXMAP_CACHE_H */
@@ -40,6 +40,24 @@ typedef struct RedChannelClientConnectivityMonitor {
     SpiceTimer *timer;
 } RedChannelClientConnectivityMonitor;
 
+#define NET_SAMPLER_MAX_MSGS 128 /* more than twice the widest ack window */
+
+/* measures the rate at which the client receives the messages, from the
+   ACK messages it sends every ack_data.client_window messages */
+typedef struct RedChannelClientNetSampler {
+    uint64_t out_bytes;
+    /* out_bytes once each of the last messages was written */
+    uint64_t msg_end_bytes[NET_SAMPLER_MAX_MSGS];
+    uint32_t msgs_done;
+    uint32_t msgs_acked;
+
+    /* start of the current sample, none when ack_time is 0 */
+    uint64_t ack_time;
+    uint64_t ack_bytes;
+    int blocked; // the socket was full during the sample
+    int idle;    // there was nothing to send during the sample
+} RedChannelClientNetSampler;
+
 typedef struct OutgoingHandler {
     OutgoingHandlerInterface *cb;
     void *opaque;
@@ -85,6 +103,11 @@ struct RedChannelClientPrivate
     int during_send;
     GQueue pipe;
 
+    /* see red_channel_client_prepare_push_in_thread() */
+    GList *push_in_thread_items;
+    gboolean push_in_thread;
+    gboolean disconnect_pending;
+
     RedChannelCapabilities remote_caps;
     int is_mini_header;
     gboolean destroying;
@@ -94,6 +117,7 @@ struct RedChannelClientPrivate
 
     RedChannelClientLatencyMonitor latency_monitor;
     RedChannelClientConnectivityMonitor connectivity_monitor;
+    RedChannelClientNetSampler net_sampler;
 
     OutgoingHandler outgoing;
 };
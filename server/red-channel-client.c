@@ -67,6 +67,8 @@ enum {
 
 #define PING_TEST_TIMEOUT_MS (MSEC_PER_SEC * 15)
 #define PING_TEST_IDLE_NET_TIMEOUT_MS (MSEC_PER_SEC / 10)
+/* shorter rate samples are dominated by the timing noise */
+#define NET_SAMPLE_MIN_TIME_NS (NSEC_PER_MILLISEC * 100)
 
 enum QosPingState {
     PING_STATE_NONE,
@@ -380,6 +382,7 @@ void red_channel_client_on_output(void *opaque, int n)
     if (rcc->priv->connectivity_monitor.timer) {
         rcc->priv->connectivity_monitor.out_bytes += n;
     }
+    rcc->priv->net_sampler.out_bytes += n;
 }
 
 void red_channel_client_on_input(void *opaque, int n)
@@ -413,6 +416,7 @@ void red_channel_client_on_out_block(void *opaque)
     RedChannelClient *rcc = RED_CHANNEL_CLIENT(opaque);
 
     rcc->priv->send_data.blocked = TRUE;
+    rcc->priv->net_sampler.blocked = TRUE;
     core = red_channel_get_core_interface(rcc->priv->channel);
     core->watch_update_mask(core, rcc->priv->stream->watch,
                             SPICE_WATCH_EVENT_READ |
@@ -439,6 +443,66 @@ static void red_channel_client_reset_send_data(RedChannelClient *rcc)
     }
 }
 
+/* the client counts the messages from here, acked is the number of messages
+   it won't acknowledge */
+static void red_channel_client_net_sampler_reset(RedChannelClient *rcc, uint32_t acked)
+{
+    RedChannelClientNetSampler *sampler = &rcc->priv->net_sampler;
+
+    sampler->msgs_acked = acked;
+    sampler->ack_time = 0;
+}
+
+/* Adds a rate sample to the network model of the client for the messages
+ * acknowledged since the start of the sample, once it is long enough. The
+ * roundtrip of the TCP stack is sampled meanwhile. */
+static void red_channel_client_net_sampler_ack(RedChannelClient *rcc)
+{
+    RedChannelClientNetSampler *sampler = &rcc->priv->net_sampler;
+    NetModel *model = red_client_get_net_model(rcc->priv->client);
+    uint32_t pending;
+    uint64_t now, bytes;
+
+    if (!model) {
+        return;
+    }
+
+    sampler->msgs_acked += rcc->priv->ack_data.client_window;
+    pending = sampler->msgs_done - sampler->msgs_acked;
+    if ((int32_t)pending < 0 || pending >= NET_SAMPLER_MAX_MSGS) {
+        /* lost track of the messages the client counts */
+        red_channel_client_net_sampler_reset(rcc, sampler->msgs_done);
+        return;
+    }
+    bytes = sampler->msg_end_bytes[(sampler->msgs_acked - 1) % NET_SAMPLER_MAX_MSGS];
+
+    now = spice_get_monotonic_time_ns();
+    if (sampler->ack_time) {
+        if (now - sampler->ack_time < NET_SAMPLE_MIN_TIME_NS) {
+            return;
+        }
+        net_model_add_rate_sample(model, bytes - sampler->ack_bytes,
+                                  (now - sampler->ack_time) / NSEC_PER_MICROSEC,
+                                  !sampler->blocked || sampler->idle);
+    }
+    sampler->ack_time = now;
+    sampler->ack_bytes = bytes;
+    sampler->blocked = rcc->priv->send_data.blocked;
+    sampler->idle = FALSE;
+
+#ifdef TCP_INFO
+    if (rcc->priv->stream) {
+        struct tcp_info info;
+        socklen_t len = sizeof(info);
+
+        /* fails for the unix sockets */
+        if (getsockopt(rcc->priv->stream->socket, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) {
+            net_model_add_roundtrip_sample(model, info.tcpi_rtt);
+        }
+    }
+#endif
+}
+
 static void red_channel_client_send_set_ack(RedChannelClient *rcc)
 {
     SpiceMsgSetAck ack;
@@ -448,6 +512,8 @@ static void red_channel_client_send_set_ack(RedChannelClient *rcc)
     ack.generation = ++rcc->priv->ack_data.generation;
     ack.window = rcc->priv->ack_data.client_window;
     rcc->priv->ack_data.messages_window = 0;
+    /* the client starts counting after this message */
+    red_channel_client_net_sampler_reset(rcc, rcc->priv->net_sampler.msgs_done + 1);
 
     spice_marshall_msg_set_ack(rcc->priv->send_data.marshaller, &ack);
 
@@ -541,6 +607,24 @@ static void red_channel_client_send_item(RedChannelClient *rcc, RedPipeItem *ite
     red_pipe_item_unref(item);
 }
 
+/* The data of the message may still be read by the kernel after a zero copy
+ * send, the buffers referenced by the marshaller are released by the stream
+ * once it is done and a new marshaller is used meanwhile */
+static void red_channel_client_detach_sent_marshaller(RedChannelClient *rcc)
+{
+    SpiceMarshaller *m = rcc->priv->send_data.marshaller;
+
+    if (red_channel_client_urgent_marshaller_is_active(rcc)) {
+        rcc->priv->send_data.urgent.marshaller = spice_marshaller_new();
+        rcc->priv->send_data.marshaller = rcc->priv->send_data.urgent.marshaller;
+    } else {
+        rcc->priv->send_data.main.marshaller = spice_marshaller_new();
+        rcc->priv->send_data.marshaller = rcc->priv->send_data.main.marshaller;
+    }
+    reds_stream_release_after_send(rcc->priv->stream,
+                                   (GDestroyNotify) spice_marshaller_destroy, m);
+}
+
 static void red_channel_client_restore_main_sender(RedChannelClient *rcc)
 {
     rcc->priv->send_data.marshaller = rcc->priv->send_data.main.marshaller;
@@ -550,8 +634,11 @@ static void red_channel_client_restore_main_sender(RedChannelClient *rcc)
 void red_channel_client_on_out_msg_done(void *opaque)
 {
     RedChannelClient *rcc = RED_CHANNEL_CLIENT(opaque);
+    RedChannelClientNetSampler *sampler = &rcc->priv->net_sampler;
     int fd;
 
+    sampler->msg_end_bytes[sampler->msgs_done++ % NET_SAMPLER_MAX_MSGS] = sampler->out_bytes;
+
     if (spice_marshaller_get_fd(rcc->priv->send_data.marshaller, &fd)) {
         if (reds_stream_send_msgfd(rcc->priv->stream, fd) < 0) {
             perror("sendfd");
@@ -564,6 +651,9 @@ void red_channel_client_on_out_msg_done(void *opaque)
             close(fd);
     }
 
+    if (reds_stream_zerocopy_pending(rcc->priv->stream)) {
+        red_channel_client_detach_sent_marshaller(rcc);
+    }
     red_channel_client_clear_sent_item(rcc);
     if (rcc->priv->send_data.blocked) {
         SpiceCoreInterfaceInternal *core = red_channel_get_core_interface(rcc->priv->channel);
@@ -577,6 +667,9 @@ void red_channel_client_on_out_msg_done(void *opaque)
         spice_assert(rcc->priv->send_data.header.data != NULL);
         red_channel_client_begin_send_message(rcc);
     } else {
+        if (!rcc->priv->send_data.blocked && g_queue_is_empty(&rcc->priv->pipe)) {
+            sampler->idle = TRUE;
+        }
         if (rcc->priv->latency_monitor.timer
             && !rcc->priv->send_data.blocked
             && g_queue_is_empty(&rcc->priv->pipe)) {
@@ -1182,16 +1275,46 @@ void red_channel_client_receive(RedChannelClient *rcc)
     g_object_unref(rcc);
 }
 
+/* The stream may keep small messages to send them together with the
+ * following ones, this is called once there is nothing more to send for
+ * now. If the socket is full the channel client stays blocked until it
+ * is done. */
+static void red_channel_client_flush_stream(RedChannelClient *rcc)
+{
+    if (!rcc->priv->stream) {
+        return;
+    }
+    if (reds_stream_flush(rcc->priv->stream) == 0) {
+        if (rcc->priv->send_data.blocked && red_channel_client_no_item_being_sent(rcc)) {
+            SpiceCoreInterfaceInternal *core = red_channel_get_core_interface(rcc->priv->channel);
+
+            rcc->priv->send_data.blocked = FALSE;
+            core->watch_update_mask(core, rcc->priv->stream->watch,
+                                    SPICE_WATCH_EVENT_READ);
+        }
+        return;
+    }
+    if (errno == EAGAIN || errno == EINTR) {
+        red_channel_client_on_out_block(rcc);
+    } else {
+        rcc->priv->outgoing.cb->on_error(rcc);
+    }
+}
+
 void red_channel_client_send(RedChannelClient *rcc)
 {
     g_object_ref(rcc);
     red_peer_handle_outgoing(rcc->priv->stream, &rcc->priv->outgoing);
+    /* red_channel_client_push() flushes once the pipe was processed */
+    if (!rcc->priv->during_send) {
+        red_channel_client_flush_stream(rcc);
+    }
     g_object_unref(rcc);
 }
 
 static inline RedPipeItem *red_channel_client_pipe_item_get(RedChannelClient *rcc)
 {
-    if (!rcc || rcc->priv->send_data.blocked
+    if (!rcc || rcc->priv->send_data.blocked || rcc->priv->disconnect_pending
              || red_channel_client_waiting_for_ack(rcc)) {
         return NULL;
     }
@@ -1210,6 +1333,9 @@ void red_channel_client_push(RedChannelClient *rcc)
     g_object_ref(rcc);
     if (rcc->priv->send_data.blocked) {
         red_channel_client_send(rcc);
+        if (red_channel_client_no_item_being_sent(rcc)) {
+            red_channel_client_flush_stream(rcc);
+        }
     }
 
     if (!red_channel_client_no_item_being_sent(rcc) && !rcc->priv->send_data.blocked) {
@@ -1220,8 +1346,11 @@ void red_channel_client_push(RedChannelClient *rcc)
     while ((pipe_item = red_channel_client_pipe_item_get(rcc))) {
         red_channel_client_send_item(rcc, pipe_item);
     }
+    if (!rcc->priv->send_data.blocked) {
+        red_channel_client_flush_stream(rcc);
+    }
     if (red_channel_client_no_item_being_sent(rcc) && g_queue_is_empty(&rcc->priv->pipe)
-        && rcc->priv->stream->watch) {
+        && !rcc->priv->send_data.blocked && rcc->priv->stream->watch) {
         SpiceCoreInterfaceInternal *core;
         core = red_channel_get_core_interface(rcc->priv->channel);
         core->watch_update_mask(core, rcc->priv->stream->watch,
@@ -1231,6 +1360,37 @@ void red_channel_client_push(RedChannelClient *rcc)
     g_object_unref(rcc);
 }
 
+gboolean red_channel_client_prepare_push_in_thread(RedChannelClient *rcc)
+{
+    GList *l;
+
+    if (!red_channel_client_is_connected(rcc) || rcc->priv->during_send ||
+        rcc->priv->send_data.blocked || red_channel_client_waiting_for_ack(rcc) ||
+        g_queue_is_empty(&rcc->priv->pipe)) {
+        return FALSE;
+    }
+
+    g_object_ref(rcc);
+    for (l = rcc->priv->pipe.head; l != NULL; l = l->next) {
+        rcc->priv->push_in_thread_items =
+            g_list_prepend(rcc->priv->push_in_thread_items, red_pipe_item_ref(l->data));
+    }
+    rcc->priv->push_in_thread = TRUE;
+    return TRUE;
+}
+
+void red_channel_client_finish_push_in_thread(RedChannelClient *rcc)
+{
+    rcc->priv->push_in_thread = FALSE;
+    g_list_free_full(rcc->priv->push_in_thread_items, (GDestroyNotify)red_pipe_item_unref);
+    rcc->priv->push_in_thread_items = NULL;
+    if (rcc->priv->disconnect_pending) {
+        rcc->priv->disconnect_pending = FALSE;
+        red_channel_client_disconnect(rcc);
+    }
+    g_object_unref(rcc);
+}
+
 int red_channel_client_get_roundtrip_ms(RedChannelClient *rcc)
 {
     if (rcc->priv->latency_monitor.roundtrip < 0) {
@@ -1242,6 +1402,7 @@ int red_channel_client_get_roundtrip_ms(RedChannelClient *rcc)
 void red_channel_client_init_outgoing_messages_window(RedChannelClient *rcc)
 {
     rcc->priv->ack_data.messages_window = 0;
+    red_channel_client_net_sampler_reset(rcc, rcc->priv->net_sampler.msgs_done);
     red_channel_client_push(rcc);
 }
 
@@ -1279,6 +1440,9 @@ static void red_channel_client_handle_pong(RedChannelClient *rcc, SpiceMsgPing *
         }
     }
 
+    net_model_add_roundtrip_sample(red_client_get_net_model(rcc->priv->client),
+                                   (now - ping->timestamp) / NSEC_PER_MICROSEC);
+
     /*
      * The real network latency shouldn't change during the connection. However,
      *  the measurements can be bigger than the real roundtrip due to other
@@ -1356,6 +1520,7 @@ int red_channel_client_handle_message(RedChannelClient *rcc, uint32_t size,
     case SPICE_MSGC_ACK:
         if (rcc->priv->ack_data.client_generation == rcc->priv->ack_data.generation) {
             rcc->priv->ack_data.messages_window -= rcc->priv->ack_data.client_window;
+            red_channel_client_net_sampler_ack(rcc);
             red_channel_client_push(rcc);
         }
         break;
@@ -1595,6 +1760,7 @@ static void red_channel_client_pipe_clear(RedChannelClient *rcc)
 void red_channel_client_ack_zero_messages_window(RedChannelClient *rcc)
 {
     rcc->priv->ack_data.messages_window = 0;
+    red_channel_client_net_sampler_reset(rcc, rcc->priv->net_sampler.msgs_done);
 }
 
 void red_channel_client_ack_set_client_window(RedChannelClient *rcc, int client_window)
@@ -1640,6 +1806,10 @@ void red_channel_client_disconnect(RedChannelClient *rcc)
 {
     RedChannelClientClass *klass = RED_CHANNEL_CLIENT_GET_CLASS(rcc);
 
+    if (rcc->priv->push_in_thread) {
+        rcc->priv->disconnect_pending = TRUE;
+        return;
+    }
     g_return_if_fail(klass->is_connected != NULL);
     klass->disconnect(rcc);
 }
@@ -1649,6 +1819,11 @@ int red_channel_client_is_blocked(RedChannelClient *rcc)
     return rcc && rcc->priv->send_data.blocked;
 }
 
+gboolean red_channel_client_is_waiting_for_ack(RedChannelClient *rcc)
+{
+    return red_channel_client_waiting_for_ack(rcc);
+}
+
 int red_channel_client_send_message_pending(RedChannelClient *rcc)
 {
     return rcc->priv->send_data.header.get_msg_type(&rcc->priv->send_data.header) != 0;
@@ -139,12 +139,24 @@ void red_channel_client_ack_set_client_window(RedChannelClient *rcc, int client_
 void red_channel_client_push_set_ack(RedChannelClient *rcc);
 
 gboolean red_channel_client_is_blocked(RedChannelClient *rcc);
+/* the client did not acknowledge enough messages to send more */
+gboolean red_channel_client_is_waiting_for_ack(RedChannelClient *rcc);
 
 /* helper for channels that have complex logic that can possibly ready a send */
 int red_channel_client_send_message_pending(RedChannelClient *rcc);
 
 gboolean red_channel_client_no_item_being_sent(RedChannelClient *rcc);
 void red_channel_client_push(RedChannelClient *rcc);
+/* To call red_channel_client_push() from another thread than the channel
+ * one, while the channel thread waits. Both functions are called from the
+ * channel thread, before and after the push. Meanwhile the items in the
+ * pipe stay referenced so that none is released by the other thread, and
+ * disconnecting the client is delayed until the push is finished.
+ * red_channel_client_prepare_push_in_thread() returns FALSE if there is
+ * nothing to push, then red_channel_client_finish_push_in_thread() must
+ * not be called. */
+gboolean red_channel_client_prepare_push_in_thread(RedChannelClient *rcc);
+void red_channel_client_finish_push_in_thread(RedChannelClient *rcc);
 void red_channel_client_receive(RedChannelClient *rcc);
 void red_channel_client_send(RedChannelClient *rcc);
 void red_channel_client_disconnect(RedChannelClient *rcc);
@@ -46,6 +46,8 @@ struct RedClient {
     int during_target_migrate;
     int seamless_migrate;
     int num_migrated_channels; /* for seamless - number of channels that wait for migrate data*/
+
+    NetModel *net_model; /* NULL unless SPICE_NET_MODEL is set */
 };
 
 struct RedClientClass
@@ -109,6 +111,7 @@ red_client_finalize (GObject *object)
     RedClient *self = RED_CLIENT(object);
 
     spice_debug("release client=%p", self);
+    net_model_free(self->net_model);
     pthread_mutex_destroy(&self->lock);
 
     G_OBJECT_CLASS (red_client_parent_class)->finalize (object);
@@ -143,6 +146,9 @@ red_client_init (RedClient *self)
 {
     pthread_mutex_init(&self->lock, NULL);
     self->thread_id = pthread_self();
+    if (getenv("SPICE_NET_MODEL") != NULL) {
+        self->net_model = net_model_new();
+    }
 }
 
 RedClient *red_client_new(RedsState *reds, int migrated)
@@ -362,3 +368,8 @@ RedsState *red_client_get_server(RedClient *client)
 {
     return client->reds;
 }
+
+NetModel *red_client_get_net_model(RedClient *client)
+{
+    return client->net_model;
+}
@@ -22,6 +22,7 @@
 #include <glib-object.h>
 
 #include "main-channel-client.h"
+#include "net-model.h"
 
 G_BEGIN_DECLS
 
@@ -70,6 +71,9 @@ void red_client_migrate(RedClient *client);
 gboolean red_client_is_disconnecting(RedClient *client);
 void red_client_set_disconnecting(RedClient *client);
 RedsState* red_client_get_server(RedClient *client);
+/* the estimate of the network shared by the channels of the client, or
+   NULL when it is only measured once, by the main channel net test */
+NetModel *red_client_get_net_model(RedClient *client);
 
 G_END_DECLS
 
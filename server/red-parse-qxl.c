@@ -89,7 +89,120 @@ static inline uint32_t color_16_to_32(uint32_t color)
     return ret;
 }
 
-static uint8_t *red_linearize_chunk(RedDataChunk *head, size_t size, bool *free_chunk)
+/* the arena gets new memory by blocks of this size, the bigger objects get a
+ * block of their own */
+#define RED_PARSE_ARENA_BLOCK_SIZE 4096
+
+struct RedParseArenaBlock {
+    RedParseArenaBlock *next;
+    uint64_t data[0];
+};
+
+struct RedParseArenaChunks {
+    RedParseArenaChunks *next;
+    SpiceChunks *chunks;
+};
+
+void *red_parse_arena_alloc(RedParseArena *arena, size_t size)
+{
+    RedParseArenaBlock *block;
+    void *ptr;
+
+    spice_assert(size <= G_MAXSIZE / 2);
+    /* even the empty objects get their own address */
+    size = size ? SPICE_ALIGN(size, sizeof(uint64_t)) : sizeof(uint64_t);
+    arena->n_allocs++;
+
+    if (G_LIKELY(size <= arena->left)) {
+        ptr = arena->ptr;
+        arena->ptr += size;
+        arena->left -= size;
+        return ptr;
+    }
+    if (arena->ptr == NULL && size <= sizeof(arena->inline_data)) {
+        arena->ptr = (uint8_t *)arena->inline_data + size;
+        arena->left = sizeof(arena->inline_data) - size;
+        return arena->inline_data;
+    }
+
+    if (size > RED_PARSE_ARENA_BLOCK_SIZE / 4) {
+        /* keep using what is left in the current block */
+        block = spice_malloc(sizeof(*block) + size);
+        block->next = arena->blocks;
+        arena->blocks = block;
+        arena->n_blocks++;
+        return block->data;
+    }
+    block = spice_malloc(sizeof(*block) + RED_PARSE_ARENA_BLOCK_SIZE);
+    block->next = arena->blocks;
+    arena->blocks = block;
+    arena->n_blocks++;
+    arena->ptr = (uint8_t *)block->data + size;
+    arena->left = RED_PARSE_ARENA_BLOCK_SIZE - size;
+    return block->data;
+}
+
+void red_parse_arena_free(RedParseArena *arena)
+{
+    RedParseArenaBlock *block;
+    RedParseArenaChunks *unstable;
+    uint32_t i;
+
+    /* spice_chunks_linearize() sets SPICE_CHUNKS_FLAGS_FREE when it copies
+     * the chunks, only that copy is not in the arena */
+    for (unstable = arena->unstable_chunks; unstable != NULL; unstable = unstable->next) {
+        SpiceChunks *chunks = unstable->chunks;
+
+        if (chunks->flags & SPICE_CHUNKS_FLAGS_FREE) {
+            for (i = 0; i < chunks->num_chunks; i++) {
+                free(chunks->chunk[i].data);
+            }
+        }
+    }
+    arena->unstable_chunks = NULL;
+
+    while ((block = arena->blocks) != NULL) {
+        arena->blocks = block->next;
+        free(block);
+    }
+    arena->ptr = NULL;
+    arena->left = 0;
+    arena->n_allocs = 0;
+    arena->n_blocks = 0;
+}
+
+void red_parse_arena_linearize_unstable(RedParseArena *arena)
+{
+    RedParseArenaChunks *unstable;
+
+    for (unstable = arena->unstable_chunks; unstable != NULL; unstable = unstable->next) {
+        spice_chunks_linearize(unstable->chunks);
+    }
+}
+
+static SpiceChunks *red_parse_arena_chunks_new(RedParseArena *arena, uint32_t num_chunks)
+{
+    SpiceChunks *chunks;
+
+    chunks = red_parse_arena_alloc(arena, sizeof(SpiceChunks) + num_chunks * sizeof(SpiceChunk));
+    memset(chunks, 0, sizeof(SpiceChunks));
+    chunks->num_chunks = num_chunks;
+    return chunks;
+}
+
+/* The encoders compress a copy of the guest data of an unstable image,
+ * which is freed with the arena */
+static void red_parse_arena_add_unstable(RedParseArena *arena, SpiceChunks *chunks)
+{
+    RedParseArenaChunks *unstable = red_parse_arena_alloc(arena, sizeof(*unstable));
+
+    chunks->flags |= SPICE_CHUNKS_FLAGS_UNSTABLE;
+    unstable->chunks = chunks;
+    unstable->next = arena->unstable_chunks;
+    arena->unstable_chunks = unstable;
+}
+
+static uint8_t *red_linearize_chunk(RedParseArena *arena, RedDataChunk *head, size_t size)
 {
     uint8_t *data, *ptr;
     RedDataChunk *chunk;
@@ -97,12 +210,10 @@ static uint8_t *red_linearize_chunk(RedDataChunk *head, size_t size, bool *free_
 
     if (head->next_chunk == NULL) {
         spice_assert(size <= head->data_size);
-        *free_chunk = false;
         return head->data;
     }
 
-    ptr = data = spice_malloc(size);
-    *free_chunk = true;
+    ptr = data = red_parse_arena_alloc(arena, size);
     for (chunk = head; chunk != NULL && size > 0; chunk = chunk->next_chunk) {
         copy = MIN(chunk->data_size, size);
         memcpy(ptr, chunk->data, copy);
@@ -113,8 +224,9 @@ static uint8_t *red_linearize_chunk(RedDataChunk *head, size_t size, bool *free_
     return data;
 }
 
+/* the chunks after the first one are allocated from the arena */
 static size_t red_get_data_chunks_ptr(RedMemSlotInfo *slots, int group_id,
-                                      int memslot_id,
+                                      RedParseArena *arena, int memslot_id,
                                       RedDataChunk *red, QXLDataChunk *qxl)
 {
     RedDataChunk *red_prev;
@@ -159,7 +271,7 @@ static size_t red_get_data_chunks_ptr(RedMemSlotInfo *slots, int group_id,
             continue;
 
         red_prev = red;
-        red = spice_new0(RedDataChunk, 1);
+        red = red_parse_arena_alloc(arena, sizeof(*red));
         red->data_size = chunk_data_size;
         red->prev_chunk = red_prev;
         red->data = qxl->data;
@@ -180,9 +292,7 @@ static size_t red_get_data_chunks_ptr(RedMemSlotInfo *slots, int group_id,
 
 error:
     while (red->prev_chunk) {
-        red_prev = red->prev_chunk;
-        free(red);
-        red = red_prev;
+        red = red->prev_chunk;
     }
     red->data_size = 0;
     red->next_chunk = NULL;
@@ -190,7 +300,7 @@ error:
     return INVALID_SIZE;
 }
 
-static size_t red_get_data_chunks(RedMemSlotInfo *slots, int group_id,
+static size_t red_get_data_chunks(RedMemSlotInfo *slots, int group_id, RedParseArena *arena,
                                   RedDataChunk *red, QXLPHYSICAL addr)
 {
     QXLDataChunk *qxl;
@@ -201,19 +311,7 @@ static size_t red_get_data_chunks(RedMemSlotInfo *slots, int group_id,
     if (error) {
         return INVALID_SIZE;
     }
-    return red_get_data_chunks_ptr(slots, group_id, memslot_id, red, qxl);
-}
-
-static void red_put_data_chunks(RedDataChunk *red)
-{
-    RedDataChunk *tmp;
-
-    red = red->next_chunk;
-    while (red) {
-        tmp = red;
-        red = red->next_chunk;
-        free(tmp);
-    }
+    return red_get_data_chunks_ptr(slots, group_id, arena, memslot_id, red, qxl);
 }
 
 static void red_get_point_ptr(SpicePoint *red, QXLPoint *qxl)
@@ -237,13 +335,12 @@ void red_get_rect_ptr(SpiceRect *red, const QXLRect *qxl)
 }
 
 static SpicePath *red_get_path(RedMemSlotInfo *slots, int group_id,
-                               QXLPHYSICAL addr)
+                               RedParseArena *arena, QXLPHYSICAL addr)
 {
     RedDataChunk chunks;
     QXLPathSeg *start, *end;
     SpicePathSeg *seg;
     uint8_t *data;
-    bool free_data;
     QXLPath *qxl;
     SpicePath *red;
     size_t size;
@@ -257,14 +354,13 @@ static SpicePath *red_get_path(RedMemSlotInfo *slots, int group_id,
     if (error) {
         return NULL;
     }
-    size = red_get_data_chunks_ptr(slots, group_id,
+    size = red_get_data_chunks_ptr(slots, group_id, arena,
                                    memslot_get_id(slots, addr),
                                    &chunks, &qxl->chunk);
     if (size == INVALID_SIZE) {
         return NULL;
     }
-    data = red_linearize_chunk(&chunks, size, &free_data);
-    red_put_data_chunks(&chunks);
+    data = red_linearize_chunk(arena, &chunks, size);
 
     n_segments = 0;
     mem_size = sizeof(*red);
@@ -282,7 +378,7 @@ static SpicePath *red_get_path(RedMemSlotInfo *slots, int group_id,
         start = (QXLPathSeg*)(&start->points[count]);
     }
 
-    red = spice_malloc(mem_size);
+    red = red_parse_arena_alloc(arena, mem_size);
     red->num_segments = n_segments;
 
     start = (QXLPathSeg*)data;
@@ -312,21 +408,17 @@ static SpicePath *red_get_path(RedMemSlotInfo *slots, int group_id,
     /* Ensure guest didn't tamper with segment count */
     spice_assert(n_segments == red->num_segments);
 
-    if (free_data) {
-        free(data);
-    }
     return red;
 }
 
 static SpiceClipRects *red_get_clip_rects(RedMemSlotInfo *slots, int group_id,
-                                          QXLPHYSICAL addr)
+                                          RedParseArena *arena, QXLPHYSICAL addr)
 {
     RedDataChunk chunks;
     QXLClipRects *qxl;
     SpiceClipRects *red;
     QXLRect *start;
     uint8_t *data;
-    bool free_data;
     size_t size;
     int i;
     int error;
@@ -336,14 +428,13 @@ static SpiceClipRects *red_get_clip_rects(RedMemSlotInfo *slots, int group_id,
     if (error) {
         return NULL;
     }
-    size = red_get_data_chunks_ptr(slots, group_id,
+    size = red_get_data_chunks_ptr(slots, group_id, arena,
                                    memslot_get_id(slots, addr),
                                    &chunks, &qxl->chunk);
     if (size == INVALID_SIZE) {
         return NULL;
     }
-    data = red_linearize_chunk(&chunks, size, &free_data);
-    red_put_data_chunks(&chunks);
+    data = red_linearize_chunk(arena, &chunks, size);
 
     num_rects = qxl->num_rects;
     /* The cast is needed to prevent 32 bit integer overflows.
@@ -352,7 +443,7 @@ static SpiceClipRects *red_get_clip_rects(RedMemSlotInfo *slots, int group_id,
      */
     spice_assert((uint64_t) num_rects * sizeof(QXLRect) == size);
     G_STATIC_ASSERT(sizeof(SpiceRect) == sizeof(QXLRect));
-    red = spice_malloc(sizeof(*red) + num_rects * sizeof(SpiceRect));
+    red = red_parse_arena_alloc(arena, sizeof(*red) + num_rects * sizeof(SpiceRect));
     red->num_rects = num_rects;
 
     start = (QXLRect*)data;
@@ -360,13 +451,11 @@ static SpiceClipRects *red_get_clip_rects(RedMemSlotInfo *slots, int group_id,
         red_get_rect_ptr(red->rects + i, start++);
     }
 
-    if (free_data) {
-        free(data);
-    }
     return red;
 }
 
 static SpiceChunks *red_get_image_data_flat(RedMemSlotInfo *slots, int group_id,
+                                            RedParseArena *arena,
                                             QXLPHYSICAL addr, size_t size)
 {
     SpiceChunks *data;
@@ -378,7 +467,7 @@ static SpiceChunks *red_get_image_data_flat(RedMemSlotInfo *slots, int group_id,
         return 0;
     }
 
-    data = spice_chunks_new(1);
+    data = red_parse_arena_chunks_new(arena, 1);
     data->data_size      = size;
     data->chunk[0].data  = (void*)bitmap_virt;
     data->chunk[0].len   = size;
@@ -386,6 +475,7 @@ static SpiceChunks *red_get_image_data_flat(RedMemSlotInfo *slots, int group_id,
 }
 
 static SpiceChunks *red_get_image_data_chunked(RedMemSlotInfo *slots, int group_id,
+                                               RedParseArena *arena,
                                                RedDataChunk *head)
 {
     SpiceChunks *data;
@@ -396,8 +486,7 @@ static SpiceChunks *red_get_image_data_chunked(RedMemSlotInfo *slots, int group_
         i++;
     }
 
-    data = spice_chunks_new(i);
-    data->data_size = 0;
+    data = red_parse_arena_chunks_new(arena, i);
     for (i = 0, chunk = head;
          chunk != NULL && i < data->num_chunks;
          chunk = chunk->next_chunk, i++) {
@@ -451,13 +540,13 @@ static int bitmap_consistent(SpiceBitmap *bitmap)
     return TRUE;
 }
 
-static SpiceImage *red_get_image(RedMemSlotInfo *slots, int group_id,
+static SpiceImage *red_get_image(RedMemSlotInfo *slots, int group_id, RedParseArena *arena,
                                  QXLPHYSICAL addr, uint32_t flags, int is_mask)
 {
     RedDataChunk chunks;
     QXLImage *qxl;
-    SpiceImage *red = NULL;
-    SpicePalette *rp = NULL;
+    SpiceImage *red;
+    SpicePalette *rp;
     uint64_t bitmap_size, size;
     uint8_t qxl_flags;
     int error;
@@ -471,7 +560,8 @@ static SpiceImage *red_get_image(RedMemSlotInfo *slots, int group_id,
     if (error) {
         return NULL;
     }
-    red = spice_new0(SpiceImage, 1);
+    red = red_parse_arena_alloc(arena, sizeof(*red));
+    memset(red, 0, sizeof(*red));
     red->descriptor.id     = qxl->descriptor.id;
     red->descriptor.type   = qxl->descriptor.type;
     red->descriptor.flags = 0;
@@ -521,7 +611,7 @@ static SpiceImage *red_get_image(RedMemSlotInfo *slots, int group_id,
                                        num_ents * sizeof(qp->ents[0]), group_id)) {
                 goto error;
             }
-            rp = spice_malloc_n_m(num_ents, sizeof(rp->ents[0]), sizeof(*rp));
+            rp = red_parse_arena_alloc(arena, sizeof(*rp) + num_ents * sizeof(rp->ents[0]));
             rp->unique   = qp->unique;
             rp->num_ents = num_ents;
             if (flags & QXL_COMMAND_FLAG_COMPAT_16BPP) {
@@ -541,22 +631,20 @@ static SpiceImage *red_get_image(RedMemSlotInfo *slots, int group_id,
             goto error;
         }
         if (qxl_flags & QXL_BITMAP_DIRECT) {
-            red->u.bitmap.data = red_get_image_data_flat(slots, group_id,
+            red->u.bitmap.data = red_get_image_data_flat(slots, group_id, arena,
                                                          qxl->bitmap.data,
                                                          bitmap_size);
         } else {
-            size = red_get_data_chunks(slots, group_id,
+            size = red_get_data_chunks(slots, group_id, arena,
                                        &chunks, qxl->bitmap.data);
             if (size == INVALID_SIZE || size != bitmap_size) {
-                red_put_data_chunks(&chunks);
                 goto error;
             }
-            red->u.bitmap.data = red_get_image_data_chunked(slots, group_id,
+            red->u.bitmap.data = red_get_image_data_chunked(slots, group_id, arena,
                                                             &chunks);
-            red_put_data_chunks(&chunks);
         }
         if (qxl_flags & QXL_BITMAP_UNSTABLE) {
-            red->u.bitmap.data->flags |= SPICE_CHUNKS_FLAGS_UNSTABLE;
+            red_parse_arena_add_unstable(arena, red->u.bitmap.data);
         }
         break;
     case SPICE_IMAGE_TYPE_SURFACE:
@@ -564,16 +652,14 @@ static SpiceImage *red_get_image(RedMemSlotInfo *slots, int group_id,
         break;
     case SPICE_IMAGE_TYPE_QUIC:
         red->u.quic.data_size = qxl->quic.data_size;
-        size = red_get_data_chunks_ptr(slots, group_id,
+        size = red_get_data_chunks_ptr(slots, group_id, arena,
                                        memslot_get_id(slots, addr),
                                        &chunks, (QXLDataChunk *)qxl->quic.data);
         if (size == INVALID_SIZE || size != red->u.quic.data_size) {
-            red_put_data_chunks(&chunks);
             goto error;
         }
-        red->u.quic.data = red_get_image_data_chunked(slots, group_id,
+        red->u.quic.data = red_get_image_data_chunked(slots, group_id, arena,
                                                       &chunks);
-        red_put_data_chunks(&chunks);
         break;
     default:
         spice_warning("unknown type %d", red->descriptor.type);
@@ -581,29 +667,11 @@ static SpiceImage *red_get_image(RedMemSlotInfo *slots, int group_id,
     }
     return red;
 error:
-    free(red);
-    free(rp);
+    /* what was allocated is released with the arena */
     return NULL;
 }
 
-static void red_put_image(SpiceImage *red)
-{
-    if (red == NULL)
-        return;
-
-    switch (red->descriptor.type) {
-    case SPICE_IMAGE_TYPE_BITMAP:
-        free(red->u.bitmap.palette);
-        spice_chunks_destroy(red->u.bitmap.data);
-        break;
-    case SPICE_IMAGE_TYPE_QUIC:
-        spice_chunks_destroy(red->u.quic.data);
-        break;
-    }
-    free(red);
-}
-
-static void red_get_brush_ptr(RedMemSlotInfo *slots, int group_id,
+static void red_get_brush_ptr(RedMemSlotInfo *slots, int group_id, RedParseArena *arena,
                               SpiceBrush *red, QXLBrush *qxl, uint32_t flags)
 {
     red->type = qxl->type;
@@ -616,69 +684,43 @@ static void red_get_brush_ptr(RedMemSlotInfo *slots, int group_id,
         }
         break;
     case SPICE_BRUSH_TYPE_PATTERN:
-        red->u.pattern.pat = red_get_image(slots, group_id, qxl->u.pattern.pat, flags, FALSE);
+        red->u.pattern.pat = red_get_image(slots, group_id, arena,
+                                           qxl->u.pattern.pat, flags, FALSE);
         break;
     }
 }
 
-static void red_put_brush(SpiceBrush *red)
-{
-    switch (red->type) {
-    case SPICE_BRUSH_TYPE_PATTERN:
-        red_put_image(red->u.pattern.pat);
-        break;
-    }
-}
-
-static void red_get_qmask_ptr(RedMemSlotInfo *slots, int group_id,
+static void red_get_qmask_ptr(RedMemSlotInfo *slots, int group_id, RedParseArena *arena,
                               SpiceQMask *red, QXLQMask *qxl, uint32_t flags)
 {
     red->flags  = qxl->flags;
     red_get_point_ptr(&red->pos, &qxl->pos);
-    red->bitmap = red_get_image(slots, group_id, qxl->bitmap, flags, TRUE);
-}
-
-static void red_put_qmask(SpiceQMask *red)
-{
-    red_put_image(red->bitmap);
+    red->bitmap = red_get_image(slots, group_id, arena, qxl->bitmap, flags, TRUE);
 }
 
-static void red_get_fill_ptr(RedMemSlotInfo *slots, int group_id,
+static void red_get_fill_ptr(RedMemSlotInfo *slots, int group_id, RedParseArena *arena,
                              SpiceFill *red, QXLFill *qxl, uint32_t flags)
 {
-    red_get_brush_ptr(slots, group_id, &red->brush, &qxl->brush, flags);
+    red_get_brush_ptr(slots, group_id, arena, &red->brush, &qxl->brush, flags);
     red->rop_descriptor = qxl->rop_descriptor;
-    red_get_qmask_ptr(slots, group_id, &red->mask, &qxl->mask, flags);
+    red_get_qmask_ptr(slots, group_id, arena, &red->mask, &qxl->mask, flags);
 }
 
-static void red_put_fill(SpiceFill *red)
-{
-    red_put_brush(&red->brush);
-    red_put_qmask(&red->mask);
-}
-
-static void red_get_opaque_ptr(RedMemSlotInfo *slots, int group_id,
+static void red_get_opaque_ptr(RedMemSlotInfo *slots, int group_id, RedParseArena *arena,
                                SpiceOpaque *red, QXLOpaque *qxl, uint32_t flags)
 {
-   red->src_bitmap     = red_get_image(slots, group_id, qxl->src_bitmap, flags, FALSE);
+   red->src_bitmap     = red_get_image(slots, group_id, arena, qxl->src_bitmap, flags, FALSE);
    red_get_rect_ptr(&red->src_area, &qxl->src_area);
-   red_get_brush_ptr(slots, group_id, &red->brush, &qxl->brush, flags);
+   red_get_brush_ptr(slots, group_id, arena, &red->brush, &qxl->brush, flags);
    red->rop_descriptor = qxl->rop_descriptor;
    red->scale_mode     = qxl->scale_mode;
-   red_get_qmask_ptr(slots, group_id, &red->mask, &qxl->mask, flags);
+   red_get_qmask_ptr(slots, group_id, arena, &red->mask, &qxl->mask, flags);
 }
 
-static void red_put_opaque(SpiceOpaque *red)
-{
-    red_put_image(red->src_bitmap);
-    red_put_brush(&red->brush);
-    red_put_qmask(&red->mask);
-}
-
-static int red_get_copy_ptr(RedMemSlotInfo *slots, int group_id,
+static int red_get_copy_ptr(RedMemSlotInfo *slots, int group_id, RedParseArena *arena,
                             SpiceCopy *red, QXLCopy *qxl, uint32_t flags)
 {
-    red->src_bitmap      = red_get_image(slots, group_id, qxl->src_bitmap, flags, FALSE);
+    red->src_bitmap      = red_get_image(slots, group_id, arena, qxl->src_bitmap, flags, FALSE);
     if (!red->src_bitmap) {
         return 1;
     }
@@ -699,64 +741,43 @@ static int red_get_copy_ptr(RedMemSlotInfo *slots, int group_id,
     }
     red->rop_descriptor  = qxl->rop_descriptor;
     red->scale_mode      = qxl->scale_mode;
-    red_get_qmask_ptr(slots, group_id, &red->mask, &qxl->mask, flags);
+    red_get_qmask_ptr(slots, group_id, arena, &red->mask, &qxl->mask, flags);
     return 0;
 }
 
-static void red_put_copy(SpiceCopy *red)
-{
-    red_put_image(red->src_bitmap);
-    red_put_qmask(&red->mask);
-}
-
 // these types are really the same thing
 #define red_get_blend_ptr red_get_copy_ptr
 
-static void red_put_blend(SpiceBlend *red)
-{
-    red_put_image(red->src_bitmap);
-    red_put_qmask(&red->mask);
-}
-
-static void red_get_transparent_ptr(RedMemSlotInfo *slots, int group_id,
+static void red_get_transparent_ptr(RedMemSlotInfo *slots, int group_id, RedParseArena *arena,
                                     SpiceTransparent *red, QXLTransparent *qxl,
                                     uint32_t flags)
 {
-    red->src_bitmap      = red_get_image(slots, group_id, qxl->src_bitmap, flags, FALSE);
+    red->src_bitmap      = red_get_image(slots, group_id, arena, qxl->src_bitmap, flags, FALSE);
    red_get_rect_ptr(&red->src_area, &qxl->src_area);
    red->src_color       = qxl->src_color;
    red->true_color      = qxl->true_color;
 }
 
-static void red_put_transparent(SpiceTransparent *red)
-{
-    red_put_image(red->src_bitmap);
-}
-
-static void red_get_alpha_blend_ptr(RedMemSlotInfo *slots, int group_id,
+static void red_get_alpha_blend_ptr(RedMemSlotInfo *slots, int group_id, RedParseArena *arena,
                                     SpiceAlphaBlend *red, QXLAlphaBlend *qxl,
                                     uint32_t flags)
 {
     red->alpha_flags = qxl->alpha_flags;
     red->alpha       = qxl->alpha;
-    red->src_bitmap  = red_get_image(slots, group_id, qxl->src_bitmap, flags, FALSE);
+    red->src_bitmap  = red_get_image(slots, group_id, arena, qxl->src_bitmap, flags, FALSE);
     red_get_rect_ptr(&red->src_area, &qxl->src_area);
 }
 
 static void red_get_alpha_blend_ptr_compat(RedMemSlotInfo *slots, int group_id,
+                                           RedParseArena *arena,
                                            SpiceAlphaBlend *red, QXLCompatAlphaBlend *qxl,
                                            uint32_t flags)
 {
     red->alpha       = qxl->alpha;
-    red->src_bitmap  = red_get_image(slots, group_id, qxl->src_bitmap, flags, FALSE);
+    red->src_bitmap  = red_get_image(slots, group_id, arena, qxl->src_bitmap, flags, FALSE);
     red_get_rect_ptr(&red->src_area, &qxl->src_area);
 }
 
-static void red_put_alpha_blend(SpiceAlphaBlend *red)
-{
-    red_put_image(red->src_bitmap);
-}
-
 static bool get_transform(RedMemSlotInfo *slots,
                           int group_id,
                           QXLPHYSICAL qxl_transform,
@@ -777,17 +798,17 @@ static bool get_transform(RedMemSlotInfo *slots,
     return TRUE;
 }
 
-static void red_get_composite_ptr(RedMemSlotInfo *slots, int group_id,
+static void red_get_composite_ptr(RedMemSlotInfo *slots, int group_id, RedParseArena *arena,
                                   SpiceComposite *red, QXLComposite *qxl, uint32_t flags)
 {
     red->flags = qxl->flags;
 
-    red->src_bitmap = red_get_image(slots, group_id, qxl->src, flags, FALSE);
+    red->src_bitmap = red_get_image(slots, group_id, arena, qxl->src, flags, FALSE);
     if (get_transform(slots, group_id, qxl->src_transform, &red->src_transform))
         red->flags |= SPICE_COMPOSITE_HAS_SRC_TRANSFORM;
 
     if (qxl->mask) {
-        red->mask_bitmap = red_get_image(slots, group_id, qxl->mask, flags, FALSE);
+        red->mask_bitmap = red_get_image(slots, group_id, arena, qxl->mask, flags, FALSE);
         red->flags |= SPICE_COMPOSITE_HAS_MASK;
         if (get_transform(slots, group_id, qxl->mask_transform, &red->mask_transform))
             red->flags |= SPICE_COMPOSITE_HAS_MASK_TRANSFORM;
@@ -800,37 +821,23 @@ static void red_get_composite_ptr(RedMemSlotInfo *slots, int group_id,
     red->mask_origin.y = qxl->mask_origin.y;
 }
 
-static void red_put_composite(SpiceComposite *red)
-{
-    red_put_image(red->src_bitmap);
-    if (red->mask_bitmap)
-        red_put_image(red->mask_bitmap);
-}
-
-static void red_get_rop3_ptr(RedMemSlotInfo *slots, int group_id,
+static void red_get_rop3_ptr(RedMemSlotInfo *slots, int group_id, RedParseArena *arena,
                              SpiceRop3 *red, QXLRop3 *qxl, uint32_t flags)
 {
-   red->src_bitmap = red_get_image(slots, group_id, qxl->src_bitmap, flags, FALSE);
+   red->src_bitmap = red_get_image(slots, group_id, arena, qxl->src_bitmap, flags, FALSE);
    red_get_rect_ptr(&red->src_area, &qxl->src_area);
-   red_get_brush_ptr(slots, group_id, &red->brush, &qxl->brush, flags);
+   red_get_brush_ptr(slots, group_id, arena, &red->brush, &qxl->brush, flags);
    red->rop3       = qxl->rop3;
    red->scale_mode = qxl->scale_mode;
-   red_get_qmask_ptr(slots, group_id, &red->mask, &qxl->mask, flags);
+   red_get_qmask_ptr(slots, group_id, arena, &red->mask, &qxl->mask, flags);
 }
 
-static void red_put_rop3(SpiceRop3 *red)
-{
-    red_put_image(red->src_bitmap);
-    red_put_brush(&red->brush);
-    red_put_qmask(&red->mask);
-}
-
-static int red_get_stroke_ptr(RedMemSlotInfo *slots, int group_id,
+static int red_get_stroke_ptr(RedMemSlotInfo *slots, int group_id, RedParseArena *arena,
                               SpiceStroke *red, QXLStroke *qxl, uint32_t flags)
 {
     int error;
 
-    red->path = red_get_path(slots, group_id, qxl->path);
+    red->path = red_get_path(slots, group_id, arena, qxl->path);
     if (!red->path) {
         return 1;
     }
@@ -840,7 +847,7 @@ static int red_get_stroke_ptr(RedMemSlotInfo *slots, int group_id,
         uint8_t *buf;
 
         style_nseg = qxl->attr.style_nseg;
-        red->attr.style = spice_malloc_n(style_nseg, sizeof(SPICE_FIXED28_4));
+        red->attr.style = red_parse_arena_alloc(arena, style_nseg * sizeof(SPICE_FIXED28_4));
         red->attr.style_nseg  = style_nseg;
         spice_assert(qxl->attr.style);
         buf = (uint8_t *)memslot_get_virt(slots, qxl->attr.style,
@@ -853,23 +860,14 @@ static int red_get_stroke_ptr(RedMemSlotInfo *slots, int group_id,
         red->attr.style_nseg  = 0;
         red->attr.style       = NULL;
     }
-    red_get_brush_ptr(slots, group_id, &red->brush, &qxl->brush, flags);
+    red_get_brush_ptr(slots, group_id, arena, &red->brush, &qxl->brush, flags);
     red->fore_mode        = qxl->fore_mode;
     red->back_mode        = qxl->back_mode;
     return 0;
 }
 
-static void red_put_stroke(SpiceStroke *red)
-{
-    red_put_brush(&red->brush);
-    free(red->path);
-    if (red->attr.flags & SPICE_LINE_FLAGS_STYLED) {
-        free(red->attr.style);
-    }
-}
-
 static SpiceString *red_get_string(RedMemSlotInfo *slots, int group_id,
-                                   QXLPHYSICAL addr)
+                                   RedParseArena *arena, QXLPHYSICAL addr)
 {
     RedDataChunk chunks;
     QXLString *qxl;
@@ -877,7 +875,6 @@ static SpiceString *red_get_string(RedMemSlotInfo *slots, int group_id,
     SpiceString *red;
     SpiceRasterGlyph *glyph;
     uint8_t *data;
-    bool free_data;
     size_t chunk_size, qxl_size, red_size, glyph_size;
     int glyphs, i;
     /* use unsigned to prevent integer overflow in multiplication below */
@@ -889,14 +886,13 @@ static SpiceString *red_get_string(RedMemSlotInfo *slots, int group_id,
     if (error) {
         return NULL;
     }
-    chunk_size = red_get_data_chunks_ptr(slots, group_id,
+    chunk_size = red_get_data_chunks_ptr(slots, group_id, arena,
                                          memslot_get_id(slots, addr),
                                          &chunks, &qxl->chunk);
     if (chunk_size == INVALID_SIZE) {
         return NULL;
     }
-    data = red_linearize_chunk(&chunks, chunk_size, &free_data);
-    red_put_data_chunks(&chunks);
+    data = red_linearize_chunk(arena, &chunks, chunk_size);
 
     qxl_size = qxl->data_size;
     qxl_flags = qxl->flags;
@@ -931,7 +927,7 @@ static SpiceString *red_get_string(RedMemSlotInfo *slots, int group_id,
     spice_assert(start <= end);
     spice_assert(glyphs == qxl_length);
 
-    red = spice_malloc(red_size);
+    red = red_parse_arena_alloc(arena, red_size);
     red->length = qxl_length;
     red->flags = qxl_flags;
 
@@ -955,79 +951,45 @@ static SpiceString *red_get_string(RedMemSlotInfo *slots, int group_id,
              SPICE_ALIGN(sizeof(SpiceRasterGlyph) + glyph_size, 4));
     }
 
-    if (free_data) {
-        free(data);
-    }
     return red;
 }
 
-static void red_get_text_ptr(RedMemSlotInfo *slots, int group_id,
+static void red_get_text_ptr(RedMemSlotInfo *slots, int group_id, RedParseArena *arena,
                              SpiceText *red, QXLText *qxl, uint32_t flags)
 {
-   red->str = red_get_string(slots, group_id, qxl->str);
+   red->str = red_get_string(slots, group_id, arena, qxl->str);
    red_get_rect_ptr(&red->back_area, &qxl->back_area);
-   red_get_brush_ptr(slots, group_id, &red->fore_brush, &qxl->fore_brush, flags);
-   red_get_brush_ptr(slots, group_id, &red->back_brush, &qxl->back_brush, flags);
+   red_get_brush_ptr(slots, group_id, arena, &red->fore_brush, &qxl->fore_brush, flags);
+   red_get_brush_ptr(slots, group_id, arena, &red->back_brush, &qxl->back_brush, flags);
    red->fore_mode  = qxl->fore_mode;
    red->back_mode  = qxl->back_mode;
 }
 
-static void red_put_text_ptr(SpiceText *red)
-{
-    free(red->str);
-    red_put_brush(&red->fore_brush);
-    red_put_brush(&red->back_brush);
-}
-
-static void red_get_whiteness_ptr(RedMemSlotInfo *slots, int group_id,
+static void red_get_whiteness_ptr(RedMemSlotInfo *slots, int group_id, RedParseArena *arena,
                                   SpiceWhiteness *red, QXLWhiteness *qxl, uint32_t flags)
 {
-    red_get_qmask_ptr(slots, group_id, &red->mask, &qxl->mask, flags);
-}
-
-static void red_put_whiteness(SpiceWhiteness *red)
-{
-    red_put_qmask(&red->mask);
+    red_get_qmask_ptr(slots, group_id, arena, &red->mask, &qxl->mask, flags);
 }
 
-static void red_get_blackness_ptr(RedMemSlotInfo *slots, int group_id,
+static void red_get_blackness_ptr(RedMemSlotInfo *slots, int group_id, RedParseArena *arena,
                                   SpiceBlackness *red, QXLBlackness *qxl, uint32_t flags)
 {
-    red_get_qmask_ptr(slots, group_id, &red->mask, &qxl->mask, flags);
+    red_get_qmask_ptr(slots, group_id, arena, &red->mask, &qxl->mask, flags);
 }
 
-static void red_put_blackness(SpiceWhiteness *red)
-{
-    red_put_qmask(&red->mask);
-}
-
-static void red_get_invers_ptr(RedMemSlotInfo *slots, int group_id,
+static void red_get_invers_ptr(RedMemSlotInfo *slots, int group_id, RedParseArena *arena,
                                SpiceInvers *red, QXLInvers *qxl, uint32_t flags)
 {
-    red_get_qmask_ptr(slots, group_id, &red->mask, &qxl->mask, flags);
+    red_get_qmask_ptr(slots, group_id, arena, &red->mask, &qxl->mask, flags);
 }
 
-static void red_put_invers(SpiceWhiteness *red)
-{
-    red_put_qmask(&red->mask);
-}
-
-static void red_get_clip_ptr(RedMemSlotInfo *slots, int group_id,
+static void red_get_clip_ptr(RedMemSlotInfo *slots, int group_id, RedParseArena *arena,
                              SpiceClip *red, QXLClip *qxl)
 {
     red->type = qxl->type;
     switch (red->type) {
     case SPICE_CLIP_TYPE_RECTS:
-        red->rects = red_get_clip_rects(slots, group_id, qxl->data);
-        break;
-    }
-}
-
-static void red_put_clip(SpiceClip *red)
-{
-    switch (red->type) {
-    case SPICE_CLIP_TYPE_RECTS:
-        free(red->rects);
+        red->rects = red_get_clip_rects(slots, group_id, arena, qxl->data);
         break;
     }
 }
@@ -1036,6 +998,7 @@ static int red_get_native_drawable(RedMemSlotInfo *slots, int group_id,
                                    RedDrawable *red, QXLPHYSICAL addr, uint32_t flags)
 {
     QXLDrawable *qxl;
+    RedParseArena *arena = &red->arena;
     int i;
     int error = 0;
 
@@ -1047,7 +1010,7 @@ static int red_get_native_drawable(RedMemSlotInfo *slots, int group_id,
     red->release_info_ext.group_id = group_id;
 
     red_get_rect_ptr(&red->bbox, &qxl->bbox);
-    red_get_clip_ptr(slots, group_id, &red->clip, &qxl->clip);
+    red_get_clip_ptr(slots, group_id, arena, &red->clip, &qxl->clip);
     red->effect           = qxl->effect;
     red->mm_time          = qxl->mm_time;
     red->self_bitmap      = qxl->self_bitmap;
@@ -1062,51 +1025,51 @@ static int red_get_native_drawable(RedMemSlotInfo *slots, int group_id,
     red->type = qxl->type;
     switch (red->type) {
     case QXL_DRAW_ALPHA_BLEND:
-        red_get_alpha_blend_ptr(slots, group_id,
+        red_get_alpha_blend_ptr(slots, group_id, arena,
                                 &red->u.alpha_blend, &qxl->u.alpha_blend, flags);
         break;
     case QXL_DRAW_BLACKNESS:
-        red_get_blackness_ptr(slots, group_id,
+        red_get_blackness_ptr(slots, group_id, arena,
                               &red->u.blackness, &qxl->u.blackness, flags);
         break;
     case QXL_DRAW_BLEND:
-        error = red_get_blend_ptr(slots, group_id, &red->u.blend, &qxl->u.blend, flags);
+        error = red_get_blend_ptr(slots, group_id, arena, &red->u.blend, &qxl->u.blend, flags);
         break;
     case QXL_DRAW_COPY:
-        error = red_get_copy_ptr(slots, group_id, &red->u.copy, &qxl->u.copy, flags);
+        error = red_get_copy_ptr(slots, group_id, arena, &red->u.copy, &qxl->u.copy, flags);
         break;
     case QXL_COPY_BITS:
         red_get_point_ptr(&red->u.copy_bits.src_pos, &qxl->u.copy_bits.src_pos);
         break;
     case QXL_DRAW_FILL:
-        red_get_fill_ptr(slots, group_id, &red->u.fill, &qxl->u.fill, flags);
+        red_get_fill_ptr(slots, group_id, arena, &red->u.fill, &qxl->u.fill, flags);
         break;
     case QXL_DRAW_OPAQUE:
-        red_get_opaque_ptr(slots, group_id, &red->u.opaque, &qxl->u.opaque, flags);
+        red_get_opaque_ptr(slots, group_id, arena, &red->u.opaque, &qxl->u.opaque, flags);
         break;
     case QXL_DRAW_INVERS:
-        red_get_invers_ptr(slots, group_id, &red->u.invers, &qxl->u.invers, flags);
+        red_get_invers_ptr(slots, group_id, arena, &red->u.invers, &qxl->u.invers, flags);
         break;
     case QXL_DRAW_NOP:
         break;
     case QXL_DRAW_ROP3:
-        red_get_rop3_ptr(slots, group_id, &red->u.rop3, &qxl->u.rop3, flags);
+        red_get_rop3_ptr(slots, group_id, arena, &red->u.rop3, &qxl->u.rop3, flags);
         break;
     case QXL_DRAW_COMPOSITE:
-        red_get_composite_ptr(slots, group_id, &red->u.composite, &qxl->u.composite, flags);
+        red_get_composite_ptr(slots, group_id, arena, &red->u.composite, &qxl->u.composite, flags);
         break;
     case QXL_DRAW_STROKE:
-        error = red_get_stroke_ptr(slots, group_id, &red->u.stroke, &qxl->u.stroke, flags);
+        error = red_get_stroke_ptr(slots, group_id, arena, &red->u.stroke, &qxl->u.stroke, flags);
         break;
     case QXL_DRAW_TEXT:
-        red_get_text_ptr(slots, group_id, &red->u.text, &qxl->u.text, flags);
+        red_get_text_ptr(slots, group_id, arena, &red->u.text, &qxl->u.text, flags);
         break;
     case QXL_DRAW_TRANSPARENT:
-        red_get_transparent_ptr(slots, group_id,
+        red_get_transparent_ptr(slots, group_id, arena,
                                 &red->u.transparent, &qxl->u.transparent, flags);
         break;
     case QXL_DRAW_WHITENESS:
-        red_get_whiteness_ptr(slots, group_id,
+        red_get_whiteness_ptr(slots, group_id, arena,
                               &red->u.whiteness, &qxl->u.whiteness, flags);
         break;
     default:
@@ -1121,6 +1084,7 @@ static int red_get_compat_drawable(RedMemSlotInfo *slots, int group_id,
                                    RedDrawable *red, QXLPHYSICAL addr, uint32_t flags)
 {
     QXLCompatDrawable *qxl;
+    RedParseArena *arena = &red->arena;
     int error;
 
     qxl = (QXLCompatDrawable *)memslot_get_virt(slots, addr, sizeof(*qxl), group_id, &error);
@@ -1131,7 +1095,7 @@ static int red_get_compat_drawable(RedMemSlotInfo *slots, int group_id,
     red->release_info_ext.group_id = group_id;
 
     red_get_rect_ptr(&red->bbox, &qxl->bbox);
-    red_get_clip_ptr(slots, group_id, &red->clip, &qxl->clip);
+    red_get_clip_ptr(slots, group_id, arena, &red->clip, &qxl->clip);
     red->effect           = qxl->effect;
     red->mm_time          = qxl->mm_time;
 
@@ -1145,18 +1109,18 @@ static int red_get_compat_drawable(RedMemSlotInfo *slots, int group_id,
     red->type = qxl->type;
     switch (red->type) {
     case QXL_DRAW_ALPHA_BLEND:
-        red_get_alpha_blend_ptr_compat(slots, group_id,
+        red_get_alpha_blend_ptr_compat(slots, group_id, arena,
                                        &red->u.alpha_blend, &qxl->u.alpha_blend, flags);
         break;
     case QXL_DRAW_BLACKNESS:
-        red_get_blackness_ptr(slots, group_id,
+        red_get_blackness_ptr(slots, group_id, arena,
                               &red->u.blackness, &qxl->u.blackness, flags);
         break;
     case QXL_DRAW_BLEND:
-        error = red_get_blend_ptr(slots, group_id, &red->u.blend, &qxl->u.blend, flags);
+        error = red_get_blend_ptr(slots, group_id, arena, &red->u.blend, &qxl->u.blend, flags);
         break;
     case QXL_DRAW_COPY:
-        error = red_get_copy_ptr(slots, group_id, &red->u.copy, &qxl->u.copy, flags);
+        error = red_get_copy_ptr(slots, group_id, arena, &red->u.copy, &qxl->u.copy, flags);
         break;
     case QXL_COPY_BITS:
         red_get_point_ptr(&red->u.copy_bits.src_pos, &qxl->u.copy_bits.src_pos);
@@ -1169,31 +1133,31 @@ static int red_get_compat_drawable(RedMemSlotInfo *slots, int group_id,
             (red->bbox.bottom - red->bbox.top);
         break;
     case QXL_DRAW_FILL:
-        red_get_fill_ptr(slots, group_id, &red->u.fill, &qxl->u.fill, flags);
+        red_get_fill_ptr(slots, group_id, arena, &red->u.fill, &qxl->u.fill, flags);
         break;
     case QXL_DRAW_OPAQUE:
-        red_get_opaque_ptr(slots, group_id, &red->u.opaque, &qxl->u.opaque, flags);
+        red_get_opaque_ptr(slots, group_id, arena, &red->u.opaque, &qxl->u.opaque, flags);
         break;
     case QXL_DRAW_INVERS:
-        red_get_invers_ptr(slots, group_id, &red->u.invers, &qxl->u.invers, flags);
+        red_get_invers_ptr(slots, group_id, arena, &red->u.invers, &qxl->u.invers, flags);
         break;
     case QXL_DRAW_NOP:
         break;
     case QXL_DRAW_ROP3:
-        red_get_rop3_ptr(slots, group_id, &red->u.rop3, &qxl->u.rop3, flags);
+        red_get_rop3_ptr(slots, group_id, arena, &red->u.rop3, &qxl->u.rop3, flags);
         break;
     case QXL_DRAW_STROKE:
-        error = red_get_stroke_ptr(slots, group_id, &red->u.stroke, &qxl->u.stroke, flags);
+        error = red_get_stroke_ptr(slots, group_id, arena, &red->u.stroke, &qxl->u.stroke, flags);
         break;
     case QXL_DRAW_TEXT:
-        red_get_text_ptr(slots, group_id, &red->u.text, &qxl->u.text, flags);
+        red_get_text_ptr(slots, group_id, arena, &red->u.text, &qxl->u.text, flags);
         break;
     case QXL_DRAW_TRANSPARENT:
-        red_get_transparent_ptr(slots, group_id,
+        red_get_transparent_ptr(slots, group_id, arena,
                                 &red->u.transparent, &qxl->u.transparent, flags);
         break;
     case QXL_DRAW_WHITENESS:
-        red_get_whiteness_ptr(slots, group_id,
+        red_get_whiteness_ptr(slots, group_id, arena,
                               &red->u.whiteness, &qxl->u.whiteness, flags);
         break;
     default:
@@ -1219,51 +1183,8 @@ int red_get_drawable(RedMemSlotInfo *slots, int group_id,
 
 void red_put_drawable(RedDrawable *red)
 {
-    red_put_clip(&red->clip);
-    if (red->self_bitmap_image) {
-        red_put_image(red->self_bitmap_image);
-    }
-    switch (red->type) {
-    case QXL_DRAW_ALPHA_BLEND:
-        red_put_alpha_blend(&red->u.alpha_blend);
-        break;
-    case QXL_DRAW_BLACKNESS:
-        red_put_blackness(&red->u.blackness);
-        break;
-    case QXL_DRAW_BLEND:
-        red_put_blend(&red->u.blend);
-        break;
-    case QXL_DRAW_COPY:
-        red_put_copy(&red->u.copy);
-        break;
-    case QXL_DRAW_FILL:
-        red_put_fill(&red->u.fill);
-        break;
-    case QXL_DRAW_OPAQUE:
-        red_put_opaque(&red->u.opaque);
-        break;
-    case QXL_DRAW_INVERS:
-        red_put_invers(&red->u.invers);
-        break;
-    case QXL_DRAW_ROP3:
-        red_put_rop3(&red->u.rop3);
-        break;
-    case QXL_DRAW_COMPOSITE:
-        red_put_composite(&red->u.composite);
-        break;
-    case QXL_DRAW_STROKE:
-        red_put_stroke(&red->u.stroke);
-        break;
-    case QXL_DRAW_TEXT:
-        red_put_text_ptr(&red->u.text);
-        break;
-    case QXL_DRAW_TRANSPARENT:
-        red_put_transparent(&red->u.transparent);
-        break;
-    case QXL_DRAW_WHITENESS:
-        red_put_whiteness(&red->u.whiteness);
-        break;
-    }
+    /* the parsed objects and the self bitmap are all in the arena */
+    red_parse_arena_free(&red->arena);
 }
 
 int red_get_update_cmd(RedMemSlotInfo *slots, int group_id,
@@ -1427,9 +1348,9 @@ static int red_get_cursor(RedMemSlotInfo *slots, int group_id,
 {
     QXLCursor *qxl;
     RedDataChunk chunks;
+    RedParseArena arena;
     size_t size;
     uint8_t *data;
-    bool free_data;
     int error;
 
     qxl = (QXLCursor *)memslot_get_virt(slots, addr, sizeof(*qxl), group_id, &error);
@@ -1446,21 +1367,20 @@ static int red_get_cursor(RedMemSlotInfo *slots, int group_id,
 
     red->flags = 0;
     red->data_size = qxl->data_size;
-    size = red_get_data_chunks_ptr(slots, group_id,
+    /* the shape outlives the command so only the chunks use the arena */
+    memset(&arena, 0, sizeof(arena));
+    size = red_get_data_chunks_ptr(slots, group_id, &arena,
                                    memslot_get_id(slots, addr),
                                    &chunks, &qxl->chunk);
     if (size == INVALID_SIZE) {
+        red_parse_arena_free(&arena);
         return 1;
     }
     red->data_size = MIN(red->data_size, size);
-    data = red_linearize_chunk(&chunks, size, &free_data);
-    red_put_data_chunks(&chunks);
-    if (free_data) {
-        red->data = data;
-    } else {
-        red->data = spice_malloc(size);
-        memcpy(red->data, data, size);
-    }
+    data = red_linearize_chunk(&arena, &chunks, size);
+    red->data = spice_malloc(size);
+    memcpy(red->data, data, size);
+    red_parse_arena_free(&arena);
     return 0;
 }
 
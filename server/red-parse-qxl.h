@@ -23,9 +23,39 @@
 
 #include "red-common.h"
 #include "memslot.h"
+#include "slab.h"
+
+/* Bytes of the arena kept in the drawable itself, enough for the clip and the
+ * images of the usual commands */
+#define RED_PARSE_ARENA_INLINE_SIZE 256
+
+typedef struct RedParseArenaBlock RedParseArenaBlock;
+typedef struct RedParseArenaChunks RedParseArenaChunks;
+
+/* The memory of the objects parsed from a command, like its clip, its paths,
+ * its strings and its images. They are all released at once by
+ * red_parse_arena_free(). A zeroed arena is empty and ready to use.
+ */
+typedef struct RedParseArena {
+    uint8_t *ptr;
+    size_t left;
+    RedParseArenaBlock *blocks;
+    /* the data of unstable images, which the encoders may replace by a copy */
+    RedParseArenaChunks *unstable_chunks;
+    uint32_t n_allocs;
+    uint32_t n_blocks;
+    uint64_t inline_data[RED_PARSE_ARENA_INLINE_SIZE / sizeof(uint64_t)];
+} RedParseArena;
+
+void *red_parse_arena_alloc(RedParseArena *arena, size_t size);
+void red_parse_arena_free(RedParseArena *arena);
+/* Replaces the data of the unstable images by a linear copy, so that their
+ * chunks are no longer modified when the images are compressed */
+void red_parse_arena_linearize_unstable(RedParseArena *arena);
 
 typedef struct RedDrawable {
     int refs;
+    Slab *slab; /* the one it was allocated from, NULL when it was malloc'ed */
     QXLInstance *qxl;
     QXLReleaseInfoExt release_info_ext;
     uint32_t surface_id;
@@ -57,11 +87,12 @@ typedef struct RedDrawable {
         SpiceWhiteness whiteness;
         SpiceComposite composite;
     } u;
+    RedParseArena arena; /* holds everything the fields above point to */
 } RedDrawable;
 
 static inline RedDrawable *red_drawable_ref(RedDrawable *drawable)
 {
-    drawable->refs++;
+    g_atomic_int_inc(&drawable->refs);
     return drawable;
 }
 
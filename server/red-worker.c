@@ -47,11 +47,33 @@
 #include "red-worker.h"
 #include "cursor-channel.h"
 #include "tree.h"
-
-#define CMD_RING_POLL_TIMEOUT 10 //milli
-#define CMD_RING_POLL_RETRIES 1
+#include "send-pool.h"
+
+/* When a command ring becomes empty, the worker polls it again a few times
+ * with an exponential backoff before asking the guest for a notification,
+ * which costs the guest a VM exit for each new command. It only does so if
+ * the commands came in at a rate the polling can keep up with. */
+#define CMD_RING_POLL_MIN_TIMEOUT 1 //milli
+#define CMD_RING_POLL_MAX_TIMEOUT 16 //milli
+#define CMD_RING_POLL_MAX_TRIES 5
+
+/* Commands are processed for at most this long before going back to the
+ * main loop. The slice is shorter when the clients have nothing left to
+ * send, so that the new drawings reach them sooner. */
+#define CMD_BATCH_MIN_BUDGET (NSEC_PER_SEC / 500)
+#define CMD_BATCH_MAX_BUDGET (NSEC_PER_SEC / 100)
 
 #define INF_EVENT_WAIT ~0
+/* how often the pipes are coalesced again while they are full, the clients
+ * which got blocked meanwhile may be behind now */
+#define COALESCE_RETRY_TIMEOUT 10 //milli
+
+typedef struct CommandRingPoll {
+    uint32_t tries;             // empty polls since the last command
+    gboolean notifying;         // waiting for a guest notification
+    uint64_t last_command;      // time of the last command, ns
+    uint64_t avg_interval;      // moving average of the time between commands
+} CommandRingPoll;
 
 struct RedWorker {
     pthread_t thread;
@@ -63,11 +85,11 @@ struct RedWorker {
     unsigned int event_timeout;
 
     DisplayChannel *display_channel;
-    uint32_t display_poll_tries;
+    CommandRingPoll display_poll;
     gboolean was_blocked;
 
     CursorChannel *cursor_channel;
-    uint32_t cursor_poll_tries;
+    CommandRingPoll cursor_poll;
 
     RedMemSlotInfo mem_slots;
 
@@ -80,6 +102,10 @@ struct RedWorker {
     StatNodeRef stat;
     uint64_t *wakeup_counter;
     uint64_t *command_counter;
+    uint64_t *poll_counter;
+    uint64_t *notification_counter;
+    uint64_t *poll_timeout_counter;
+    uint64_t *batch_budget_counter;
 #endif
 
     int driver_cap_monitors_config;
@@ -96,12 +122,82 @@ static int display_is_connected(RedWorker *worker)
 
 void red_drawable_unref(RedDrawable *red_drawable)
 {
-    if (--red_drawable->refs) {
+    /* the resource must be released from the worker thread */
+    if (send_pool_defer((SendPoolDeferFunc)red_drawable_unref, red_drawable)) {
         return;
     }
-    red_qxl_release_resource(red_drawable->qxl, red_drawable->release_info_ext);
+    if (!g_atomic_int_dec_and_test(&red_drawable->refs)) {
+        return;
+    }
+    /* the drawables made by the server, like the heat frames, have no qxl resource */
+    if (red_drawable->qxl) {
+        red_qxl_release_resource(red_drawable->qxl, red_drawable->release_info_ext);
+    }
     red_put_drawable(red_drawable);
-    free(red_drawable);
+    if (red_drawable->slab) {
+        slab_release(red_drawable->slab, red_drawable);
+    } else {
+        free(red_drawable);
+    }
+}
+
+static void command_ring_poll_got_command(CommandRingPoll *poll, uint64_t now)
+{
+    uint64_t interval = MIN(now - poll->last_command, NSEC_PER_SEC);
+
+    poll->avg_interval = (poll->avg_interval * 7 + interval) / 8;
+    poll->last_command = now;
+    poll->tries = 0;
+    poll->notifying = FALSE;
+}
+
+/* returns how long to wait before polling the empty ring again, or 0 if
+ * the guest should notify the next command */
+static unsigned int command_ring_poll_get_timeout(CommandRingPoll *poll)
+{
+    unsigned int timeout = CMD_RING_POLL_MIN_TIMEOUT << MIN(poll->tries, 16);
+
+    if (poll->tries >= CMD_RING_POLL_MAX_TRIES ||
+        poll->avg_interval > CMD_RING_POLL_MAX_TIMEOUT * NSEC_PER_MILLISEC) {
+        return 0;
+    }
+    return MIN(timeout, CMD_RING_POLL_MAX_TIMEOUT);
+}
+
+/* Returns TRUE if the caller should stop, FALSE if a command was queued
+ * meanwhile and can be read */
+static gboolean red_worker_command_ring_empty(RedWorker *worker, CommandRingPoll *poll,
+                                              int (*req_notification)(QXLInstance *qxl))
+{
+    unsigned int timeout;
+
+    if (poll->notifying) {
+        return TRUE;
+    }
+    timeout = command_ring_poll_get_timeout(poll);
+    if (timeout) {
+        worker->event_timeout = MIN(worker->event_timeout, timeout);
+        poll->tries++;
+        stat_inc_counter(reds, worker->poll_counter, 1);
+        stat_set_counter(reds, worker->poll_timeout_counter, timeout);
+        return TRUE;
+    }
+    if (!req_notification(worker->qxl)) {
+        return FALSE;
+    }
+    poll->notifying = TRUE;
+    stat_inc_counter(reds, worker->notification_counter, 1);
+    stat_set_counter(reds, worker->poll_timeout_counter, 0);
+    return TRUE;
+}
+
+static uint64_t red_process_display_budget(RedWorker *worker)
+{
+    int pipe_size = MIN(red_channel_max_pipe_size(RED_CHANNEL(worker->display_channel)),
+                        MAX_PIPE_SIZE);
+
+    return CMD_BATCH_MIN_BUDGET +
+           (CMD_BATCH_MAX_BUDGET - CMD_BATCH_MIN_BUDGET) * pipe_size / MAX_PIPE_SIZE;
 }
 
 static int red_process_cursor(RedWorker *worker, int *ring_is_empty)
@@ -118,13 +214,10 @@ static int red_process_cursor(RedWorker *worker, int *ring_is_empty)
     while (red_channel_max_pipe_size(RED_CHANNEL(worker->cursor_channel)) <= MAX_PIPE_SIZE) {
         if (!red_qxl_get_cursor_command(worker->qxl, &ext_cmd)) {
             *ring_is_empty = TRUE;
-            if (worker->cursor_poll_tries < CMD_RING_POLL_RETRIES) {
-                worker->event_timeout = MIN(worker->event_timeout, CMD_RING_POLL_TIMEOUT);
-            } else if (worker->cursor_poll_tries == CMD_RING_POLL_RETRIES &&
-                       !red_qxl_req_cursor_notification(worker->qxl)) {
+            if (!red_worker_command_ring_empty(worker, &worker->cursor_poll,
+                                               red_qxl_req_cursor_notification)) {
                 continue;
             }
-            worker->cursor_poll_tries++;
             return n;
         }
 
@@ -132,7 +225,7 @@ static int red_process_cursor(RedWorker *worker, int *ring_is_empty)
             red_record_qxl_command(worker->record, &worker->mem_slots, ext_cmd);
         }
 
-        worker->cursor_poll_tries = 0;
+        command_ring_poll_got_command(&worker->cursor_poll, spice_get_monotonic_time_ns());
         switch (ext_cmd.cmd.type) {
         case QXL_CMD_CURSOR: {
             RedCursorCmd *cursor = spice_new0(RedCursorCmd, 1);
@@ -155,39 +248,37 @@ static int red_process_cursor(RedWorker *worker, int *ring_is_empty)
     return n;
 }
 
-static RedDrawable *red_drawable_new(QXLInstance *qxl)
-{
-    RedDrawable * red = spice_new0(RedDrawable, 1);
-
-    red->refs = 1;
-    red->qxl = qxl;
-
-    return red;
-}
-
 static int red_process_display(RedWorker *worker, int *ring_is_empty)
 {
     QXLCommandExt ext_cmd;
     int n = 0;
     uint64_t start = spice_get_monotonic_time_ns();
+    uint64_t now = start;
+    uint64_t budget;
 
     if (!worker->running) {
         *ring_is_empty = TRUE;
         return n;
     }
 
+    budget = red_process_display_budget(worker);
+    stat_set_counter(reds, worker->batch_budget_counter, budget / NSEC_PER_MICROSEC);
     worker->process_display_generation++;
     *ring_is_empty = FALSE;
-    while (red_channel_max_pipe_size(RED_CHANNEL(worker->display_channel)) <= MAX_PIPE_SIZE) {
+    /* once per batch: after a merge the run at the head of a pipe starts
+     * with the merged image, coalescing before each command would render
+     * and read back a growing area over and over */
+    display_channel_coalesce_pipes(worker->display_channel);
+    for (;;) {
+        if (!display_channel_pipes_have_room(worker->display_channel)) {
+            break;
+        }
         if (!red_qxl_get_command(worker->qxl, &ext_cmd)) {
             *ring_is_empty = TRUE;
-            if (worker->display_poll_tries < CMD_RING_POLL_RETRIES) {
-                worker->event_timeout = MIN(worker->event_timeout, CMD_RING_POLL_TIMEOUT);
-            } else if (worker->display_poll_tries == CMD_RING_POLL_RETRIES &&
-                       !red_qxl_req_cmd_notification(worker->qxl)) {
+            if (!red_worker_command_ring_empty(worker, &worker->display_poll,
+                                               red_qxl_req_cmd_notification)) {
                 continue;
             }
-            worker->display_poll_tries++;
             return n;
         }
 
@@ -196,10 +287,11 @@ static int red_process_display(RedWorker *worker, int *ring_is_empty)
         }
 
         stat_inc_counter(reds, worker->command_counter, 1);
-        worker->display_poll_tries = 0;
+        command_ring_poll_got_command(&worker->display_poll, now);
         switch (ext_cmd.cmd.type) {
         case QXL_CMD_DRAW: {
-            RedDrawable *red_drawable = red_drawable_new(worker->qxl); // returns with 1 ref
+            RedDrawable *red_drawable = display_channel_red_drawable_new(worker->display_channel,
+                                                                         worker->qxl); // returns with 1 ref
 
             if (!red_get_drawable(&worker->mem_slots, ext_cmd.group_id,
                                  red_drawable, ext_cmd.cmd.data, ext_cmd.flags)) {
@@ -257,20 +349,24 @@ static int red_process_display(RedWorker *worker, int *ring_is_empty)
             spice_error("bad command type");
         }
         n++;
+        now = spice_get_monotonic_time_ns();
         if (red_channel_all_blocked(RED_CHANNEL(worker->display_channel))
-            || spice_get_monotonic_time_ns() - start > NSEC_PER_SEC / 100) {
+            || now - start > budget) {
             worker->event_timeout = 0;
             return n;
         }
     }
     worker->was_blocked = TRUE;
+    if (display_channel_get_coalesce_pipes(worker->display_channel)) {
+        worker->event_timeout = MIN(worker->event_timeout, COALESCE_RETRY_TIMEOUT);
+    }
     return n;
 }
 
 static bool red_process_is_blocked(RedWorker *worker)
 {
     return red_channel_max_pipe_size(RED_CHANNEL(worker->cursor_channel)) > MAX_PIPE_SIZE ||
-           red_channel_max_pipe_size(RED_CHANNEL(worker->display_channel)) > MAX_PIPE_SIZE;
+           !display_channel_pipes_have_room(worker->display_channel);
 }
 
 static void red_disconnect_display(RedWorker *worker)
@@ -1299,6 +1395,8 @@ static gboolean worker_source_dispatch(GSource *source, GSourceFunc callback,
     worker->was_blocked = FALSE;
     red_process_cursor(worker, &ring_is_empty);
     red_process_display(worker, &ring_is_empty);
+    display_channel_add_heat_frame(display, worker->process_display_generation);
+    display_channel_push_in_threads(display);
 
     return TRUE;
 }
@@ -1350,6 +1448,13 @@ RedWorker* red_worker_new(QXLInstance *qxl,
     worker->stat = stat_add_node(reds, INVALID_STAT_REF, worker_str, TRUE);
     worker->wakeup_counter = stat_add_counter(reds, worker->stat, "wakeups", TRUE);
     worker->command_counter = stat_add_counter(reds, worker->stat, "commands", TRUE);
+    worker->poll_counter = stat_add_counter(reds, worker->stat, "ring_polls", TRUE);
+    worker->notification_counter = stat_add_counter(reds, worker->stat,
+                                                    "ring_notifications", TRUE);
+    worker->poll_timeout_counter = stat_add_counter(reds, worker->stat,
+                                                    "ring_poll_timeout_ms", TRUE);
+    worker->batch_budget_counter = stat_add_counter(reds, worker->stat,
+                                                    "batch_budget_us", TRUE);
 #endif
 
     worker->dispatch_watch =
@@ -24,6 +24,10 @@
 #include <unistd.h>
 #include <sys/socket.h>
 #include <fcntl.h>
+#ifdef HAVE_LINUX_ERRQUEUE_H
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#endif
 
 #include <glib.h>
 
@@ -36,6 +40,33 @@
 #include "reds-stream.h"
 #include "reds.h"
 
+#if defined(HAVE_LINUX_ERRQUEUE_H) && defined(SO_EE_ORIGIN_ZEROCOPY) && \
+    defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#define USE_ZEROCOPY
+#endif
+
+/* smaller sends are always copied, pinning the pages and handling the
+ * completion would cost more than the copy */
+#define ZEROCOPY_MIN_SIZE (32 * 1024)
+/* the completions are read once per message, and during long messages
+ * every so many zero copy sends so that the socket option memory they
+ * hold in the kernel does not run out */
+#define ZEROCOPY_POLL_SENDS 16
+
+/* a TLS record carries at most 16KiB of data */
+#define SSL_COALESCE_MAX_SIZE (16 * 1024)
+
+typedef struct ZeroCopyRelease {
+    uint32_t id;    /* released when all the sends before this one completed */
+    GDestroyNotify release;
+    gpointer data;
+} ZeroCopyRelease;
+
+typedef struct ZeroCopyRange {
+    uint32_t lo;
+    uint32_t hi;
+} ZeroCopyRange;
+
 struct AsyncRead {
     RedsStream *stream;
     void *opaque;
@@ -79,6 +110,12 @@ typedef struct RedsSASL {
 
 struct RedsStreamPrivate {
     SSL *ssl;
+    /* small writes are gathered here to be encrypted in a single record,
+     * see stream_ssl_writev_cb() */
+    uint8_t *ssl_out;
+    size_t ssl_out_size;
+    size_t ssl_out_len;
+    bool ssl_out_retry;
 
 #if HAVE_SASL
     RedsSASL sasl;
@@ -96,6 +133,16 @@ struct RedsStreamPrivate {
     ssize_t (*write)(RedsStream *s, const void *buf, size_t nbyte);
     ssize_t (*writev)(RedsStream *s, const struct iovec *iov, int iovcnt);
 
+    /* MSG_ZEROCOPY state: the kernel numbers the zero copy sends of the
+     * socket and reports ranges of completed ones in the error queue. The
+     * memory passed to these sends must stay untouched until then. */
+    bool zerocopy;
+    uint32_t zerocopy_next_id;
+    uint32_t zerocopy_done_id;      // all sends before this one completed
+    uint32_t zerocopy_polled_id;    // zerocopy_next_id when last polled
+    GArray *zerocopy_done_ranges;   // ranges completed out of order
+    GQueue zerocopy_releases;
+
     RedsState *reds;
 };
 
@@ -133,25 +180,230 @@ static ssize_t stream_writev_cb(RedsStream *s, const struct iovec *iov, int iovc
     return ret;
 }
 
+#ifdef USE_ZEROCOPY
+static void stream_zerocopy_complete(RedsStream *s, uint32_t lo, uint32_t hi)
+{
+    RedsStreamPrivate *priv = s->priv;
+    ZeroCopyRange range = { lo, hi };
+    gboolean merged;
+    guint i;
+
+    if (lo != priv->zerocopy_done_id) {
+        if (!priv->zerocopy_done_ranges) {
+            priv->zerocopy_done_ranges = g_array_new(FALSE, FALSE, sizeof(ZeroCopyRange));
+        }
+        g_array_append_val(priv->zerocopy_done_ranges, range);
+        return;
+    }
+
+    priv->zerocopy_done_id = hi + 1;
+    do {
+        merged = FALSE;
+        for (i = 0; priv->zerocopy_done_ranges && i < priv->zerocopy_done_ranges->len; i++) {
+            ZeroCopyRange *r = &g_array_index(priv->zerocopy_done_ranges, ZeroCopyRange, i);
+
+            if (r->lo == priv->zerocopy_done_id) {
+                priv->zerocopy_done_id = r->hi + 1;
+                g_array_remove_index_fast(priv->zerocopy_done_ranges, i);
+                merged = TRUE;
+                break;
+            }
+        }
+    } while (merged);
+}
+
+/* reads the completion notifications from the error queue */
+static void stream_zerocopy_read_completions(RedsStream *s)
+{
+    for (;;) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+        struct msghdr msg;
+        struct cmsghdr *cmsg;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(s->socket, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            struct sock_extended_err *serr;
+
+            if (!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+                  (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))) {
+                continue;
+            }
+            serr = (struct sock_extended_err *) CMSG_DATA(cmsg);
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            if ((serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) && s->priv->zerocopy) {
+                /* the device or the route (loopback) cannot send from our
+                 * pages, the kernel copied them anyway */
+                spice_debug("zero copy send not supported on fd %d, disabling", s->socket);
+                s->priv->zerocopy = false;
+            }
+            stream_zerocopy_complete(s, serr->ee_info, serr->ee_data);
+        }
+    }
+}
+
+static ssize_t stream_writev_zerocopy_cb(RedsStream *s, const struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg;
+    size_t size = 0;
+    ssize_t n;
+    int i;
+
+    if (s->priv->zerocopy_next_id - s->priv->zerocopy_polled_id >= ZEROCOPY_POLL_SENDS) {
+        reds_stream_zerocopy_pending(s);
+    }
+
+#ifdef IOV_MAX
+    iovcnt = MIN(iovcnt, IOV_MAX);
+#endif
+    for (i = 0; i < iovcnt; i++) {
+        size += iov[i].iov_len;
+    }
+    if (!s->priv->zerocopy || size < ZEROCOPY_MIN_SIZE) {
+        return stream_writev_cb(s, iov, iovcnt);
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec *) iov;
+    msg.msg_iovlen = iovcnt;
+    n = sendmsg(s->socket, &msg, MSG_ZEROCOPY);
+    if (n < 0 && errno == ENOBUFS) {
+        /* not enough socket option memory to pin the pages */
+        return stream_writev_cb(s, iov, iovcnt);
+    }
+    if (n > 0) {
+        s->priv->zerocopy_next_id++;
+    }
+    return n;
+}
+#endif
+
 static ssize_t stream_read_cb(RedsStream *s, void *buf, size_t size)
 {
     return read(s->socket, buf, size);
 }
 
+/* the callers of the write functions look at errno, which SSL_write() does
+ * not always set */
+static void stream_ssl_set_errno(RedsStream *s, int return_code)
+{
+    switch (SSL_get_error(s->priv->ssl, return_code)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        break;
+    default:
+        errno = EPIPE;
+        break;
+    }
+}
+
+/* sends the coalesced data, returns 0 on success or -1 with errno set.
+ * After a failure SSL_write() must be retried with the same buffer and
+ * length, nothing can be appended until the buffer was sent. */
+static int stream_ssl_flush(RedsStream *s)
+{
+    RedsStreamPrivate *priv = s->priv;
+    int return_code;
+
+    if (priv->ssl_out_len == 0) {
+        return 0;
+    }
+    return_code = SSL_write(priv->ssl, priv->ssl_out, priv->ssl_out_len);
+    if (return_code <= 0) {
+        stream_ssl_set_errno(s, return_code);
+        priv->ssl_out_retry = true;
+        return -1;
+    }
+    priv->ssl_out_len = 0;
+    priv->ssl_out_retry = false;
+    return 0;
+}
+
 static ssize_t stream_ssl_write_cb(RedsStream *s, const void *buf, size_t size)
 {
     int return_code;
-    SPICE_GNUC_UNUSED int ssl_error;
 
+    /* keep the order of the data coalesced by stream_ssl_writev_cb() */
+    if (stream_ssl_flush(s) < 0) {
+        return -1;
+    }
     return_code = SSL_write(s->priv->ssl, buf, size);
 
-    if (return_code < 0) {
-        ssl_error = SSL_get_error(s->priv->ssl, return_code);
+    if (return_code <= 0) {
+        stream_ssl_set_errno(s, return_code);
+        return -1;
     }
 
     return return_code;
 }
 
+/* Each SSL_write() produces at least one record with its own header, MAC
+ * and padding, and one system call. The buffers are copied to a
+ * per-stream buffer instead which is encrypted when it is full or when
+ * the caller is done sending with reds_stream_flush(), so small messages
+ * sent one after another share a record. Large buffers are still written
+ * directly. */
+static ssize_t stream_ssl_writev_cb(RedsStream *s, const struct iovec *iov, int iovcnt)
+{
+    RedsStreamPrivate *priv = s->priv;
+    ssize_t ret = 0;
+    int i;
+
+    if (priv->ssl_out_retry && stream_ssl_flush(s) < 0) {
+        return -1;
+    }
+
+    for (i = 0; i < iovcnt; i++) {
+        const uint8_t *data = iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+
+        while (len > 0) {
+            size_t now;
+
+            if (priv->ssl_out_len == 0 && len >= priv->ssl_out_size) {
+                int return_code = SSL_write(priv->ssl, data, len);
+
+                if (return_code <= 0) {
+                    if (ret == 0) {
+                        stream_ssl_set_errno(s, return_code);
+                        return -1;
+                    }
+                    return ret;
+                }
+                ret += return_code;
+                data += return_code;
+                len -= return_code;
+                continue;
+            }
+
+            now = MIN(len, priv->ssl_out_size - priv->ssl_out_len);
+            memcpy(priv->ssl_out + priv->ssl_out_len, data, now);
+            priv->ssl_out_len += now;
+            ret += now;
+            data += now;
+            len -= now;
+            /* the data is accepted even if the record cannot be sent yet,
+             * the next call will fail with EAGAIN until it is */
+            if (priv->ssl_out_len == priv->ssl_out_size && stream_ssl_flush(s) < 0) {
+                return ret;
+            }
+        }
+    }
+
+    return ret;
+}
+
 static ssize_t stream_ssl_read_cb(RedsStream *s, void *buf, size_t size)
 {
     int return_code;
@@ -340,11 +592,33 @@ void reds_stream_free(RedsStream *s)
     if (s->priv->ssl) {
         SSL_free(s->priv->ssl);
     }
+    g_free(s->priv->ssl_out);
 
     reds_stream_remove_watch(s);
+
+    /* on a graceful close the kernel would keep sending the queued data
+     * from the pages of the pending zero copy sends once they are released
+     * and reused, reset the connection so that the send queue is dropped */
+    if (!g_queue_is_empty(&s->priv->zerocopy_releases)) {
+        struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+
+        if (setsockopt(s->socket, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger)) < 0) {
+            spice_warning("SO_LINGER failed on fd %d: %s", s->socket, strerror(errno));
+        }
+    }
     spice_info("close socket fd %d", s->socket);
     close(s->socket);
 
+    while (!g_queue_is_empty(&s->priv->zerocopy_releases)) {
+        ZeroCopyRelease *release = g_queue_pop_head(&s->priv->zerocopy_releases);
+
+        release->release(release->data);
+        g_free(release);
+    }
+    if (s->priv->zerocopy_done_ranges) {
+        g_array_free(s->priv->zerocopy_done_ranges, TRUE);
+    }
+
     free(s);
 }
 
@@ -395,6 +669,7 @@ RedsStream *reds_stream_new(RedsState *reds, int socket)
     stream->priv->read = stream_read_cb;
     stream->priv->write = stream_write_cb;
     stream->priv->writev = stream_writev_cb;
+    g_queue_init(&stream->priv->zerocopy_releases);
 
     return stream;
 }
@@ -417,6 +692,95 @@ void reds_stream_disable_writev(RedsStream *stream)
     stream->priv->writev = NULL;
 }
 
+int reds_stream_flush(RedsStream *stream)
+{
+    if (stream->priv->ssl_out_len == 0) {
+        return 0;
+    }
+    return stream_ssl_flush(stream);
+}
+
+bool reds_stream_enable_zerocopy(RedsStream *stream)
+{
+#ifdef USE_ZEROCOPY
+    int one = 1;
+
+    /* the kernel TLS layer does not support MSG_ZEROCOPY */
+    if (stream->priv->writev != stream_writev_cb || stream->priv->ssl ||
+        reds_stream_get_family(stream) == AF_UNIX) {
+        return false;
+    }
+    if (setsockopt(stream->socket, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+        spice_debug("SO_ZEROCOPY failed on fd %d: %s", stream->socket, strerror(errno));
+        return false;
+    }
+    stream->priv->zerocopy = true;
+    stream->priv->writev = stream_writev_zerocopy_cb;
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool reds_stream_zerocopy_pending(RedsStream *stream)
+{
+#ifdef USE_ZEROCOPY
+    RedsStreamPrivate *priv = stream->priv;
+
+    /* no system call unless some sends are not completed yet */
+    if (priv->zerocopy_next_id == priv->zerocopy_done_id) {
+        return false;
+    }
+
+    priv->zerocopy_polled_id = priv->zerocopy_next_id;
+    stream_zerocopy_read_completions(stream);
+    while (!g_queue_is_empty(&priv->zerocopy_releases)) {
+        ZeroCopyRelease *release = g_queue_peek_head(&priv->zerocopy_releases);
+
+        if ((int32_t)(priv->zerocopy_done_id - release->id) < 0) {
+            break;
+        }
+        g_queue_pop_head(&priv->zerocopy_releases);
+        release->release(release->data);
+        g_free(release);
+    }
+    return priv->zerocopy_next_id != priv->zerocopy_done_id;
+#else
+    return false;
+#endif
+}
+
+void reds_stream_release_after_send(RedsStream *stream, GDestroyNotify release, gpointer data)
+{
+    ZeroCopyRelease *item;
+
+    if (!reds_stream_zerocopy_pending(stream)) {
+        release(data);
+        return;
+    }
+
+    item = g_new(ZeroCopyRelease, 1);
+    item->id = stream->priv->zerocopy_next_id;
+    item->release = release;
+    item->data = data;
+    g_queue_push_tail(&stream->priv->zerocopy_releases, item);
+}
+
+/* When OpenSSL could hand the session keys to the kernel, the socket
+ * encrypts what is written to it: the data can be sent with plain write()
+ * and writev() calls instead of one SSL_write() per buffer. Reads still go
+ * through SSL_read() which handles the control messages. */
+static void stream_ssl_check_ktls(RedsStream *s)
+{
+#ifdef SSL_OP_ENABLE_KTLS
+    if (BIO_get_ktls_send(SSL_get_wbio(s->priv->ssl))) {
+        spice_debug("kernel TLS enabled on fd %d", s->socket);
+        s->priv->write = stream_write_cb;
+        s->priv->writev = stream_writev_cb;
+    }
+#endif
+}
+
 RedsStreamSslStatus reds_stream_ssl_accept(RedsStream *stream)
 {
     int ssl_error;
@@ -424,6 +788,7 @@ RedsStreamSslStatus reds_stream_ssl_accept(RedsStream *stream)
 
     return_code = SSL_accept(stream->priv->ssl);
     if (return_code == 1) {
+        stream_ssl_check_ktls(stream);
         return REDS_STREAM_SSL_STATUS_OK;
     }
 
@@ -448,6 +813,7 @@ RedsStreamSslStatus reds_stream_ssl_accept(RedsStream *stream)
 int reds_stream_enable_ssl(RedsStream *stream, SSL_CTX *ctx)
 {
     BIO *sbio;
+    const char *coalesce;
 
     // Handle SSL handshaking
     if (!(sbio = BIO_new_socket(stream->socket, BIO_NOCLOSE))) {
@@ -468,6 +834,16 @@ int reds_stream_enable_ssl(RedsStream *stream, SSL_CTX *ctx)
     stream->priv->read = stream_ssl_read_cb;
     stream->priv->writev = NULL;
 
+    coalesce = getenv("SPICE_SSL_COALESCE");
+    if (coalesce != NULL) {
+        int size = atoi(coalesce);
+
+        stream->priv->ssl_out_size = size > 0 ? MIN(size, SSL_COALESCE_MAX_SIZE) :
+                                                SSL_COALESCE_MAX_SIZE;
+        stream->priv->ssl_out = g_malloc(stream->priv->ssl_out_size);
+        stream->priv->writev = stream_ssl_writev_cb;
+    }
+
     return reds_stream_ssl_accept(stream);
 }
 
@@ -61,6 +61,18 @@ bool reds_stream_write_all(RedsStream *stream, const void *in_buf, size_t n);
 bool reds_stream_write_u8(RedsStream *s, uint8_t n);
 bool reds_stream_write_u32(RedsStream *s, uint32_t n);
 void reds_stream_disable_writev(RedsStream *stream);
+/* Sends the data kept by reds_stream_writev() to be coalesced with the
+ * next writes (SSL streams only), returns 0 or -1 with errno set */
+int reds_stream_flush(RedsStream *stream);
+/* Large writev() calls are done with MSG_ZEROCOPY if the socket supports
+ * it, the buffers must then be released with reds_stream_release_after_send() */
+bool reds_stream_enable_zerocopy(RedsStream *stream);
+/* Processes the completed zero copy sends, returns whether some are still
+ * in progress. Meant to be called once per message, the error queue of the
+ * socket is only read when some sends are in progress. */
+bool reds_stream_zerocopy_pending(RedsStream *stream);
+/* Calls release(data) once the kernel is done with all the data sent so far */
+void reds_stream_release_after_send(RedsStream *stream, GDestroyNotify release, gpointer data);
 void reds_stream_free(RedsStream *s);
 
 void reds_stream_push_channel_event(RedsStream *s, int event);
@@ -2767,6 +2767,13 @@ static int reds_init_ssl(RedsState *reds)
     /* Limit connection to TLSv1 only */
 #ifdef SSL_OP_NO_COMPRESSION
     ssl_options |= SSL_OP_NO_COMPRESSION;
+#endif
+#ifdef SSL_OP_ENABLE_KTLS
+    /* let OpenSSL move the encryption to the kernel when the tls module
+     * and the negotiated cipher allow it, see reds_stream_ssl_accept() */
+    if (getenv("SPICE_KTLS") != NULL) {
+        ssl_options |= SSL_OP_ENABLE_KTLS;
+    }
 #endif
     SSL_CTX_set_options(reds->ctx, ssl_options);
 
@@ -0,0 +1,219 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <pthread.h>
+#include <signal.h>
+
+#include "send-pool.h"
+
+#define SEND_POOL_MAX_THREADS 16
+
+typedef struct SendPoolDeferred {
+    SendPoolDeferFunc func;
+    void *data;
+} SendPoolDeferred;
+
+struct SendPool {
+    pthread_mutex_t lock;
+    pthread_cond_t jobs_cond;   // signalled when clients are queued or on quit
+    pthread_cond_t done_cond;   // signalled when the last client was pushed
+    GList *rccs;                // the clients left to push
+    int n_pushing;              // the clients being pushed
+    GArray *deferred;
+    int quit;
+
+    int n_threads;
+    pthread_t threads[0];
+};
+
+/* the pool for which the current thread pushes clients */
+static pthread_key_t send_pool_key;
+static pthread_once_t send_pool_key_once = PTHREAD_ONCE_INIT;
+
+static void send_pool_key_init(void)
+{
+    pthread_key_create(&send_pool_key, NULL);
+}
+
+static SendPool *send_pool_get_current(void)
+{
+    pthread_once(&send_pool_key_once, send_pool_key_init);
+    return pthread_getspecific(send_pool_key);
+}
+
+/* must be called with the pool lock held, which is released meanwhile */
+static void send_pool_push_next(SendPool *pool)
+{
+    RedChannelClient *rcc = pool->rccs->data;
+
+    pool->rccs = g_list_delete_link(pool->rccs, pool->rccs);
+    pool->n_pushing++;
+    pthread_mutex_unlock(&pool->lock);
+
+    red_channel_client_push(rcc);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->n_pushing--;
+    if (pool->rccs == NULL && pool->n_pushing == 0) {
+        pthread_cond_signal(&pool->done_cond);
+    }
+}
+
+static void *send_pool_thread_main(void *opaque)
+{
+    SendPool *pool = opaque;
+
+    pthread_setspecific(send_pool_key, pool);
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->quit && pool->rccs == NULL) {
+            pthread_cond_wait(&pool->jobs_cond, &pool->lock);
+        }
+        if (pool->quit) {
+            break;
+        }
+        send_pool_push_next(pool);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+SendPool *send_pool_new(int n_threads)
+{
+    SendPool *pool;
+    sigset_t thread_sig_mask;
+    sigset_t curr_sig_mask;
+    int i;
+
+    spice_return_val_if_fail(n_threads > 0, NULL);
+
+    pthread_once(&send_pool_key_once, send_pool_key_init);
+
+    n_threads = MIN(n_threads, SEND_POOL_MAX_THREADS);
+    pool = spice_malloc0(sizeof(SendPool) + n_threads * sizeof(pthread_t));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->jobs_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    pool->deferred = g_array_new(FALSE, FALSE, sizeof(SendPoolDeferred));
+
+    /* the threads are not supposed to handle any signal, see red_worker_run() */
+    sigfillset(&thread_sig_mask);
+    sigdelset(&thread_sig_mask, SIGILL);
+    sigdelset(&thread_sig_mask, SIGFPE);
+    sigdelset(&thread_sig_mask, SIGSEGV);
+    pthread_sigmask(SIG_SETMASK, &thread_sig_mask, &curr_sig_mask);
+    for (i = 0; i < n_threads; i++) {
+        int r;
+
+        if ((r = pthread_create(&pool->threads[pool->n_threads], NULL,
+                                send_pool_thread_main, pool))) {
+            spice_warning("create send thread failed %d", r);
+            break;
+        }
+        pool->n_threads++;
+    }
+    pthread_sigmask(SIG_SETMASK, &curr_sig_mask, NULL);
+
+    if (pool->n_threads == 0) {
+        send_pool_free(pool);
+        return NULL;
+    }
+    spice_debug("send pool with %d threads", pool->n_threads);
+    return pool;
+}
+
+void send_pool_free(SendPool *pool)
+{
+    int i;
+
+    if (!pool) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = TRUE;
+    pthread_cond_broadcast(&pool->jobs_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->n_threads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    spice_warn_if_fail(pool->deferred->len == 0);
+    g_array_unref(pool->deferred);
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_cond_destroy(&pool->jobs_cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+int send_pool_get_n_threads(SendPool *pool)
+{
+    return pool ? pool->n_threads : 0;
+}
+
+void send_pool_push(SendPool *pool, GList *rccs)
+{
+    guint i;
+
+    spice_return_if_fail(send_pool_get_current() == NULL);
+
+    pthread_setspecific(send_pool_key, pool);
+    pthread_mutex_lock(&pool->lock);
+    pool->rccs = g_list_copy(rccs);
+    pthread_cond_broadcast(&pool->jobs_cond);
+    while (pool->rccs != NULL) {
+        send_pool_push_next(pool);
+    }
+    while (pool->n_pushing > 0) {
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    pthread_setspecific(send_pool_key, NULL);
+
+    /* the pool threads are idle, and the releases are not deferred anymore */
+    for (i = 0; i < pool->deferred->len; i++) {
+        SendPoolDeferred *deferred = &g_array_index(pool->deferred, SendPoolDeferred, i);
+
+        deferred->func(deferred->data);
+    }
+    g_array_set_size(pool->deferred, 0);
+}
+
+gboolean send_pool_defer(SendPoolDeferFunc func, void *data)
+{
+    SendPool *pool = send_pool_get_current();
+    SendPoolDeferred deferred = { func, data };
+
+    if (!pool) {
+        return FALSE;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    g_array_append_val(pool->deferred, deferred);
+    pthread_mutex_unlock(&pool->lock);
+
+    return TRUE;
+}
+
+gboolean send_pool_in_thread(void)
+{
+    return send_pool_get_current() != NULL;
+}
@@ -0,0 +1,55 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef SEND_POOL_H_
+#define SEND_POOL_H_
+
+#include <glib.h>
+
+#include "red-channel-client.h"
+
+/* A pool of threads pushing the pipes of several channel clients at the
+ * same time, so that marshalling and compressing the items of each client
+ * runs on its own core.
+ *
+ * The thread calling send_pool_push() owns the channel state: it waits
+ * for all the clients to be pushed and does not change anything
+ * meanwhile. The objects of that thread which are not thread safe, like
+ * the drawables, are only read by the pool threads; releasing them is
+ * handed back with send_pool_defer() and done by send_pool_push() before
+ * it returns. The encoders replace the chunks of the unstable images by a
+ * linear copy, which the worker does beforehand for the drawables it
+ * processes, see red_parse_arena_linearize_unstable().
+ */
+
+typedef struct SendPool SendPool;
+typedef void (*SendPoolDeferFunc)(void *data);
+
+SendPool *send_pool_new(int n_threads);
+void send_pool_free(SendPool *pool);
+int send_pool_get_n_threads(SendPool *pool);
+
+/* Pushes each client of the list with red_channel_client_push(), the
+ * calling thread helps the pool threads. The clients must have been
+ * prepared with red_channel_client_prepare_push_in_thread(). */
+void send_pool_push(SendPool *pool, GList *rccs);
+
+/* Returns FALSE when not called from send_pool_push(). Otherwise func
+ * will be called with data once all the clients have been pushed, from
+ * the thread which called send_pool_push(). */
+gboolean send_pool_defer(SendPoolDeferFunc func, void *data);
+gboolean send_pool_in_thread(void);
+
+#endif /* SEND_POOL_H_ */
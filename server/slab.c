@@ -0,0 +1,157 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "red-common.h"
+#include "stat.h"
+#include "slab.h"
+
+/* enough for any of the types of the objects */
+#define SLAB_ALIGN 16
+#define SLAB_ROUND_UP(size) (((size) + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1))
+
+typedef struct SlabObject SlabObject;
+struct SlabObject {
+    SlabObject *next;
+};
+
+typedef struct SlabChunk SlabChunk;
+struct SlabChunk {
+    SlabChunk *next;
+};
+
+struct Slab {
+    size_t object_size;
+    uint32_t chunk_objects;
+    uint32_t max_objects;
+    uint32_t n_used;
+    uint32_t capacity;
+    SlabObject *free_objects;
+    SlabChunk *chunks;
+
+    uint64_t *used_counter;
+    uint64_t *capacity_counter;
+};
+
+Slab *slab_new(size_t object_size, uint32_t chunk_objects, uint32_t max_objects)
+{
+    Slab *slab;
+
+    spice_return_val_if_fail(chunk_objects > 0, NULL);
+
+    slab = spice_new0(Slab, 1);
+    slab->object_size = SLAB_ROUND_UP(MAX(object_size, sizeof(SlabObject)));
+    slab->chunk_objects = chunk_objects;
+    slab->max_objects = max_objects;
+    return slab;
+}
+
+void slab_free(Slab *slab)
+{
+    if (!slab) {
+        return;
+    }
+    /* the objects still used would point to freed memory */
+    if (slab->n_used != 0) {
+        spice_warning("%u objects still in use, the slab is leaked", slab->n_used);
+        return;
+    }
+    while (slab->chunks) {
+        SlabChunk *next = slab->chunks->next;
+
+        free(slab->chunks);
+        slab->chunks = next;
+    }
+    free(slab);
+}
+
+static gboolean slab_grow(Slab *slab)
+{
+    uint32_t n_objects = slab->chunk_objects;
+    SlabChunk *chunk;
+    uint8_t *objects;
+
+    if (slab->max_objects) {
+        if (slab->capacity >= slab->max_objects) {
+            return FALSE;
+        }
+        n_objects = MIN(n_objects, slab->max_objects - slab->capacity);
+    }
+
+    chunk = spice_malloc(SLAB_ROUND_UP(sizeof(SlabChunk)) + n_objects * slab->object_size);
+    chunk->next = slab->chunks;
+    slab->chunks = chunk;
+
+    /* linked backwards so that they are allocated in memory order */
+    objects = (uint8_t *)chunk + SLAB_ROUND_UP(sizeof(SlabChunk));
+    while (n_objects--) {
+        SlabObject *object = (SlabObject *)(objects + n_objects * slab->object_size);
+
+        object->next = slab->free_objects;
+        slab->free_objects = object;
+        slab->capacity++;
+    }
+    stat_set_counter(reds, slab->capacity_counter, slab->capacity);
+
+    return TRUE;
+}
+
+void *slab_alloc(Slab *slab)
+{
+    SlabObject *object;
+
+    if (!slab->free_objects && !slab_grow(slab)) {
+        return NULL;
+    }
+    object = slab->free_objects;
+    slab->free_objects = object->next;
+    slab->n_used++;
+    stat_set_counter(reds, slab->used_counter, slab->n_used);
+
+    return object;
+}
+
+void slab_release(Slab *slab, void *object)
+{
+    SlabObject *free_object = object;
+
+    spice_return_if_fail(slab->n_used > 0);
+
+    free_object->next = slab->free_objects;
+    slab->free_objects = free_object;
+    slab->n_used--;
+    stat_set_counter(reds, slab->used_counter, slab->n_used);
+}
+
+uint32_t slab_get_n_used(Slab *slab)
+{
+    return slab->n_used;
+}
+
+uint32_t slab_get_capacity(Slab *slab)
+{
+    return slab->capacity;
+}
+
+void slab_set_counters(Slab *slab, uint64_t *used_counter, uint64_t *capacity_counter)
+{
+    slab->used_counter = used_counter;
+    slab->capacity_counter = capacity_counter;
+    stat_set_counter(reds, slab->used_counter, slab->n_used);
+    stat_set_counter(reds, slab->capacity_counter, slab->capacity);
+}
@@ -0,0 +1,52 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef SLAB_H_
+#define SLAB_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* An allocator of objects of a single size, for the objects which are
+ * allocated and freed at a high rate.
+ *
+ * The objects are carved out of chunks of chunk_objects objects, a chunk
+ * being allocated when no object is free. The freed objects are kept for
+ * the next allocations, and the chunks are freed with the slab, which
+ * must not have any object left then.
+ *
+ * A slab is not thread safe: its objects must be allocated and freed from
+ * the same thread.
+ */
+
+typedef struct Slab Slab;
+
+/* max_objects: 0 for no limit */
+Slab *slab_new(size_t object_size, uint32_t chunk_objects, uint32_t max_objects);
+void slab_free(Slab *slab);
+
+/* returns an uninitialized object, NULL when max_objects are allocated */
+void *slab_alloc(Slab *slab);
+void slab_release(Slab *slab, void *object);
+
+uint32_t slab_get_n_used(Slab *slab);
+/* the objects in use and the ones which can be allocated without growing */
+uint32_t slab_get_capacity(Slab *slab);
+
+/* for RED_STATISTICS: counters kept up to date with the number of objects
+ * in use and the capacity of the slab, either can be NULL */
+void slab_set_counters(Slab *slab, uint64_t *used_counter, uint64_t *capacity_counter);
+
+#endif /* SLAB_H_ */
@@ -311,7 +311,8 @@ static int snd_send_data(SndChannelClient *client)
         return FALSE;
     }
 
-    if (!(n = client->send_data.size - client->send_data.pos)) {
+    /* a blocked client may still have to flush the end of its message */
+    if (!(n = client->send_data.size - client->send_data.pos) && !client->blocked) {
         return TRUE;
     }
 
@@ -321,18 +322,24 @@ static int snd_send_data(SndChannelClient *client)
         int vec_size;
 
         if (!n) {
-            client->on_message_done(client);
-
-            if (client->blocked) {
-                client->blocked = FALSE;
-                reds_core_watch_update_mask(reds, client->stream->watch, SPICE_WATCH_EVENT_READ);
+            /* the stream may keep the data to coalesce it with the next
+             * message, which only comes with the next audio period */
+            if (reds_stream_flush(client->stream) == 0) {
+                client->on_message_done(client);
+
+                if (client->blocked) {
+                    client->blocked = FALSE;
+                    reds_core_watch_update_mask(reds, client->stream->watch,
+                                                SPICE_WATCH_EVENT_READ);
+                }
+                break;
             }
-            break;
+            n = -1;
+        } else {
+            vec_size = spice_marshaller_fill_iovec(client->send_data.marshaller,
+                                                   vec, IOV_MAX, client->send_data.pos);
+            n = reds_stream_writev(client->stream, vec, vec_size);
         }
-
-        vec_size = spice_marshaller_fill_iovec(client->send_data.marshaller,
-                                               vec, IOV_MAX, client->send_data.pos);
-        n = reds_stream_writev(client->stream, vec, vec_size);
         if (n == -1) {
             switch (errno) {
             case EAGAIN:
@@ -20,6 +20,206 @@
 #endif
 #include "spice-bitmap-utils.h"
 
+#ifdef HAVE_X86_SIMD_DISPATCH
+#include <immintrin.h>
+#define SPICE_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+/* The graduality of a bitmap is estimated by sampling squares of 2x2 pixels
+ * and scoring the 3 pairs formed by the top left pixel with the others.
+ * Scores are integers in quarters of the original weights so that the SIMD
+ * versions give exactly the same results as the scalar one. */
+#define SAME_PIXEL_SCORE 2             // 0.5
+#define NOT_CONTRAST_PIXELS_SCORE -1   // -0.25
+#define CONTRAST_PIXELS_SCORE 4        // 1.0
+#define GRADUAL_SCORE_SCALE 4
+
+#define GRADUAL_SAMPLES_BATCH 64
+
+/* pixels with the r, g and b channels in the 3 low bytes */
+typedef struct GradualSamples {
+    uint32_t pix[GRADUAL_SAMPLES_BATCH];
+    uint32_t right[GRADUAL_SAMPLES_BATCH];
+    uint32_t bottom[GRADUAL_SAMPLES_BATCH];
+    uint32_t bottom_right[GRADUAL_SAMPLES_BATCH];
+    int count;
+} GradualSamples;
+
+typedef int (*GradualScoreFunc)(const GradualSamples *samples, int contrast_th);
+
+static GradualScoreFunc gradual_score_func;
+
+static inline int gradual_pair_score(uint32_t p1, uint32_t p2, int contrast_th)
+{
+    int shift;
+
+    if (p1 == p2) {
+        return SAME_PIXEL_SCORE;
+    }
+    for (shift = 0; shift < 24; shift += 8) {
+        int diff = (int)((p1 >> shift) & 0xff) - (int)((p2 >> shift) & 0xff);
+        if (diff <= -contrast_th || diff >= contrast_th) {
+            return CONTRAST_PIXELS_SCORE;
+        }
+    }
+    return NOT_CONTRAST_PIXELS_SCORE;
+}
+
+static int gradual_score_samples_from(const GradualSamples *samples, int start,
+                                      int contrast_th)
+{
+    int score = 0;
+    int i;
+
+    for (i = start; i < samples->count; i++) {
+        uint32_t pix = samples->pix[i];
+
+        // ignore squares where all pixels are identical
+        if (pix == samples->right[i] && pix == samples->bottom[i] &&
+            pix == samples->bottom_right[i]) {
+            continue;
+        }
+        score += gradual_pair_score(pix, samples->right[i], contrast_th);
+        score += gradual_pair_score(pix, samples->bottom[i], contrast_th);
+        score += gradual_pair_score(pix, samples->bottom_right[i], contrast_th);
+    }
+    return score;
+}
+
+static int gradual_score_samples_scalar(const GradualSamples *samples, int contrast_th)
+{
+    return gradual_score_samples_from(samples, 0, contrast_th);
+}
+
+#ifdef HAVE_X86_SIMD_DISPATCH
+/* per 32 bit lane: SAME_PIXEL_SCORE, CONTRAST_PIXELS_SCORE or
+ * NOT_CONTRAST_PIXELS_SCORE, computed as -1 + (same & 3) + (contrast & 5) */
+SPICE_TARGET("sse2")
+static inline __m128i gradual_pair_score_sse2(__m128i p1, __m128i p2, __m128i th,
+                                              __m128i *same)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i diff = _mm_or_si128(_mm_subs_epu8(p1, p2), _mm_subs_epu8(p2, p1));
+    __m128i not_contrast = _mm_cmpeq_epi32(_mm_subs_epu8(diff, th), zero);
+
+    *same = _mm_cmpeq_epi32(diff, zero);
+    return _mm_add_epi32(_mm_set1_epi32(NOT_CONTRAST_PIXELS_SCORE),
+                         _mm_add_epi32(_mm_and_si128(*same, _mm_set1_epi32(3)),
+                                       _mm_andnot_si128(not_contrast, _mm_set1_epi32(5))));
+}
+
+SPICE_TARGET("sse2")
+static int gradual_score_samples_sse2(const GradualSamples *samples, int contrast_th)
+{
+    const __m128i th = _mm_set1_epi8(contrast_th - 1);
+    __m128i acc = _mm_setzero_si128();
+    int32_t lanes[4];
+    int i;
+
+    for (i = 0; i + 4 <= samples->count; i += 4) {
+        __m128i pix = _mm_loadu_si128((const __m128i *) &samples->pix[i]);
+        __m128i same1, same2, same3, score;
+
+        score = gradual_pair_score_sse2(pix,
+                                        _mm_loadu_si128((const __m128i *) &samples->right[i]),
+                                        th, &same1);
+        score = _mm_add_epi32(score,
+                              gradual_pair_score_sse2(pix,
+                                  _mm_loadu_si128((const __m128i *) &samples->bottom[i]),
+                                  th, &same2));
+        score = _mm_add_epi32(score,
+                              gradual_pair_score_sse2(pix,
+                                  _mm_loadu_si128((const __m128i *) &samples->bottom_right[i]),
+                                  th, &same3));
+        // ignore squares where all pixels are identical
+        score = _mm_andnot_si128(_mm_and_si128(same1, _mm_and_si128(same2, same3)), score);
+        acc = _mm_add_epi32(acc, score);
+    }
+    _mm_storeu_si128((__m128i *) lanes, acc);
+
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+           gradual_score_samples_from(samples, i, contrast_th);
+}
+
+SPICE_TARGET("avx2")
+static inline __m256i gradual_pair_score_avx2(__m256i p1, __m256i p2, __m256i th,
+                                              __m256i *same)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i diff = _mm256_or_si256(_mm256_subs_epu8(p1, p2), _mm256_subs_epu8(p2, p1));
+    __m256i not_contrast = _mm256_cmpeq_epi32(_mm256_subs_epu8(diff, th), zero);
+
+    *same = _mm256_cmpeq_epi32(diff, zero);
+    return _mm256_add_epi32(_mm256_set1_epi32(NOT_CONTRAST_PIXELS_SCORE),
+                            _mm256_add_epi32(_mm256_and_si256(*same, _mm256_set1_epi32(3)),
+                                             _mm256_andnot_si256(not_contrast,
+                                                                 _mm256_set1_epi32(5))));
+}
+
+SPICE_TARGET("avx2")
+static int gradual_score_samples_avx2(const GradualSamples *samples, int contrast_th)
+{
+    const __m256i th = _mm256_set1_epi8(contrast_th - 1);
+    __m256i acc = _mm256_setzero_si256();
+    int32_t lanes[8];
+    int i;
+
+    for (i = 0; i + 8 <= samples->count; i += 8) {
+        __m256i pix = _mm256_loadu_si256((const __m256i *) &samples->pix[i]);
+        __m256i same1, same2, same3, score;
+
+        score = gradual_pair_score_avx2(pix,
+                                        _mm256_loadu_si256((const __m256i *) &samples->right[i]),
+                                        th, &same1);
+        score = _mm256_add_epi32(score,
+                                 gradual_pair_score_avx2(pix,
+                                     _mm256_loadu_si256((const __m256i *) &samples->bottom[i]),
+                                     th, &same2));
+        score = _mm256_add_epi32(score,
+                                 gradual_pair_score_avx2(pix,
+                                     _mm256_loadu_si256((const __m256i *)
+                                                        &samples->bottom_right[i]),
+                                     th, &same3));
+        // ignore squares where all pixels are identical
+        score = _mm256_andnot_si256(_mm256_and_si256(same1, _mm256_and_si256(same2, same3)),
+                                    score);
+        acc = _mm256_add_epi32(acc, score);
+    }
+    _mm256_storeu_si256((__m256i *) lanes, acc);
+
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+           lanes[4] + lanes[5] + lanes[6] + lanes[7] +
+           gradual_score_samples_from(samples, i, contrast_th);
+}
+#endif
+
+BitmapSimdLevel bitmap_set_simd_level(BitmapSimdLevel level)
+{
+#ifdef HAVE_X86_SIMD_DISPATCH
+    __builtin_cpu_init();
+    if (level >= BITMAP_SIMD_AVX2 && __builtin_cpu_supports("avx2")) {
+        gradual_score_func = gradual_score_samples_avx2;
+        return BITMAP_SIMD_AVX2;
+    }
+    if (level >= BITMAP_SIMD_SSE2 && __builtin_cpu_supports("sse2")) {
+        gradual_score_func = gradual_score_samples_sse2;
+        return BITMAP_SIMD_SSE2;
+    }
+#endif
+    gradual_score_func = gradual_score_samples_scalar;
+    return BITMAP_SIMD_NONE;
+}
+
+static inline int gradual_score_samples(const GradualSamples *samples, int contrast_th)
+{
+    // the best implementation is picked on first use, concurrent callers
+    // would all store the same pointer
+    if (G_UNLIKELY(gradual_score_func == NULL)) {
+        bitmap_set_simd_level(BITMAP_SIMD_AVX2);
+    }
+    return gradual_score_func(samples, contrast_th);
+}
+
 #define RED_BITMAP_UTILS_RGB16
 #include "spice-bitmap-utils.tmpl.c"
 #define RED_BITMAP_UTILS_RGB24
@@ -36,7 +236,7 @@
 #define GRADUAL_MEDIUM_SCORE_TH 0.002
 
 // assumes that stride doesn't overflow
-BitmapGradualType bitmap_get_graduality_level(SpiceBitmap *bitmap)
+double bitmap_get_graduality_score(SpiceBitmap *bitmap)
 {
     double score = 0.0;
     int num_samples = 0;
@@ -72,7 +272,12 @@ BitmapGradualType bitmap_get_graduality_level(SpiceBitmap *bitmap)
     }
 
     spice_assert(num_samples);
-    score /= num_samples;
+    return score / num_samples;
+}
+
+BitmapGradualType bitmap_get_graduality_level(SpiceBitmap *bitmap)
+{
+    double score = bitmap_get_graduality_score(bitmap);
 
     if (bitmap->format == SPICE_BITMAP_FMT_16BIT) {
         if (score < GRADUAL_HIGH_RGB16_TH) {
@@ -118,6 +323,77 @@ int bitmap_has_extra_stride(SpiceBitmap *bitmap)
     return 0;
 }
 
+#define CONTENT_HASH_PRIME1 G_GUINT64_CONSTANT(0x9e3779b185ebca87)
+#define CONTENT_HASH_PRIME2 G_GUINT64_CONSTANT(0xc2b2ae3d27d4eb4f)
+#define CONTENT_HASH_PRIME3 G_GUINT64_CONSTANT(0x165667b19e3779f9)
+
+static inline uint64_t content_hash_rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline void content_hash_word(uint64_t *h, uint64_t word)
+{
+    h[0] = content_hash_rotl(h[0] ^ (word * CONTENT_HASH_PRIME2), 31) * CONTENT_HASH_PRIME1;
+    h[1] = content_hash_rotl(h[1] + (word * CONTENT_HASH_PRIME3), 29) * CONTENT_HASH_PRIME2;
+}
+
+static void content_hash_update(uint64_t *h, const uint8_t *data, size_t len)
+{
+    uint64_t word;
+
+    for (; len >= sizeof(word); data += sizeof(word), len -= sizeof(word)) {
+        memcpy(&word, data, sizeof(word));
+        content_hash_word(h, word);
+    }
+    if (len) {
+        word = 0;
+        memcpy(&word, data, len);
+        content_hash_word(h, word);
+    }
+}
+
+static inline uint64_t content_hash_avalanche(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= CONTENT_HASH_PRIME2;
+    h ^= h >> 29;
+    h *= CONTENT_HASH_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+/* Fingerprint of the pixels, geometry, palette and flags of a bitmap, used
+ * to find identical images sent by the guest under different ids. The padding
+ * at the end of the lines is hashed too, so identical images might not match
+ * but different ones only do in case of a hash collision.
+ * image_flags are the flags of the descriptor of the image, the ones only
+ * telling what to do with the cache are ignored. */
+void bitmap_get_content_hash(SpiceBitmap *bitmap, uint8_t image_flags,
+                             BitmapContentHash *hash)
+{
+    uint64_t h[2] = { CONTENT_HASH_PRIME1, CONTENT_HASH_PRIME2 };
+    uint32_t i;
+
+    image_flags &= ~(SPICE_IMAGE_FLAGS_CACHE_ME | SPICE_IMAGE_FLAGS_CACHE_REPLACE_ME);
+    content_hash_word(h, bitmap->format |
+                         ((uint64_t)bitmap->flags << 8) |
+                         ((uint64_t)image_flags << 16) |
+                         ((uint64_t)bitmap->stride << 32));
+    content_hash_word(h, bitmap->x | ((uint64_t)bitmap->y << 32));
+    for (i = 0; i < bitmap->data->num_chunks; i++) {
+        content_hash_update(h, bitmap->data->chunk[i].data, bitmap->data->chunk[i].len);
+    }
+    if (bitmap->palette) {
+        content_hash_update(h, (const uint8_t *)bitmap->palette->ents,
+                            bitmap->palette->num_ents * sizeof(bitmap->palette->ents[0]));
+    }
+    content_hash_word(h, bitmap->data->data_size);
+
+    hash->h[0] = content_hash_avalanche(h[0] + content_hash_rotl(h[1], 17));
+    hash->h[1] = content_hash_avalanche(h[1] ^ h[0]);
+}
+
 int spice_bitmap_from_surface_type(uint32_t surface_format)
 {
     switch (surface_format) {
@@ -82,8 +82,33 @@ static inline int bitmap_fmt_has_graduality(uint8_t fmt)
 }
 
 
+typedef enum {
+    BITMAP_SIMD_NONE,
+    BITMAP_SIMD_SSE2,
+    BITMAP_SIMD_AVX2,
+} BitmapSimdLevel;
+
+/* 128 bit fingerprint of the content of a bitmap, not cryptographically
+ * strong, see bitmap_get_content_hash() */
+typedef struct BitmapContentHash {
+    uint64_t h[2];
+} BitmapContentHash;
+
+static inline int bitmap_content_hash_equal(const BitmapContentHash *a,
+                                            const BitmapContentHash *b)
+{
+    return a->h[0] == b->h[0] && a->h[1] == b->h[1];
+}
+
 BitmapGradualType bitmap_get_graduality_level     (SpiceBitmap *bitmap);
+double            bitmap_get_graduality_score     (SpiceBitmap *bitmap);
 int               bitmap_has_extra_stride         (SpiceBitmap *bitmap);
+void              bitmap_get_content_hash         (SpiceBitmap *bitmap,
+                                                   uint8_t image_flags,
+                                                   BitmapContentHash *hash);
+/* Limits the instruction sets used by the functions above, the best one
+ * supported by the CPU is used by default. Returns the level actually used. */
+BitmapSimdLevel   bitmap_set_simd_level           (BitmapSimdLevel level);
 
 void dump_bitmap(SpiceBitmap *bitmap);
 
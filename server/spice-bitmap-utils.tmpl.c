@@ -43,77 +43,20 @@
 #endif
 
 
-#define SAME_PIXEL_WEIGHT 0.5
-#define NOT_CONTRAST_PIXELS_WEIGHT -0.25
-#define CONTRAST_PIXELS_WEIGHT 1.0
-
 #ifndef RED_BITMAP_UTILS_RGB16
 #define CONTRAST_TH 60
 #else
 #define CONTRAST_TH 8
 #endif
-#define CONTRASTING(n) ((n) <= -CONTRAST_TH || (n) >= CONTRAST_TH)
 
 
 #define SAMPLE_JUMP 15
 
-static const double FNAME(PIX_PAIR_SCORE)[] = {
-    SAME_PIXEL_WEIGHT,
-    CONTRAST_PIXELS_WEIGHT,
-    NOT_CONTRAST_PIXELS_WEIGHT,
-};
-
-// return 0 - equal, 1 - for contrast, 2 for no contrast (PIX_PAIR_SCORE is defined accordingly)
-static inline int FNAME(pixelcmp)(PIXEL p1, PIXEL p2)
-{
-    int diff, any_different;
-
-    diff = GET_r(p1) - GET_r(p2);
-    any_different = diff;
-    if (CONTRASTING(diff)) {
-        return 1;
-    }
-
-    diff = GET_g(p1) - GET_g(p2);
-    any_different |= diff;
-    if (CONTRASTING(diff)) {
-        return 1;
-    }
-
-    diff = GET_b(p1) - GET_b(p2);
-    any_different |= diff;
-    if (CONTRASTING(diff)) {
-        return 1;
-    }
-
-    if (!any_different) {
-        return 0;
-    } else {
-        return 2;
-    }
-}
-
-static inline double FNAME(pixels_square_score)(PIXEL *line1, PIXEL *line2)
+// packs the channels in the low 3 bytes so that all the formats are scored by
+// the same code, see gradual_score_samples()
+static inline uint32_t FNAME(pixel_channels)(PIXEL pix)
 {
-    double ret;
-    int any_different = 0;
-    int cmp_res;
-    cmp_res = FNAME(pixelcmp)(*line1, line1[1]);
-    any_different |= cmp_res;
-    ret  = FNAME(PIX_PAIR_SCORE)[cmp_res];
-    cmp_res = FNAME(pixelcmp)(*line1, *line2);
-    any_different |= cmp_res;
-    ret += FNAME(PIX_PAIR_SCORE)[cmp_res];
-    cmp_res = FNAME(pixelcmp)(*line1, line2[1]);
-    any_different |= cmp_res;
-    ret += FNAME(PIX_PAIR_SCORE)[cmp_res];
-
-    // ignore squares where all pixels are identical
-    if (!any_different) {
-        ret = 0;
-    }
-
-    return ret;
+    return GET_r(pix) | (GET_g(pix) << 8) | (GET_b(pix) << 16);
 }
 
 static void FNAME(compute_lines_gradual_score)(PIXEL *lines, int width, int num_lines,
@@ -123,6 +66,8 @@ static void FNAME(compute_lines_gradual_score)(PIXEL *lines, int width, int num_
     PIXEL *cur_pix = lines + width / 2;
     PIXEL *bottom_pix;
     PIXEL *last_line = lines + (num_lines - 1) * width;
+    GradualSamples samples;
+    int64_t score = 0;
 
     if ((width <= 1) || (num_lines <= 1)) {
         *o_num_samples = 1;
@@ -130,19 +75,28 @@ static void FNAME(compute_lines_gradual_score)(PIXEL *lines, int width, int num_
         return;
     }
 
-    *o_samples_sum_score = 0;
     *o_num_samples = 0;
+    samples.count = 0;
 
     while (cur_pix < last_line) {
         if ((cur_pix + 1 - lines) % width == 0) { // last pixel in the row
             cur_pix--; // jump is bigger than 1 so we will not enter endless loop
         }
         bottom_pix = cur_pix + width;
-        (*o_samples_sum_score) += FNAME(pixels_square_score)(cur_pix, bottom_pix);
+        samples.pix[samples.count] = FNAME(pixel_channels)(cur_pix[0]);
+        samples.right[samples.count] = FNAME(pixel_channels)(cur_pix[1]);
+        samples.bottom[samples.count] = FNAME(pixel_channels)(bottom_pix[0]);
+        samples.bottom_right[samples.count] = FNAME(pixel_channels)(bottom_pix[1]);
+        if (++samples.count == GRADUAL_SAMPLES_BATCH) {
+            score += gradual_score_samples(&samples, CONTRAST_TH);
+            samples.count = 0;
+        }
         (*o_num_samples)++;
         cur_pix += jump;
     }
+    score += gradual_score_samples(&samples, CONTRAST_TH);
 
+    *o_samples_sum_score = (double)score / GRADUAL_SCORE_SCALE;
     (*o_num_samples) *= 3;
 }
 
@@ -156,5 +110,3 @@ static void FNAME(compute_lines_gradual_score)(PIXEL *lines, int width, int num_
 #undef RED_BITMAP_UTILS_RGB32
 #undef SAMPLE_JUMP
 #undef CONTRAST_TH
-#undef SAME_PIXEL_WEIGHT
-#undef NOT_CONTRAST_PIXELS_WEIGHT
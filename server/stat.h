@@ -36,12 +36,20 @@ void stat_remove_counter(SpiceServer *reds, uint64_t *counter);
     }                                       \
 }
 
+/* for counters showing the current value of a parameter */
+#define stat_set_counter(reds, counter, value) {  \
+    if (counter) {                          \
+        *(counter) = (value);               \
+    }                                       \
+}
+
 #else
 #define stat_add_node(r, p, n, v) INVALID_STAT_REF
 #define stat_remove_node(r, n)
 #define stat_add_counter(r, p, n, v) NULL
 #define stat_remove_counter(r, c)
 #define stat_inc_counter(r, c, v)
+#define stat_set_counter(r, c, v)
 #endif /* RED_STATISTICS */
 
 typedef uint64_t stat_time_t;
@@ -29,6 +29,8 @@
          item != NULL;                                  \
          item = ring_next(&(display)->priv->streams, item))
 
+static void stream_heatmap_start_stream(DisplayChannel *display, Drawable *drawable);
+
 static void stream_agent_stats_print(StreamAgent *agent)
 {
 #ifdef STREAM_STATS
@@ -41,7 +43,8 @@ static void stream_agent_stats_print(StreamAgent *agent)
     }
 
     spice_debug("stream=%p dim=(%dx%d) #in-frames=%"PRIu64" #in-avg-fps=%.2f #out-frames=%"PRIu64" "
-                "out/in=%.2f #drops=%"PRIu64" (#pipe=%"PRIu64" #fps=%"PRIu64") out-avg-fps=%.2f "
+                "out/in=%.2f #drops=%"PRIu64" (#pipe=%"PRIu64" #fps=%"PRIu64") "
+                "#superseded=%"PRIu64" out-avg-fps=%.2f "
                 "passed-mm-time(sec)=%.2f size-total(MB)=%.2f size-per-sec(Mbps)=%.2f "
                 "size-per-frame(KBpf)=%.2f avg-quality=%.2f "
                 "start-bit-rate(Mbps)=%.2f end-bit-rate(Mbps)=%.2f",
@@ -54,6 +57,7 @@ static void stream_agent_stats_print(StreamAgent *agent)
                 stats->num_drops_fps,
                 stats->num_drops_pipe,
                 stats->num_drops_fps,
+                stats->num_skips_superseded,
                 stats->num_frames_sent / passed_mm_time,
                 passed_mm_time,
                 stats->size_sent / 1024.0 / 1024.0,
@@ -493,6 +497,11 @@ void stream_trace_update(DisplayChannel *display, Drawable *drawable)
         }
     }
 
+    if (drawable->heat_frame) {
+        stream_heatmap_start_stream(display, drawable);
+        return;
+    }
+
     trace = display->priv->items_trace;
     trace_end = trace + NUM_TRACE_ITEMS;
     for (; trace < trace_end; trace++) {
@@ -827,7 +836,7 @@ static void dcc_detach_stream_gracefully(DisplayChannelClient *dcc,
         red_pipe_item_init_full(&upgrade_item->base, RED_PIPE_ITEM_TYPE_UPGRADE,
                                 red_upgrade_item_free);
         upgrade_item->drawable = stream->current;
-        upgrade_item->drawable->refs++;
+        drawable_ref(upgrade_item->drawable);
         n_rects = pixman_region32_n_rects(&upgrade_item->drawable->tree_item.base.rgn);
         upgrade_item->rects = spice_malloc_n_m(n_rects, sizeof(SpiceRect), sizeof(SpiceClipRects));
         upgrade_item->rects->num_rects = n_rects;
@@ -959,3 +968,171 @@ void stream_trace_add_drawable(DisplayChannel *display, Drawable *item)
     trace->height = src_area->bottom - src_area->top;
     trace->dest_area = item->red_drawable->bbox;
 }
+
+/* the damages of a block closer than this belong to the same frame */
+#define RED_STREAM_HEAT_FRAME_MIN_DELTA (NSEC_PER_SEC / (2 * MAX_FPS))
+
+void stream_heatmap_free(DisplayChannel *display)
+{
+    StreamHeatmap *heatmap = &display->priv->heatmap;
+
+    free(heatmap->blocks);
+    memset(heatmap, 0, sizeof(*heatmap));
+}
+
+static void stream_heatmap_reset(DisplayChannel *display, int width, int height)
+{
+    StreamHeatmap *heatmap = &display->priv->heatmap;
+
+    stream_heatmap_free(display);
+    heatmap->blocks = spice_new0(StreamHeatBlock, width * height);
+    heatmap->width = width;
+    heatmap->height = height;
+}
+
+/* the hot area becomes the hot blocks damaged during the last period, it is kept as long as
+ * they are inside of it, so that the frames made from it have the same size */
+static void stream_heatmap_next_period(StreamHeatmap *heatmap, red_time_t now)
+{
+    if (now - heatmap->area_start > 2 * RED_STREAM_DETECTION_MAX_DELTA ||
+        rect_get_area(&heatmap->area) < RED_STREAM_MIN_SIZE) {
+        memset(&heatmap->hot_area, 0, sizeof(heatmap->hot_area));
+    } else if (!rect_contains(&heatmap->hot_area, &heatmap->area)) {
+        heatmap->hot_area = heatmap->area;
+        heatmap->first_frame_time = heatmap->area_start;
+    }
+    heatmap->frames_count = heatmap->area_frames_count;
+
+    memset(&heatmap->area, 0, sizeof(heatmap->area));
+    heatmap->area_frames_count = 0;
+    heatmap->area_start = now;
+}
+
+void stream_heatmap_add_damage(DisplayChannel *display, Drawable *drawable)
+{
+    StreamHeatmap *heatmap = &display->priv->heatmap;
+    DrawContext *context = &display->priv->surfaces[drawable->surface_id].context;
+    const SpiceRect *bbox = &drawable->red_drawable->bbox;
+    red_time_t now = drawable->creation_time;
+    int width, height, left, top, right, bottom, x, y;
+    int hot_left = G_MAXINT, hot_top = G_MAXINT, hot_right = 0, hot_bottom = 0;
+
+    /* the copies the stream detection follows are left to it */
+    if (!display->priv->stream_heatmap_enabled ||
+        display->priv->stream_video == SPICE_STREAM_VIDEO_OFF ||
+        drawable->stream || drawable->streamable ||
+        !is_primary_surface(display, drawable->surface_id)) {
+        return;
+    }
+
+    width = (context->width + RED_STREAM_HEAT_BLOCK_SIZE - 1) >> RED_STREAM_HEAT_BLOCK_SHIFT;
+    height = (context->height + RED_STREAM_HEAT_BLOCK_SIZE - 1) >> RED_STREAM_HEAT_BLOCK_SHIFT;
+    if (heatmap->width != width || heatmap->height != height) {
+        stream_heatmap_reset(display, width, height);
+    }
+    if (now - heatmap->area_start > RED_STREAM_DETECTION_MAX_DELTA) {
+        stream_heatmap_next_period(heatmap, now);
+    }
+
+    left = MAX(bbox->left, 0) >> RED_STREAM_HEAT_BLOCK_SHIFT;
+    top = MAX(bbox->top, 0) >> RED_STREAM_HEAT_BLOCK_SHIFT;
+    right = MIN((bbox->right + RED_STREAM_HEAT_BLOCK_SIZE - 1) >> RED_STREAM_HEAT_BLOCK_SHIFT,
+                width);
+    bottom = MIN((bbox->bottom + RED_STREAM_HEAT_BLOCK_SIZE - 1) >> RED_STREAM_HEAT_BLOCK_SHIFT,
+                 height);
+    for (y = top; y < bottom; y++) {
+        StreamHeatBlock *block = &heatmap->blocks[y * width + left];
+
+        for (x = left; x < right; x++, block++) {
+            if (now - block->last_time >= RED_STREAM_HEAT_FRAME_MIN_DELTA) {
+                if (now - block->last_time > RED_STREAM_DETECTION_MAX_DELTA) {
+                    block->frames_count = 1;
+                } else {
+                    block->frames_count++;
+                }
+                block->last_time = now;
+            }
+            if (block->frames_count < RED_STREAM_FRAMES_START_CONDITION) {
+                continue;
+            }
+            hot_left = MIN(hot_left, x);
+            hot_top = MIN(hot_top, y);
+            hot_right = MAX(hot_right, x + 1);
+            hot_bottom = MAX(hot_bottom, y + 1);
+            heatmap->area_frames_count = MAX(heatmap->area_frames_count, block->frames_count);
+        }
+    }
+
+    if (hot_right > 0) {
+        SpiceRect hot = {
+            .left = hot_left << RED_STREAM_HEAT_BLOCK_SHIFT,
+            .top = hot_top << RED_STREAM_HEAT_BLOCK_SHIFT,
+            .right = MIN(hot_right << RED_STREAM_HEAT_BLOCK_SHIFT, context->width),
+            .bottom = MIN(hot_bottom << RED_STREAM_HEAT_BLOCK_SHIFT, context->height),
+        };
+
+        if (rect_is_empty(&heatmap->area)) {
+            heatmap->area = hot;
+        } else {
+            rect_union(&heatmap->area, &hot);
+        }
+    }
+
+    if (!rect_is_empty(&heatmap->hot_area) && rect_intersects(&heatmap->hot_area, bbox) &&
+        now >= heatmap->cold_until) {
+        heatmap->frame_pending = TRUE;
+    }
+}
+
+/* Returns the area of the primary surface to copy as the next frame of the damaged hot area,
+ * at most MAX_FPS times per second. The stream of the area then goes on with these frames,
+ * see stream_trace_update(). */
+gboolean stream_heatmap_get_frame_area(DisplayChannel *display, SpiceRect *area)
+{
+    StreamHeatmap *heatmap = &display->priv->heatmap;
+    DrawContext *context = &display->priv->surfaces[0].context;
+    red_time_t now = spice_get_monotonic_time_ns();
+    RingItem *item;
+
+    if (!heatmap->frame_pending || now - heatmap->last_frame_time < NSEC_PER_SEC / MAX_FPS) {
+        return FALSE;
+    }
+    heatmap->frame_pending = FALSE;
+
+    /* the primary surface may have changed since the damage */
+    if (display->priv->stream_video == SPICE_STREAM_VIDEO_OFF || !context->canvas ||
+        heatmap->hot_area.right > context->width || heatmap->hot_area.bottom > context->height) {
+        return FALSE;
+    }
+
+    /* the video is already streamed from its own copies */
+    FOREACH_STREAMS(display, item) {
+        Stream *stream = SPICE_CONTAINEROF(item, Stream, link);
+
+        if (rect_intersects(&stream->dest_area, &heatmap->hot_area) &&
+            !rect_is_equal(&stream->dest_area, &heatmap->hot_area)) {
+            return FALSE;
+        }
+    }
+
+    heatmap->last_frame_time = now;
+    *area = heatmap->hot_area;
+    return TRUE;
+}
+
+/* The area was updated at a video rate already, so the stream starts with the first frame,
+ * unless it doesn't look like a video, e.g. scrolling text */
+static void stream_heatmap_start_stream(DisplayChannel *display, Drawable *drawable)
+{
+    StreamHeatmap *heatmap = &display->priv->heatmap;
+
+    update_copy_graduality(display, drawable);
+    if (drawable->copy_bitmap_graduality == BITMAP_GRADUAL_LOW) {
+        heatmap->cold_until = drawable->creation_time + RED_STREAM_INPUT_FPS_TIMEOUT;
+        return;
+    }
+
+    drawable->first_frame_time = heatmap->first_frame_time;
+    drawable->frames_count = MAX(heatmap->frames_count, 1);
+    display_channel_create_stream(display, drawable);
+}
@@ -53,6 +53,7 @@ typedef struct RedStreamActivateReportItem {
 typedef struct StreamStats {
     uint64_t num_drops_pipe;
     uint64_t num_drops_fps;
+    uint64_t num_skips_superseded;
     uint64_t num_frames_sent;
     uint64_t num_input_frames;
     uint64_t size_sent;
@@ -110,6 +111,32 @@ typedef struct ItemTrace {
     SpiceRect dest_area;
 } ItemTrace;
 
+/* The damage of the primary surface, by blocks of 16x16 pixels, to find the areas which are
+ * updated at a video rate by drawables the stream detection doesn't follow, like the small
+ * copies and fills browsers draw videos with. */
+#define RED_STREAM_HEAT_BLOCK_SHIFT 4
+#define RED_STREAM_HEAT_BLOCK_SIZE (1 << RED_STREAM_HEAT_BLOCK_SHIFT)
+
+typedef struct StreamHeatBlock {
+    red_time_t last_time;           // the last frame which damaged the block
+    uint32_t frames_count;          // the frames at most RED_STREAM_DETECTION_MAX_DELTA apart
+} StreamHeatBlock;
+
+typedef struct StreamHeatmap {
+    StreamHeatBlock *blocks;
+    int width;                      // in blocks
+    int height;
+    SpiceRect area;                 // the hot blocks damaged since area_start
+    red_time_t area_start;
+    uint32_t area_frames_count;
+    SpiceRect hot_area;             // the hot blocks of the last period, empty if too small
+    red_time_t first_frame_time;    // since when hot_area is hot
+    uint32_t frames_count;
+    int frame_pending;              // hot_area was damaged since the last frame
+    red_time_t last_frame_time;
+    red_time_t cold_until;          // when hot_area didn't look like a video
+} StreamHeatmap;
+
 struct Stream {
     uint8_t refs;
     Drawable *current;
@@ -150,4 +177,10 @@ void                  stream_agent_stop                             (StreamAgent
 
 void stream_detach_drawable(Stream *stream);
 
+void                  stream_heatmap_free                           (DisplayChannel *display);
+void                  stream_heatmap_add_damage                     (DisplayChannel *display,
+                                                                     Drawable *drawable);
+gboolean              stream_heatmap_get_frame_area                 (DisplayChannel *display,
+                                                                     SpiceRect *area);
+
 #endif /* STREAM_H */
@@ -0,0 +1,267 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Check that all the implementations of bitmap_get_graduality_score() give
+ * the same results as the original floating point scalar code, and time them.
+ * Also check bitmap_get_content_hash().
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#undef NDEBUG
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "spice-bitmap-utils.h"
+#include "test-timing.h"
+
+#define BENCHMARK_ITERATIONS 200
+
+static const char *simd_names[] = { "scalar", "sse2", "avx2" };
+
+static void get_rgb(const SpiceBitmap *bitmap, const uint8_t *pixel, int *r, int *g, int *b)
+{
+    if (bitmap->format == SPICE_BITMAP_FMT_16BIT) {
+        uint16_t pix = pixel[0] | (pixel[1] << 8);
+
+        *r = (pix >> 10) & 0x1f;
+        *g = (pix >> 5) & 0x1f;
+        *b = pix & 0x1f;
+    } else {
+        *b = pixel[0];
+        *g = pixel[1];
+        *r = pixel[2];
+    }
+}
+
+/* the original implementation, returns 0 for equal pixels, 1 for contrasting
+ * ones, 2 otherwise */
+static int ref_pixelcmp(const SpiceBitmap *bitmap, const uint8_t *p1, const uint8_t *p2)
+{
+    int contrast_th = bitmap->format == SPICE_BITMAP_FMT_16BIT ? 8 : 60;
+    int r1, g1, b1, r2, g2, b2;
+
+    get_rgb(bitmap, p1, &r1, &g1, &b1);
+    get_rgb(bitmap, p2, &r2, &g2, &b2);
+    if (abs(r1 - r2) >= contrast_th || abs(g1 - g2) >= contrast_th ||
+        abs(b1 - b2) >= contrast_th) {
+        return 1;
+    }
+    return (r1 == r2 && g1 == g2 && b1 == b2) ? 0 : 2;
+}
+
+static double ref_graduality_score(const SpiceBitmap *bitmap)
+{
+    static const double pair_score[] = { 0.5, 1.0, -0.25 };
+    int bpp = bitmap_fmt_get_bytes_per_pixel(bitmap->format);
+    const uint8_t *lines = bitmap->data->chunk[0].data;
+    int width = bitmap->x;
+    int num_lines = bitmap->y;
+    int jump = (15 % width) ? 15 : 14;
+    int cur = width / 2;
+    int last_line = (num_lines - 1) * width;
+    double score = 0;
+    int num_samples = 0;
+
+    if (width <= 1 || num_lines <= 1) {
+        return 1.0;
+    }
+
+    while (cur < last_line) {
+        const uint8_t *pix, *bottom;
+        int cmp1, cmp2, cmp3;
+
+        if ((cur + 1) % width == 0) {
+            cur--;
+        }
+        pix = lines + cur * bpp;
+        bottom = pix + width * bpp;
+        cmp1 = ref_pixelcmp(bitmap, pix, pix + bpp);
+        cmp2 = ref_pixelcmp(bitmap, pix, bottom);
+        cmp3 = ref_pixelcmp(bitmap, pix, bottom + bpp);
+        if (cmp1 | cmp2 | cmp3) {
+            score += pair_score[cmp1] + pair_score[cmp2] + pair_score[cmp3];
+        }
+        num_samples++;
+        cur += jump;
+    }
+
+    return score / (num_samples * 3);
+}
+
+/* mixes flat areas, gradients, noise and small differences around the
+ * contrast thresholds */
+static SpiceBitmap *create_bitmap(GRand *rand, int format, int width, int height)
+{
+    SpiceBitmap *bitmap = g_new0(SpiceBitmap, 1);
+    int bpp = bitmap_fmt_get_bytes_per_pixel(format);
+    uint8_t *data = g_malloc(width * height * bpp);
+    int kind = g_rand_int_range(rand, 0, 4);
+    int x, y, i;
+
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++) {
+            uint8_t *pixel = data + (y * width + x) * bpp;
+            uint32_t value;
+
+            switch (kind) {
+            case 0:
+                value = g_rand_int(rand);
+                break;
+            case 1:
+                value = (x * 3) | ((y * 2) << 8) | (((x + y) & 0xff) << 16);
+                break;
+            case 2:
+                value = g_rand_int_range(rand, 0, 8) == 0 ? 0x202020 : 0xf0f0f0;
+                break;
+            default:
+                value = 0x808080 + g_rand_int_range(rand, -3, 4) * 0x010101 * 20;
+                break;
+            }
+            for (i = 0; i < bpp; i++) {
+                pixel[i] = value >> (i * 8);
+            }
+        }
+    }
+
+    bitmap->format = format;
+    bitmap->flags = SPICE_BITMAP_FLAGS_TOP_DOWN;
+    bitmap->x = width;
+    bitmap->y = height;
+    bitmap->stride = width * bpp;
+    bitmap->data = spice_chunks_new_linear(data, bitmap->stride * height);
+
+    return bitmap;
+}
+
+static void free_bitmap(SpiceBitmap *bitmap)
+{
+    g_free(bitmap->data->chunk[0].data);
+    spice_chunks_destroy(bitmap->data);
+    g_free(bitmap);
+}
+
+static void test_scores(GRand *rand)
+{
+    static const int formats[] = {
+        SPICE_BITMAP_FMT_16BIT, SPICE_BITMAP_FMT_24BIT, SPICE_BITMAP_FMT_32BIT
+    };
+    int i, level;
+
+    for (i = 0; i < 300; i++) {
+        SpiceBitmap *bitmap = create_bitmap(rand, formats[i % G_N_ELEMENTS(formats)],
+                                            g_rand_int_range(rand, 1, 300),
+                                            g_rand_int_range(rand, 1, 100));
+        double expected = ref_graduality_score(bitmap);
+
+        for (level = BITMAP_SIMD_NONE; level <= BITMAP_SIMD_AVX2; level++) {
+            if (bitmap_set_simd_level(level) != level) {
+                continue;
+            }
+            if (bitmap_get_graduality_score(bitmap) != expected) {
+                printf("%s score mismatch for format %d %dx%d: %f != %f\n",
+                       simd_names[level], bitmap->format, bitmap->x, bitmap->y,
+                       bitmap_get_graduality_score(bitmap), expected);
+                exit(EXIT_FAILURE);
+            }
+        }
+        free_bitmap(bitmap);
+    }
+}
+
+static void test_content_hash(GRand *rand)
+{
+    SpiceBitmap *bitmap = create_bitmap(rand, SPICE_BITMAP_FMT_32BIT, 64, 64);
+    SpiceBitmap copy = *bitmap;
+    BitmapContentHash hash, other;
+    uint8_t *data = bitmap->data->chunk[0].data;
+
+    bitmap_get_content_hash(bitmap, 0, &hash);
+
+    // same content in another buffer
+    copy.data = spice_chunks_new_linear(g_memdup(data, bitmap->data->data_size),
+                                        bitmap->data->data_size);
+    bitmap_get_content_hash(&copy, 0, &other);
+    assert(bitmap_content_hash_equal(&hash, &other));
+
+    // one changed pixel
+    copy.data->chunk[0].data[64 * 4 * 10 + 7] ^= 1;
+    bitmap_get_content_hash(&copy, 0, &other);
+    assert(!bitmap_content_hash_equal(&hash, &other));
+    copy.data->chunk[0].data[64 * 4 * 10 + 7] ^= 1;
+
+    // the cache flags of the image are not part of its content
+    bitmap_get_content_hash(&copy, SPICE_IMAGE_FLAGS_CACHE_ME, &other);
+    assert(bitmap_content_hash_equal(&hash, &other));
+
+    // same pixels, but not the same meaning
+    bitmap_get_content_hash(&copy, SPICE_IMAGE_FLAGS_HIGH_BITS_SET, &other);
+    assert(!bitmap_content_hash_equal(&hash, &other));
+    copy.flags ^= SPICE_BITMAP_FLAGS_TOP_DOWN;
+    bitmap_get_content_hash(&copy, 0, &other);
+    assert(!bitmap_content_hash_equal(&hash, &other));
+    copy.flags ^= SPICE_BITMAP_FLAGS_TOP_DOWN;
+
+    // same pixels, different geometry
+    copy.x = 128;
+    copy.y = 32;
+    copy.stride = 128 * 4;
+    bitmap_get_content_hash(&copy, 0, &other);
+    assert(!bitmap_content_hash_equal(&hash, &other));
+
+    g_free(copy.data->chunk[0].data);
+    spice_chunks_destroy(copy.data);
+    free_bitmap(bitmap);
+}
+
+static void benchmark(GRand *rand)
+{
+    SpiceBitmap *bitmap = create_bitmap(rand, SPICE_BITMAP_FMT_32BIT, 1920, 1080);
+    int level, i;
+
+    for (level = BITMAP_SIMD_NONE; level <= BITMAP_SIMD_AVX2; level++) {
+        uint64_t start;
+        double score = 0;
+
+        if (bitmap_set_simd_level(level) != level) {
+            printf("%-6s: not supported\n", simd_names[level]);
+            continue;
+        }
+        start = get_time_ns();
+        for (i = 0; i < BENCHMARK_ITERATIONS; i++) {
+            score += bitmap_get_graduality_score(bitmap);
+        }
+        printf("%-6s: %8.1f us per 1920x1080 bitmap (score %f)\n", simd_names[level],
+               (get_time_ns() - start) / 1e3 / BENCHMARK_ITERATIONS,
+               score / BENCHMARK_ITERATIONS);
+    }
+    free_bitmap(bitmap);
+}
+
+int main(int argc, char **argv)
+{
+    GRand *rand = g_rand_new_with_seed(argc > 1 ? atoi(argv[1]) : 1);
+
+    test_scores(rand);
+    test_content_hash(rand);
+    benchmark(rand);
+    g_rand_free(rand);
+
+    return 0;
+}
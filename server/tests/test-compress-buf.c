@@ -0,0 +1,273 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Check that the pool of the compression buffers of the encoders reuses
+ * the buffers which are sent, never hands out a buffer twice while they are
+ * freed from another thread, and outlives its release until the last buffer
+ * is freed. Then benchmark it against allocating each buffer with malloc.
+ * Every image fills a chain of buffers like an encoder does, and the chain
+ * is freed once a few more images were compressed, like the marshaller does
+ * after sending it.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#undef NDEBUG
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <glib.h>
+
+#include "image-encoders.h"
+#include "test-timing.h"
+
+#define CHECK_IMAGES 2000
+#define CHECK_BUFS_PER_IMAGE 5
+#define CHECK_HELD 8
+
+static gint n_images = 5000;
+static gint image_kb = 200;
+static gint in_flight = 8;
+
+static gboolean sent_images[CHECK_IMAGES];
+
+static RedCompressBuf *buf_new(RedCompressBufPool *pool)
+{
+    RedCompressBuf *buf;
+
+    if (pool) {
+        return compress_buf_new(pool);
+    }
+    buf = g_new(RedCompressBuf, 1);
+    buf->send_next = NULL;
+    return buf;
+}
+
+static void free_chain(RedCompressBufPool *pool, RedCompressBuf *buf)
+{
+    while (buf) {
+        RedCompressBuf *next = buf->send_next;
+
+        if (pool) {
+            compress_buf_free(buf);
+        } else {
+            g_free(buf);
+        }
+        buf = next;
+    }
+}
+
+/* the size of the images varies like the compressed images do */
+static RedCompressBuf *fill_chain(RedCompressBufPool *pool, size_t size)
+{
+    RedCompressBuf *head = buf_new(pool);
+    RedCompressBuf *tail = head;
+
+    for (;;) {
+        size_t now = MIN(size, sizeof(tail->buf));
+
+        memset(tail->buf.bytes, 0x5a, now);
+        size -= now;
+        if (size == 0) {
+            return head;
+        }
+        tail->send_next = buf_new(pool);
+        tail = tail->send_next;
+    }
+}
+
+static void test_reuse(void)
+{
+    ImageEncoderSharedData shared_data;
+    RedCompressBufPool *pool;
+    RedCompressBuf *buf, *next;
+
+    memset(&shared_data, 0, sizeof(shared_data));
+    image_encoder_shared_init(&shared_data);
+    pool = compress_buf_pool_new(&shared_data);
+
+    buf = compress_buf_new(pool);
+    assert(buf->pool == pool && buf->send_next == NULL);
+    buf->send_next = compress_buf_new(pool);
+    next = buf->send_next;
+    compress_buf_free(next);
+    compress_buf_free(buf);
+
+    /* the last one sent is the first one reused */
+    assert(compress_buf_new(pool) == buf);
+    assert(buf->send_next == NULL);
+    assert(compress_buf_new(pool) == next);
+    compress_buf_free(next);
+
+    /* the pool lives until the buffer is freed */
+    compress_buf_pool_release(pool);
+    compress_buf_free(buf);
+}
+
+/* a buffer handed out twice would be overwritten by another image */
+static void check_chain(RedCompressBuf *buf)
+{
+    uint32_t image = buf->buf.words[0];
+
+    assert(image < CHECK_IMAGES && !sent_images[image]);
+    sent_images[image] = TRUE;
+    for (; buf; buf = buf->send_next) {
+        assert(buf->buf.words[0] == image);
+        assert(buf->buf.words[G_N_ELEMENTS(buf->buf.words) - 1] == image);
+    }
+}
+
+static RedCompressBuf *mark_chain(RedCompressBufPool *pool, uint32_t image)
+{
+    RedCompressBuf *head = NULL;
+    int i;
+
+    for (i = 0; i < CHECK_BUFS_PER_IMAGE; i++) {
+        RedCompressBuf *buf = compress_buf_new(pool);
+
+        buf->buf.words[0] = image;
+        buf->buf.words[G_N_ELEMENTS(buf->buf.words) - 1] = image;
+        buf->send_next = head;
+        head = buf;
+    }
+    return head;
+}
+
+/* the marshaller of a send pool thread frees the chains once they are sent */
+static void *sender_thread(void *opaque)
+{
+    GAsyncQueue *sent = opaque;
+    int i;
+
+    for (i = 0; i < CHECK_IMAGES; i++) {
+        RedCompressBuf *buf = g_async_queue_pop(sent);
+
+        check_chain(buf);
+        free_chain(buf->pool, buf);
+    }
+    return NULL;
+}
+
+static void test_threads(void)
+{
+    ImageEncoderSharedData shared_data;
+    RedCompressBufPool *pool;
+    GAsyncQueue *sent = g_async_queue_new();
+    RedCompressBuf *held[CHECK_HELD];
+    pthread_t thread;
+    uint32_t image;
+
+    memset(&shared_data, 0, sizeof(shared_data));
+    image_encoder_shared_init(&shared_data);
+    pool = compress_buf_pool_new(&shared_data);
+    assert(pthread_create(&thread, NULL, sender_thread, sent) == 0);
+
+    /* the pool reuses the buffers of the chains while they are being freed */
+    for (image = 0; image < CHECK_IMAGES; image++) {
+        RedCompressBuf *chain = mark_chain(pool, image);
+
+        if (image < CHECK_HELD) {
+            held[image] = chain;
+        } else {
+            g_async_queue_push(sent, chain);
+        }
+    }
+    /* the encoders are gone, the images already compressed are still sent */
+    compress_buf_pool_release(pool);
+    for (image = 0; image < CHECK_HELD; image++) {
+        g_async_queue_push(sent, held[image]);
+    }
+    pthread_join(thread, NULL);
+
+    for (image = 0; image < CHECK_IMAGES; image++) {
+        assert(sent_images[image]);
+    }
+    g_async_queue_unref(sent);
+}
+
+static uint64_t run(RedCompressBufPool *pool)
+{
+    RedCompressBuf **sent = g_new0(RedCompressBuf *, in_flight);
+    GRand *rand = g_rand_new_with_seed(42);
+    uint64_t start = get_time_ns();
+    int i;
+
+    for (i = 0; i < n_images; i++) {
+        size_t size = g_rand_int_range(rand, 1, image_kb * 2) * 1024;
+
+        free_chain(pool, sent[i % in_flight]);
+        sent[i % in_flight] = fill_chain(pool, size);
+    }
+    for (i = 0; i < in_flight; i++) {
+        free_chain(pool, sent[i]);
+    }
+
+    g_rand_free(rand);
+    g_free(sent);
+    return get_time_ns() - start;
+}
+
+int main(int argc, char **argv)
+{
+    GOptionContext *context;
+    GError *error = NULL;
+    ImageEncoderSharedData shared_data;
+    RedCompressBufPool *pool;
+    uint64_t malloc_ns, pool_ns;
+
+    GOptionEntry entries[] = {
+        { "images", 'n', 0, G_OPTION_ARG_INT, &n_images,
+          "Number of compressed images (default 5000)", "INT" },
+        { "size", 's', 0, G_OPTION_ARG_INT, &image_kb,
+          "Mean size of the compressed images in KiB (default 200)", "INT" },
+        { "in-flight", 'f', 0, G_OPTION_ARG_INT, &in_flight,
+          "Number of images being sent (default 8)", "INT" },
+        { NULL }
+    };
+
+    context = g_option_context_new("- compression buffers benchmark");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        printf("Option parsing failed: %s\n", error->message);
+        exit(-1);
+    }
+    g_option_context_free(context);
+    if (n_images <= 0 || image_kb <= 0 || image_kb > 65536 || in_flight <= 0) {
+        printf("Invalid arguments\n");
+        exit(-1);
+    }
+
+    test_reuse();
+    test_threads();
+
+    memset(&shared_data, 0, sizeof(shared_data));
+    image_encoder_shared_init(&shared_data);
+    pool = compress_buf_pool_new(&shared_data);
+
+    malloc_ns = run(NULL);
+    pool_ns = run(pool);
+    compress_buf_pool_release(pool);
+
+    printf("%d images of %d KiB on average, %d in flight\n", n_images, image_kb, in_flight);
+    printf("malloc %8.2f us/image\n", malloc_ns / 1e3 / n_images);
+    printf("pool   %8.2f us/image, %5.2fx\n", pool_ns / 1e3 / n_images,
+           (double)malloc_ns / pool_ns);
+
+    return 0;
+}
@@ -0,0 +1,328 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Check that both Dispatcher transports deliver the messages of several
+ * senders in order and intact, the ring wrapping and getting full, and that
+ * the acked ones are handled when dispatcher_send_message() returns.
+ *
+ * Then benchmark them the way the QXL device uses the worker dispatcher:
+ * the round trip time of RED_WORKER_MESSAGE_UPDATE, which waits for the
+ * worker ack, and the cost for the sender of the messages which are not
+ * acked, like RED_WORKER_MESSAGE_WAKEUP.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#undef NDEBUG
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <glib.h>
+
+#include "dispatcher.h"
+#include "red-qxl.h"
+#include "test-timing.h"
+
+#define CHECK_SENDERS 3
+#define CHECK_MSGS 20000
+/* not a divisor of the ring size, the entries wrap anywhere */
+#define CHECK_LARGE_SIZE 1503
+
+static gint n_msgs = 10000;
+
+typedef struct Receiver {
+    Dispatcher *dispatcher;
+    int quit;
+    int n_wakeups;
+} Receiver;
+
+static void handle_update(void *opaque, void *payload)
+{
+}
+
+static void handle_wakeup(void *opaque, void *payload)
+{
+    Receiver *receiver = opaque;
+
+    receiver->n_wakeups++;
+}
+
+static void handle_close(void *opaque, void *payload)
+{
+    Receiver *receiver = opaque;
+
+    receiver->quit = TRUE;
+}
+
+/* the red worker loop, without anything else to do */
+static void *receiver_thread(void *opaque)
+{
+    Receiver *receiver = opaque;
+    struct pollfd pollfd = {
+        .fd = dispatcher_get_recv_fd(receiver->dispatcher),
+        .events = POLLIN,
+    };
+
+    while (!receiver->quit) {
+        if (poll(&pollfd, 1, -1) > 0) {
+            dispatcher_handle_recv_read(receiver->dispatcher);
+        }
+    }
+    return NULL;
+}
+
+enum {
+    CHECK_MESSAGE_SMALL,
+    CHECK_MESSAGE_LARGE,
+    CHECK_MESSAGE_SYNC,
+    CHECK_MESSAGE_CLOSE,
+
+    CHECK_MESSAGE_COUNT
+};
+
+typedef struct CheckSmall {
+    uint32_t sender;
+    uint32_t seq;
+} CheckSmall;
+
+typedef struct CheckLarge {
+    uint32_t sender;
+    uint32_t seq;
+    uint8_t data[CHECK_LARGE_SIZE];
+} CheckLarge;
+
+typedef struct Checker {
+    Receiver receiver;
+    uint32_t next_seq[CHECK_SENDERS];
+    /* the last acked message handled, read by the senders */
+    gint handled[CHECK_SENDERS];
+} Checker;
+
+typedef struct Sender {
+    Checker *checker;
+    uint32_t id;
+    pthread_t thread;
+} Sender;
+
+static void check_seq(Checker *checker, uint32_t sender, uint32_t seq)
+{
+    assert(sender < CHECK_SENDERS);
+    assert(seq == checker->next_seq[sender]);
+    checker->next_seq[sender]++;
+
+    /* let the ring get full now and then */
+    if (sender == 0 && seq % 2000 == 0) {
+        g_usleep(5000);
+    }
+}
+
+static void handle_small(void *opaque, void *payload)
+{
+    CheckSmall *msg = payload;
+
+    check_seq(opaque, msg->sender, msg->seq);
+}
+
+static void handle_large(void *opaque, void *payload)
+{
+    CheckLarge *msg = payload;
+    int i;
+
+    check_seq(opaque, msg->sender, msg->seq);
+    for (i = 0; i < CHECK_LARGE_SIZE; i++) {
+        assert(msg->data[i] == (uint8_t)(msg->seq + msg->sender + i));
+    }
+}
+
+static void handle_sync(void *opaque, void *payload)
+{
+    Checker *checker = opaque;
+    CheckSmall *msg = payload;
+
+    check_seq(checker, msg->sender, msg->seq);
+    g_atomic_int_set(&checker->handled[msg->sender], msg->seq);
+}
+
+static void handle_check_close(void *opaque, void *payload)
+{
+    Checker *checker = opaque;
+
+    checker->receiver.quit = TRUE;
+}
+
+static void *sender_thread(void *opaque)
+{
+    Sender *sender = opaque;
+    Dispatcher *dispatcher = sender->checker->receiver.dispatcher;
+    uint32_t seq;
+    int i;
+
+    for (seq = 0; seq < CHECK_MSGS; seq++) {
+        if (seq % 7 == 3) {
+            CheckLarge msg = { sender->id, seq };
+
+            for (i = 0; i < CHECK_LARGE_SIZE; i++) {
+                msg.data[i] = seq + sender->id + i;
+            }
+            dispatcher_send_message(dispatcher, CHECK_MESSAGE_LARGE, &msg);
+        } else if (seq % 101 == 0) {
+            CheckSmall msg = { sender->id, seq };
+
+            dispatcher_send_message(dispatcher, CHECK_MESSAGE_SYNC, &msg);
+            assert(g_atomic_int_get(&sender->checker->handled[sender->id]) == (gint)seq);
+        } else {
+            CheckSmall msg = { sender->id, seq };
+
+            dispatcher_send_message(dispatcher, CHECK_MESSAGE_SMALL, &msg);
+        }
+    }
+    return NULL;
+}
+
+static void test_order(gboolean use_ring)
+{
+    Checker checker;
+    Sender senders[CHECK_SENDERS];
+    CheckSmall close_msg = { 0, };
+    Dispatcher *dispatcher;
+    pthread_t thread;
+    int i;
+
+    memset(&checker, 0, sizeof(checker));
+    dispatcher = use_ring ? dispatcher_new_ring(CHECK_MESSAGE_COUNT, &checker) :
+                            dispatcher_new(CHECK_MESSAGE_COUNT, &checker);
+    checker.receiver.dispatcher = dispatcher;
+    dispatcher_register_handler(dispatcher, CHECK_MESSAGE_SMALL, handle_small,
+                                sizeof(CheckSmall), DISPATCHER_NONE);
+    dispatcher_register_handler(dispatcher, CHECK_MESSAGE_LARGE, handle_large,
+                                sizeof(CheckLarge), DISPATCHER_NONE);
+    dispatcher_register_handler(dispatcher, CHECK_MESSAGE_SYNC, handle_sync,
+                                sizeof(CheckSmall), DISPATCHER_ACK);
+    dispatcher_register_handler(dispatcher, CHECK_MESSAGE_CLOSE, handle_check_close,
+                                sizeof(CheckSmall), DISPATCHER_ACK);
+    assert(pthread_create(&thread, NULL, receiver_thread, &checker.receiver) == 0);
+
+    for (i = 0; i < CHECK_SENDERS; i++) {
+        senders[i].checker = &checker;
+        senders[i].id = i;
+        assert(pthread_create(&senders[i].thread, NULL, sender_thread, &senders[i]) == 0);
+    }
+    for (i = 0; i < CHECK_SENDERS; i++) {
+        pthread_join(senders[i].thread, NULL);
+    }
+
+    dispatcher_send_message(dispatcher, CHECK_MESSAGE_CLOSE, &close_msg);
+    pthread_join(thread, NULL);
+    for (i = 0; i < CHECK_SENDERS; i++) {
+        assert(checker.next_seq[i] == CHECK_MSGS);
+    }
+
+    g_object_unref(dispatcher);
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    const uint64_t *x = a, *y = b;
+
+    return *x < *y ? -1 : *x > *y;
+}
+
+static void run(const char *name, gboolean use_ring)
+{
+    Receiver receiver = { NULL, };
+    RedWorkerMessageUpdate update = { 0, };
+    RedWorkerMessageWakeup wakeup;
+    RedWorkerMessageClose close_msg;
+    uint64_t *round_trips = g_new(uint64_t, n_msgs);
+    uint64_t start, total = 0, wakeup_ns;
+    pthread_t thread;
+    int i;
+
+    receiver.dispatcher = use_ring ? dispatcher_new_ring(RED_WORKER_MESSAGE_COUNT, &receiver) :
+                                     dispatcher_new(RED_WORKER_MESSAGE_COUNT, &receiver);
+    dispatcher_register_handler(receiver.dispatcher, RED_WORKER_MESSAGE_UPDATE,
+                                handle_update, sizeof(RedWorkerMessageUpdate),
+                                DISPATCHER_ACK);
+    dispatcher_register_handler(receiver.dispatcher, RED_WORKER_MESSAGE_WAKEUP,
+                                handle_wakeup, sizeof(RedWorkerMessageWakeup),
+                                DISPATCHER_NONE);
+    dispatcher_register_handler(receiver.dispatcher, RED_WORKER_MESSAGE_CLOSE_WORKER,
+                                handle_close, sizeof(RedWorkerMessageClose),
+                                DISPATCHER_ACK);
+    pthread_create(&thread, NULL, receiver_thread, &receiver);
+
+    for (i = 0; i < n_msgs; i++) {
+        start = get_time_ns();
+        dispatcher_send_message(receiver.dispatcher, RED_WORKER_MESSAGE_UPDATE, &update);
+        round_trips[i] = get_time_ns() - start;
+        total += round_trips[i];
+    }
+    qsort(round_trips, n_msgs, sizeof(uint64_t), compare_u64);
+
+    start = get_time_ns();
+    for (i = 0; i < n_msgs; i++) {
+        dispatcher_send_message(receiver.dispatcher, RED_WORKER_MESSAGE_WAKEUP, &wakeup);
+    }
+    wakeup_ns = get_time_ns() - start;
+
+    dispatcher_send_message(receiver.dispatcher, RED_WORKER_MESSAGE_CLOSE_WORKER, &close_msg);
+    pthread_join(thread, NULL);
+    g_assert_cmpint(receiver.n_wakeups, ==, n_msgs);
+
+    printf("%-7s update round trip: %7.2f us average, %7.2f us median, %7.2f us 99th\n",
+           name, total / 1e3 / n_msgs, round_trips[n_msgs / 2] / 1e3,
+           round_trips[n_msgs - n_msgs / 100 - 1] / 1e3);
+    printf("%-7s wakeup send:       %7.2f us\n", name, wakeup_ns / 1e3 / n_msgs);
+
+    g_object_unref(receiver.dispatcher);
+    g_free(round_trips);
+}
+
+int main(int argc, char **argv)
+{
+    GOptionContext *context;
+    GError *error = NULL;
+
+    GOptionEntry entries[] = {
+        { "messages", 'n', 0, G_OPTION_ARG_INT, &n_msgs,
+          "Number of messages (default 10000)", "INT" },
+        { NULL }
+    };
+
+    context = g_option_context_new("- dispatcher latency benchmark");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        printf("Option parsing failed: %s\n", error->message);
+        exit(-1);
+    }
+    g_option_context_free(context);
+    if (n_msgs <= 0) {
+        printf("Invalid arguments\n");
+        exit(-1);
+    }
+
+    test_order(FALSE);
+    test_order(TRUE);
+
+    run("socket", FALSE);
+    run("ring", TRUE);
+
+    return 0;
+}
@@ -0,0 +1,470 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Check that each of the match length implementations the cpu supports
+ * produces the same GLZ output as the plain one, on images built so that
+ * the matches end at every offset of the vectors, and that the bits which
+ * are not compared are ignored. Then benchmark them on the compression of
+ * a sequence of desktop captures.
+ *
+ * The captures are binary PPM files (P6, 8 bits per channel), given in
+ * the order they were taken, e.g. "grim -t ppm" or "import -window root"
+ * output. Without files a synthetic desktop is used.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#undef NDEBUG
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <glib.h>
+
+#include "glz-encoder.h"
+#include "test-timing.h"
+
+#define MATCH_WIDTH 67
+#define MATCH_HEIGHT 200
+
+static gint iterations = 1;
+static gint bits = 32;
+static gchar **files = NULL;
+
+typedef struct Capture {
+    int width;
+    int height;
+    int stride;
+    uint8_t *pixels;
+} Capture;
+
+static SPICE_GNUC_PRINTF(2, 3) void usr_error(GlzEncoderUsrContext *usr, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    abort();
+}
+
+static SPICE_GNUC_PRINTF(2, 3) void usr_warn(GlzEncoderUsrContext *usr, const char *fmt, ...)
+{
+}
+
+static void *usr_malloc(GlzEncoderUsrContext *usr, int size)
+{
+    return g_malloc(size);
+}
+
+static void usr_free(GlzEncoderUsrContext *usr, void *ptr)
+{
+    g_free(ptr);
+}
+
+static int usr_more_lines(GlzEncoderUsrContext *usr, uint8_t **lines)
+{
+    return 0;
+}
+
+static int usr_more_space(GlzEncoderUsrContext *usr, uint8_t **io_ptr)
+{
+    return 0;
+}
+
+static void usr_free_image(GlzEncoderUsrContext *usr, GlzUsrImageContext *image)
+{
+}
+
+static GlzEncoderUsrContext usr = {
+    .error = usr_error,
+    .warn = usr_warn,
+    .info = usr_warn,
+    .malloc = usr_malloc,
+    .free = usr_free,
+    .more_lines = usr_more_lines,
+    .more_space = usr_more_space,
+    .free_image = usr_free_image,
+};
+
+static void capture_set_pixel(Capture *capture, int x, int y, uint8_t r, uint8_t g, uint8_t b)
+{
+    uint8_t *pixel = capture->pixels + y * capture->stride;
+
+    switch (bits) {
+    case 16: {
+        uint16_t rgb555 = ((r >> 3) << 10) | ((g >> 3) << 5) | (b >> 3);
+
+        memcpy(pixel + x * 2, &rgb555, 2);
+        break;
+    }
+    case 24:
+        pixel += x * 3;
+        pixel[0] = b;
+        pixel[1] = g;
+        pixel[2] = r;
+        break;
+    default:
+        pixel += x * 4;
+        pixel[0] = b;
+        pixel[1] = g;
+        pixel[2] = r;
+        pixel[3] = 0;
+        break;
+    }
+}
+
+/* the pad byte of rgb32 pixels and the top bit of rgb16 ones */
+static void capture_set_ignored_bits(Capture *capture, int x, int y, uint8_t noise)
+{
+    uint8_t *pixel = capture->pixels + y * capture->stride;
+
+    if (bits == 32) {
+        pixel[x * 4 + 3] = noise;
+    } else if (bits == 16) {
+        pixel[x * 2 + 1] = (pixel[x * 2 + 1] & 0x7f) | (noise & 0x80);
+    }
+}
+
+static Capture *capture_new(int width, int height)
+{
+    Capture *capture = g_new0(Capture, 1);
+
+    capture->width = width;
+    capture->height = height;
+    capture->stride = width * (bits / 8);
+    capture->pixels = g_malloc(capture->stride * height);
+
+    return capture;
+}
+
+static void capture_free(gpointer data)
+{
+    Capture *capture = data;
+
+    g_free(capture->pixels);
+    g_free(capture);
+}
+
+static const char *ppm_next_token(const char *p, const char *end)
+{
+    while (p < end && (g_ascii_isspace(*p) || *p == '#')) {
+        if (*p == '#') {
+            while (p < end && *p != '\n') {
+                p++;
+            }
+        } else {
+            p++;
+        }
+    }
+    return p;
+}
+
+static Capture *capture_load(const char *filename)
+{
+    Capture *capture;
+    gchar *contents;
+    gsize length;
+    const char *p, *end;
+    char *next;
+    long width, height, maxval;
+    int x, y;
+
+    if (!g_file_get_contents(filename, &contents, &length, NULL)) {
+        printf("Can't read %s\n", filename);
+        exit(-1);
+    }
+    end = contents + length;
+    if (length < 2 || strncmp(contents, "P6", 2) != 0) {
+        goto invalid;
+    }
+    p = ppm_next_token(contents + 2, end);
+    width = strtol(p, &next, 10);
+    p = ppm_next_token(next, end);
+    height = strtol(p, &next, 10);
+    p = ppm_next_token(next, end);
+    maxval = strtol(p, &next, 10);
+    p = next + 1;
+    if (width <= 0 || height <= 0 || maxval != 255 || p + width * height * 3 > end) {
+        goto invalid;
+    }
+
+    capture = capture_new(width, height);
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++, p += 3) {
+            capture_set_pixel(capture, x, y, p[0], p[1], p[2]);
+        }
+    }
+    g_free(contents);
+
+    return capture;
+
+invalid:
+    printf("%s is not a binary PPM file with 8 bits per channel\n", filename);
+    exit(-1);
+}
+
+/* a few frames of something looking like a desktop: a gradient background,
+ * flat windows with text, and a window moving over it */
+static GPtrArray *create_captures(void)
+{
+    GPtrArray *captures = g_ptr_array_new_with_free_func(capture_free);
+    GRand *rand = g_rand_new_with_seed(42);
+    const int width = 1920, height = 1080;
+    int frame, x, y;
+
+    for (frame = 0; frame < 8; frame++) {
+        Capture *capture = capture_new(width, height);
+
+        for (y = 0; y < height; y++) {
+            for (x = 0; x < width; x++) {
+                int wx = x - frame * 40, wy = y - frame * 20;
+                uint8_t r = x * 255 / width, g = y * 255 / height, b = 0x80;
+
+                if (wx >= 200 && wx < 1000 && wy >= 100 && wy < 700) {
+                    r = g = b = 0xf0;
+                    if ((wy % 16) < 10 && (wx % 8) < 6 && (wx * 7 + wy * 13) % 5 == 0) {
+                        r = g = b = 0x20;
+                    }
+                } else if (x >= 1200 && x < 1600 && y >= 600 && y < 900) {
+                    r = g_rand_int(rand);
+                    g = g_rand_int(rand);
+                    b = g_rand_int(rand);
+                }
+                capture_set_pixel(capture, x, y, r, g, b);
+            }
+        }
+        g_ptr_array_add(captures, capture);
+    }
+    g_rand_free(rand);
+
+    return captures;
+}
+
+/* rows matching the previous one up to a difference in one of the channels
+ * moving along them, and runs of all the lengths; with a different shift the captures match each
+ * other the same way */
+static Capture *create_match_capture(const uint32_t *row, int width, int height, int shift)
+{
+    Capture *capture = capture_new(width, height);
+    GRand *rand = g_rand_new_with_seed(shift);
+    int x, y;
+
+    for (y = 0; y < height; y++) {
+        int end = (y * 5 + shift) % width;
+        uint32_t color = g_rand_int(rand);
+
+        for (x = 0; x < width; x++) {
+            uint32_t pixel = row[x];
+
+            if (y % 3 == 2 && x < end) {
+                pixel = color;
+            } else if (y % 3 != 2 && x == end) {
+                /* a single channel differs */
+                pixel ^= 0x80 << (8 * (y / 3 % 3));
+            }
+            capture_set_pixel(capture, x, y, pixel >> 16, pixel >> 8, pixel);
+            capture_set_ignored_bits(capture, x, y, g_rand_int(rand));
+        }
+    }
+    g_rand_free(rand);
+
+    return capture;
+}
+
+static GByteArray *encode_captures(GPtrArray *captures, LzImageType type)
+{
+    GlzEncDictContext *dict = glz_enc_dictionary_create(LZ_MAX_WINDOW_SIZE, 1, &usr);
+    GlzEncoderContext *encoder = glz_encoder_create(0, dict, &usr);
+    GByteArray *output = g_byte_array_new();
+    guint i;
+
+    for (i = 0; i < captures->len; i++) {
+        Capture *capture = g_ptr_array_index(captures, i);
+        int out_size = capture->stride * capture->height * 2 + 1024;
+        uint8_t *out = g_malloc(out_size);
+        GlzEncDictImageContext *dict_image;
+        int size;
+
+        size = glz_encode(encoder, type, capture->width, capture->height, TRUE,
+                          capture->pixels, capture->height, capture->stride,
+                          out, out_size, NULL, &dict_image);
+        g_byte_array_append(output, out, size);
+        g_free(out);
+    }
+    glz_encoder_destroy(encoder);
+    glz_enc_dictionary_destroy(dict, &usr);
+
+    return output;
+}
+
+static void test_match_len(void)
+{
+    static const GlzSimd levels[] = { GLZ_SIMD_SSE2, GLZ_SIMD_AVX2 };
+    static const int depths[] = { 16, 24, 32 };
+    const int saved_bits = bits;
+    uint32_t row[MATCH_WIDTH];
+    GRand *rand = g_rand_new_with_seed(3);
+    int i, j;
+
+    for (i = 0; i < MATCH_WIDTH; i++) {
+        row[i] = g_rand_int(rand);
+    }
+
+    for (i = 0; i < (int)G_N_ELEMENTS(depths); i++) {
+        LzImageType type;
+        GPtrArray *captures = g_ptr_array_new_with_free_func(capture_free);
+        GByteArray *plain;
+
+        bits = depths[i];
+        type = bits == 16 ? LZ_IMAGE_TYPE_RGB16 :
+               bits == 24 ? LZ_IMAGE_TYPE_RGB24 : LZ_IMAGE_TYPE_RGB32;
+        g_ptr_array_add(captures, create_match_capture(row, MATCH_WIDTH, MATCH_HEIGHT, 1));
+        g_ptr_array_add(captures, create_match_capture(row, MATCH_WIDTH, MATCH_HEIGHT, 2));
+
+        assert(glz_encoder_set_simd(GLZ_SIMD_NONE) == GLZ_SIMD_NONE);
+        plain = encode_captures(captures, type);
+        for (j = 0; j < (int)G_N_ELEMENTS(levels); j++) {
+            GByteArray *output;
+
+            if (glz_encoder_set_simd(levels[j]) != levels[j]) {
+                continue;
+            }
+            output = encode_captures(captures, type);
+            assert(output->len == plain->len);
+            assert(memcmp(output->data, plain->data, plain->len) == 0);
+            g_byte_array_unref(output);
+        }
+
+        g_byte_array_unref(plain);
+        g_ptr_array_unref(captures);
+    }
+
+    glz_encoder_set_simd(GLZ_SIMD_AVX2);
+    bits = saved_bits;
+    g_rand_free(rand);
+}
+
+static void run(GPtrArray *captures, GlzSimd simd, const char *name,
+                GChecksum **reference, uint64_t *reference_ns)
+{
+    LzImageType type = bits == 16 ? LZ_IMAGE_TYPE_RGB16 :
+                       bits == 24 ? LZ_IMAGE_TYPE_RGB24 : LZ_IMAGE_TYPE_RGB32;
+    GChecksum *checksum = g_checksum_new(G_CHECKSUM_MD5);
+    uint64_t elapsed = 0, raw = 0, compressed = 0;
+    int i;
+    guint j;
+
+    if (glz_encoder_set_simd(simd) != simd) {
+        g_checksum_free(checksum);
+        return;
+    }
+
+    for (i = 0; i < iterations; i++) {
+        GlzEncDictContext *dict = glz_enc_dictionary_create(LZ_MAX_WINDOW_SIZE, 1, &usr);
+        GlzEncoderContext *encoder = glz_encoder_create(0, dict, &usr);
+
+        for (j = 0; j < captures->len; j++) {
+            Capture *capture = g_ptr_array_index(captures, j);
+            int out_size = capture->stride * capture->height * 2 + 1024;
+            uint8_t *out = g_malloc(out_size);
+            GlzEncDictImageContext *dict_image;
+            uint64_t start = get_time_ns();
+            int size;
+
+            size = glz_encode(encoder, type, capture->width, capture->height, TRUE,
+                              capture->pixels, capture->height, capture->stride,
+                              out, out_size, NULL, &dict_image);
+            elapsed += get_time_ns() - start;
+            raw += capture->stride * capture->height;
+            compressed += size;
+            if (i == 0) {
+                g_checksum_update(checksum, out, size);
+            }
+            g_free(out);
+        }
+        glz_encoder_destroy(encoder);
+        glz_enc_dictionary_destroy(dict, &usr);
+    }
+
+    printf("%-5s %8.1f MB/s, ratio %6.2f", name, raw / (elapsed / 1e3), (double)raw / compressed);
+    if (!*reference) {
+        *reference = checksum;
+        *reference_ns = elapsed;
+        printf("\n");
+        return;
+    }
+    printf(", %5.2fx\n", (double)*reference_ns / elapsed);
+    assert(strcmp(g_checksum_get_string(checksum), g_checksum_get_string(*reference)) == 0);
+    g_checksum_free(checksum);
+}
+
+int main(int argc, char **argv)
+{
+    GOptionContext *context;
+    GError *error = NULL;
+    GPtrArray *captures;
+    GChecksum *reference = NULL;
+    uint64_t reference_ns = 0;
+
+    GOptionEntry entries[] = {
+        { "iterations", 'n', 0, G_OPTION_ARG_INT, &iterations,
+          "Number of times the captures are compressed (default 1)", "INT" },
+        { "bits", 'b', 0, G_OPTION_ARG_INT, &bits,
+          "Bits per pixel of the images: 16, 24 or 32 (default 32)", "INT" },
+        { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &files,
+          "Desktop captures", "FILE.ppm..." },
+        { NULL }
+    };
+
+    context = g_option_context_new("- GLZ compression benchmark");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        printf("Option parsing failed: %s\n", error->message);
+        exit(-1);
+    }
+    g_option_context_free(context);
+    if (iterations <= 0 || (bits != 16 && bits != 24 && bits != 32)) {
+        printf("Invalid arguments\n");
+        exit(-1);
+    }
+
+    test_match_len();
+
+    if (files) {
+        gchar **file;
+
+        captures = g_ptr_array_new_with_free_func(capture_free);
+        for (file = files; *file; file++) {
+            g_ptr_array_add(captures, capture_load(*file));
+        }
+    } else {
+        captures = create_captures();
+    }
+
+    printf("%u captures, %d bits per pixel, %d iterations\n", captures->len, bits, iterations);
+    run(captures, GLZ_SIMD_NONE, "plain", &reference, &reference_ns);
+    run(captures, GLZ_SIMD_SSE2, "sse2", &reference, &reference_ns);
+    run(captures, GLZ_SIMD_AVX2, "avx2", &reference, &reference_ns);
+
+    g_checksum_free(reference);
+    g_ptr_array_unref(captures);
+    g_strfreev(files);
+
+    return 0;
+}
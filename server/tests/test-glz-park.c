@@ -0,0 +1,123 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Check that the GLZ dictionary of a client which disconnected is parked
+ * with its images for SPICE_GLZ_DICT_GRACE seconds, that the client gets it
+ * back when it reconnects meanwhile, and that it is destroyed once the grace
+ * period is over.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#undef NDEBUG
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <glib.h>
+
+#include "image-encoders.h"
+#include "red-parse-qxl.h"
+
+#define CONNECTION_ID 42
+#define IMAGE_WIDTH 64
+#define IMAGE_HEIGHT 64
+#define WINDOW_SIZE (IMAGE_WIDTH * IMAGE_HEIGHT * 16)
+
+static ImageEncoderSharedData shared_data;
+static RedDrawable *red_drawable;
+static GlzImageRetention glz_retention;
+static uint32_t pixels[IMAGE_WIDTH * IMAGE_HEIGHT];
+
+static void connect_client(ImageEncoders *enc, RedClient *client)
+{
+    image_encoders_init(enc, &shared_data);
+    assert(image_encoders_get_glz_dictionary(enc, client, CONNECTION_ID, 0, WINDOW_SIZE));
+    assert(image_encoders_glz_create(enc, 0));
+}
+
+static void encode(ImageEncoders *enc)
+{
+    compress_send_data_t comp_data = {0};
+    RedCompressBuf *buf;
+    SpiceImage dest;
+    SpiceBitmap bitmap;
+
+    memset(&dest, 0, sizeof(dest));
+    memset(&bitmap, 0, sizeof(bitmap));
+    bitmap.format = SPICE_BITMAP_FMT_32BIT;
+    bitmap.flags = SPICE_BITMAP_FLAGS_TOP_DOWN;
+    bitmap.x = IMAGE_WIDTH;
+    bitmap.y = IMAGE_HEIGHT;
+    bitmap.stride = IMAGE_WIDTH * sizeof(uint32_t);
+    bitmap.data = spice_chunks_new_linear((uint8_t *) pixels, bitmap.stride * bitmap.y);
+
+    assert(image_encoders_compress_glz(enc, &dest, &bitmap, red_drawable, &glz_retention,
+                                       &comp_data, FALSE));
+    while ((buf = comp_data.comp_buf) != NULL) {
+        comp_data.comp_buf = buf->send_next;
+        compress_buf_free(buf);
+    }
+    spice_chunks_destroy(bitmap.data);
+}
+
+int main(void)
+{
+    ImageEncoders enc;
+    GlzSharedDictionary *parked;
+    int client_a, client_b;
+    uint32_t timeout;
+    int i;
+
+    g_setenv("SPICE_GLZ_DICT_GRACE", "1", TRUE);
+    image_encoder_shared_init(&shared_data);
+
+    red_drawable = spice_new0(RedDrawable, 1);
+    red_drawable->refs = 1;
+    glz_retention_init(&glz_retention);
+    for (i = 0; i < IMAGE_WIDTH * IMAGE_HEIGHT; i++) {
+        pixels[i] = i * 0x010203;
+    }
+
+    /* park: the images are copied, the drawables are released */
+    connect_client(&enc, (RedClient *) &client_a);
+    encode(&enc);
+    assert(red_drawable->refs == 2);
+    parked = enc.glz_dict;
+    image_encoders_free(&enc);
+    assert(red_drawable->refs == 1);
+    assert(ring_is_empty(&glz_retention.ring));
+    assert(shared_data.glz_drawable_count == 0);
+    timeout = image_encoders_glz_expire_parked();
+    assert(timeout > 0 && timeout <= 1000);
+
+    /* reuse: the same connection gets it back */
+    connect_client(&enc, (RedClient *) &client_b);
+    assert(enc.glz_dict == parked);
+    assert(image_encoders_glz_expire_parked() == 0);
+    encode(&enc);
+    image_encoders_free(&enc);
+    assert(red_drawable->refs == 1);
+
+    /* expire: it is destroyed once the grace period is over */
+    timeout = image_encoders_glz_expire_parked();
+    assert(timeout > 0 && timeout <= 1000);
+    g_usleep((timeout + 10) * 1000);
+    assert(image_encoders_glz_expire_parked() == 0);
+
+    red_drawable_unref(red_drawable);
+    return 0;
+}
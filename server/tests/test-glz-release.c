@@ -0,0 +1,177 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Check the release of the GLZ images encoded from several threads, the
+ * way the send pool threads encode them for the clients of a display.
+ *
+ * The dictionary of a client is shared by its displays and the drawables of
+ * a display by its clients. Both encoders are given the same of each: the
+ * window of one trims the images of the other, which are queued to be freed
+ * by the worker, and they add their glz drawables to the same retention
+ * while the images trimmed by their own window are freed at once.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#undef NDEBUG
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <glib.h>
+
+#include "image-encoders.h"
+#include "red-parse-qxl.h"
+
+#define N_ENCODERS 2
+#define N_DRAWABLES 8
+#define N_IMAGES 2000
+#define IMAGE_WIDTH 64
+#define IMAGE_HEIGHT 64
+/* the window holds a few images only, it is trimmed all the time */
+#define WINDOW_SIZE (IMAGE_WIDTH * IMAGE_HEIGHT * 6)
+
+typedef struct TestDrawable {
+    RedDrawable *red_drawable;
+    GlzImageRetention glz_retention;
+    uint32_t pixels[IMAGE_WIDTH * IMAGE_HEIGHT];
+} TestDrawable;
+
+typedef struct Encoder {
+    ImageEncoders encoders;
+    pthread_t thread;
+    int seed;
+} Encoder;
+
+static TestDrawable drawables[N_DRAWABLES];
+
+static void release_compressed(compress_send_data_t *comp_data)
+{
+    RedCompressBuf *buf = comp_data->comp_buf;
+
+    while (buf) {
+        RedCompressBuf *next = buf->send_next;
+        compress_buf_free(buf);
+        buf = next;
+    }
+}
+
+static void *encode_thread(void *opaque)
+{
+    Encoder *encoder = opaque;
+    GRand *rand = g_rand_new_with_seed(encoder->seed);
+    int i;
+
+    for (i = 0; i < N_IMAGES; i++) {
+        TestDrawable *drawable = &drawables[g_rand_int_range(rand, 0, N_DRAWABLES)];
+        compress_send_data_t comp_data = {0};
+        SpiceImage dest;
+        SpiceBitmap bitmap;
+
+        memset(&dest, 0, sizeof(dest));
+        memset(&bitmap, 0, sizeof(bitmap));
+        bitmap.format = SPICE_BITMAP_FMT_32BIT;
+        bitmap.flags = SPICE_BITMAP_FLAGS_TOP_DOWN;
+        bitmap.x = IMAGE_WIDTH;
+        bitmap.y = IMAGE_HEIGHT;
+        bitmap.stride = IMAGE_WIDTH * sizeof(uint32_t);
+        bitmap.data = spice_chunks_new_linear((uint8_t *) drawable->pixels,
+                                              bitmap.stride * bitmap.y);
+
+        assert(image_encoders_compress_glz(&encoder->encoders, &dest, &bitmap,
+                                           drawable->red_drawable, &drawable->glz_retention,
+                                           &comp_data, FALSE));
+        assert(dest.descriptor.type == SPICE_IMAGE_TYPE_GLZ_RGB);
+        release_compressed(&comp_data);
+        spice_chunks_destroy(bitmap.data);
+    }
+
+    g_rand_free(rand);
+    return NULL;
+}
+
+int main(void)
+{
+    ImageEncoderSharedData shared_data;
+    Encoder encoders[N_ENCODERS];
+    int client;
+    GRand *rand = g_rand_new_with_seed(7);
+    int queued = 0;
+    int i, j;
+
+    image_encoder_shared_init(&shared_data);
+
+    for (i = 0; i < N_DRAWABLES; i++) {
+        drawables[i].red_drawable = spice_new0(RedDrawable, 1);
+        drawables[i].red_drawable->refs = 1;
+        glz_retention_init(&drawables[i].glz_retention);
+        for (j = 0; j < IMAGE_WIDTH * IMAGE_HEIGHT; j++) {
+            drawables[i].pixels[j] = g_rand_int(rand) & 0xffffff;
+        }
+    }
+
+    for (i = 0; i < N_ENCODERS; i++) {
+        image_encoders_init(&encoders[i].encoders, &shared_data);
+        assert(image_encoders_get_glz_dictionary(&encoders[i].encoders,
+                                                 (RedClient *) &client, 0, 0, WINDOW_SIZE));
+        assert(image_encoders_glz_create(&encoders[i].encoders, i));
+        encoders[i].seed = i + 1;
+    }
+    assert(encoders[0].encoders.glz_dict == encoders[1].encoders.glz_dict);
+
+    for (i = 0; i < N_ENCODERS; i++) {
+        assert(pthread_create(&encoders[i].thread, NULL, encode_thread, &encoders[i]) == 0);
+    }
+    for (i = 0; i < N_ENCODERS; i++) {
+        pthread_join(encoders[i].thread, NULL);
+    }
+
+    /* what the worker does once the clients are sent */
+    for (i = 0; i < N_ENCODERS; i++) {
+        ImageEncoders *enc = &encoders[i].encoders;
+
+        queued += ring_get_length(&enc->glz_drawables_inst_to_free);
+        image_encoders_free_glz_drawables_to_free(enc);
+        assert(ring_is_empty(&enc->glz_drawables_inst_to_free));
+    }
+    assert(queued > 0);
+
+    /* the drawables still in the window keep a reference */
+    for (i = 0; i < N_DRAWABLES; i++) {
+        RedDrawable *red_drawable = drawables[i].red_drawable;
+
+        assert(red_drawable->refs ==
+               1 + (int) ring_get_length(&drawables[i].glz_retention.ring));
+    }
+    assert(shared_data.glz_drawable_count > 0);
+
+    for (i = 0; i < N_DRAWABLES; i++) {
+        glz_retention_free_drawables(&drawables[i].glz_retention);
+        assert(ring_is_empty(&drawables[i].glz_retention.ring));
+        assert(drawables[i].red_drawable->refs == 1);
+        red_drawable_unref(drawables[i].red_drawable);
+    }
+    assert(shared_data.glz_drawable_count == 0);
+
+    for (i = 0; i < N_ENCODERS; i++) {
+        assert(ring_is_empty(&encoders[i].encoders.glz_drawables));
+        image_encoders_free(&encoders[i].encoders);
+    }
+
+    g_rand_free(rand);
+    return 0;
+}
@@ -0,0 +1,523 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* The GLZ encoders of a client with several displays: each display channel
+ * has its own encoder and thread, all of them share the dictionary of the
+ * client. The images of the displays are built from a common set of tiles,
+ * so that the encoders find matches in the images added by the other ones,
+ * like windows moved from one monitor to another.
+ *
+ * Check that the images encoded concurrently while the window is trimmed
+ * decode back to the original ones, the way the client decodes them, then
+ * benchmark the encoders.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#undef NDEBUG
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <glib.h>
+
+#include "glz-encoder.h"
+#include "test-timing.h"
+
+#define N_TILES 64
+#define N_THREAD_IMAGES 64
+
+#define CHECK_THREADS 4
+#define CHECK_IMAGES 300
+#define CHECK_SIZE 32
+#define CHECK_TILES 4
+/* a few images only, the window is trimmed all the time */
+#define CHECK_WINDOW (CHECK_SIZE * CHECK_SIZE * 8)
+
+static gint max_threads = 4;
+static gint n_images = 200;
+static gint image_size = 256;
+static gint window_size = 4 * 1024 * 1024;
+
+static uint32_t *tiles[N_TILES];
+
+typedef struct Encoded {
+    uint8_t *data;
+    int size;
+    int display;
+    const uint32_t *image;
+} Encoded;
+
+typedef struct Display {
+    GlzEncoderUsrContext usr;
+    GlzEncoderContext *encoder;
+    pthread_t thread;
+    int id;
+    uint32_t *images[N_THREAD_IMAGES];
+    uint8_t *out;
+    int out_size;
+    uint64_t compressed;
+    /* the compressed images, kept by the check only */
+    Encoded *encoded;
+} Display;
+
+static pthread_barrier_t start_barrier;
+
+static SPICE_GNUC_PRINTF(2, 3) void usr_error(GlzEncoderUsrContext *usr, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    abort();
+}
+
+static SPICE_GNUC_PRINTF(2, 3) void usr_warn(GlzEncoderUsrContext *usr, const char *fmt, ...)
+{
+}
+
+static void *usr_malloc(GlzEncoderUsrContext *usr, int size)
+{
+    return g_malloc(size);
+}
+
+static void usr_free(GlzEncoderUsrContext *usr, void *ptr)
+{
+    g_free(ptr);
+}
+
+static int usr_more_lines(GlzEncoderUsrContext *usr, uint8_t **lines)
+{
+    return 0;
+}
+
+static int usr_more_space(GlzEncoderUsrContext *usr, uint8_t **io_ptr)
+{
+    return 0;
+}
+
+/* the images are owned by the displays and stay valid until the end */
+static void usr_free_image(GlzEncoderUsrContext *usr, GlzUsrImageContext *image)
+{
+}
+
+static void display_usr_init(GlzEncoderUsrContext *usr)
+{
+    usr->error = usr_error;
+    usr->warn = usr_warn;
+    usr->info = usr_warn;
+    usr->malloc = usr_malloc;
+    usr->free = usr_free;
+    usr->more_lines = usr_more_lines;
+    usr->more_space = usr_more_space;
+    usr->free_image = usr_free_image;
+}
+
+/* flat areas with some "text" on them */
+static void create_tiles(int size)
+{
+    GRand *rand = g_rand_new_with_seed(42);
+    int i, j;
+
+    for (i = 0; i < N_TILES; i++) {
+        uint32_t background = g_rand_int(rand) & 0xffffff;
+
+        tiles[i] = g_new(uint32_t, size * size);
+        for (j = 0; j < size * size; j++) {
+            tiles[i][j] = g_rand_int_range(rand, 0, 8) ? background : g_rand_int(rand) & 0xffffff;
+        }
+    }
+    g_rand_free(rand);
+}
+
+static void free_tiles(void)
+{
+    int i;
+
+    for (i = 0; i < N_TILES; i++) {
+        g_free(tiles[i]);
+    }
+}
+
+/* a tile with a few lines of its own */
+static void create_display_images(Display *display, int size, int n_tiles)
+{
+    GRand *rand = g_rand_new_with_seed(display->id);
+    int i, j;
+
+    for (i = 0; i < N_THREAD_IMAGES; i++) {
+        uint32_t *image = g_new(uint32_t, size * size);
+        int row = g_rand_int_range(rand, 0, size - size / 32);
+
+        memcpy(image, tiles[g_rand_int_range(rand, 0, n_tiles)], sizeof(uint32_t) * size * size);
+        for (j = row * size; j < (row + size / 32) * size; j++) {
+            image[j] = g_rand_int(rand) & 0xffffff;
+        }
+        display->images[i] = image;
+    }
+    g_rand_free(rand);
+}
+
+static void free_display_images(Display *display)
+{
+    int i;
+
+    for (i = 0; i < N_THREAD_IMAGES; i++) {
+        g_free(display->images[i]);
+    }
+}
+
+static void *check_thread(void *opaque)
+{
+    Display *display = opaque;
+    GlzEncDictImageContext *dict_image;
+    int i;
+
+    pthread_barrier_wait(&start_barrier);
+    for (i = 0; i < CHECK_IMAGES; i++) {
+        Encoded *encoded = &display->encoded[i];
+
+        encoded->image = display->images[i % N_THREAD_IMAGES];
+        encoded->display = display->id;
+        encoded->size = glz_encode(display->encoder, LZ_IMAGE_TYPE_RGB32,
+                                   CHECK_SIZE, CHECK_SIZE, TRUE, (uint8_t *)encoded->image,
+                                   CHECK_SIZE, CHECK_SIZE * sizeof(uint32_t),
+                                   display->out, display->out_size, NULL, &dict_image);
+        encoded->data = g_malloc(encoded->size);
+        memcpy(encoded->data, display->out, encoded->size);
+    }
+
+    return NULL;
+}
+
+static uint32_t read_32(const uint8_t **ip)
+{
+    const uint8_t *p = *ip;
+
+    *ip += 4;
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static const uint8_t *decode_header(const Encoded *encoded, uint64_t *id,
+                                   uint32_t *win_head_dist)
+{
+    const uint8_t *ip = encoded->data;
+
+    assert(read_32(&ip) == GUINT32_TO_LE(LZ_MAGIC));
+    assert(read_32(&ip) == LZ_VERSION);
+    assert(*ip++ == (LZ_IMAGE_TYPE_RGB32 | (1 << LZ_IMAGE_TYPE_LOG)));
+    assert(read_32(&ip) == CHECK_SIZE);
+    assert(read_32(&ip) == CHECK_SIZE);
+    assert(read_32(&ip) == CHECK_SIZE * sizeof(uint32_t));
+    *id = (uint64_t)read_32(&ip) << 32;
+    *id |= read_32(&ip);
+    *win_head_dist = read_32(&ip);
+
+    return ip;
+}
+
+/* What the client does with a GLZ_RGB image: the matches either refer to
+ * the image itself or to an earlier image of the window, which may come
+ * from another display. Returns the id of the image. */
+static uint64_t decode(const Encoded *encoded, uint32_t **decoded, const int *owners,
+                       int n_decoded, int *cross_refs, int *trimmed)
+{
+    const int n_pixels = CHECK_SIZE * CHECK_SIZE;
+    uint32_t *out, *op;
+    uint32_t win_head_dist;
+    uint64_t id;
+    const uint8_t *ip = decode_header(encoded, &id, &win_head_dist);
+
+    assert(id < n_decoded && decoded[id] == NULL);
+    assert(win_head_dist <= id);
+    if (win_head_dist < id) {
+        (*trimmed)++;
+    }
+
+    out = op = g_new(uint32_t, n_pixels);
+    while (op < out + n_pixels) {
+        uint8_t ctrl = *ip++;
+
+        if (ctrl >= MAX_COPY) {
+            uint32_t len = ctrl >> 5;
+            uint32_t pixel_ofs = ctrl & 0x0f;
+            uint32_t image_dist;
+            int long_dist = (ctrl >> 4) & 0x01;
+            int image_bytes, i;
+            const uint32_t *ref;
+            uint8_t code;
+
+            if (len == 7) {
+                do {
+                    code = *ip++;
+                    len += code;
+                } while (code == 255);
+            }
+            pixel_ofs += *ip++ << 4;
+            code = *ip++;
+            image_bytes = code >> 6;
+            if (!long_dist) {
+                image_dist = code & 0x3f;
+                for (i = 0; i < image_bytes; i++) {
+                    image_dist += (uint32_t)*ip++ << (6 + 8 * i);
+                }
+            } else {
+                long_dist = (code >> 5) & 0x01;
+                pixel_ofs += (code & 0x1f) << 12;
+                image_dist = 0;
+                for (i = 0; i < image_bytes; i++) {
+                    image_dist += (uint32_t)*ip++ << (8 * i);
+                }
+                if (long_dist) {
+                    pixel_ofs += (uint32_t)*ip++ << 17;
+                }
+            }
+
+            if (image_dist == 0) {
+                pixel_ofs++;
+                assert(pixel_ofs <= op - out);
+                ref = op - pixel_ofs;
+            } else {
+                /* the image must still be in the window of the client */
+                assert(image_dist <= win_head_dist);
+                assert(decoded[id - image_dist] != NULL);
+                assert(pixel_ofs + len <= n_pixels);
+                ref = decoded[id - image_dist] + pixel_ofs;
+                if (owners[id - image_dist] != encoded->display) {
+                    (*cross_refs)++;
+                }
+            }
+            assert(op + len <= out + n_pixels);
+            while (len--) {
+                *op++ = *ref++;
+            }
+        } else {
+            int n = ctrl + 1;
+
+            assert(op + n <= out + n_pixels);
+            while (n--) {
+                *op++ = ip[0] | (ip[1] << 8) | (ip[2] << 16);
+                ip += 3;
+            }
+        }
+    }
+    assert(ip == encoded->data + encoded->size);
+
+    decoded[id] = out;
+    return id;
+}
+
+static void test_decode(void)
+{
+    const int n_encoded = CHECK_THREADS * CHECK_IMAGES;
+    GlzEncoderUsrContext dict_usr;
+    GlzEncDictContext *dict;
+    Display displays[CHECK_THREADS];
+    Encoded **by_id = g_new0(Encoded *, n_encoded);
+    uint32_t **decoded = g_new0(uint32_t *, n_encoded);
+    int *owners = g_new0(int, n_encoded);
+    int cross_refs = 0, trimmed = 0;
+    int i, j;
+
+    create_tiles(CHECK_SIZE);
+    display_usr_init(&dict_usr);
+    dict = glz_enc_dictionary_create(CHECK_WINDOW, CHECK_THREADS, &dict_usr);
+    pthread_barrier_init(&start_barrier, NULL, CHECK_THREADS);
+
+    for (i = 0; i < CHECK_THREADS; i++) {
+        Display *display = &displays[i];
+
+        memset(display, 0, sizeof(*display));
+        display->id = i;
+        display_usr_init(&display->usr);
+        display->encoder = glz_encoder_create(i, dict, &display->usr);
+        display->out_size = CHECK_SIZE * CHECK_SIZE * sizeof(uint32_t) * 2;
+        display->out = g_malloc(display->out_size);
+        display->encoded = g_new0(Encoded, CHECK_IMAGES);
+        create_display_images(display, CHECK_SIZE, CHECK_TILES);
+    }
+    for (i = 0; i < CHECK_THREADS; i++) {
+        assert(pthread_create(&displays[i].thread, NULL, check_thread, &displays[i]) == 0);
+    }
+    for (i = 0; i < CHECK_THREADS; i++) {
+        pthread_join(displays[i].thread, NULL);
+    }
+
+    /* the ids follow the order the images entered the dictionary, which
+     * is the order the client receives them in */
+    for (i = 0; i < CHECK_THREADS; i++) {
+        for (j = 0; j < CHECK_IMAGES; j++) {
+            uint32_t win_head_dist;
+            uint64_t id;
+
+            decode_header(&displays[i].encoded[j], &id, &win_head_dist);
+            assert(id < n_encoded && by_id[id] == NULL);
+            by_id[id] = &displays[i].encoded[j];
+            owners[id] = i;
+        }
+    }
+    for (i = 0; i < n_encoded; i++) {
+        assert(decode(by_id[i], decoded, owners, n_encoded, &cross_refs, &trimmed) == i);
+        assert(memcmp(decoded[i], by_id[i]->image,
+                      CHECK_SIZE * CHECK_SIZE * sizeof(uint32_t)) == 0);
+    }
+    /* the encoders did share the dictionary, and the window was trimmed */
+    assert(cross_refs > 0);
+    assert(trimmed > 0);
+
+    for (i = 0; i < CHECK_THREADS; i++) {
+        Display *display = &displays[i];
+
+        for (j = 0; j < CHECK_IMAGES; j++) {
+            g_free(display->encoded[j].data);
+        }
+        g_free(display->encoded);
+        glz_encoder_destroy(display->encoder);
+        free_display_images(display);
+        g_free(display->out);
+    }
+    glz_enc_dictionary_destroy(dict, &dict_usr);
+    pthread_barrier_destroy(&start_barrier);
+    for (i = 0; i < n_encoded; i++) {
+        g_free(decoded[i]);
+    }
+    g_free(decoded);
+    g_free(owners);
+    g_free(by_id);
+    free_tiles();
+}
+
+static void *display_thread(void *opaque)
+{
+    Display *display = opaque;
+    GlzEncDictImageContext *dict_image;
+    int i;
+
+    pthread_barrier_wait(&start_barrier);
+    for (i = 0; i < n_images; i++) {
+        display->compressed += glz_encode(display->encoder, LZ_IMAGE_TYPE_RGB32,
+                                          image_size, image_size, TRUE,
+                                          (uint8_t *)display->images[i % N_THREAD_IMAGES],
+                                          image_size, image_size * sizeof(uint32_t),
+                                          display->out, display->out_size,
+                                          NULL, &dict_image);
+    }
+    pthread_barrier_wait(&start_barrier);
+
+    return NULL;
+}
+
+static void run(int n_threads)
+{
+    GlzEncoderUsrContext dict_usr;
+    GlzEncDictContext *dict;
+    Display *displays = g_new0(Display, n_threads);
+    uint64_t start, elapsed, compressed = 0;
+    double images_per_sec;
+    int i;
+
+    display_usr_init(&dict_usr);
+    dict = glz_enc_dictionary_create(window_size, n_threads, &dict_usr);
+    pthread_barrier_init(&start_barrier, NULL, n_threads + 1);
+
+    for (i = 0; i < n_threads; i++) {
+        Display *display = &displays[i];
+
+        display->id = i;
+        display_usr_init(&display->usr);
+        display->encoder = glz_encoder_create(i, dict, &display->usr);
+        display->out_size = image_size * image_size * sizeof(uint32_t) * 2;
+        display->out = g_malloc(display->out_size);
+        create_display_images(display, image_size, N_TILES);
+        pthread_create(&display->thread, NULL, display_thread, display);
+    }
+
+    pthread_barrier_wait(&start_barrier);
+    start = get_time_ns();
+    pthread_barrier_wait(&start_barrier);
+    elapsed = get_time_ns() - start;
+
+    for (i = 0; i < n_threads; i++) {
+        Display *display = &displays[i];
+
+        pthread_join(display->thread, NULL);
+        compressed += display->compressed;
+        glz_encoder_destroy(display->encoder);
+        free_display_images(display);
+        g_free(display->out);
+    }
+    glz_enc_dictionary_destroy(dict, &dict_usr);
+    pthread_barrier_destroy(&start_barrier);
+    g_free(displays);
+
+    images_per_sec = (double)n_threads * n_images / (elapsed / 1e9);
+    printf("%2d displays: %9.1f images/s, %7.1f MiB/s, ratio %5.1f\n",
+           n_threads, images_per_sec,
+           images_per_sec * image_size * image_size * sizeof(uint32_t) / (1024 * 1024),
+           (double)n_threads * n_images * image_size * image_size * sizeof(uint32_t) /
+           compressed);
+}
+
+int main(int argc, char **argv)
+{
+    GOptionContext *context;
+    GError *error = NULL;
+    int i;
+
+    GOptionEntry entries[] = {
+        { "threads", 't', 0, G_OPTION_ARG_INT, &max_threads,
+          "Maximum number of displays (default 4)", "INT" },
+        { "images", 'n', 0, G_OPTION_ARG_INT, &n_images,
+          "Number of images per display (default 200)", "INT" },
+        { "size", 's', 0, G_OPTION_ARG_INT, &image_size,
+          "Width and height of the images (default 256)", "INT" },
+        { "window", 'w', 0, G_OPTION_ARG_INT, &window_size,
+          "Dictionary window in pixels (default 4194304)", "INT" },
+        { NULL }
+    };
+
+    context = g_option_context_new("- shared GLZ dictionary benchmark");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        printf("Option parsing failed: %s\n", error->message);
+        exit(-1);
+    }
+    g_option_context_free(context);
+    if (max_threads <= 0 || max_threads > 256 || n_images <= 0 || image_size < 16 ||
+        window_size <= image_size * image_size || window_size > 1 << 25) {
+        printf("Invalid arguments\n");
+        exit(-1);
+    }
+
+    test_decode();
+
+    create_tiles(image_size);
+    printf("%d images of %dx%d per display, window of %d pixels\n",
+           n_images, image_size, image_size, window_size);
+    for (i = 1; i <= max_threads; i *= 2) {
+        run(i);
+    }
+    if (max_threads & (max_threads - 1)) {
+        run(max_threads);
+    }
+    free_tiles();
+
+    return 0;
+}
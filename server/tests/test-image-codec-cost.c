@@ -0,0 +1,346 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Check the choices of the cost model of SPICE_IMAGE_COST_MODEL: from the
+ * priors, after the samples of a codec, and the codecs measured again now
+ * and then. Then benchmark the time an image takes to reach a client, its
+ * encoding plus its transfer at a given bit rate, when the codec is chosen
+ * by graduality like the auto LZ compression does it, and when it is chosen
+ * by the cost model. The same sequence of images, a mix of text, user
+ * interface and photos, is replayed for each bit rate.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#undef NDEBUG
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <glib.h>
+
+#include "image-encoders.h"
+#include "test-timing.h"
+
+#define MBPS G_GUINT64_CONSTANT(1000000)
+#define TEST_IMAGE_SIZE (1024 * 1024)
+
+static gint n_images = 100;
+static gint width = 640;
+static gint height = 480;
+static gint bit_rate_mbps = 0;
+static gboolean use_jpeg = FALSE;
+
+static const gint default_bit_rates_mbps[] = { 2, 10, 100, 1000 };
+
+static const char *const codec_names[IMAGE_CODEC_COUNT] = {
+    [IMAGE_CODEC_QUIC] = "quic",
+    [IMAGE_CODEC_JPEG] = "jpeg",
+    [IMAGE_CODEC_LZ] = "lz",
+    [IMAGE_CODEC_GLZ] = "glz",
+    [IMAGE_CODEC_LZ4] = "lz4",
+};
+
+typedef struct Result {
+    uint64_t time_ns;
+    uint64_t bytes;
+    int images[IMAGE_CODEC_COUNT];
+} Result;
+
+static ImageCodec choose(ImageEncoderSharedData *shared, uint32_t codecs, uint64_t bit_rate)
+{
+    return image_encoder_shared_choose_codec(shared, BITMAP_GRADUAL_HIGH, codecs,
+                                             TEST_IMAGE_SIZE, bit_rate);
+}
+
+/* before any sample: the lossy codecs on a slow link, the quickest one on a
+ * fast link, and only the codecs offered */
+static void test_priors(void)
+{
+    ImageEncoderSharedData shared;
+    uint32_t codecs = (1 << IMAGE_CODEC_QUIC) | (1 << IMAGE_CODEC_LZ) | (1 << IMAGE_CODEC_LZ4);
+
+    memset(&shared, 0, sizeof(shared));
+    image_encoder_shared_init(&shared);
+
+    assert(choose(&shared, codecs | (1 << IMAGE_CODEC_JPEG), 2 * MBPS) == IMAGE_CODEC_JPEG);
+    assert(choose(&shared, codecs, 2 * MBPS) == IMAGE_CODEC_QUIC);
+    assert(choose(&shared, codecs, 10000 * MBPS) == IMAGE_CODEC_LZ4);
+    assert(choose(&shared, 1 << IMAGE_CODEC_LZ, 10000 * MBPS) == IMAGE_CODEC_LZ);
+}
+
+/* the samples replace the priors, and the codec which was not chosen is
+ * measured again now and then */
+static void test_samples(void)
+{
+    ImageEncoderSharedData shared;
+    uint32_t codecs = (1 << IMAGE_CODEC_QUIC) | (1 << IMAGE_CODEC_LZ);
+    int chosen[IMAGE_CODEC_COUNT] = { 0, };
+    int i;
+
+    memset(&shared, 0, sizeof(shared));
+    image_encoder_shared_init(&shared);
+    assert(choose(&shared, codecs, 2 * MBPS) == IMAGE_CODEC_QUIC);
+
+    /* empty images don't count */
+    image_encoder_shared_add_codec_sample(&shared, IMAGE_CODEC_LZ, BITMAP_GRADUAL_HIGH,
+                                          0, 0, 1000);
+    assert(shared.codec_cost[BITMAP_GRADUAL_HIGH][IMAGE_CODEC_LZ].samples == 0);
+
+    /* these images compress well with LZ, quickly */
+    for (i = 0; i < 8; i++) {
+        image_encoder_shared_add_codec_sample(&shared, IMAGE_CODEC_LZ, BITMAP_GRADUAL_HIGH,
+                                              TEST_IMAGE_SIZE, TEST_IMAGE_SIZE / 100,
+                                              TEST_IMAGE_SIZE);
+    }
+    assert(shared.codec_cost[BITMAP_GRADUAL_HIGH][IMAGE_CODEC_LZ].samples == 8);
+    assert(shared.codec_cost[BITMAP_GRADUAL_HIGH][IMAGE_CODEC_QUIC].samples == 0);
+    /* the other classes of images keep their own estimates */
+    assert(image_encoder_shared_choose_codec(&shared, BITMAP_GRADUAL_MEDIUM, codecs,
+                                             TEST_IMAGE_SIZE, 2 * MBPS) == IMAGE_CODEC_QUIC);
+
+    for (i = 0; i < 64; i++) {
+        ImageCodec codec = choose(&shared, codecs, 2 * MBPS);
+
+        assert(codec == IMAGE_CODEC_QUIC || codec == IMAGE_CODEC_LZ);
+        chosen[codec]++;
+    }
+    assert(chosen[IMAGE_CODEC_LZ] > 56);
+    assert(chosen[IMAGE_CODEC_QUIC] > 0);
+
+    /* nothing else to measure with a single codec */
+    for (i = 0; i < 64; i++) {
+        assert(choose(&shared, 1 << IMAGE_CODEC_LZ, 2 * MBPS) == IMAGE_CODEC_LZ);
+    }
+}
+
+/* the n-th image of the session: mostly text and windows, sometimes a photo */
+static void fill_image(uint32_t *pixels, int n)
+{
+    GRand *rand = g_rand_new_with_seed(n);
+    int kind = n % 7 == 3 ? 2 : n % 3;
+    int x, y;
+
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++) {
+            uint32_t r, g, b;
+
+            switch (kind) {
+            case 0: /* text */
+                r = g = b = 0xf8;
+                if ((y % 18) < 12 && (x % 9) < 7 && g_rand_int_range(rand, 0, 3) == 0) {
+                    r = g = b = 0x10;
+                }
+                break;
+            case 1: /* flat widgets on a gradient */
+                r = x * 255 / width;
+                g = y * 255 / height;
+                b = 0x80;
+                if (((x + n * 16) / 64 + y / 48) % 4 == 0) {
+                    r = g = b = 0xd0;
+                }
+                break;
+            default: /* photo */
+                r = (x * 160 / width + g_rand_int_range(rand, 0, 48)) & 0xff;
+                g = (y * 160 / height + g_rand_int_range(rand, 0, 48)) & 0xff;
+                b = ((x + y) * 96 / (width + height) + g_rand_int_range(rand, 0, 48)) & 0xff;
+                break;
+            }
+            pixels[y * width + x] = (r << 16) | (g << 8) | b;
+        }
+    }
+    g_rand_free(rand);
+}
+
+static void init_bitmap(SpiceBitmap *bitmap, uint32_t *pixels)
+{
+    memset(bitmap, 0, sizeof(*bitmap));
+    bitmap->format = SPICE_BITMAP_FMT_32BIT;
+    bitmap->flags = SPICE_BITMAP_FLAGS_TOP_DOWN;
+    bitmap->x = width;
+    bitmap->y = height;
+    bitmap->stride = width * sizeof(uint32_t);
+    bitmap->data = spice_chunks_new_linear((uint8_t *) pixels, bitmap->stride * height);
+}
+
+static size_t release_compressed(compress_send_data_t *comp_data)
+{
+    RedCompressBuf *buf = comp_data->comp_buf;
+
+    while (buf) {
+        RedCompressBuf *next = buf->send_next;
+        compress_buf_free(buf);
+        buf = next;
+    }
+    return comp_data->comp_buf_size;
+}
+
+/* returns the size of the image as sent, raw when it can't be compressed */
+static size_t compress(ImageEncoders *enc, ImageCodec codec, SpiceBitmap *bitmap)
+{
+    compress_send_data_t comp_data = {0};
+    SpiceImage dest;
+    int success;
+
+    memset(&dest, 0, sizeof(dest));
+    switch (codec) {
+    case IMAGE_CODEC_QUIC:
+        success = image_encoders_compress_quic(enc, &dest, bitmap, &comp_data);
+        break;
+    case IMAGE_CODEC_JPEG:
+        success = image_encoders_compress_jpeg(enc, &dest, bitmap, &comp_data);
+        break;
+#ifdef USE_LZ4
+    case IMAGE_CODEC_LZ4:
+        success = image_encoders_compress_lz4(enc, &dest, bitmap, &comp_data);
+        break;
+#endif
+    default:
+        success = image_encoders_compress_lz(enc, &dest, bitmap, &comp_data);
+        break;
+    }
+
+    return success ? release_compressed(&comp_data) : bitmap->stride * bitmap->y;
+}
+
+static void replay(uint32_t *pixels, uint64_t bit_rate, gboolean cost_model,
+                   Result *result)
+{
+    ImageEncoderSharedData shared;
+    ImageEncoders enc;
+    ImageCodec lossy_codec = use_jpeg ? IMAGE_CODEC_JPEG : IMAGE_CODEC_QUIC;
+    uint32_t codecs = (1 << lossy_codec) | (1 << IMAGE_CODEC_LZ);
+    int i;
+
+#ifdef USE_LZ4
+    codecs |= 1 << IMAGE_CODEC_LZ4;
+#endif
+    memset(&shared, 0, sizeof(shared));
+    image_encoder_shared_init(&shared);
+    image_encoders_init(&enc, &shared);
+    enc.jpeg_quality = 85;
+    memset(result, 0, sizeof(*result));
+
+    for (i = 0; i < n_images; i++) {
+        BitmapGradualType graduality;
+        SpiceBitmap bitmap;
+        ImageCodec codec;
+        uint64_t start;
+        size_t size;
+
+        fill_image(pixels, i);
+        init_bitmap(&bitmap, pixels);
+
+        /* the graduality is known before the encoding in both cases */
+        start = get_time_ns();
+        graduality = bitmap_get_graduality_level(&bitmap);
+        if (cost_model) {
+            codec = image_encoder_shared_choose_codec(&shared, graduality, codecs,
+                                                      bitmap.stride * bitmap.y, bit_rate);
+        } else {
+            codec = graduality == BITMAP_GRADUAL_HIGH ? lossy_codec : IMAGE_CODEC_LZ;
+        }
+        size = compress(&enc, codec, &bitmap);
+        if (cost_model) {
+            image_encoder_shared_add_codec_sample(&shared, codec, graduality,
+                                                  bitmap.stride * bitmap.y, size,
+                                                  get_time_ns() - start);
+        }
+        result->time_ns += get_time_ns() - start + size * 8 * G_GUINT64_CONSTANT(1000000000) / bit_rate;
+        result->bytes += size;
+        result->images[codec]++;
+
+        spice_chunks_destroy(bitmap.data);
+    }
+
+    image_encoders_free(&enc);
+}
+
+static void print_result(const char *name, const Result *result)
+{
+    int codec;
+
+    printf("  %-11s %8.2f ms/image %10.1f KiB/image ", name,
+           result->time_ns / 1e6 / n_images, result->bytes / 1024.0 / n_images);
+    for (codec = 0; codec < IMAGE_CODEC_COUNT; codec++) {
+        if (result->images[codec]) {
+            printf(" %s %d", codec_names[codec], result->images[codec]);
+        }
+    }
+    printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+    GOptionContext *context;
+    GError *error = NULL;
+    const gint *bit_rates = default_bit_rates_mbps;
+    int n_bit_rates = G_N_ELEMENTS(default_bit_rates_mbps);
+    uint32_t *pixels;
+    int i;
+
+    GOptionEntry entries[] = {
+        { "images", 'n', 0, G_OPTION_ARG_INT, &n_images,
+          "Number of images of the session (default 100)", "INT" },
+        { "width", 'W', 0, G_OPTION_ARG_INT, &width,
+          "Width of the images (default 640)", "INT" },
+        { "height", 'H', 0, G_OPTION_ARG_INT, &height,
+          "Height of the images (default 480)", "INT" },
+        { "bit-rate", 'b', 0, G_OPTION_ARG_INT, &bit_rate_mbps,
+          "Bit rate of the client in Mbps (default 2, 10, 100 and 1000)", "INT" },
+        { "jpeg", 'j', 0, G_OPTION_ARG_NONE, &use_jpeg,
+          "Use JPEG rather than QUIC, as when the client is on a WAN", NULL },
+        { NULL }
+    };
+
+    context = g_option_context_new("- image codec choice benchmark");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        printf("Option parsing failed: %s\n", error->message);
+        exit(-1);
+    }
+    g_option_context_free(context);
+    if (n_images <= 0 || width <= 0 || width > 8192 || height <= 0 || height > 8192 ||
+        bit_rate_mbps < 0) {
+        printf("Invalid arguments\n");
+        exit(-1);
+    }
+    if (bit_rate_mbps > 0) {
+        bit_rates = &bit_rate_mbps;
+        n_bit_rates = 1;
+    }
+
+    test_priors();
+    test_samples();
+
+    pixels = g_new(uint32_t, width * height);
+    printf("%d images of %dx%d\n", n_images, width, height);
+    for (i = 0; i < n_bit_rates; i++) {
+        uint64_t bit_rate = bit_rates[i] * G_GUINT64_CONSTANT(1000000);
+        Result graduality, cost_model;
+
+        replay(pixels, bit_rate, FALSE, &graduality);
+        replay(pixels, bit_rate, TRUE, &cost_model);
+
+        printf("%d Mbps\n", bit_rates[i]);
+        print_result("graduality", &graduality);
+        print_result("cost model", &cost_model);
+    }
+    g_free(pixels);
+
+    return 0;
+}
@@ -0,0 +1,386 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Check that the tiles compressed by a CompressPool are the ones the
+ * calling thread would produce, whether the job ran or was skipped.
+ *
+ * With --benchmark, also time the latency of a full surface push: the surface is compressed
+ * either as a single image in the calling thread or split in tiles which
+ * are compressed by the pool, the way dcc_push_surface_image() does it when
+ * SPICE_COMPRESS_THREADS is set.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#undef NDEBUG
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <glib.h>
+
+#include "compress-pool.h"
+#include "test-timing.h"
+
+#define CHECK_WIDTH 1024
+#define CHECK_HEIGHT 600
+#define CHECK_THREADS 4
+/* COMPRESS_POOL_TILE_PIXELS */
+#define TILE_PIXELS (512 * 512)
+
+static gint width = 3840;
+static gint height = 2160;
+static gint n_threads = 4;
+static gint iterations = 10;
+static gboolean use_lz = FALSE;
+static gboolean benchmark = FALSE;
+
+/* something looking like a desktop: a gradient background, some flat
+ * windows and noisy areas standing for text and pictures */
+static uint32_t *create_surface(int surface_width, int surface_height)
+{
+    uint32_t *pixels = g_new(uint32_t, surface_width * surface_height);
+    GRand *rand = g_rand_new_with_seed(42);
+    int x, y;
+
+    for (y = 0; y < surface_height; y++) {
+        for (x = 0; x < surface_width; x++) {
+            uint32_t pixel = ((x * 255 / surface_width) << 16) |
+                             ((y * 255 / surface_height) << 8) | 0x80;
+
+            if ((x / 400 + y / 300) % 3 == 0) {
+                pixel = 0xf0f0f0;
+                if ((y % 16) < 10 && (x % 8) < 6 && g_rand_int_range(rand, 0, 4) == 0) {
+                    pixel = 0x202020;
+                }
+            } else if ((x / 400 + y / 300) % 5 == 1) {
+                pixel = g_rand_int(rand) & 0xffffff;
+            }
+            pixels[y * surface_width + x] = pixel;
+        }
+    }
+    g_rand_free(rand);
+
+    return pixels;
+}
+
+static void init_bitmap(SpiceBitmap *bitmap, uint32_t *pixels, int surface_width, int rows)
+{
+    memset(bitmap, 0, sizeof(*bitmap));
+    bitmap->format = SPICE_BITMAP_FMT_32BIT;
+    bitmap->flags = SPICE_BITMAP_FLAGS_TOP_DOWN;
+    bitmap->x = surface_width;
+    bitmap->y = rows;
+    bitmap->stride = surface_width * sizeof(uint32_t);
+    bitmap->data = spice_chunks_new_linear((uint8_t *) pixels, bitmap->stride * rows);
+}
+
+static size_t release_compressed(compress_send_data_t *comp_data)
+{
+    RedCompressBuf *buf = comp_data->comp_buf;
+
+    while (buf) {
+        RedCompressBuf *next = buf->send_next;
+        compress_buf_free(buf);
+        buf = next;
+    }
+    return comp_data->comp_buf_size;
+}
+
+static int compress_with(ImageEncoders *enc, SpiceImageCompression compression,
+                         SpiceImage *dest, SpiceBitmap *bitmap, compress_send_data_t *comp_data)
+{
+    memset(dest, 0, sizeof(*dest));
+    if (compression == SPICE_IMAGE_COMPRESSION_LZ) {
+        return image_encoders_compress_lz(enc, dest, bitmap, comp_data);
+    }
+    return image_encoders_compress_quic(enc, dest, bitmap, comp_data);
+}
+
+static int compress(ImageEncoders *enc, SpiceBitmap *bitmap, compress_send_data_t *comp_data)
+{
+    SpiceImage dest;
+
+    return compress_with(enc, use_lz ? SPICE_IMAGE_COMPRESSION_LZ : SPICE_IMAGE_COMPRESSION_QUIC,
+                         &dest, bitmap, comp_data);
+}
+
+/* the compressed data, the buffers are released */
+static GByteArray *take_compressed(compress_send_data_t *comp_data)
+{
+    GByteArray *bytes = g_byte_array_new();
+    RedCompressBuf *buf = comp_data->comp_buf;
+    uint32_t left = comp_data->comp_buf_size;
+
+    while (buf) {
+        RedCompressBuf *next = buf->send_next;
+        uint32_t n = MIN(left, sizeof(buf->buf.bytes));
+
+        g_byte_array_append(bytes, buf->buf.bytes, n);
+        left -= n;
+        compress_buf_free(buf);
+        buf = next;
+    }
+    assert(left == 0);
+    return bytes;
+}
+
+static void test_tile_rows(void)
+{
+    CompressPool *pool = compress_pool_new(CHECK_THREADS);
+    CompressPool *single = compress_pool_new(1);
+    int rows;
+
+    assert(pool != NULL && single != NULL);
+    assert(compress_pool_get_n_threads(pool) > 1);
+
+    /* one thread or a small image: no tiles */
+    assert(compress_pool_get_tile_rows(single, 3840, 2160) == 2160);
+    assert(compress_pool_get_tile_rows(pool, 1024, 511) == 511);
+
+    /* bands of full rows, each about the same number of pixels */
+    rows = compress_pool_get_tile_rows(pool, CHECK_WIDTH, CHECK_HEIGHT);
+    assert(rows > 0 && rows < CHECK_HEIGHT);
+    assert(rows * CHECK_WIDTH <= TILE_PIXELS && (rows + 1) * CHECK_WIDTH > TILE_PIXELS);
+    rows = compress_pool_get_tile_rows(pool, 3840, 2160);
+    assert(rows * 3840 <= TILE_PIXELS && (rows + 1) * 3840 > TILE_PIXELS);
+
+    /* rows wider than a tile are one row each */
+    assert(compress_pool_get_tile_rows(pool, TILE_PIXELS + 1, 2) == 1);
+
+    compress_pool_free(single);
+    compress_pool_free(pool);
+}
+
+static void submit_tiles(CompressPool *pool, SpiceImageCompression compression,
+                         uint32_t *pixels, int tile_rows, CompressJob **jobs, int n_tiles)
+{
+    int i;
+
+    for (i = 0; i < n_tiles; i++) {
+        SpiceBitmap bitmap;
+
+        init_bitmap(&bitmap, pixels + i * tile_rows * CHECK_WIDTH, CHECK_WIDTH,
+                    MIN(tile_rows, CHECK_HEIGHT - i * tile_rows));
+        jobs[i] = compress_pool_submit(pool, &bitmap, compression, FALSE);
+        assert(jobs[i] != NULL);
+    }
+}
+
+/* Finishes the job of a tile and checks that its data is the one the calling
+ * thread produces, the caller compresses the tile if the job was skipped */
+static CompressJobResult finish_tile(ImageEncoders *enc, SpiceImageCompression compression,
+                                     uint32_t *pixels, int tile_rows, int i, CompressJob *job)
+{
+    compress_send_data_t comp_data = {0};
+    compress_send_data_t ref_data = {0};
+    SpiceImage dest, ref_dest;
+    SpiceBitmap bitmap;
+    GByteArray *bytes, *ref_bytes;
+    CompressJobResult result;
+
+    init_bitmap(&bitmap, pixels + i * tile_rows * CHECK_WIDTH, CHECK_WIDTH,
+                MIN(tile_rows, CHECK_HEIGHT - i * tile_rows));
+    assert(compress_with(enc, compression, &ref_dest, &bitmap, &ref_data));
+
+    memset(&dest, 0, sizeof(dest));
+    result = compress_job_finish(job, &dest, &comp_data, NULL);
+    if (result == COMPRESS_JOB_SKIPPED) {
+        assert(compress_with(enc, compression, &dest, &bitmap, &comp_data));
+    } else {
+        assert(result == COMPRESS_JOB_SUCCEEDED);
+    }
+
+    bytes = take_compressed(&comp_data);
+    ref_bytes = take_compressed(&ref_data);
+    assert(dest.descriptor.type == ref_dest.descriptor.type);
+    assert(bytes->len > 0 && bytes->len == ref_bytes->len);
+    assert(memcmp(bytes->data, ref_bytes->data, bytes->len) == 0);
+    g_byte_array_free(bytes, TRUE);
+    g_byte_array_free(ref_bytes, TRUE);
+    spice_chunks_destroy(bitmap.data);
+
+    return result;
+}
+
+/* the tiles the pool compresses are identical to the ones compressed by the
+ * calling thread, and so are the ones of the skipped jobs */
+static void test_tiles(ImageEncoders *enc, SpiceImageCompression compression)
+{
+    CompressPool *pool = compress_pool_new(CHECK_THREADS);
+    uint32_t *pixels = create_surface(CHECK_WIDTH, CHECK_HEIGHT);
+    int tile_rows = compress_pool_get_tile_rows(pool, CHECK_WIDTH, CHECK_HEIGHT);
+    int n_tiles = (CHECK_HEIGHT + tile_rows - 1) / tile_rows;
+    CompressJob **jobs = g_new(CompressJob *, n_tiles);
+    int i;
+
+    assert(n_tiles > 1);
+
+    /* freeing the pool runs the queued jobs, which can be finished afterwards */
+    submit_tiles(pool, compression, pixels, tile_rows, jobs, n_tiles);
+    compress_pool_free(pool);
+    for (i = 0; i < n_tiles; i++) {
+        assert(finish_tile(enc, compression, pixels, tile_rows, i, jobs[i]) ==
+               COMPRESS_JOB_SUCCEEDED);
+    }
+
+    /* finished at once, the jobs which did not start yet are skipped */
+    pool = compress_pool_new(CHECK_THREADS);
+    submit_tiles(pool, compression, pixels, tile_rows, jobs, n_tiles);
+    for (i = 0; i < n_tiles; i++) {
+        finish_tile(enc, compression, pixels, tile_rows, i, jobs[i]);
+    }
+    compress_pool_free(pool);
+
+    g_free(jobs);
+    g_free(pixels);
+}
+
+static size_t push_single(ImageEncoders *enc, uint32_t *pixels)
+{
+    compress_send_data_t comp_data = {0};
+    SpiceBitmap bitmap;
+    size_t size;
+
+    init_bitmap(&bitmap, pixels, width, height);
+    size = compress(enc, &bitmap, &comp_data) ? release_compressed(&comp_data) :
+                                                bitmap.stride * bitmap.y;
+    spice_chunks_destroy(bitmap.data);
+
+    return size;
+}
+
+/* same pattern as dcc_push_surface_image() followed by red_marshall_image()
+ * for each tile */
+static size_t push_tiles(ImageEncoders *enc, CompressPool *pool, uint32_t *pixels)
+{
+    int tile_rows = compress_pool_get_tile_rows(pool, width, height);
+    int n_tiles = (height + tile_rows - 1) / tile_rows;
+    CompressJob **jobs = g_new(CompressJob *, n_tiles);
+    size_t size = 0;
+    int i;
+
+    for (i = 0; i < n_tiles; i++) {
+        SpiceBitmap bitmap;
+
+        init_bitmap(&bitmap, pixels + i * tile_rows * width, width,
+                    MIN(tile_rows, height - i * tile_rows));
+        jobs[i] = compress_pool_submit(pool, &bitmap,
+                                       use_lz ? SPICE_IMAGE_COMPRESSION_LZ :
+                                                SPICE_IMAGE_COMPRESSION_QUIC,
+                                       FALSE);
+    }
+    for (i = 0; i < n_tiles; i++) {
+        compress_send_data_t comp_data = {0};
+        SpiceImage dest;
+        SpiceBitmap bitmap;
+        int rows = MIN(tile_rows, height - i * tile_rows);
+
+        switch (compress_job_finish(jobs[i], &dest, &comp_data, NULL)) {
+        case COMPRESS_JOB_SUCCEEDED:
+            size += release_compressed(&comp_data);
+            break;
+        case COMPRESS_JOB_FAILED:
+            size += rows * width * sizeof(uint32_t);
+            break;
+        case COMPRESS_JOB_SKIPPED:
+            init_bitmap(&bitmap, pixels + i * tile_rows * width, width, rows);
+            size += compress(enc, &bitmap, &comp_data) ? release_compressed(&comp_data) :
+                                                         bitmap.stride * bitmap.y;
+            spice_chunks_destroy(bitmap.data);
+            break;
+        }
+    }
+    g_free(jobs);
+
+    return size;
+}
+
+int main(int argc, char **argv)
+{
+    GOptionContext *context;
+    GError *error = NULL;
+    ImageEncoderSharedData shared_data;
+    ImageEncoders encoders;
+    CompressPool *pool;
+    uint32_t *pixels;
+    uint64_t start, single_ns = 0, tiles_ns = 0;
+    size_t single_size = 0, tiles_size = 0;
+    int i;
+
+    GOptionEntry entries[] = {
+        { "width", 'W', 0, G_OPTION_ARG_INT, &width, "Surface width (default 3840)", "INT" },
+        { "height", 'H', 0, G_OPTION_ARG_INT, &height, "Surface height (default 2160)", "INT" },
+        { "threads", 't', 0, G_OPTION_ARG_INT, &n_threads, "Compression threads (default 4)", "INT" },
+        { "iterations", 'n', 0, G_OPTION_ARG_INT, &iterations, "Iterations (default 10)", "INT" },
+        { "lz", 'l', 0, G_OPTION_ARG_NONE, &use_lz, "Use LZ instead of QUIC", NULL },
+        { "benchmark", 'b', 0, G_OPTION_ARG_NONE, &benchmark,
+          "Time the push of a surface after the checks", NULL },
+        { NULL }
+    };
+
+    context = g_option_context_new("- full surface push benchmark");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        printf("Option parsing failed: %s\n", error->message);
+        exit(-1);
+    }
+    g_option_context_free(context);
+    if (width <= 0 || height <= 0 || n_threads <= 0 || iterations <= 0) {
+        printf("Invalid arguments\n");
+        exit(-1);
+    }
+
+    image_encoder_shared_init(&shared_data);
+    image_encoders_init(&encoders, &shared_data);
+
+    test_tile_rows();
+    test_tiles(&encoders, SPICE_IMAGE_COMPRESSION_QUIC);
+    test_tiles(&encoders, SPICE_IMAGE_COMPRESSION_LZ);
+    if (!benchmark) {
+        image_encoders_free(&encoders);
+        return 0;
+    }
+
+    pool = compress_pool_new(n_threads);
+    assert(pool != NULL);
+    pixels = create_surface(width, height);
+
+    for (i = 0; i < iterations; i++) {
+        start = get_time_ns();
+        single_size = push_single(&encoders, pixels);
+        single_ns += get_time_ns() - start;
+
+        start = get_time_ns();
+        tiles_size = push_tiles(&encoders, pool, pixels);
+        tiles_ns += get_time_ns() - start;
+    }
+
+    printf("%dx%d %s, %d iterations\n", width, height, use_lz ? "LZ" : "QUIC", iterations);
+    printf("single image: %8.2f ms %10zu bytes\n",
+           single_ns / 1e6 / iterations, single_size);
+    printf("%2d tiles/%2d threads: %8.2f ms %10zu bytes\n",
+           (height + compress_pool_get_tile_rows(pool, width, height) - 1) /
+           compress_pool_get_tile_rows(pool, width, height),
+           compress_pool_get_n_threads(pool), tiles_ns / 1e6 / iterations, tiles_size);
+
+    g_free(pixels);
+    compress_pool_free(pool);
+    image_encoders_free(&encoders);
+
+    return 0;
+}
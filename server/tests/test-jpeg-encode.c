@@ -0,0 +1,298 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Check that the 32 bits and BGR 24 bits images given to the encoder as
+ * they are produce the same JPEG data as the same images converted to 24
+ * bits RGB lines first, which is what the encoder does when libjpeg doesn't
+ * read them itself, with padded strides and lines given in chunks. Then
+ * benchmark both on a full frame.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#undef NDEBUG
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <glib.h>
+
+#include "jpeg-encoder.h"
+#include "test-timing.h"
+
+static gint iterations = 5;
+static gint quality = 85;
+static gint width = 1920;
+static gint height = 1080;
+
+typedef struct EncoderUsr {
+    JpegEncoderUsrContext base;
+    uint8_t **chunks;
+    int next_chunk;
+    int n_chunks;
+    int chunk;
+    int height;
+} EncoderUsr;
+
+static EncoderUsr usr;
+
+/* the output buffer is big enough */
+static int usr_more_space(JpegEncoderUsrContext *usr, uint8_t **io_ptr)
+{
+    return 0;
+}
+
+static int chunk_lines(EncoderUsr *usr, int i)
+{
+    return MIN(usr->chunk, usr->height - i * usr->chunk);
+}
+
+/* the next chunk of lines, like the chunks of a bitmap from the guest */
+static int usr_more_lines(JpegEncoderUsrContext *jpeg_usr, uint8_t **lines)
+{
+    EncoderUsr *usr = (EncoderUsr *)jpeg_usr;
+
+    if (usr->next_chunk == usr->n_chunks) {
+        return 0;
+    }
+    *lines = usr->chunks[usr->next_chunk];
+    return chunk_lines(usr, usr->next_chunk++);
+}
+
+/* each chunk is in a buffer of its own, the encoder must not read past it */
+static int encode(JpegEncoderContext *encoder, JpegEncoderImageType type, int width,
+                  int height, uint8_t *lines, int stride, int chunk,
+                  uint8_t *out, unsigned int out_size)
+{
+    int size, i;
+
+    if (chunk >= height) {
+        usr.n_chunks = usr.next_chunk = 0;
+        return jpeg_encode(encoder, quality, type, width, height, lines, height, stride,
+                           out, out_size);
+    }
+
+    usr.chunk = chunk;
+    usr.height = height;
+    usr.n_chunks = (height + chunk - 1) / chunk;
+    usr.chunks = g_new(uint8_t *, usr.n_chunks);
+    for (i = 0; i < usr.n_chunks; i++) {
+        usr.chunks[i] = g_malloc(chunk_lines(&usr, i) * stride);
+        memcpy(usr.chunks[i], lines + i * chunk * stride, chunk_lines(&usr, i) * stride);
+    }
+    usr.next_chunk = 1;
+
+    size = jpeg_encode(encoder, quality, type, width, height,
+                       usr.chunks[0], chunk_lines(&usr, 0), stride, out, out_size);
+
+    for (i = 0; i < usr.n_chunks; i++) {
+        g_free(usr.chunks[i]);
+    }
+    g_free(usr.chunks);
+    return size;
+}
+
+/* a gradient background, a window with text, and a video-like area of noise */
+static uint32_t *create_frame(void)
+{
+    GRand *rand = g_rand_new_with_seed(42);
+    uint32_t *frame = g_new(uint32_t, width * height);
+    int x, y;
+
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++) {
+            uint32_t r = x * 255 / width, g = y * 255 / height, b = 0x80;
+
+            if (x >= width / 10 && x < width / 2 && y >= height / 10 && y < height * 2 / 3) {
+                r = g = b = 0xf0;
+                if ((y % 16) < 10 && (x % 8) < 6 && (x * 7 + y * 13) % 5 == 0) {
+                    r = g = b = 0x20;
+                }
+            } else if (x >= width * 5 / 8 && y >= height / 2) {
+                r = (r + g_rand_int_range(rand, 0, 32)) & 0xff;
+                g = (g + g_rand_int_range(rand, 0, 32)) & 0xff;
+                b = (b + g_rand_int_range(rand, 0, 32)) & 0xff;
+            }
+            frame[y * width + x] = (r << 16) | (g << 8) | b;
+        }
+    }
+    g_rand_free(rand);
+
+    return frame;
+}
+
+static void convert_BGRX32_to_RGB24(const uint32_t *line, uint8_t *out, int n_pixels)
+{
+    int i;
+
+    for (i = 0; i < n_pixels; i++) {
+        uint32_t pixel = line[i];
+
+        *out++ = (pixel >> 16) & 0xff;
+        *out++ = (pixel >> 8) & 0xff;
+        *out++ = pixel & 0xff;
+    }
+}
+
+static void test_direct(JpegEncoderContext *encoder)
+{
+    static const struct {
+        int width, height, pad, chunk;
+    } cases[] = {
+        { 1, 1, 0, 1 },
+        { 17, 9, 0, 9 },
+        { 33, 40, 3, 40 },
+        { 64, 50, 0, 7 },
+        { 64, 50, 1, 1 },
+        { 130, 35, 2, 16 },
+    };
+    GRand *rand = g_rand_new_with_seed(3);
+    int i;
+
+    for (i = 0; i < (int)G_N_ELEMENTS(cases); i++) {
+        const int w = cases[i].width, h = cases[i].height, chunk = cases[i].chunk;
+        const int stride32 = (w + cases[i].pad) * 4, stride24 = w * 3 + cases[i].pad;
+        uint32_t *bgrx = g_malloc0(stride32 * h);
+        uint8_t *bgr = g_malloc0(stride24 * h);
+        uint8_t *rgb = g_malloc(w * 3 * h);
+        unsigned int out_size = w * h * 4 + 4096;
+        uint8_t *converted_out = g_malloc(out_size);
+        uint8_t *direct_out = g_malloc(out_size);
+        int converted_size, direct_size;
+        int x, y;
+
+        /* the pad byte is not part of the pixels */
+        for (y = 0; y < h; y++) {
+            uint32_t *line = bgrx + y * stride32 / 4;
+            uint8_t *line24 = bgr + y * stride24;
+
+            for (x = 0; x < w; x++) {
+                line[x] = g_rand_int(rand) | 0x00404040;
+                line24[x * 3] = line[x] & 0xff;
+                line24[x * 3 + 1] = (line[x] >> 8) & 0xff;
+                line24[x * 3 + 2] = (line[x] >> 16) & 0xff;
+            }
+            convert_BGRX32_to_RGB24(line, rgb + y * w * 3, w);
+        }
+
+        converted_size = encode(encoder, JPEG_IMAGE_TYPE_RGB24, w, h, rgb, w * 3, h,
+                                converted_out, out_size);
+        direct_size = encode(encoder, JPEG_IMAGE_TYPE_BGRX32, w, h, (uint8_t *)bgrx,
+                             stride32, chunk, direct_out, out_size);
+        assert(converted_size > 0 && direct_size == converted_size);
+        assert(memcmp(converted_out, direct_out, direct_size) == 0);
+
+        direct_size = encode(encoder, JPEG_IMAGE_TYPE_BGR24, w, h, bgr, stride24, chunk,
+                             direct_out, out_size);
+        assert(direct_size == converted_size);
+        assert(memcmp(converted_out, direct_out, direct_size) == 0);
+
+        g_free(direct_out);
+        g_free(converted_out);
+        g_free(rgb);
+        g_free(bgr);
+        g_free(bgrx);
+    }
+    g_rand_free(rand);
+}
+
+static uint64_t run(JpegEncoderContext *encoder, const uint32_t *frame, int direct,
+                    uint8_t *out, unsigned int out_size, int *size)
+{
+    uint8_t *rgb24 = direct ? NULL : g_malloc(width * height * 3);
+    uint64_t start = get_time_ns();
+    int i;
+
+    for (i = 0; i < iterations; i++) {
+        if (direct) {
+            *size = encode(encoder, JPEG_IMAGE_TYPE_BGRX32, width, height,
+                           (uint8_t *)frame, width * 4, height, out, out_size);
+        } else {
+            convert_BGRX32_to_RGB24(frame, rgb24, width * height);
+            *size = encode(encoder, JPEG_IMAGE_TYPE_RGB24, width, height,
+                           rgb24, width * 3, height, out, out_size);
+        }
+    }
+
+    g_free(rgb24);
+    return get_time_ns() - start;
+}
+
+int main(int argc, char **argv)
+{
+    GOptionContext *context;
+    GError *error = NULL;
+    JpegEncoderContext *encoder;
+    uint32_t *frame;
+    uint8_t *converted_out, *direct_out;
+    unsigned int out_size;
+    int converted_size, direct_size;
+    uint64_t converted_ns, direct_ns;
+
+    GOptionEntry entries[] = {
+        { "iterations", 'n', 0, G_OPTION_ARG_INT, &iterations,
+          "Number of times the frame is compressed (default 5)", "INT" },
+        { "quality", 'q', 0, G_OPTION_ARG_INT, &quality,
+          "JPEG quality (default 85)", "INT" },
+        { "width", 'W', 0, G_OPTION_ARG_INT, &width,
+          "Width of the frame (default 1920)", "INT" },
+        { "height", 'H', 0, G_OPTION_ARG_INT, &height,
+          "Height of the frame (default 1080)", "INT" },
+        { NULL }
+    };
+
+    context = g_option_context_new("- JPEG compression benchmark");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        printf("Option parsing failed: %s\n", error->message);
+        exit(-1);
+    }
+    g_option_context_free(context);
+    if (iterations <= 0 || quality <= 0 || quality > 100 ||
+        width <= 0 || width > 8192 || height <= 0 || height > 8192) {
+        printf("Invalid arguments\n");
+        exit(-1);
+    }
+
+    usr.base.more_space = usr_more_space;
+    usr.base.more_lines = usr_more_lines;
+    encoder = jpeg_encoder_create(&usr.base);
+    test_direct(encoder);
+
+    frame = create_frame();
+    out_size = width * height * 4 + 4096;
+    converted_out = g_malloc(out_size);
+    direct_out = g_malloc(out_size);
+
+    converted_ns = run(encoder, frame, FALSE, converted_out, out_size, &converted_size);
+    direct_ns = run(encoder, frame, TRUE, direct_out, out_size, &direct_size);
+
+    printf("%dx%d frame, quality %d, %d iterations\n", width, height, quality, iterations);
+    printf("converted %7.2f ms/frame, %d bytes\n",
+           converted_ns / 1e6 / iterations, converted_size);
+    printf("direct    %7.2f ms/frame, %d bytes, %5.2fx\n",
+           direct_ns / 1e6 / iterations, direct_size, (double)converted_ns / direct_ns);
+    assert(direct_size == converted_size);
+    assert(memcmp(converted_out, direct_out, direct_size) == 0);
+
+    g_free(direct_out);
+    g_free(converted_out);
+    g_free(frame);
+    jpeg_encoder_destroy(encoder);
+
+    return 0;
+}
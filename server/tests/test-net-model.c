@@ -0,0 +1,157 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Feed synthetic samples to a NetModel and check its estimates: the moving
+ * average of the bit rate, the app-limited samples which can only raise it
+ * and the minimal roundtrip of the recent samples.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#undef NDEBUG
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <glib.h>
+
+#include "net-model.h"
+
+#define MBIT 1000000
+
+/* a rate sample of bit_rate bits/s lasting 100ms */
+static void add_rate(NetModel *model, uint64_t bit_rate, int app_limited)
+{
+    net_model_add_rate_sample(model, bit_rate / 8 / 10, 100000, app_limited);
+}
+
+static void test_empty(void)
+{
+    NetModel *model = net_model_new();
+
+    assert(net_model_get_bit_rate(model) == 0);
+    assert(net_model_get_roundtrip_us(model) == 0);
+
+    /* the invalid samples are ignored */
+    net_model_add_rate_sample(model, 1000, 0, FALSE);
+    net_model_add_roundtrip_sample_at(model, 0, 0);
+    assert(net_model_get_bit_rate(model) == 0);
+    assert(net_model_get_roundtrip_us(model) == 0);
+
+    /* as is a missing model */
+    add_rate(NULL, 10 * MBIT, FALSE);
+    net_model_add_roundtrip_sample(NULL, 1000);
+    assert(net_model_get_bit_rate(NULL) == 0);
+    assert(net_model_get_roundtrip_us(NULL) == 0);
+
+    net_model_free(model);
+    net_model_free(NULL);
+}
+
+static void test_average(void)
+{
+    NetModel *model = net_model_new();
+    int i;
+
+    /* the first sample is taken as is */
+    add_rate(model, 16 * MBIT, FALSE);
+    assert(net_model_get_bit_rate(model) == 16 * MBIT);
+
+    /* each new sample weighs a quarter */
+    add_rate(model, 32 * MBIT, FALSE);
+    assert(net_model_get_bit_rate(model) == 20 * MBIT);
+    add_rate(model, 8 * MBIT, FALSE);
+    assert(net_model_get_bit_rate(model) == 17 * MBIT);
+
+    /* and the estimate follows a new steady rate */
+    for (i = 0; i < 100; i++) {
+        add_rate(model, 2 * MBIT, FALSE);
+    }
+    assert(net_model_get_bit_rate(model) >= 2 * MBIT);
+    assert(net_model_get_bit_rate(model) < 2 * MBIT + 4);
+
+    net_model_free(model);
+}
+
+static void test_app_limited(void)
+{
+    NetModel *model = net_model_new();
+
+    /* an app-limited sample tells nothing before the first estimate */
+    add_rate(model, 8 * MBIT, TRUE);
+    assert(net_model_get_bit_rate(model) == 0);
+
+    add_rate(model, 8 * MBIT, FALSE);
+    assert(net_model_get_bit_rate(model) == 8 * MBIT);
+
+    /* a slower app-limited sample doesn't lower the estimate */
+    add_rate(model, 1 * MBIT, TRUE);
+    assert(net_model_get_bit_rate(model) == 8 * MBIT);
+
+    /* a faster one raises it to the sample, not to an average */
+    add_rate(model, 40 * MBIT, TRUE);
+    assert(net_model_get_bit_rate(model) == 40 * MBIT);
+
+    /* while a network-limited sample still lowers it */
+    add_rate(model, 8 * MBIT, FALSE);
+    assert(net_model_get_bit_rate(model) == 32 * MBIT);
+
+    net_model_free(model);
+}
+
+static void test_roundtrip(void)
+{
+    NetModel *model = net_model_new();
+    uint64_t now = NSEC_PER_SEC;
+
+    net_model_add_roundtrip_sample_at(model, 5000, now);
+    assert(net_model_get_roundtrip_us(model) == 5000);
+
+    /* the slower samples of a loaded link are left out */
+    now += NSEC_PER_SEC;
+    net_model_add_roundtrip_sample_at(model, 9000, now);
+    assert(net_model_get_roundtrip_us(model) == 5000);
+
+    /* a faster one is taken at once and restarts the window */
+    now += NSEC_PER_SEC;
+    net_model_add_roundtrip_sample_at(model, 4000, now);
+    assert(net_model_get_roundtrip_us(model) == 4000);
+
+    now += NET_MODEL_ROUNDTRIP_WINDOW_NS;
+    net_model_add_roundtrip_sample_at(model, 9000, now);
+    assert(net_model_get_roundtrip_us(model) == 4000);
+
+    /* once the minimum is older than the window, a slower path replaces it */
+    now += 1;
+    net_model_add_roundtrip_sample_at(model, 9000, now);
+    assert(net_model_get_roundtrip_us(model) == 9000);
+
+    now += NSEC_PER_SEC;
+    net_model_add_roundtrip_sample_at(model, 12000, now);
+    assert(net_model_get_roundtrip_us(model) == 9000);
+
+    net_model_free(model);
+}
+
+int main(void)
+{
+    test_empty();
+    test_average();
+    test_app_limited();
+    test_roundtrip();
+
+    return 0;
+}
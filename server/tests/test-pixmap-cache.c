@@ -0,0 +1,382 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Check that the PixmapCache finds its items after removals, which move
+ * back the following entries of the table, and after the table grows, and
+ * that it evicts the items in the CLOCK order. Then time it on a stream of
+ * ids the way fill_bits() and dcc_pixmap_cache_unlocked_add() use it,
+ * against the previous implementation based on a chained hash table and a
+ * Ring LRU.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#undef NDEBUG
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <glib.h>
+
+#include "pixmap-cache.h"
+#include "test-timing.h"
+
+#define BENCHMARK_CAPACITY 20000
+#define BENCHMARK_IDS 40000
+#define BENCHMARK_OPS 200000
+
+typedef struct Released {
+    uint64_t ids[16];
+    int n;
+} Released;
+
+static void release_item(NewCacheItem *item, void *opaque)
+{
+    Released *released = opaque;
+
+    if (released) {
+        assert(released->n < (int)G_N_ELEMENTS(released->ids));
+        released->ids[released->n++] = item->id;
+    }
+}
+
+/* the previous implementation */
+typedef struct LegacyItem LegacyItem;
+
+struct LegacyItem {
+    RingItem lru_link;
+    LegacyItem *next;
+    uint64_t id;
+    uint64_t sync[MAX_CACHE_CLIENTS];
+    size_t size;
+    int lossy;
+};
+
+typedef struct LegacyCache {
+    LegacyItem *hash_table[BITS_CACHE_HASH_SIZE];
+    Ring lru;
+    int64_t available;
+} LegacyCache;
+
+static LegacyItem *legacy_hit(LegacyCache *cache, uint64_t id, uint64_t serial)
+{
+    LegacyItem *item = cache->hash_table[BITS_CACHE_HASH_KEY(id)];
+
+    while (item) {
+        if (item->id == id) {
+            ring_remove(&item->lru_link);
+            ring_add(&cache->lru, &item->lru_link);
+            item->sync[0] = serial;
+            break;
+        }
+        item = item->next;
+    }
+    return item;
+}
+
+static int legacy_add(LegacyCache *cache, uint64_t id, uint32_t size, uint64_t serial)
+{
+    LegacyItem *item = spice_new(LegacyItem, 1);
+    int key;
+
+    cache->available -= size;
+    while (cache->available < 0) {
+        LegacyItem *tail;
+        LegacyItem **now;
+
+        if (!(tail = (LegacyItem *)ring_get_tail(&cache->lru)) || tail->sync[0] == serial) {
+            cache->available += size;
+            free(item);
+            return FALSE;
+        }
+
+        now = &cache->hash_table[BITS_CACHE_HASH_KEY(tail->id)];
+        while (*now != tail) {
+            now = &(*now)->next;
+        }
+        *now = tail->next;
+        ring_remove(&tail->lru_link);
+        cache->available += tail->size;
+        free(tail);
+    }
+    item->next = cache->hash_table[(key = BITS_CACHE_HASH_KEY(id))];
+    cache->hash_table[key] = item;
+    ring_item_init(&item->lru_link);
+    ring_add(&cache->lru, &item->lru_link);
+    item->id = id;
+    item->size = size;
+    item->lossy = FALSE;
+    memset(item->sync, 0, sizeof(item->sync));
+    item->sync[0] = serial;
+    return TRUE;
+}
+
+static void legacy_clear(LegacyCache *cache)
+{
+    LegacyItem *item;
+
+    while ((item = (LegacyItem *)ring_get_head(&cache->lru))) {
+        ring_remove(&item->lru_link);
+        free(item);
+    }
+}
+
+/* what dcc_pixmap_cache_unlocked_add() does */
+static int cache_add(PixmapCache *cache, uint64_t id, uint32_t size, uint64_t serial,
+                     Released *released)
+{
+    NewCacheItem *item;
+
+    if (!pixmap_cache_unlocked_reserve(cache, 0, serial, size, release_item, released)) {
+        return FALSE;
+    }
+    item = pixmap_cache_unlocked_insert(cache, id);
+    item->size = size;
+    item->sync[0] = serial;
+    return TRUE;
+}
+
+static void check_lookup(PixmapCache *cache, uint64_t id, int present)
+{
+    NewCacheItem *item = pixmap_cache_unlocked_lookup(cache, id);
+
+    if (present) {
+        assert(item != NULL);
+        assert(item->in_use && item->id == id);
+    } else {
+        assert(item == NULL);
+    }
+}
+
+/* the entries of a cluster are moved back when an entry in front of them is
+ * removed, they must still be found from their hash */
+static void test_remove(void)
+{
+    PixmapCache *cache = pixmap_cache_get(NULL, 0, 1 << 30);
+    GRand *rand = g_rand_new_with_seed(1);
+    NewCacheItem *items[4096] = { NULL, };
+    int i;
+
+    /* sequential ids, like the ones the guest sends */
+    for (i = 0; i < 700; i++) {
+        items[i] = pixmap_cache_unlocked_insert(cache, i);
+    }
+    for (i = 0; i < 700; i += 3) {
+        pixmap_cache_unlocked_remove(cache, items[i]);
+        items[i] = NULL;
+    }
+    for (i = 0; i < 700; i++) {
+        check_lookup(cache, i, items[i] != NULL);
+    }
+    assert(cache->items == 700 - 234);
+
+    /* random insertions and removals, the table stays close to full */
+    for (i = 0; i < 200000; i++) {
+        uint64_t id = g_rand_int_range(rand, 0, G_N_ELEMENTS(items));
+
+        if (items[id]) {
+            pixmap_cache_unlocked_remove(cache, items[id]);
+            items[id] = NULL;
+        } else if (cache->items < 700) {
+            items[id] = pixmap_cache_unlocked_insert(cache, id);
+        }
+        if (i % 1000 == 0) {
+            uint64_t j;
+
+            for (j = 0; j < G_N_ELEMENTS(items); j++) {
+                check_lookup(cache, j, items[j] != NULL);
+            }
+        }
+    }
+
+    g_rand_free(rand);
+    pixmap_cache_unref(cache);
+}
+
+static void test_grow(void)
+{
+    PixmapCache *cache = pixmap_cache_get(NULL, 0, 1 << 30);
+    uint32_t table_size = cache->table_mask + 1;
+    uint64_t id;
+
+    for (id = 0; id < 20000; id++) {
+        pixmap_cache_unlocked_insert(cache, (id << 32) | id);
+    }
+    assert(cache->table_mask + 1 > table_size);
+    assert((uint64_t)cache->items * 4 <= (uint64_t)(cache->table_mask + 1) * 3);
+    for (id = 0; id < 20000; id++) {
+        check_lookup(cache, (id << 32) | id, TRUE);
+    }
+    check_lookup(cache, 20000, FALSE);
+
+    pixmap_cache_clear(cache);
+    assert(cache->items == 0);
+    check_lookup(cache, 0, FALSE);
+    pixmap_cache_unref(cache);
+}
+
+static void test_clock(void)
+{
+    PixmapCache *cache = pixmap_cache_get(NULL, 0, 4);
+    Released released = { .n = 0 };
+    NewCacheItem *item;
+    int64_t available;
+
+    assert(cache_add(cache, 'a', 1, 1, &released));
+    assert(cache_add(cache, 'b', 1, 1, &released));
+    assert(cache_add(cache, 'c', 1, 1, &released));
+    assert(cache_add(cache, 'd', 1, 1, &released));
+    assert(released.n == 0 && cache->available == 0);
+
+    /* new items survive one turn of the hand, the oldest one goes first */
+    assert(cache_add(cache, 'e', 1, 2, &released));
+    assert(released.n == 1 && released.ids[0] == 'a');
+    check_lookup(cache, 'a', FALSE);
+
+    /* b is used again, c is the next one without a hit */
+    check_lookup(cache, 'b', TRUE);
+    assert(cache_add(cache, 'f', 1, 3, &released));
+    assert(released.n == 2 && released.ids[1] == 'c');
+    check_lookup(cache, 'c', FALSE);
+
+    /* d is used by the message being sent, b lost its reference meanwhile */
+    item = pixmap_cache_unlocked_lookup(cache, 'd');
+    item->sync[0] = 4;
+    item->referenced = FALSE;
+    assert(cache_add(cache, 'g', 1, 4, &released));
+    assert(released.n == 3 && released.ids[2] == 'b');
+    check_lookup(cache, 'd', TRUE);
+    check_lookup(cache, 'e', TRUE);
+    check_lookup(cache, 'f', TRUE);
+    check_lookup(cache, 'g', TRUE);
+
+    /* no room if all the items are used by the message */
+    pixmap_cache_unlocked_lookup(cache, 'e')->sync[0] = 4;
+    pixmap_cache_unlocked_lookup(cache, 'f')->sync[0] = 4;
+    available = cache->available;
+    assert(!cache_add(cache, 'h', 1, 4, &released));
+    assert(released.n == 3 && cache->available == available);
+    assert(cache->items == 4);
+
+    /* the items of a frozen cache are not visible */
+    assert(pixmap_cache_freeze(cache));
+    check_lookup(cache, 'd', FALSE);
+    assert(pixmap_cache_unlocked_get_victim(cache, 0, 5) == NULL);
+    pixmap_cache_clear(cache);
+    assert(cache->available == 4);
+
+    pixmap_cache_unref(cache);
+}
+
+static void test_content(void)
+{
+    PixmapCache *cache = pixmap_cache_get(NULL, 0, 1 << 30);
+    BitmapContentHash hash = { { 1, 2 } };
+    BitmapContentHash other = { { 1 + BITS_CACHE_HASH_SIZE, 2 } };
+    NewCacheItem *item = pixmap_cache_unlocked_insert(cache, 1);
+    NewCacheItem *item2 = pixmap_cache_unlocked_insert(cache, 2);
+    NewCacheItem *item3;
+
+    pixmap_cache_unlocked_content_add(cache, item, &hash);
+    pixmap_cache_unlocked_content_add(cache, item2, &other);
+    assert(pixmap_cache_unlocked_content_find(cache, &hash) == item);
+    assert(pixmap_cache_unlocked_content_find(cache, &other) == item2);
+
+    /* a lossy item added last does not hide the lossless one */
+    item3 = pixmap_cache_unlocked_insert(cache, 3);
+    item3->lossy = TRUE;
+    pixmap_cache_unlocked_content_add(cache, item3, &other);
+    assert(pixmap_cache_unlocked_content_find(cache, &other) == item2);
+    item2->lossy = TRUE;
+    assert(pixmap_cache_unlocked_content_find(cache, &other) == NULL);
+    item2->lossy = FALSE;
+
+    pixmap_cache_unlocked_remove(cache, item);
+    assert(pixmap_cache_unlocked_content_find(cache, &hash) == NULL);
+    assert(pixmap_cache_unlocked_content_find(cache, &other) == item2);
+
+    pixmap_cache_unref(cache);
+}
+
+/* image ids as the guest generates them (a unique counter in the low bits),
+ * with a skewed popularity: a few icons and glyphs are sent over and over
+ * while most images are seldom reused */
+static void benchmark(void)
+{
+    PixmapCache *cache = pixmap_cache_get(NULL, 0, BENCHMARK_CAPACITY);
+    LegacyCache *legacy = spice_new0(LegacyCache, 1);
+    GRand *rand = g_rand_new_with_seed(42);
+    uint64_t *ids = g_new(uint64_t, BENCHMARK_OPS);
+    uint64_t start, legacy_ns, cache_ns;
+    int legacy_hits = 0, hits = 0;
+    int i;
+
+    for (i = 0; i < BENCHMARK_OPS; i++) {
+        double r = g_rand_double(rand);
+
+        ids[i] = (G_GUINT64_CONSTANT(1) << 32) | (uint64_t)(BENCHMARK_IDS * r * r * r);
+    }
+
+    ring_init(&legacy->lru);
+    legacy->available = BENCHMARK_CAPACITY;
+    start = get_time_ns();
+    for (i = 0; i < BENCHMARK_OPS; i++) {
+        if (legacy_hit(legacy, ids[i], i + 1)) {
+            legacy_hits++;
+        } else {
+            assert(legacy_add(legacy, ids[i], 1, i + 1));
+        }
+    }
+    legacy_ns = get_time_ns() - start;
+    legacy_clear(legacy);
+    free(legacy);
+
+    start = get_time_ns();
+    for (i = 0; i < BENCHMARK_OPS; i++) {
+        NewCacheItem *item = pixmap_cache_unlocked_lookup(cache, ids[i]);
+
+        if (item) {
+            item->sync[0] = i + 1;
+            hits++;
+        } else {
+            assert(cache_add(cache, ids[i], 1, i + 1, NULL));
+        }
+    }
+    cache_ns = get_time_ns() - start;
+    assert(cache->items == BENCHMARK_CAPACITY);
+
+    printf("%d items, %d ids, %d images\n", BENCHMARK_CAPACITY, BENCHMARK_IDS, BENCHMARK_OPS);
+    printf("chained hash + LRU:       %7.1f ns per image, %5.1f%% hits\n",
+           (double)legacy_ns / BENCHMARK_OPS, 100.0 * legacy_hits / BENCHMARK_OPS);
+    printf("open addressing + CLOCK:  %7.1f ns per image, %5.1f%% hits\n",
+           (double)cache_ns / BENCHMARK_OPS, 100.0 * hits / BENCHMARK_OPS);
+
+    g_free(ids);
+    g_rand_free(rand);
+    pixmap_cache_unref(cache);
+}
+
+int main(void)
+{
+    test_remove();
+    test_grow();
+    test_clock();
+    test_content();
+    benchmark();
+
+    return 0;
+}
@@ -16,7 +16,8 @@
    License along with this library; if not, see <http://www.gnu.org/licenses/>.
 */
 
-/* Do some tests on memory parsing
+/* Do some tests on memory parsing, and time the parsing of a stream of
+ * usual drawing commands
  */
 #ifdef HAVE_CONFIG_H
 #include <config.h>
@@ -28,10 +29,12 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <assert.h>
+#include <glib.h>
 
 #include <spice/macros.h>
 #include "memslot.h"
 #include "red-parse-qxl.h"
+#include "test-timing.h"
 
 static int exit_code = EXIT_SUCCESS;
 static const char *test_name = NULL;
@@ -71,6 +74,213 @@ create_chunk(size_t prefix, uint32_t size, QXLDataChunk* prev, int fill)
     return ptr;
 }
 
+/* the guest memory of the drawing commands, released at the end */
+static void *guest_mem[64];
+static unsigned int n_guest_mem;
+
+static void*
+keep_guest_mem(void *ptr)
+{
+    assert(n_guest_mem < G_N_ELEMENTS(guest_mem));
+    guest_mem[n_guest_mem++] = ptr;
+    return ptr;
+}
+
+static void
+free_guest_mem(void)
+{
+    while (n_guest_mem > 0) {
+        free(guest_mem[--n_guest_mem]);
+    }
+}
+
+static QXLDrawable*
+create_drawable(uint8_t type)
+{
+    QXLDrawable *qxl = keep_guest_mem(spice_malloc0(sizeof(QXLDrawable)));
+
+    qxl->type = type;
+    qxl->effect = QXL_EFFECT_OPAQUE;
+    qxl->bbox.right = 64;
+    qxl->bbox.bottom = 64;
+    qxl->clip.type = SPICE_CLIP_TYPE_NONE;
+    qxl->surfaces_dest[0] = qxl->surfaces_dest[1] = qxl->surfaces_dest[2] = -1;
+    return qxl;
+}
+
+static void
+set_clip_rects(QXLDrawable *qxl, int num_rects)
+{
+    QXLClipRects *clip = keep_guest_mem(create_chunk(SPICE_OFFSETOF(QXLClipRects, chunk),
+                                                     num_rects * sizeof(QXLRect), NULL, 0));
+    QXLRect *rects = (QXLRect *) clip->chunk.data;
+    int i;
+
+    clip->num_rects = num_rects;
+    for (i = 0; i < num_rects; i++) {
+        rects[i].top = i * 8;
+        rects[i].bottom = i * 8 + 4;
+        rects[i].right = 64;
+    }
+    qxl->clip.type = SPICE_CLIP_TYPE_RECTS;
+    qxl->clip.data = to_physical(clip);
+}
+
+static QXLDrawable*
+create_fill(void)
+{
+    QXLDrawable *qxl = create_drawable(QXL_DRAW_FILL);
+
+    set_clip_rects(qxl, 4);
+    qxl->u.fill.brush.type = SPICE_BRUSH_TYPE_SOLID;
+    qxl->u.fill.brush.u.color = 0xffffff;
+    qxl->u.fill.rop_descriptor = SPICE_ROPD_OP_PUT;
+    return qxl;
+}
+
+/* a 64x64 bitmap split in n_chunks chunks */
+static QXLDrawable*
+create_copy(int n_chunks)
+{
+    QXLDrawable *qxl = create_drawable(QXL_DRAW_COPY);
+    QXLImage *image = keep_guest_mem(spice_malloc0(sizeof(QXLImage)));
+    QXLDataChunk *prev = NULL;
+    int i;
+
+    image->descriptor.type = SPICE_IMAGE_TYPE_BITMAP;
+    image->descriptor.width = image->bitmap.x = 64;
+    image->descriptor.height = image->bitmap.y = 64;
+    image->bitmap.format = SPICE_BITMAP_FMT_32BIT;
+    image->bitmap.flags = QXL_BITMAP_TOP_DOWN;
+    image->bitmap.stride = 64 * 4;
+    for (i = 0; i < n_chunks; i++) {
+        QXLDataChunk *chunk = keep_guest_mem(create_chunk(0, 64 * 4 * 64 / n_chunks, prev, i));
+
+        if (prev == NULL) {
+            image->bitmap.data = to_physical(chunk);
+        }
+        prev = chunk;
+    }
+
+    qxl->u.copy.src_bitmap = to_physical(image);
+    qxl->u.copy.src_area.right = 64;
+    qxl->u.copy.src_area.bottom = 64;
+    qxl->u.copy.rop_descriptor = SPICE_ROPD_OP_PUT;
+    qxl->u.copy.scale_mode = SPICE_IMAGE_SCALE_MODE_NEAREST;
+    return qxl;
+}
+
+/* a path of 4 segments of 2 points, split in 2 chunks */
+static QXLDrawable*
+create_stroke(void)
+{
+    QXLDrawable *qxl = create_drawable(QXL_DRAW_STROKE);
+    size_t seg_size = sizeof(QXLPathSeg) + 2 * sizeof(QXLPointFix);
+    uint8_t *segs = spice_malloc0(4 * seg_size);
+    QXLPath *path;
+    QXLDataChunk *chunk;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        QXLPathSeg *seg = (QXLPathSeg *) (segs + i * seg_size);
+
+        seg->flags = i == 0 ? SPICE_PATH_BEGIN : 0;
+        seg->count = 2;
+        seg->points[0].x = i << 4;
+        seg->points[1].y = i << 4;
+    }
+    path = keep_guest_mem(create_chunk(SPICE_OFFSETOF(QXLPath, chunk), 2 * seg_size, NULL, 0));
+    path->data_size = 4 * seg_size;
+    memcpy(path->chunk.data, segs, 2 * seg_size);
+    chunk = keep_guest_mem(create_chunk(0, 2 * seg_size, &path->chunk, 0));
+    memcpy(chunk->data, segs + 2 * seg_size, 2 * seg_size);
+    free(segs);
+
+    qxl->u.stroke.path = to_physical(path);
+    qxl->u.stroke.brush.type = SPICE_BRUSH_TYPE_SOLID;
+    qxl->u.stroke.fore_mode = SPICE_ROPD_OP_PUT;
+    qxl->u.stroke.back_mode = SPICE_ROPD_OP_PUT;
+    return qxl;
+}
+
+/* a string of 8x12 glyphs */
+static QXLDrawable*
+create_text(int n_glyphs)
+{
+    QXLDrawable *qxl = create_drawable(QXL_DRAW_TEXT);
+    size_t glyph_size = sizeof(QXLRasterGlyph) + 12;
+    QXLString *str = keep_guest_mem(create_chunk(SPICE_OFFSETOF(QXLString, chunk),
+                                                 n_glyphs * glyph_size, NULL, 0x5a));
+    int i;
+
+    str->data_size = n_glyphs * glyph_size;
+    str->length = n_glyphs;
+    str->flags = SPICE_STRING_FLAGS_RASTER_A1;
+    for (i = 0; i < n_glyphs; i++) {
+        QXLRasterGlyph *glyph = (QXLRasterGlyph *) (str->chunk.data + i * glyph_size);
+
+        glyph->render_pos.x = i * 8;
+        glyph->width = 8;
+        glyph->height = 12;
+    }
+
+    qxl->u.text.str = to_physical(str);
+    qxl->u.text.back_area.right = n_glyphs * 8;
+    qxl->u.text.back_area.bottom = 12;
+    qxl->u.text.fore_brush.type = SPICE_BRUSH_TYPE_SOLID;
+    qxl->u.text.back_brush.type = SPICE_BRUSH_TYPE_NONE;
+    qxl->u.text.fore_mode = SPICE_ROPD_OP_PUT;
+    qxl->u.text.back_mode = SPICE_ROPD_OP_PUT;
+    return qxl;
+}
+
+#define BENCHMARK_ROUNDS 20000
+
+/* parse and release the commands like the worker does, and count the
+ * objects the parser allocates and the memory blocks they need */
+static void
+benchmark(RedMemSlotInfo *mem_info)
+{
+    static const char *const names[] = {
+        "fill", "copy", "copy-4", "stroke", "text-16", "text-64"
+    };
+    QXLDrawable *cmds[G_N_ELEMENTS(names)];
+    uint64_t time_ns[G_N_ELEMENTS(names)] = { 0 };
+    uint64_t objects[G_N_ELEMENTS(names)] = { 0 };
+    uint64_t blocks[G_N_ELEMENTS(names)] = { 0 };
+    RedDrawable red;
+    unsigned int i;
+    int n;
+
+    cmds[0] = create_fill();
+    cmds[1] = create_copy(1);
+    cmds[2] = create_copy(4);
+    cmds[3] = create_stroke();
+    cmds[4] = create_text(16);
+    cmds[5] = create_text(64);
+
+    memset(&red, 0, sizeof(red));
+    for (n = 0; n < BENCHMARK_ROUNDS; n++) {
+        for (i = 0; i < G_N_ELEMENTS(cmds); i++) {
+            uint64_t start = get_time_ns();
+
+            if (red_get_drawable(mem_info, 0, &red, to_physical(cmds[i]), 0)) {
+                failure();
+            }
+            objects[i] += red.arena.n_allocs;
+            blocks[i] += red.arena.n_blocks;
+            red_put_drawable(&red);
+            time_ns[i] += get_time_ns() - start;
+        }
+    }
+
+    for (i = 0; i < G_N_ELEMENTS(cmds); i++) {
+        printf("%-8s %7.1f ns/command %5.1f objects %5.2f allocations\n", names[i],
+               (double) time_ns[i] / BENCHMARK_ROUNDS, (double) objects[i] / BENCHMARK_ROUNDS,
+               (double) blocks[i] / BENCHMARK_ROUNDS);
+    }
+}
+
 int main(int argc, char **argv)
 {
     RedMemSlotInfo mem_info;
@@ -81,9 +291,13 @@ int main(int argc, char **argv)
     QXLSurfaceCmd qxl;
 
     RedCursorCmd red_cursor_cmd;
+    RedDrawable red_drawable;
     QXLCursorCmd cursor_cmd;
     QXLCursor *cursor;
     QXLDataChunk *chunks[2];
+    QXLDrawable *qxl_drawable;
+    QXLImage *qxl_image;
+    SpiceChunks *bitmap_data;
 
     void *surface_mem;
 
@@ -197,6 +411,71 @@ int main(int argc, char **argv)
     free(cursor);
     free(chunks[0]);
 
+    /* the clip and the image of the usual commands need no allocation */
+    test("fill with clip rects");
+    memset(&red_drawable, 0, sizeof(red_drawable));
+    if (red_get_drawable(&mem_info, 0, &red_drawable, to_physical(create_fill()), 0))
+        failure();
+    assert(red_drawable.clip.type == SPICE_CLIP_TYPE_RECTS);
+    assert(red_drawable.clip.rects->num_rects == 4);
+    assert(red_drawable.clip.rects->rects[3].top == 24);
+    assert(red_drawable.u.fill.brush.u.color == 0xffffff);
+    assert(red_drawable.arena.n_blocks == 0);
+    red_put_drawable(&red_drawable);
+    assert(red_drawable.arena.n_allocs == 0);
+
+    test("copy of a chunked bitmap");
+    if (red_get_drawable(&mem_info, 0, &red_drawable, to_physical(create_copy(4)), 0))
+        failure();
+    assert(red_drawable.u.copy.src_bitmap->u.bitmap.data->num_chunks == 4);
+    assert(red_drawable.u.copy.src_bitmap->u.bitmap.data->data_size == 64 * 4 * 64);
+    assert(red_drawable.u.copy.src_bitmap->u.bitmap.data->chunk[3].data[0] == 3);
+    red_put_drawable(&red_drawable);
+
+    /* the encoders replace the chunks by a copy of their own, it is released
+     * with the drawable */
+    test("copy of an unstable chunked bitmap");
+    qxl_drawable = create_copy(4);
+    qxl_image = (QXLImage *) (uintptr_t) qxl_drawable->u.copy.src_bitmap;
+    qxl_image->bitmap.flags |= QXL_BITMAP_UNSTABLE;
+    if (red_get_drawable(&mem_info, 0, &red_drawable, to_physical(qxl_drawable), 0))
+        failure();
+    bitmap_data = red_drawable.u.copy.src_bitmap->u.bitmap.data;
+    assert(bitmap_data->flags & SPICE_CHUNKS_FLAGS_UNSTABLE);
+    spice_chunks_linearize(bitmap_data);
+    assert(bitmap_data->num_chunks == 1);
+    assert(bitmap_data->flags & SPICE_CHUNKS_FLAGS_FREE);
+    assert(bitmap_data->chunk[0].data[64 * 4 * 64 - 1] == 3);
+    assert(red_drawable.arena.unstable_chunks != NULL);
+    red_put_drawable(&red_drawable);
+    assert(red_drawable.arena.unstable_chunks == NULL);
+
+    test("stroke of a chunked path");
+    if (red_get_drawable(&mem_info, 0, &red_drawable, to_physical(create_stroke()), 0))
+        failure();
+    assert(red_drawable.u.stroke.path->num_segments == 4);
+    assert(red_drawable.u.stroke.path->segments[0]->flags == SPICE_PATH_BEGIN);
+    assert(red_drawable.u.stroke.path->segments[3]->count == 2);
+    assert(red_drawable.u.stroke.path->segments[3]->points[0].x == 3 << 4);
+    assert(red_drawable.u.stroke.path->segments[3]->points[1].y == 3 << 4);
+    red_put_drawable(&red_drawable);
+
+    /* the glyphs don't fit in the drawable */
+    test("text");
+    if (red_get_drawable(&mem_info, 0, &red_drawable, to_physical(create_text(64)), 0))
+        failure();
+    assert(red_drawable.u.text.str->length == 64);
+    assert(red_drawable.u.text.str->glyphs[63]->render_pos.x == 63 * 8);
+    assert(red_drawable.u.text.str->glyphs[63]->data[11] == 0x5a);
+    assert(red_drawable.arena.n_blocks == 1);
+    red_put_drawable(&red_drawable);
+
+    free_guest_mem();
+
+    test("parsing benchmark");
+    benchmark(&mem_info);
+    free_guest_mem();
+
     memslot_info_destroy(&mem_info);
     free(surface_mem);
 
@@ -0,0 +1,156 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Check that a slab grows by chunks up to its limit, reuses the freed
+ * objects and gives distinct aligned objects, and time it against malloc.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#undef NDEBUG
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <glib.h>
+
+#include "slab.h"
+#include "test-timing.h"
+
+#define OBJECT_SIZE 200
+#define BENCHMARK_OBJECTS 1000
+#define BENCHMARK_ITERATIONS 2000
+
+static void test_grow(void)
+{
+    Slab *slab = slab_new(OBJECT_SIZE, 10, 25);
+    uint8_t *objects[25];
+    uint64_t used = 0, capacity = 0;
+    int i, j;
+
+    slab_set_counters(slab, &used, &capacity);
+    assert(slab_get_capacity(slab) == 0);
+
+    for (i = 0; i < 25; i++) {
+        objects[i] = slab_alloc(slab);
+        assert(objects[i] != NULL);
+        assert(((uintptr_t)objects[i] % 16) == 0);
+        memset(objects[i], i, OBJECT_SIZE);
+        assert(slab_get_capacity(slab) == MIN((i / 10 + 1) * 10, 25));
+    }
+    assert(slab_get_n_used(slab) == 25);
+    assert(slab_alloc(slab) == NULL);
+
+    /* no object overlaps another one */
+    for (i = 0; i < 25; i++) {
+        for (j = 0; j < OBJECT_SIZE; j++) {
+            assert(objects[i][j] == i);
+        }
+    }
+
+    slab_release(slab, objects[7]);
+    assert(slab_get_n_used(slab) == 24);
+    assert(slab_alloc(slab) == objects[7]);
+
+    for (i = 0; i < 25; i++) {
+        slab_release(slab, objects[i]);
+    }
+    assert(slab_get_n_used(slab) == 0);
+    assert(slab_get_capacity(slab) == 25);
+#ifdef RED_STATISTICS
+    assert(used == 0 && capacity == 25);
+#endif
+    slab_free(slab);
+}
+
+static void test_unlimited(void)
+{
+    Slab *slab = slab_new(1, 4, 0);
+    void *objects[100];
+    int i;
+
+    for (i = 0; i < 100; i++) {
+        objects[i] = slab_alloc(slab);
+        assert(objects[i] != NULL);
+    }
+    assert(slab_get_capacity(slab) == 100);
+    for (i = 0; i < 100; i++) {
+        slab_release(slab, objects[i]);
+    }
+    slab_free(slab);
+}
+
+/* objects freed in a different order than they were allocated, like the
+ * drawables released by the clients */
+static void benchmark(void)
+{
+    Slab *slab = slab_new(OBJECT_SIZE, BENCHMARK_OBJECTS, 0);
+    void **objects = g_new0(void *, BENCHMARK_OBJECTS);
+    GRand *rand = g_rand_new_with_seed(1);
+    uint64_t start, malloc_ns, slab_ns;
+    int i;
+
+    start = get_time_ns();
+    for (i = 0; i < BENCHMARK_OBJECTS * BENCHMARK_ITERATIONS; i++) {
+        int n = g_rand_int_range(rand, 0, BENCHMARK_OBJECTS);
+
+        free(objects[n]);
+        objects[n] = malloc(OBJECT_SIZE);
+        memset(objects[n], 0, OBJECT_SIZE);
+    }
+    for (i = 0; i < BENCHMARK_OBJECTS; i++) {
+        free(objects[i]);
+        objects[i] = NULL;
+    }
+    malloc_ns = get_time_ns() - start;
+
+    g_rand_set_seed(rand, 1);
+    start = get_time_ns();
+    for (i = 0; i < BENCHMARK_OBJECTS * BENCHMARK_ITERATIONS; i++) {
+        int n = g_rand_int_range(rand, 0, BENCHMARK_OBJECTS);
+
+        if (objects[n]) {
+            slab_release(slab, objects[n]);
+        }
+        objects[n] = slab_alloc(slab);
+        memset(objects[n], 0, OBJECT_SIZE);
+    }
+    for (i = 0; i < BENCHMARK_OBJECTS; i++) {
+        if (objects[i]) {
+            slab_release(slab, objects[i]);
+        }
+    }
+    slab_ns = get_time_ns() - start;
+
+    printf("malloc: %6.1f ns per object\n",
+           (double)malloc_ns / (BENCHMARK_OBJECTS * BENCHMARK_ITERATIONS));
+    printf("slab  : %6.1f ns per object\n",
+           (double)slab_ns / (BENCHMARK_OBJECTS * BENCHMARK_ITERATIONS));
+
+    g_rand_free(rand);
+    g_free(objects);
+    slab_free(slab);
+}
+
+int main(int argc, char **argv)
+{
+    test_grow();
+    test_unlimited();
+    benchmark();
+
+    return 0;
+}
@@ -0,0 +1,300 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Check that the data sent with RedsStream writev() over a TCP connection,
+ * with plain copies and with MSG_ZEROCOPY, reaches the peer intact while the
+ * buffers are reused as soon as they are released, and measure the
+ * throughput. Large messages are split in chunks the way the display channel
+ * marshaller does.
+ *
+ * On the loopback interface the kernel has to copy the data anyway and
+ * zero copy is disabled after the first completions, use --host to connect
+ * to a "nc -l -k <port> > /dev/null" running on another machine to see the
+ * actual difference.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#undef NDEBUG
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include <common/log.h>
+#include "reds-stream.h"
+#include "basic-event-loop.h"
+#include "test-timing.h"
+
+#define N_BUFFERS 8
+
+static gint msg_size = 1024 * 1024;
+static gint chunk_size = 64 * 1024;
+static gint n_msgs = 256;
+static gchar *host = NULL;
+static gint port = 0;
+
+static SpiceServer *server = NULL;
+
+typedef struct BufferPool BufferPool;
+
+typedef struct Buffer {
+    BufferPool *pool;
+    uint8_t *data;
+} Buffer;
+
+struct BufferPool {
+    Buffer buffers[N_BUFFERS];
+    int n_free;
+    Buffer *free[N_BUFFERS];
+};
+
+/* the local peer, all the bytes of message n are n & 0xff */
+typedef struct Reader {
+    pthread_t thread;
+    int fd;
+    uint64_t received;
+    gboolean corrupted;
+} Reader;
+
+static void *reader_thread(void *opaque)
+{
+    Reader *reader = opaque;
+    uint8_t *buf = g_malloc(1024 * 1024);
+    ssize_t n;
+
+    while ((n = read(reader->fd, buf, 1024 * 1024)) > 0) {
+        ssize_t i;
+
+        for (i = 0; i < n; i++) {
+            if (buf[i] != (uint8_t)((reader->received + i) / msg_size)) {
+                reader->corrupted = TRUE;
+            }
+        }
+        reader->received += n;
+    }
+    g_free(buf);
+    close(reader->fd);
+
+    return NULL;
+}
+
+/* returns a connected socket, the peer is drained by a thread unless an
+ * external host is used */
+static int connect_socket(Reader *reader)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int listen_fd = -1, fd, peer;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (host && inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        spice_error("invalid address %s", host);
+    }
+
+    if (!host) {
+        listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+            listen(listen_fd, 1) < 0 ||
+            getsockname(listen_fd, (struct sockaddr *) &addr, &len) < 0) {
+            spice_error("listen failed %s", strerror(errno));
+        }
+    }
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        spice_error("connect failed %s", strerror(errno));
+    }
+
+    if (!host) {
+        peer = accept(listen_fd, NULL, NULL);
+        if (peer < 0) {
+            spice_error("accept failed %s", strerror(errno));
+        }
+        close(listen_fd);
+        reader->fd = peer;
+        reader->received = 0;
+        reader->corrupted = FALSE;
+        pthread_create(&reader->thread, NULL, reader_thread, reader);
+    }
+
+    return fd;
+}
+
+static void buffer_release(gpointer opaque)
+{
+    Buffer *buf = opaque;
+
+    buf->pool->free[buf->pool->n_free++] = buf;
+}
+
+static void send_msg(RedsStream *stream, uint8_t *data, struct iovec *iov, int n_chunks)
+{
+    struct iovec *cur = iov;
+    int i;
+
+    for (i = 0; i < n_chunks; i++) {
+        iov[i].iov_base = data + i * chunk_size;
+        iov[i].iov_len = MIN(chunk_size, msg_size - i * chunk_size);
+    }
+    while (n_chunks > 0) {
+        ssize_t n = reds_stream_writev(stream, cur, n_chunks);
+
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            spice_error("writev failed %s", strerror(errno));
+        }
+        while (n > 0 && n >= (ssize_t) cur->iov_len) {
+            n -= cur->iov_len;
+            cur++;
+            n_chunks--;
+        }
+        if (n > 0) {
+            cur->iov_base = (uint8_t *) cur->iov_base + n;
+            cur->iov_len -= n;
+        }
+    }
+}
+
+static double run(gboolean zerocopy)
+{
+    BufferPool pool;
+    Reader reader;
+    RedsStream *stream;
+    int n_chunks = (msg_size + chunk_size - 1) / chunk_size;
+    struct iovec *iov = g_new(struct iovec, n_chunks);
+    uint64_t start, elapsed;
+    int i;
+
+    stream = reds_stream_new(server, connect_socket(&reader));
+    if (zerocopy && !reds_stream_enable_zerocopy(stream)) {
+        printf("zero copy not supported\n");
+        reds_stream_free(stream);
+        if (!host) {
+            pthread_join(reader.thread, NULL);
+        }
+        g_free(iov);
+        return 0;
+    }
+
+    pool.n_free = 0;
+    for (i = 0; i < N_BUFFERS; i++) {
+        pool.buffers[i].pool = &pool;
+        pool.buffers[i].data = g_malloc(msg_size);
+        pool.free[pool.n_free++] = &pool.buffers[i];
+    }
+
+    start = get_time_ns();
+    for (i = 0; i < n_msgs; i++) {
+        Buffer *buf;
+
+        while (pool.n_free == 0) {
+            reds_stream_zerocopy_pending(stream);
+        }
+        buf = pool.free[--pool.n_free];
+        /* overwrites the data of a previous message, which the kernel must
+         * not read anymore */
+        memset(buf->data, i, msg_size);
+        send_msg(stream, buf->data, iov, n_chunks);
+        /* like red_channel_client_on_out_msg_done() */
+        reds_stream_release_after_send(stream, buffer_release, buf);
+    }
+    while (reds_stream_zerocopy_pending(stream)) {
+        continue;
+    }
+    elapsed = get_time_ns() - start;
+    assert(pool.n_free == N_BUFFERS);
+
+    reds_stream_free(stream);
+    if (!host) {
+        pthread_join(reader.thread, NULL);
+        assert(reader.received == (uint64_t)msg_size * n_msgs);
+        assert(!reader.corrupted);
+    }
+    for (i = 0; i < N_BUFFERS; i++) {
+        g_free(pool.buffers[i].data);
+    }
+    g_free(iov);
+
+    return (double) msg_size * n_msgs / (1024 * 1024) / (elapsed / 1e9);
+}
+
+int main(int argc, char **argv)
+{
+    GOptionContext *context;
+    GError *error = NULL;
+    SpiceCoreInterface *core;
+    double plain, zerocopy;
+
+    GOptionEntry entries[] = {
+        { "size", 's', 0, G_OPTION_ARG_INT, &msg_size,
+          "Message size in bytes (default 1048576)", "INT" },
+        { "chunk", 'c', 0, G_OPTION_ARG_INT, &chunk_size,
+          "Chunk size in bytes (default 65536)", "INT" },
+        { "messages", 'n', 0, G_OPTION_ARG_INT, &n_msgs,
+          "Number of messages (default 256)", "INT" },
+        { "host", 'H', 0, G_OPTION_ARG_STRING, &host,
+          "Send to an IPv4 address instead of a local reader", "ADDRESS" },
+        { "port", 'p', 0, G_OPTION_ARG_INT, &port,
+          "Port to use with --host", "INT" },
+        { NULL }
+    };
+
+    context = g_option_context_new("- stream throughput benchmark");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        printf("Option parsing failed: %s\n", error->message);
+        exit(-1);
+    }
+    g_option_context_free(context);
+    if (msg_size <= 0 || chunk_size <= 0 || n_msgs <= 0 || (host && port <= 0)) {
+        printf("Invalid arguments\n");
+        exit(-1);
+    }
+
+    core = basic_event_loop_init();
+    server = spice_server_new();
+    spice_return_val_if_fail(spice_server_init(server, core) == 0, -1);
+
+    printf("%d messages of %d bytes in %d byte chunks to %s\n",
+           n_msgs, msg_size, chunk_size, host ? host : "localhost");
+    plain = run(FALSE);
+    printf("writev:       %8.1f MiB/s\n", plain);
+    zerocopy = run(TRUE);
+    if (zerocopy > 0) {
+        printf("MSG_ZEROCOPY: %8.1f MiB/s\n", zerocopy);
+    }
+
+    spice_server_destroy(server);
+    basic_event_loop_destroy();
+    g_free(host);
+
+    return 0;
+}